@@ -11,6 +11,9 @@
 #include <utility> // pair
 #include <string>
 #include <array>
+#include <cstdint>
+#include <cstring>
+#include <functional>
 
 namespace atlasdb {
   namespace query {
@@ -29,7 +32,7 @@ namespace atlasdb {
 
       key& operator=(const key&);
       key& operator=(key&&);
-      bool operator<(const key&);
+      bool operator<(const key&) const;
 
       std::pair<const char*, size_t> data() const;
       void data(const char* k, size_t sz);
@@ -47,6 +50,20 @@ namespace atlasdb {
 
     const key key::nil;
 
+    // the raw bytes of a key, e.g. straight out of a message body
+    typedef std::pair<const char*, size_t> key_bytes;
+
+    // keys compare to raw bytes byte by byte, so that a repository can be
+    // looked up by the bytes without building a key (see basic_repository::find)
+    inline int compare_bytes(const key_bytes& a, const key_bytes& b) {
+      int c = std::memcmp(a.first, b.first, a.second < b.second ? a.second : b.second);
+      return c != 0 ? c : (a.second < b.second ? -1 : (a.second > b.second ? 1 : 0));
+    }
+
+    inline bool key::operator<(const key& k) const { return compare_bytes(data(), k.data()) < 0; }
+    inline bool operator<(const key& a, const key_bytes& b) { return compare_bytes(a.data(), b) < 0; }
+    inline bool operator<(const key_bytes& a, const key& b) { return compare_bytes(a, b.data()) < 0; }
+
     class value {
     public:
 
@@ -80,4 +97,21 @@ namespace atlasdb {
   } // query
 } // atlasdb
 
+namespace std {
+
+  // FNV-1a over the bytes of the key, for hash indexes of repositories
+  template<>
+  struct hash<atlasdb::query::key> {
+    size_t operator()(const atlasdb::query::key& k) const {
+      atlasdb::query::key_bytes b = k.data();
+      uint64_t h = 14695981039346656037ULL;
+      for (size_t i = 0; i < b.second; ++i) {
+        h = (h ^ static_cast<unsigned char>(b.first[i])) * 1099511628211ULL;
+      }
+      return static_cast<size_t>(h);
+    }
+  };
+
+} // std
+
 #endif /* ATLASDB_QUERY_KEY_VALUE_H_ */
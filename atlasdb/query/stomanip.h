@@ -33,16 +33,13 @@ namespace atlasdb {
 
         repository storage(table);
 
-        size_t scan_count = 0;
         size_t load_count = 0;
 
+        // jump to the first record of the page instead of scanning up to it
         ss << 0;
-        for (auto it = storage.begin(); it != storage.end(); ++it) {
-          if (scan_count < start) ++scan_count;
-          else if (load_count <= limit) {
-            ss.write(it->second.address(), it->second.size());
-            ++load_count;
-          }
+        for (auto it = storage.scan_at(start); it != storage.scan_end() && load_count <= limit; ++it) {
+          ss.write(it->second.address(), it->second.size());
+          ++load_count;
         }
 
         // ss.rdbuf()->
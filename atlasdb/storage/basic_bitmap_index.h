@@ -0,0 +1,197 @@
+#ifndef ATLASDB_STORAGE_BASIC_BITMAP_INDEX_H_
+#define ATLASDB_STORAGE_BASIC_BITMAP_INDEX_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <atlasdb/storage/btree/btree_map.h>
+#include <atlasdb/storage/btree/btree_allocator.h>
+#include <atlasdb/storage/roaring_bitmap.h>
+#include <atlasdb/storage/storage_base.h>
+#include <atlasdb/storage/storage_error.h>
+
+namespace atlasdb {
+  namespace storage {
+
+    template<typename Key, typename Value, typename Ikey>
+    class basic_storehouse;
+
+    /**
+     * The dense row ids of the record keys of a table. The bitmap indexes of
+     * a basic_storehouse share one, so that a row names the same record in
+     * all of them and their bitmaps combine: the rows of a condition on one
+     * index & those of a condition on another are the records matching both.
+     * A row counts the index keys it is under in all of the indexes, and is
+     * given back once it is under none, to be reused first so that the rows
+     * stay dense.
+     * */
+    template<typename Key>
+    class basic_row_space {
+    public:
+
+      typedef Key key_type;
+      typedef roaring_bitmap::value_type row_type;
+
+      typedef btree_node_allocator<std::pair<const key_type, row_type>> allocator_type;
+      typedef btree_map<key_type, row_type, std::less<key_type>, allocator_type> container_type;
+
+    public:
+
+      /**
+       * the row of key, given a new one if it has none, for one more use
+       * @throw storage_error(errc::invalid_argument) if all of the rows are
+       *    in use
+       */
+      row_type acquire(const key_type& key);
+
+      /**
+       * drop a use of row, which is given back once unused
+       */
+      void release(row_type row);
+
+      /**
+       * the row of key, nullptr if it has none
+       */
+      const row_type* find(const key_type& key) const {
+        auto it = _rows.find(key);
+        return it == _rows.end() ? nullptr : &it->second;
+      }
+
+      /**
+       * the record key of a row
+       */
+      const key_type& key(row_type row) const { return _keys[row]; }
+
+      /**
+       * the number of rows in use
+       */
+      size_t size() const { return _rows.size(); }
+
+    private:
+
+      // the rows of the record keys and the other way round, the number of
+      // uses of each row, and the rows given back
+      container_type _rows;
+      std::vector<key_type> _keys;
+      std::vector<uint32_t> _uses;
+      std::vector<row_type> _free;
+    };
+
+    /**
+     * An index for index keys having few distinct values, each of them with
+     * many records, e.g. a status or a region: every record key gets a dense
+     * row id, and every index key maps to the compressed set of the rows of
+     * its records, a roaring_bitmap, so that the conditions on such indexes
+     * are combined by set operations on the bitmaps instead of merges of
+     * lists of record keys.
+     * The rows come from a basic_row_space, that of the index alone unless it
+     * shares the one of its storehouse, see share_rows().
+     * */
+    template<typename Key, typename Value, typename Ikey>
+    class basic_bitmap_index : public storage_base {
+      friend class basic_storehouse<Key, Value, Ikey>;
+
+    public:
+
+      typedef storage_base base_type;
+      typedef basic_bitmap_index<Key, Value, Ikey> self_type;
+
+      typedef Ikey index_key_type;
+      typedef Key index_value_type;
+      typedef std::less<index_key_type> index_key_compare;
+
+      typedef roaring_bitmap bitmap_type;
+      typedef roaring_bitmap::value_type row_type;
+
+      typedef btree_node_allocator<std::pair<const index_key_type, bitmap_type>> allocator_type;
+      typedef btree_map<index_key_type, bitmap_type, index_key_compare, allocator_type> container_type;
+
+      typedef basic_row_space<index_value_type> row_space_type;
+
+    public:
+
+      basic_bitmap_index() : _space(std::make_shared<row_space_type>()) {}
+
+      basic_bitmap_index(const std::string& name) : base_type(name), _space(std::make_shared<row_space_type>()) {}
+
+      virtual ~basic_bitmap_index() {}
+
+    public:
+
+      /**
+       * the rows of the records indexed under key
+       */
+      bitmap_type rows(const index_key_type& key) const;
+
+      /**
+       * the rows of the records whose index key is in [lower, upper)
+       */
+      bitmap_type rows(const index_key_type& lower, const index_key_type& upper) const;
+
+      /**
+       * the number of records indexed under key
+       */
+      size_t count(const index_key_type& key) const;
+
+      /**
+       * the record key of a row
+       */
+      const index_value_type& key(row_type row) const { return _space->key(row); }
+
+      /**
+       * take the rows of the records from space from now on, shared with the
+       * other indexes using it
+       * @throw storage_error(errc::invalid_argument) if the index is not
+       *    empty, its rows being those of its own space
+       */
+      void share_rows(const std::shared_ptr<row_space_type>& space);
+
+      /**
+       * the space the rows of the index come from
+       */
+      const row_space_type& row_space() const { return *_space; }
+
+      /**
+       * copy the record keys of rows to out, in row order
+       */
+      template<class OutputIterator>
+      OutputIterator keys(const bitmap_type& rows, OutputIterator out) const;
+
+      /**
+       * compress the bitmaps further where they hold runs of rows, e.g. once
+       * the index was loaded, see roaring_bitmap::optimize()
+       */
+      void optimize();
+
+      /**
+       * the number of bytes held by the bitmaps
+       */
+      size_t bytes() const;
+
+      bool empty() const { return _container.empty(); }
+
+    protected:
+
+      void insert(const index_key_type& key, const index_value_type& data);
+
+      void update(const index_key_type& key, const index_key_type& new_key, const index_value_type& data);
+
+      void del(const index_key_type& key);
+
+      void del(const index_key_type& key, const index_value_type& data);
+
+    private:
+
+      container_type _container;
+
+      // the rows of the record keys, each used once per index key it is
+      // under in this index
+      std::shared_ptr<row_space_type> _space;
+    };
+
+  } // storage
+} // atlasdb
+
+#endif // ATLASDB_STORAGE_BASIC_BITMAP_INDEX_H_
@@ -0,0 +1,171 @@
+#ifndef ATLASDB_STORAGE_BASIC_HASH_INDEX_H_
+#define ATLASDB_STORAGE_BASIC_HASH_INDEX_H_
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include <boost/optional.hpp>
+
+#include <atlasdb/storage/storage_base.h>
+#include <atlasdb/storage/storage_error.h>
+
+namespace atlasdb {
+  namespace storage {
+
+    template<typename Key, typename Value, typename Ikey>
+    class basic_storehouse;
+
+    /**
+     * An index for equality lookups only, e.g. for the conditions
+     * op_t::equal_to and op_t::in: a hash table from the index keys to the
+     * record keys indexed under each of them.
+     *
+     * The table is open addressed with linear probing. A slot holds 32 bits
+     * of the hash of an index key and the position of its entry, so that a
+     * probe reads a line of slots and then the entry. The entry holds the
+     * record keys in an array, the first one in the entry itself.
+     *
+     * When the table is half full, a table twice as large is allocated and
+     * every modification then moves a few of the slots of the old table to
+     * the new one, so that no modification waits for the whole table to be
+     * rehashed; until all are moved, lookups probe both tables.
+     * */
+    template<typename Key, typename Value, typename Ikey>
+    class basic_hash_index : public storage_base {
+      friend class basic_storehouse<Key, Value, Ikey>;
+
+    public:
+
+      typedef storage_base base_type;
+      typedef basic_hash_index<Key, Value, Ikey> self_type;
+
+      typedef Ikey index_key_type;
+      typedef Key index_value_type;
+      typedef std::hash<index_key_type> hasher;
+
+    public:
+
+      basic_hash_index() : _migrated(0), _size(0) {}
+
+      basic_hash_index(const std::string& name) : base_type(name), _migrated(0), _size(0) {}
+
+      virtual ~basic_hash_index() {}
+
+    public:
+
+      /**
+       * the first record key indexed under key, if any
+       */
+      boost::optional<index_value_type> get(const index_key_type& key) const;
+
+      /**
+       * the number of record keys indexed under key
+       */
+      size_t count(const index_key_type& key) const;
+
+      /**
+       * copy the record keys indexed under key to out
+       */
+      template<class OutputIterator>
+      OutputIterator keys(const index_key_type& key, OutputIterator out) const;
+
+      /**
+       * copy the record keys indexed under any of the keys in [first, last)
+       * to out, for op_t::in
+       */
+      template<class InputIterator, class OutputIterator>
+      OutputIterator keys(InputIterator first, InputIterator last, OutputIterator out) const;
+
+      /**
+       * the number of distinct index keys
+       */
+      size_t size() const { return _entries.size(); }
+
+      bool empty() const { return _entries.empty(); }
+
+      /**
+       * the number of bytes held by the tables and the entries
+       */
+      size_t bytes() const;
+
+    protected:
+
+      void insert(const index_key_type& key, const index_value_type& data);
+
+      void update(const index_key_type& key, const index_key_type& new_key, const index_value_type& data);
+
+      void del(const index_key_type& key);
+
+      void del(const index_key_type& key, const index_value_type& data);
+
+    private:
+
+      // tags 0 and 1 mark the empty slots and those whose entry was deleted
+      // from the old table while it is moved
+      static const uint32_t kEmpty = 0;
+      static const uint32_t kDeleted = 1;
+
+      // the old table is moved that many slots per modification
+      static const size_t kMigrateStep = 8;
+
+      struct slot {
+        uint32_t tag;
+        uint32_t entry;
+      };
+
+      struct entry {
+        index_key_type key;
+        uint64_t hash;
+        index_value_type first;
+        std::vector<index_value_type> rest;
+      };
+
+      static uint64_t hash(const index_key_type& key) {
+        // the high bits of the product depend on all of the bits of the hash
+        return static_cast<uint64_t>(hasher()(key)) * 0x9e3779b97f4a7c15ULL;
+      }
+
+      static uint32_t tag(uint64_t h) { return uint32_t(h) | 2; }
+
+      // the home slot of h in a table of n slots, n a power of 2
+      static size_t home(uint64_t h, size_t n) { return size_t(h >> 32) & (n - 1); }
+
+      // the entry of key, -1 if there is none
+      size_t find(const index_key_type& key, uint64_t h) const;
+
+      // the slot of the entry at position e, in the new table or in the old
+      // one, found by the hash of the entry
+      slot* locate(size_t e);
+
+      void place(std::vector<slot>& table, uint64_t h, uint32_t e);
+
+      // deletes the slot s of the new table, moving back the slots after it
+      // that would no longer be reached
+      void erase_slot(size_t s);
+
+      // deletes the entry at position e and its slot
+      void erase_entry(size_t e);
+
+      void grow();
+
+      void migrate(size_t n);
+
+    private:
+
+      std::vector<entry> _entries;
+
+      std::vector<slot> _table;
+
+      // the table being moved to _table, from slot _migrated on
+      std::vector<slot> _old;
+      size_t _migrated;
+
+      // the number of slots in use in _table
+      size_t _size;
+    };
+
+  } // storage
+} // atlasdb
+
+#endif // ATLASDB_STORAGE_BASIC_HASH_INDEX_H_
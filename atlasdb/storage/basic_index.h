@@ -1,17 +1,28 @@
 #ifndef ATLASDB_STORAGE_BASIC_INDEX_H_
 #define ATLASDB_STORAGE_BASIC_INDEX_H_
 
+#include <cstring>
 #include <string>
+#include <type_traits>
+#include <vector>
 #include <boost/optional.hpp>
 
 #include <atlasdb/storage/btree/btree_map.h>
+#include <atlasdb/storage/btree/btree_set.h>
+#include <atlasdb/storage/btree/btree_allocator.h>
 #include <atlasdb/storage/storage_base.h>
+#include <atlasdb/storage/storage_error.h>
 
 namespace atlasdb {
   namespace storage {
 
+    template<typename Key, typename Value, typename Ikey>
+    class basic_storehouse;
+
     template<typename Key, typename Value, typename Ikey>
     class basic_index : public storage_base {
+      friend class basic_storehouse<Key, Value, Ikey>;
+
     public:
 
       typedef storage_base base_type;
@@ -22,38 +33,219 @@ namespace atlasdb {
       typedef std::pair<index_key_type, index_value_type> index_node_type;
       typedef std::less<index_key_type> index_key_compare;
 
+      // the entries are ordered by index key, then by record key, so that the
+      // record keys of an index key are sorted; they are also compared to
+      // bare index keys, by which the entries of an index key are looked up
+      struct index_node_compare {
+        typedef void is_transparent;
+
+        bool operator()(const index_node_type& x, const index_node_type& y) const { return x < y; }
+
+        bool operator()(const index_node_type& x, const index_key_type& key) const { return x.first < key; }
+
+        bool operator()(const index_key_type& key, const index_node_type& x) const { return key < x.first; }
+      };
+
+      // btree nodes are carved out of an arena owned by the container
+      typedef btree_node_allocator<index_node_type> allocator_type;
+      typedef btree_multiset<index_node_type, index_node_compare, allocator_type> container_type;
+
+      // a field of the records projected into a covering index, as the
+      // bytes [offset, offset + size) of the record
+      struct field_type {
+        ptrdiff_t offset;
+        size_t size;
+      };
+
+      // the entries of a covering index, ordered as those of the index, each
+      // with the slot of the projected fields of its record in the projection
+      // slab, see project()
+      typedef btree_node_allocator<std::pair<const index_node_type, size_t>> covered_allocator_type;
+      typedef btree_multimap<index_node_type, size_t, index_node_compare, covered_allocator_type>
+          covered_container_type;
+
     public:
 
-      basic_index() = default;
+      basic_index() : _sorted(0), _threshold(0), _width(0) {}
 
-      basic_index(const std::string& name) : base_type(name) {}
+      basic_index(const std::string& name) : base_type(name), _sorted(0), _threshold(0), _width(0) {}
 
       virtual ~basic_index() {}
 
     public:
 
-      bool lower_bound(const index_key_type& lower, bool open);
+      class cursor;
 
-      bool upper_bound(const index_key_type& upper, bool open);
+      /**
+       * a cursor over the entries whose index key is greater than lower, or
+       * not less than lower if the bound is closed
+       */
+      cursor lower_bound(const index_key_type& lower, bool open) const;
 
-    protected:
+      /**
+       * a cursor over the entries whose index key is less than upper, or not
+       * greater than upper if the bound is closed
+       */
+      cursor upper_bound(const index_key_type& upper, bool open) const;
+
+      /**
+       * a cursor over the entries whose index key is between lower and
+       * upper, each bound open or closed
+       */
+      cursor range(const index_key_type& lower, bool open, const index_key_type& upper, bool open2) const;
+
+      /**
+       * a cursor over the entries of key, their record keys in order
+       */
+      cursor range(const index_key_type& key) const { return range(key, false, key, false); }
+
+      /**
+       * a cursor over all of the entries
+       */
+      cursor range() const;
+
+      /**
+       * copy to out the record keys found by all of the cursors, once each and
+       * in order: the cursors leapfrog, each one skipping to the greatest key
+       * the others are at, so that the entries in between are not read
+       * @throw storage_error(errc::invalid_argument) if a cursor is not ordered
+       */
+      template<class OutputIterator>
+      static OutputIterator intersect(std::vector<cursor>& cursors, OutputIterator out);
+
+      /**
+       * copy to out the record keys found by any of the cursors, once each and
+       * in order
+       * @throw storage_error(errc::invalid_argument) if a cursor is not ordered
+       */
+      template<class OutputIterator>
+      static OutputIterator unite(std::vector<cursor>& cursors, OutputIterator out);
+
+      /**
+       * bulk load (ikey, key) pairs sorted by ikey, then by key, into an empty
+       * index, the btree is built bottom-up in one pass
+       * @param fill the fraction of each btree node to be filled, in (0, 1]
+       */
+      template<class InputIterator>
+      void load(InputIterator first, InputIterator last, double fill = 1.0) {
+        _container.bulk_load(first, last, fill);
+      }
+
+      /**
+       * buffer the changes of the index, up to threshold of them, instead of
+       * making a btree insert or erase per change: they are applied as a
+       * sorted batch by flush(), when the buffer is full or at the commit of
+       * the storehouse, 0 applies the buffered changes and turns buffering off
+       * @notice get(), count() and keys() see the buffered changes through an
+       *    overlay, the iterators apply them first
+       * @throw storage_error(errc::invalid_argument) if the index is a covering
+       *    index, whose projections would not be buffered with its entries
+       */
+      void defer(size_t threshold);
 
-      boost::optional<index_value_type> get(const index_key_type& key);
+      /**
+       * apply the buffered changes, merging the inserted entries into the
+       * btree in one pass
+       */
+      void flush();
+
+      /**
+       * the number of buffered changes
+       */
+      size_t pending() const { return _deltas.size(); }
+
+      /**
+       * the first record key indexed under key, if any
+       */
+      boost::optional<index_value_type> get(const index_key_type& key) const;
+
+      /**
+       * the number of record keys indexed under key
+       */
+      size_t count(const index_key_type& key) const;
+
+      /**
+       * copy the record keys indexed under key to out, those of the btree
+       * first
+       */
+      template<class OutputIterator>
+      OutputIterator keys(const index_key_type& key, OutputIterator out) const;
+
+    public:
+
+      /**
+       * the field of the records that p returns a reference to, e.g.
+       * [](const vertex& v) -> const int64_t& { return v.timestamp; }
+       */
+      template<class P>
+      static field_type field(P p) {
+        static_assert(std::is_trivially_copyable<Value>::value, "only the fields of plain records can be projected");
+        Value data = Value();
+        const auto& f = p(data);
+        field_type result = { reinterpret_cast<const char*>(&f) - reinterpret_cast<const char*>(&data), sizeof(f) };
+        return result;
+      }
+
+      /**
+       * make a covering index: next to every record key, the index keeps the
+       * given fields of the record, so that queries reading only the index key
+       * and those fields are answered by an index scan, without looking the
+       * records up in the repository
+       * @notice the projections of the entries already in the index are
+       *    dropped, basic_storehouse::cover() fills them in again
+       * @throw storage_error(errc::invalid_argument) if a field is not within
+       *    a record, or if the changes of the index are buffered, see defer()
+       */
+      void cover(const std::vector<field_type>& fields);
+
+      /**
+       * whether the index is a covering index
+       */
+      bool covering() const { return !_fields.empty(); }
+
+      /**
+       * whether the projection of the index holds all of the bytes of f
+       */
+      bool covers(const field_type& f) const;
+
+      /**
+       * call f(ikey, key, data) for the entries of a covering index whose
+       * index key is in [lower, upper), in index key order, while it returns
+       * true; data holds the projected fields of the record of key, its other
+       * fields are value-initialized
+       */
+      template<class F>
+      void covered_range(const index_key_type& lower, const index_key_type& upper, F f) const;
+
+    protected:
 
       void insert(const index_key_type& key, const index_value_type& data);
 
+      // an insert into a covering index, which also keeps the projection of record
+      void insert(const index_key_type& key, const index_value_type& data, const Value& record);
+
       void update(const index_key_type& key, const index_key_type& new_key, const index_value_type& data);
 
+      void update(const index_key_type& key, const index_key_type& new_key, const index_value_type& data,
+          const Value& record);
+
+      // replaces the projection of the entry of data under key with that of
+      // record
+      void refresh(const index_key_type& key, const index_value_type& data, const Value& record);
+
       void del(const index_key_type& key);
 
       void del(const index_key_type& key,const index_value_type& data);
 
     public:
 
-      typedef typename btree_map<index_key_type, index_value_type>::iterator iterator;
-      typedef typename btree_map<index_key_type, index_value_type>::const_iterator const_iterator;
-      typedef typename btree_map<index_key_type, index_value_type>::reverse_iterator reverse_iterator;
-      typedef typename btree_map<index_key_type, index_value_type>::const_reverse_iterator const_reverse_iterator;
+      typedef typename container_type::iterator iterator;
+      typedef typename container_type::const_iterator const_iterator;
+      typedef typename container_type::reverse_iterator reverse_iterator;
+      typedef typename container_type::const_reverse_iterator const_reverse_iterator;
+      // forward only iterators for index scans, they prefetch the btree
+      // leaves ahead of the one being read
+      typedef typename container_type::scan_iterator scan_iterator;
 
       bool empty() const;
       iterator find(const index_key_type& key);
@@ -66,14 +258,160 @@ namespace atlasdb {
       const_reverse_iterator rbegin() const;
       reverse_iterator rend();
       const_reverse_iterator rend() const;
+      scan_iterator scan_begin() const { settle(); return _container.scan_begin(); }
+      scan_iterator scan_end() const { return _container.scan_end(); }
+      scan_iterator scan_lower_bound(const index_key_type& key) const {
+        settle();
+        return scan_iterator(_container.lower_bound(key));
+      }
       index_value_type front();
       const index_value_type front() const;
       index_value_type back();
       const index_value_type back() const;
 
+    public:
+
+      /**
+       * A view of the entries of the index whose index key is within bounds,
+       * each one open, closed or missing: it reads the entries in the btree
+       * leaves as it moves, in index key order, then in record key order.
+       * Like the iterators, a cursor is invalidated by the changes of the
+       * index.
+       * */
+      class cursor {
+        friend class basic_index;
+
+      public:
+
+        cursor() : _container(nullptr), _lower_open(false), _upper_open(false) {}
+
+        /**
+         * whether the cursor is past its last entry
+         */
+        bool at_end() const { return _it == _last; }
+
+        const index_key_type& ikey() const { return _it->first; }
+
+        const index_value_type& key() const { return _it->second; }
+
+        const index_node_type& operator*() const { return *_it; }
+
+        void next() { ++_it; }
+
+        /**
+         * whether the record keys come in order, the cursor being over a
+         * single index key
+         */
+        bool ordered() const;
+
+        /**
+         * move to the first entry whose index key is not less than key,
+         * backwards or forwards, within the bounds
+         * @complex O(logN)
+         */
+        void seek(const index_key_type& key);
+
+        /**
+         * move forwards to the first entry of the current index key whose
+         * record key is not less than key, or else to the entries of the next
+         * index key
+         * @complex O(logN)
+         */
+        void skip_to(const index_value_type& key);
+
+      private:
+
+        // whether an entry of key is past the upper bound
+        bool beyond(const index_key_type& key) const;
+
+        // the first entry of the cursor that is not before it
+        typename container_type::const_iterator clamp(typename container_type::const_iterator it) const;
+
+      private:
+
+        const container_type* _container;
+        typename container_type::const_iterator _it;
+        typename container_type::const_iterator _last;
+        boost::optional<index_key_type> _lower;
+        boost::optional<index_key_type> _upper;
+        bool _lower_open;
+        bool _upper_open;
+      };
+
     private:
 
-      btree_multimap<index_key_type, index_value_type, index_key_compare> _container;
+      // the buffered changes of node: they take the number n of its entries
+      // to max(n + count, floor), as an insert adds an entry and an erase
+      // removes one if there is any; {1, 0} for an insert, {-1, 0} for an
+      // erase, composed in order once the changes of a node are collapsed
+      struct delta {
+        index_node_type node;
+        int count;
+        int floor;
+
+        bool operator<(const delta& x) const { return node < x.node; }
+      };
+
+      void insert_entry(const index_key_type& key, const index_value_type& data);
+
+      void erase_entry(const index_key_type& key, const index_value_type& data);
+
+      cursor make_cursor(const boost::optional<index_key_type>& lower, bool open,
+          const boost::optional<index_key_type>& upper, bool open2) const;
+
+      // sorts the deltas appended since the last call and merges them into
+      // the sorted ones, collapsing the deltas of a node
+      void sort_deltas() const;
+
+      // the number of entries d adds to the btree, negative if it removes
+      // some, looking the node up only if d may erase
+      ptrdiff_t change(const delta& d) const;
+
+      // calls f with the record keys indexed under key, seeing the buffered
+      // changes, while it returns true
+      template<class F>
+      void for_each_key(const index_key_type& key, F f) const;
+
+      void insert_covered(const index_key_type& key, const index_value_type& data, const Value& record);
+
+      void erase_covered(typename covered_container_type::iterator it);
+
+      // copies the projected fields of record, concatenated, to the given slot
+      // of the projection slab
+      void project(const Value& record, size_t slot);
+
+      // the entry of data under key in the covering container
+      typename covered_container_type::iterator find_covered(const index_key_type& key, const index_value_type& data);
+
+      // the first of the sorted deltas of key
+      typename std::vector<delta>::const_iterator lower_delta(const index_key_type& key) const;
+
+      // applies the buffered changes before the btree is read directly
+      void settle() const {
+        if (!_deltas.empty()) {
+          const_cast<self_type*>(this)->flush();
+        }
+      }
+
+    private:
+
+      container_type _container;
+
+      // the buffered changes, the first _sorted of them sorted and collapsed
+      mutable std::vector<delta> _deltas;
+      mutable size_t _sorted;
+      size_t _threshold;
+
+      // the projected fields of a covering index, the number of bytes they
+      // take, and its entries; they are not buffered by defer()
+      std::vector<field_type> _fields;
+      size_t _width;
+      covered_container_type _covered;
+
+      // the projections of the entries of a covering index, _width bytes per
+      // slot, and the slots of the erased entries, which new entries reuse
+      std::vector<char> _projections;
+      std::vector<size_t> _free_slots;
     };
 
   } // storage
@@ -6,15 +6,30 @@
 #include <set>
 #include <vector>
 #include <memory>
+#include <mutex>
 #include <algorithm>
 
 #include <atlasdb/storage/storage_error.h>
 #include <atlasdb/storage/storage_base.h>
 #include <atlasdb/storage/basic_index.h>
+#include <atlasdb/storage/basic_bitmap_index.h>
+#include <atlasdb/storage/basic_hash_index.h>
 
 namespace atlasdb {
   namespace storage {
 
+    /**
+     * how an index is organized, chosen when it is created
+     */
+    enum class index_kind {
+      // ordered, for any condition, see basic_index
+      btree,
+      // for index keys having few distinct values, see basic_bitmap_index
+      bitmap,
+      // for equality conditions only, see basic_hash_index
+      hash
+    };
+
     template<typename Key, typename Value, typename IKey>
     class basic_indexer : virtual public storage_base {
     public:
@@ -23,6 +38,8 @@ namespace atlasdb {
       // typedef storage_base<Key, Value, IKey> base_type;
 
       typedef basic_index<Key, Value, IKey> index;
+      typedef basic_bitmap_index<Key, Value, IKey> bitmap_index;
+      typedef basic_hash_index<Key, Value, IKey> hash_index;
 
       typedef Key key_type;
       typedef Value value_type;
@@ -47,7 +64,17 @@ namespace atlasdb {
 
     public:
 
-      static void create(const std::string& name);
+      /**
+       * create an index, of the given kind: the indexes opened by that name
+       * from then on are of that kind, see kind()
+       */
+      static void create(const std::string& name, index_kind kind = index_kind::btree);
+
+      /**
+       * the kind an index was created with, index_kind::btree for the indexes
+       * that were not created
+       */
+      static index_kind kind(const std::string& name);
 
       template<class InputIterator>
       static void create(InputIterator first, InputIterator last) {
@@ -84,8 +111,6 @@ namespace atlasdb {
       /**
        * open an index with an arithmetic range, one of the following cases:
        * [a, b], (a, b), [a, b), (a, b]
-       * if none of the arguments is provided, it does a full scan over the
-       * index storage
        *
        * @complex O(logN)
        * @param lower the lower bound
@@ -94,16 +119,57 @@ namespace atlasdb {
        * @param upper the upper bound
        * @param open2 indicate whether upper bound is an open interval(true)
        *          or an closed interval(false)
-       * @return true if success
+       * @return a cursor over the entries of the range, see
+       *          basic_index::cursor
+       * @throw storage_error(errc::item_not_found) if no index of that name
+       *          was opened, as does the overload below
        */
-      index& open(const std::string& name, const index_key_type& lower,
-          bool open = true, const index_key_type& upper = index_key_type::nil,
-          bool open2 = true);
+      typename index::cursor open(const std::string& name, const index_key_type& lower,
+          bool open, const index_key_type& upper, bool open2 = true);
+
+      /**
+       * open an index with a range having no upper bound, (a, +inf) or
+       * [a, +inf)
+       */
+      typename index::cursor open(const std::string& name, const index_key_type& lower, bool open = true);
 
       index& operator[](const std::string& name) { return _indexes[name]; }
 
       index& at(const std::string& name) { return _indexes.at(name); }
 
+      /**
+       * open a bitmap index, for index keys having few distinct values, see
+       * basic_bitmap_index; the name of an index is that of an index of one
+       * kind only
+       */
+      bitmap_index& open_bitmap(const std::string& name) { return _bitmaps[name]; }
+
+      bitmap_index& bitmap(const std::string& name) { return _bitmaps.at(name); }
+
+      /**
+       * the bitmap index of that name, nullptr if there is none
+       */
+      bitmap_index* find_bitmap(const std::string& name) {
+        auto it = _bitmaps.find(name);
+        return it == _bitmaps.end() ? nullptr : &it->second;
+      }
+
+      /**
+       * open a hash index, for equality conditions only, see
+       * basic_hash_index
+       */
+      hash_index& open_hash(const std::string& name) { return _hashes[name]; }
+
+      hash_index& hash(const std::string& name) { return _hashes.at(name); }
+
+      /**
+       * the hash index of that name, nullptr if there is none
+       */
+      hash_index* find_hash(const std::string& name) {
+        auto it = _hashes.find(name);
+        return it == _hashes.end() ? nullptr : &it->second;
+      }
+
       /**
        * close an open index
        * */
@@ -116,10 +182,10 @@ namespace atlasdb {
 
     public:
 
-      typedef typename std::multimap<std::string, index>::iterator iterator;
-      typedef typename std::multimap<std::string, index>::const_iterator const_iterator;
-      typedef typename std::multimap<std::string, index>::reverse_iterator reverse_iterator;
-      typedef typename std::multimap<std::string, index>::const_reverse_iterator const_reverse_iterator;
+      typedef typename std::map<std::string, index>::iterator iterator;
+      typedef typename std::map<std::string, index>::const_iterator const_iterator;
+      typedef typename std::map<std::string, index>::reverse_iterator reverse_iterator;
+      typedef typename std::map<std::string, index>::const_reverse_iterator const_reverse_iterator;
 
       size_type max_size() const { return _indexes.max_size(); }
 
@@ -131,7 +197,7 @@ namespace atlasdb {
 
       const_iterator begin() const { return _indexes.begin(); }
 
-      iterator end() { return _indexes.begin(); }
+      iterator end() { return _indexes.end(); }
 
       const_iterator end() const { return _indexes.end(); }
 
@@ -153,7 +219,17 @@ namespace atlasdb {
 
     private:
 
-      std::multimap<std::string, index> _indexes;
+      std::map<std::string, index> _indexes;
+      std::map<std::string, bitmap_index> _bitmaps;
+      std::map<std::string, hash_index> _hashes;
+
+      // the opened btree index of that name, item_not_found if there is none
+      const index& opened(const std::string& name) const;
+
+      // the kinds of the created indexes
+      static std::map<std::string, index_kind>& catalog();
+
+      static std::mutex& catalog_lock();
     };
 
   } // storage
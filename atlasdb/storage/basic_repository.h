@@ -1,9 +1,21 @@
 #ifndef ATLASDB_STORAGE_BASIC_REPOSITORY_H_
 #define ATLASDB_STORAGE_BASIC_REPOSITORY_H_
 
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include <atlasdb/storage/btree/btree_map.h>
+#include <atlasdb/storage/btree/btree_allocator.h>
+#include <atlasdb/storage/btree/btree_hash_index.h>
 
 #include <atlasdb/storage/storage_base.h>
+#include <atlasdb/storage/write_ahead_log.h>
 //#include <atlasdb/storage/basic_environment.h>
 //#include <atlasdb/storage/basic_transaction.h>
 
@@ -28,7 +40,18 @@ namespace atlasdb {
       typedef Key key_type;
       typedef Value value_type;
       typedef std::pair<key_type, value_type> node_type;
-      typedef std::less<key_type> key_compare;
+      // transparent, so that records can be looked up by any value comparable
+      // to a key_type without building a key_type first
+      typedef btree_transparent_less<key_type> key_compare;
+
+      // btree nodes are carved out of an arena owned by the container, whose
+      // internal nodes count the records below them for positional access
+      typedef btree_node_allocator<std::pair<const key_type, value_type>> allocator_type;
+      typedef btree_ranked_map<key_type, value_type, key_compare, allocator_type> container_type;
+      typedef typename container_type::snapshot_type snapshot_type;
+      typedef typename container_type::verifier_type verifier_type;
+      // an optional companion of the container for exact match lookups
+      typedef btree_hash_index<container_type> hash_index_type;
 
       typedef size_t identifier;
 
@@ -66,6 +89,39 @@ namespace atlasdb {
        */
       virtual void close();
 
+      /**
+       * make the storage durable: load the last checkpoint at
+       * path.checkpoint, replay the log at path.log written since, then log
+       * the modifications of the storage from then on, the storage being
+       * cleared first
+       * @throw storage_error(errc::run_recovery) if the checkpoint or the log
+       *    are damaged, other than by a crash while appending to the log
+       * @notice the modifications are durable once commit() returned, images
+       *    opened with open_image() are not logged
+       */
+      void recover(const string& path, const log_options& options = log_options());
+
+      /**
+       * make the modifications logged so far durable, as the sync policy of
+       * the log says, a no-op if the storage is not durable
+       * @throw storage_error(errc::run_recovery) if the log could not be
+       *    written
+       */
+      void commit() {
+        if (_log) {
+          _log->commit(_log->lsn());
+        }
+      }
+
+      /**
+       * take a checkpoint of the storage, written by a background thread from
+       * a snapshot so that writers are not blocked, after which the log
+       * segments it covers are deleted; checkpoints are also taken every
+       * log_options::checkpoint_bytes of log
+       * @throw the error of the previous checkpoint if it failed
+       */
+      void checkpoint();
+
       bool upper_bound(const key_type& key, bool open);
 
       bool lower_bound(const key_type& key, bool open);
@@ -97,6 +153,44 @@ namespace atlasdb {
         return put(rk.address(), rk.size(), rd.address(), rd.size());
       }
 
+      /**
+       * bulk load key/value pairs sorted by key into an empty storage, the
+       * btree is built bottom-up in one pass instead of a put per pair
+       * @param fill the fraction of each btree node to be filled, in (0, 1]
+       * @notice duplicate keys are skipped
+       */
+      template<class InputIterator>
+      void load(InputIterator first, InputIterator last, double fill = 1.0) {
+        if (_log) {
+          std::vector<node_type> nodes(first, last);
+          log_all(nodes);
+          _container.bulk_load(nodes.begin(), nodes.end(), fill);
+          maybe_checkpoint();
+          return;
+        }
+        _container.bulk_load(first, last, fill);
+      }
+
+      /**
+       * put key/value pairs sorted by key into the storage, the btree is
+       * walked from one insertion to the next rather than descended from the
+       * root for every pair and the pairs going to a node are merged into it
+       * at once
+       * @return the number of pairs put
+       * @notice pairs whose key is already in the storage are skipped
+       */
+      template<class InputIterator>
+      size_t put_sorted(InputIterator first, InputIterator last) {
+        if (_log) {
+          std::vector<node_type> nodes(first, last);
+          log_all(nodes);
+          size_t n = _container.insert_sorted_batch(nodes.begin(), nodes.end());
+          maybe_checkpoint();
+          return n;
+        }
+        return _container.insert_sorted_batch(first, last);
+      }
+
       /**
        * Simple fetch a data block with a given key
        */
@@ -113,8 +207,73 @@ namespace atlasdb {
        */
       value_type get(const key_type& key, void* buffer, size_t size) const;
 
+      /**
+       * fetch the data blocks of many keys at once, which is much faster than
+       * a get per key for large key sets: the lookups run in key order with
+       * their btree descents interleaved
+       * @param out receives a boost::optional<value_type> per key, in the
+       *    order of the keys, empty if the key is not in the storage
+       */
+      template<class ForwardIterator, class OutputIterator>
+      OutputIterator get_many(ForwardIterator first, ForwardIterator last, OutputIterator out) const {
+        std::vector<const_iterator> found;
+        found.reserve(std::distance(first, last));
+        _container.find_batch(first, last, std::back_inserter(found));
+        for (const auto& it : found) {
+          *out++ = it == _container.end() ? boost::optional<value_type>() : boost::optional<value_type>(it->second);
+        }
+        return out;
+      }
+
       bool exists(const key_type& key) const;
 
+      /**
+       * keep a hash index of at most max_bytes for the exact match lookups of
+       * get() and exists(), which then take about one cache miss for keys
+       * looked up before instead of a btree descent, 0 drops the index
+       * @notice the index refills lazily after btree nodes were merged or
+       *    freed, range scans and the other lookups keep using the btree
+       */
+      void hash_index(size_t max_bytes) {
+        _hash_index.reset(max_bytes ? new hash_index_type(max_bytes) : nullptr);
+      }
+
+      /**
+       * the memory taken by the hash index and its hit and miss counts, all
+       * zero without a hash index
+       */
+      btree_hash_index_stats hash_index_stats() const {
+        return _hash_index ? _hash_index->stats() : btree_hash_index_stats();
+      }
+
+      /**
+       * look up records by a value of any type comparable to key_type, e.g.
+       * a <buffer, size> pair straight out of a received message, without
+       * building a key_type, so without allocating
+       * @return the first record with the key, or end() if there is none
+       */
+      template<class Key2>
+      typename container_type::const_iterator find(const Key2& key) const {
+        return _container.find(key);
+      }
+
+      /**
+       * the first record whose key is not less than key, see find()
+       */
+      template<class Key2>
+      typename container_type::const_iterator lower_bound(const Key2& key) const {
+        return _container.lower_bound(key);
+      }
+
+      /**
+       * the records whose key compares equal to key, see find()
+       */
+      template<class Key2>
+      std::pair<typename container_type::const_iterator, typename container_type::const_iterator>
+      equal_range(const Key2& key) const {
+        return _container.equal_range(key);
+      }
+
       /**
        *  Replace a data block to the given data block
        *  All the open index should also be updated
@@ -125,6 +284,15 @@ namespace atlasdb {
         _container.find_unique(key);
       }
 
+      /**
+       * overwrite the bytes [offset, offset + size) of the data block of key
+       * with the same bytes of new_value, in place: the other bytes are
+       * neither copied nor moved, and only the changed bytes are logged
+       * @throw storage_error(errc::item_not_found) if key is not in the
+       *    storage, storage_error(errc::invalid_argument) if the range is
+       *    not within both data blocks
+       * @notice snapshots and images keep the data block as it was
+       */
       void update(const key_type& key, const value_type& new_value, ptrdiff_t offset, size_t size);
 
       // delete the old one and insert a new one
@@ -138,25 +306,138 @@ namespace atlasdb {
       void update(const Key2& key, const Key2& new_key, const Value2& new_value);
 
       /**
-       * delayed
+       * overwrite a field of the data block of key with the same field of
+       * data in place, see update(key, new_value, offset, size)
        * @param P is a filed extractor used to indicate the exact field portion
-       *    to be updated.
+       *    to be updated: it returns a reference to the field of the value it
+       *    is given, e.g. [](const vertex& v) -> const int64_t& { return v.timestamp; }
        */
       template<class P>
-      void update(const key_type& key, const value_type& data, P p);
+      void update(const key_type& key, const value_type& data, P p) {
+        const auto& field = p(data);
+        update(key, data, reinterpret_cast<const char*>(&field) - reinterpret_cast<const char*>(&data), sizeof(field));
+      }
 
       /**
        * delete an existing data node in the storage
        * @notice these updating operation affects only the primary storage
        */
       void del(const key_type& key) {
+        if (_log) {
+          append_log(kLogDel, key);
+        }
         _container.erase(key);
+        maybe_checkpoint();
+      }
+
+      /**
+       * delete the records whose key is in [lower, upper), the btree subtrees
+       * lying within the range are dropped whole instead of record by record
+       * @return the number of deleted records
+       */
+      size_t erase_range(const key_type& lower, const key_type& upper) {
+        if (_log) {
+          append_log(kLogEraseRange, lower, upper);
+        }
+        size_t n = _container.erase_range(lower, upper);
+        maybe_checkpoint();
+        return n;
+      }
+
+      /**
+       * delete all of the records in O(1), the storage goes on with an empty
+       * btree at once while the old one is freed by the background thread of
+       * the storage, which the destructor waits for
+       */
+      void truncate() {
+        if (_log) {
+          _log->append(kLogClear, nullptr, 0, nullptr, 0);
+        }
+        std::unique_ptr<container_type> old(new container_type());
+        old->swap(_container);
+        if (!_reclaimer) {
+          _reclaimer.reset(new reclaimer());
+        }
+        _reclaimer->push(std::move(old), std::move(_image));
+      }
+
+      /**
+       * write an image of the storage to the file at path, which open_image()
+       * maps back in this or another process, e.g. after a restart
+       * @throw std::system_error if the file cannot be written
+       * @notice only the storages of trivially copyable keys and values have
+       *    images, the file is replaced once the image is complete
+       */
+      void save_image(const string& path) const;
+
+      /**
+       * replace the records of the storage by those of the image file at path,
+       * which are read from the file as they are accessed instead of being
+       * loaded up front, so the storage is ready in about the time it takes to
+       * map the file; modified btree nodes are copied into memory
+       * @throw std::system_error if the file cannot be mapped, and
+       *    std::runtime_error if it is not an image of this type of storage
+       * @notice snapshots taken from then on must be released before the
+       *    storage is destroyed or opens another image
+       */
+      void open_image(const string& path);
+
+      /**
+       * take a consistent read only view of the storage in O(1), the
+       * snapshot stays valid and unchanged while the storage is modified, so
+       * long running scans and exports do not block writers
+       * @notice the snapshot may be read and released by any thread, taking it
+       *    needs the same synchronisation as writing the storage
+       */
+      snapshot_type snapshot() {
+        return _container.snapshot();
+      }
+
+      /**
+       * start checking the btree of the storage without blocking writers: the
+       * verifier checks a snapshot of the storage a bounded number of nodes
+       * per step() and reports how full the btree nodes are along the way
+       * @notice taking the snapshot needs the same synchronisation as writing
+       *    the storage, stepping the verifier needs none
+       */
+      verifier_type verifier() {
+        return verifier_type(_container.snapshot());
+      }
+
+      /**
+       * fill up sparse btree nodes, as left by deletes, up to fill of their
+       * capacity and free the emptied ones, either for the whole storage or for
+       * the records whose key is in [lower, upper) so that the work can be
+       * spread over several calls
+       * @return the number of btree nodes freed
+       */
+      size_t compact(double fill = 1.0) {
+        return _container.compact(fill);
+      }
+
+      size_t compact(const key_type& lower, const key_type& upper, double fill = 1.0) {
+        return _container.compact_range(lower, upper, fill);
       }
 
     public:
 
       size_t count() const {
-        return _container.count();
+        return _container.size();
+      }
+
+      /**
+       * count the records whose key is in [first, last) in O(log n)
+       */
+      size_t count(const key_type& first, const key_type& last) const {
+        return _container.count_range(first, last);
+      }
+
+      /**
+       * the position of the first record whose key is not less than key, in
+       * O(log n)
+       */
+      size_t rank(const key_type& key) const {
+        return _container.rank(key);
       }
 
     public:
@@ -166,10 +447,13 @@ namespace atlasdb {
       // Note : A storage must be an associated container just like
       // std::map, so the iterator interface can refers to std::map iterator
       // and berkeley db provider something similar
-      typedef typename btree_map<key_type, value_type>::iterator iterator;
-      typedef typename btree_map<key_type, value_type>::const_iterator const_iterator;
-      typedef typename btree_map<key_type, value_type>::reverse_iterator reverse_iterator;
-      typedef typename btree_map<key_type, value_type>::const_reverse_iterator const_reverse_iterator;
+      typedef typename container_type::iterator iterator;
+      typedef typename container_type::const_iterator const_iterator;
+      typedef typename container_type::reverse_iterator reverse_iterator;
+      typedef typename container_type::const_reverse_iterator const_reverse_iterator;
+      // forward only iterators for full or range scans, they prefetch the
+      // btree leaves ahead of the one being read
+      typedef typename container_type::scan_iterator scan_iterator;
 
       bool empty() const { return _container.empty(); }
 
@@ -189,6 +473,15 @@ namespace atlasdb {
 
       const_reverse_iterator rend() const { return _container.rend(); }
 
+      scan_iterator scan_begin() const { return _container.scan_begin(); }
+
+      scan_iterator scan_end() const { return _container.scan_end(); }
+
+      scan_iterator scan_lower_bound(const key_type& key) const { return _container.scan_lower_bound(key); }
+
+      // start a scan at the n-th record in key order in O(log n), or at the end
+      scan_iterator scan_at(size_t n) const { return scan_iterator(_container.select(n)); }
+
       value_type front() { return _container.front(); }
 
       const value_type front() const { return _container.front(); }
@@ -199,7 +492,114 @@ namespace atlasdb {
 
     private:
 
-      btree_map<key_type, value_type> _container;
+      // the types of the records of the log
+      enum : uint8_t {
+        kLogPut = 1,
+        // a put skipped if the key exists, see put_sorted()
+        kLogInsert,
+        kLogDel,
+        // the lower key of the range, and the upper one as value
+        kLogEraseRange,
+        kLogClear,
+        // the offset of the changed bytes of a value followed by the bytes,
+        // see update()
+        kLogPatch,
+      };
+
+      template<class Value2>
+      void append_log(uint8_t type, const key_type& key, const Value2& value) {
+        _log->append(type, log_codec<key_type>::data(key), log_codec<key_type>::size(key),
+            log_codec<Value2>::data(value), log_codec<Value2>::size(value));
+      }
+
+      void append_log(uint8_t type, const key_type& key) {
+        _log->append(type, log_codec<key_type>::data(key), log_codec<key_type>::size(key), nullptr, 0);
+      }
+
+      void log_all(const std::vector<node_type>& nodes) {
+        for (const auto& node : nodes) {
+          append_log(kLogInsert, node.first, node.second);
+        }
+      }
+
+      // replays a record of the log
+      void apply(const log_record& record);
+
+      // starts a checkpoint once the log grew enough since the last one
+      void maybe_checkpoint() {
+        if (_log && _log_options.checkpoint_bytes && _log->lsn() - _checkpoint_lsn >= _log_options.checkpoint_bytes
+            && !(_checkpoint.valid()
+                && _checkpoint.wait_for(std::chrono::seconds(0)) != std::future_status::ready)) {
+          checkpoint();
+        }
+      }
+
+      // finds key through the hash index if there is one
+      typename container_type::const_iterator lookup(const key_type& key) const {
+        return _hash_index ? _hash_index->find(_container, key) : _container.find(key);
+      }
+
+      // frees the btrees dropped by truncate(), along with the images they
+      // read from, one after the other on a thread of its own, and waits
+      // until all of them are freed when destroyed
+      class reclaimer {
+      public:
+
+        reclaimer() : _stop(false), _thread([this]() { run(); }) {}
+
+        ~reclaimer() {
+          {
+            std::lock_guard<std::mutex> guard(_lock);
+            _stop = true;
+          }
+          _ready.notify_one();
+          _thread.join();
+        }
+
+        void push(std::unique_ptr<container_type> container, std::shared_ptr<btree_image> image) {
+          {
+            std::lock_guard<std::mutex> guard(_lock);
+            _garbage.push_back(garbage { std::move(image), std::move(container) });
+          }
+          _ready.notify_one();
+        }
+
+      private:
+
+        struct garbage {
+          // destroyed in reverse order, the btree before its image
+          std::shared_ptr<btree_image> image;
+          std::unique_ptr<container_type> container;
+        };
+
+        void run();
+
+        std::mutex _lock;
+        std::condition_variable _ready;
+        std::deque<garbage> _garbage;
+        bool _stop;
+        std::thread _thread;
+      };
+
+    private:
+
+      // the image the btree serves reads from, declared first so that it
+      // is unmapped after the btree is destroyed
+      std::shared_ptr<btree_image> _image;
+      container_type _container;
+      std::unique_ptr<hash_index_type> _hash_index;
+
+      // the log of a durable storage, see recover(), and the checkpoint being
+      // written if any
+      std::unique_ptr<write_ahead_log> _log;
+      string _log_path;
+      log_options _log_options;
+      uint64_t _checkpoint_lsn;
+      std::future<void> _checkpoint;
+
+      // started by the first truncate(), declared last so that the btrees it
+      // frees are gone before the rest of the storage
+      std::unique_ptr<reclaimer> _reclaimer;
     };
 
   } // storage
@@ -4,6 +4,8 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <memory>
+#include <future>
 #include <utility>
 #include <functional>
 
@@ -33,6 +35,9 @@ namespace atlasdb {
       typedef basic_repository<Key, Value, Ikey> repository;
       typedef basic_indexer<Key, Value, Ikey> indexer;
       typedef basic_index<Key, Value, Ikey> index;
+      typedef basic_bitmap_index<Key, Value, Ikey> bitmap_index;
+      typedef basic_hash_index<Key, Value, Ikey> hash_index;
+      typedef typename bitmap_index::row_space_type row_space;
 
       typedef Key key_type;
       typedef Value value_type;
@@ -52,20 +57,97 @@ namespace atlasdb {
 
     public:
 
-      basic_storehouse(const string name) : repository(name), indexer(name) {}
+      basic_storehouse(const string name) : repository(name), indexer(name), _rows(std::make_shared<row_space>()) {}
 
-      basic_storehouse(const string name, const std::vector<string>& indexes);
+      basic_storehouse(const string& name, const std::vector<string>& indexes);
 
       virtual ~basic_storehouse() {}
 
     public:
 
-      void open(const string name, const std::vector<string>& indexes);
+      /**
+       * open the indexes of the storage, each of the kind it was created
+       * with, see basic_indexer::create(); the storage itself is named by
+       * the constructor
+       */
+      void open(const string& name, const std::vector<string>& indexes);
+
+      // the indexes are opened by name as well, or over a range of index keys
+      using indexer::open;
+
+      /**
+       * open a bitmap index, see basic_indexer::open_bitmap(); all of the
+       * bitmap indexes of the storage take the rows of the records from one
+       * row space, so that the bitmaps of different indexes combine, e.g.
+       * bitmap("status").rows(active) & bitmap("region").rows(eu)
+       */
+      bitmap_index& open_bitmap(const string& name);
 
       virtual void close();
 
       /**
-       * insert a value node to the storage, all relative indexes are also updated
+       * buffer the changes of every index, up to threshold per index, and
+       * apply them in sorted batches instead of an index btree insert per
+       * index key, 0 turns buffering off, see basic_index::defer()
+       * @notice the lookups through an index see the buffered changes
+       * @throw storage_error(errc::invalid_argument) if an index is a covering
+       *    index, leaving every index as it was
+       */
+      void defer_indexes(size_t threshold);
+
+      /**
+       * make the named index a covering index projecting the given fields of
+       * the records, see basic_index::cover(); the projections of the
+       * records already indexed are taken from the repository
+       * @notice a partial update of a record through
+       *    basic_repository::update() does not refresh the projections
+       */
+      void cover(const string& name, const std::vector<typename index::field_type>& fields);
+
+      /**
+       * build the btree index name from the records of the storage, e.g. for
+       * an index added to a populated storage, without blocking the writers:
+       * ikeys(key, value, emit) calls emit(ikey) for every index key of a
+       * record, from several threads at once.
+       * A snapshot of the storage is split into partitions, scanned in
+       * parallel, each one sorting its (ikey, key) entries; the sorted runs
+       * are then merged into a bulk load of the index btree. All of it runs
+       * in background threads, while the changes of the index made by put(),
+       * update() and del() are kept in a side log, applied once the index is
+       * built by finish_build() or by a commit().
+       * @param partitions the number of partitions, by default that of the
+       *    hardware threads
+       * @notice the entries of the index are replaced by the built ones, it
+       *    must not be read until then, see building(); the projections of
+       *    a covering index are then taken from the repository again
+       * @throw storage_error(errc::invalid_argument) if the index is not a
+       *    btree index or is being built already
+       */
+      template<class F>
+      void build(const string& name, F ikeys, size_t partitions = 0);
+
+      /**
+       * whether the index is being built, see build()
+       */
+      bool building(const string& name) const { return _builds.count(name) != 0; }
+
+      /**
+       * wait for the index to be built, then apply the changes of its side
+       * log to it, a no-op if it is not being built
+       * @throw the error the build failed with, if any
+       */
+      void finish_build(const string& name);
+
+      /**
+       * apply the buffered index changes, then make the modifications of the
+       * storage durable, see basic_repository::commit(); the indexes built in
+       * the meantime are finished, see build()
+       */
+      void commit();
+
+      /**
+       * insert a value node to the storage, all relative indexes are also
+       * updated, whatever their kind
        */
       void put(const key_type& key, const value_type& value, const named_ikeyset& ikeys);
 
@@ -85,6 +167,12 @@ namespace atlasdb {
 
       /**
        * update a value node in the storage, all relative indexes are also updated
+       * @param ikeys holds for every index whose key changes the old index
+       *    key followed by the new one, and for a covering index all of its
+       *    keys of the record, unchanged ones twice, so that their projections
+       *    are refreshed
+       * @throw storage_error(errc::invalid_argument) if an index is given an
+       *    odd number of index keys
        */
       void update(const key_type& key, const value_type& value, const named_ikeyset& ikeys);
 
@@ -104,6 +192,41 @@ namespace atlasdb {
 
     private:
 
+      // maintain a bitmap or a hash index, which hold no projections
+      template<class Index>
+      static void insert_keys(Index& index, const key_type& key, const ikeyset& ikeys);
+
+      template<class Index>
+      static void update_keys(Index& index, const key_type& key, const ikeyset& ikeys);
+
+      template<class Index>
+      static void del_keys(Index& index, const key_type& key, const ikeyset& ikeys);
+
+      // a change of an index being built: +1 for an insert of the entry, -1
+      // for an erase
+      typedef std::pair<index_node_type, int> side_change;
+
+      // an index being built in the background, and the changes made to it
+      // in the meantime
+      struct build_state {
+        std::unique_ptr<index> built;
+        std::future<void> done;
+        std::vector<side_change> side_log;
+      };
+
+      // the sorted runs of a build merged, as an input iterator
+      class run_merger;
+
+      // the side log of the index, nullptr if it is not being built
+      std::vector<side_change>* side_log(const string& name);
+
+    private:
+
+      std::map<string, build_state> _builds;
+
+      // the rows of the records in the bitmap indexes, see open_bitmap()
+      std::shared_ptr<row_space> _rows;
+
 //      std::error_code err_code(atlasdb::storage::errc e) {
 //        // return std::error_code(static_cast<int>(e), storage_error_category::instance());
 //      }
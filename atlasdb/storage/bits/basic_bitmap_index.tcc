@@ -0,0 +1,145 @@
+#ifndef BASIC_BITMAP_INDEX_TCC_
+#define BASIC_BITMAP_INDEX_TCC_
+
+namespace atlasdb {
+  namespace storage {
+
+    template<typename Key, typename Value, typename Ikey>
+    typename basic_bitmap_index<Key, Value, Ikey>::bitmap_type
+    basic_bitmap_index<Key, Value, Ikey>::rows(const index_key_type& key) const {
+      auto it = _container.find(key);
+      return it == _container.end() ? bitmap_type() : it->second;
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    typename basic_bitmap_index<Key, Value, Ikey>::bitmap_type
+    basic_bitmap_index<Key, Value, Ikey>::rows(const index_key_type& lower, const index_key_type& upper) const {
+      bitmap_type result;
+      auto last = _container.lower_bound(upper);
+      for (auto it = _container.lower_bound(lower); it != last; ++it) {
+        result |= it->second;
+      }
+      return result;
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    size_t basic_bitmap_index<Key, Value, Ikey>::count(const index_key_type& key) const {
+      auto it = _container.find(key);
+      return it == _container.end() ? 0 : it->second.cardinality();
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    template<class OutputIterator>
+    OutputIterator basic_bitmap_index<Key, Value, Ikey>::keys(const bitmap_type& rows, OutputIterator out) const {
+      rows.for_each([this, &out](row_type row) {
+        *out++ = _space->key(row);
+        return true;
+      });
+      return out;
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_bitmap_index<Key, Value, Ikey>::share_rows(const std::shared_ptr<row_space_type>& space) {
+      if (!_container.empty()) {
+        throw storage_error(make_error_code(errc::invalid_argument), "a bitmap index shares rows while empty only");
+      }
+      _space = space;
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_bitmap_index<Key, Value, Ikey>::optimize() {
+      for (auto it = _container.begin(); it != _container.end(); ++it) {
+        it->second.optimize();
+      }
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    size_t basic_bitmap_index<Key, Value, Ikey>::bytes() const {
+      size_t n = 0;
+      for (auto it = _container.begin(); it != _container.end(); ++it) {
+        n += it->second.bytes();
+      }
+      return n;
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_bitmap_index<Key, Value, Ikey>::insert(const index_key_type& key, const index_value_type& data) {
+      row_type row = _space->acquire(data);
+      if (!_container[key].add(row)) {
+        // indexed under key already
+        _space->release(row);
+      }
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_bitmap_index<Key, Value, Ikey>::update(const index_key_type& key, const index_key_type& new_key,
+        const index_value_type& data) {
+      del(key, data);
+      insert(new_key, data);
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_bitmap_index<Key, Value, Ikey>::del(const index_key_type& key) {
+      auto it = _container.find(key);
+      if (it == _container.end()) {
+        return;
+      }
+      it->second.for_each([this](row_type row) {
+        _space->release(row);
+        return true;
+      });
+      _container.erase(it);
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_bitmap_index<Key, Value, Ikey>::del(const index_key_type& key, const index_value_type& data) {
+      const row_type* row = _space->find(data);
+      auto it = _container.find(key);
+      if (!row || it == _container.end() || !it->second.remove(*row)) {
+        return;
+      }
+      if (it->second.empty()) {
+        _container.erase(it);
+      }
+      _space->release(*row);
+    }
+
+    template<typename Key>
+    typename basic_row_space<Key>::row_type basic_row_space<Key>::acquire(const key_type& key) {
+      auto it = _rows.find(key);
+      if (it != _rows.end()) {
+        ++_uses[it->second];
+        return it->second;
+      }
+      row_type row;
+      if (!_free.empty()) {
+        row = _free.back();
+        _free.pop_back();
+        _keys[row] = key;
+      }
+      else {
+        if (_keys.size() > row_type(-1)) {
+          throw storage_error(make_error_code(errc::invalid_argument), "too many rows in a bitmap index");
+        }
+        row = row_type(_keys.size());
+        _keys.push_back(key);
+        _uses.push_back(0);
+      }
+      _uses[row] = 1;
+      _rows.insert(std::make_pair(key, row));
+      return row;
+    }
+
+    template<typename Key>
+    void basic_row_space<Key>::release(row_type row) {
+      if (--_uses[row] == 0) {
+        _rows.erase(_keys[row]);
+        _keys[row] = key_type();
+        _free.push_back(row);
+      }
+    }
+
+  } // storage
+} // atlasdb
+
+#endif // BASIC_BITMAP_INDEX_TCC_
@@ -0,0 +1,260 @@
+#ifndef BASIC_HASH_INDEX_TCC_
+#define BASIC_HASH_INDEX_TCC_
+
+#include <algorithm>
+
+namespace atlasdb {
+  namespace storage {
+
+    template<typename Key, typename Value, typename Ikey>
+    boost::optional<typename basic_hash_index<Key, Value, Ikey>::index_value_type>
+    basic_hash_index<Key, Value, Ikey>::get(const index_key_type& key) const {
+      size_t e = find(key, hash(key));
+      if (e == size_t(-1)) {
+        return boost::none;
+      }
+      return _entries[e].first;
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    size_t basic_hash_index<Key, Value, Ikey>::count(const index_key_type& key) const {
+      size_t e = find(key, hash(key));
+      return e == size_t(-1) ? 0 : 1 + _entries[e].rest.size();
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    template<class OutputIterator>
+    OutputIterator basic_hash_index<Key, Value, Ikey>::keys(const index_key_type& key, OutputIterator out) const {
+      size_t e = find(key, hash(key));
+      if (e != size_t(-1)) {
+        *out++ = _entries[e].first;
+        out = std::copy(_entries[e].rest.begin(), _entries[e].rest.end(), out);
+      }
+      return out;
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    template<class InputIterator, class OutputIterator>
+    OutputIterator basic_hash_index<Key, Value, Ikey>::keys(InputIterator first, InputIterator last,
+        OutputIterator out) const {
+      for (; first != last; ++first) {
+        out = keys(*first, out);
+      }
+      return out;
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    size_t basic_hash_index<Key, Value, Ikey>::bytes() const {
+      size_t n = (_table.capacity() + _old.capacity()) * sizeof(slot) + _entries.capacity() * sizeof(entry);
+      for (const entry& x : _entries) {
+        n += x.rest.capacity() * sizeof(index_value_type);
+      }
+      return n;
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_hash_index<Key, Value, Ikey>::insert(const index_key_type& key, const index_value_type& data) {
+      migrate(kMigrateStep);
+      uint64_t h = hash(key);
+      size_t e = find(key, h);
+      if (e != size_t(-1)) {
+        _entries[e].rest.push_back(data);
+        return;
+      }
+
+      if (_entries.size() >= size_t(uint32_t(-1))) {
+        throw storage_error(make_error_code(errc::invalid_argument), "too many keys in a hash index");
+      }
+      if ((_size + 1) * 2 > _table.size()) {
+        grow();
+      }
+      entry x = { key, h, data, std::vector<index_value_type>() };
+      _entries.push_back(std::move(x));
+      place(_table, h, uint32_t(_entries.size() - 1));
+      ++_size;
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_hash_index<Key, Value, Ikey>::update(const index_key_type& key, const index_key_type& new_key,
+        const index_value_type& data) {
+      del(key, data);
+      insert(new_key, data);
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_hash_index<Key, Value, Ikey>::del(const index_key_type& key) {
+      migrate(kMigrateStep);
+      size_t e = find(key, hash(key));
+      if (e != size_t(-1)) {
+        erase_entry(e);
+      }
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_hash_index<Key, Value, Ikey>::del(const index_key_type& key, const index_value_type& data) {
+      migrate(kMigrateStep);
+      size_t e = find(key, hash(key));
+      if (e == size_t(-1)) {
+        return;
+      }
+      entry& x = _entries[e];
+      auto equal = [&data](const index_value_type& k) { return !(k < data) && !(data < k); };
+      if (equal(x.first)) {
+        if (x.rest.empty()) {
+          erase_entry(e);
+          return;
+        }
+        x.first = std::move(x.rest.back());
+        x.rest.pop_back();
+        return;
+      }
+      auto it = std::find_if(x.rest.begin(), x.rest.end(), equal);
+      if (it != x.rest.end()) {
+        *it = std::move(x.rest.back());
+        x.rest.pop_back();
+      }
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    size_t basic_hash_index<Key, Value, Ikey>::find(const index_key_type& key, uint64_t h) const {
+      uint32_t t = tag(h);
+      size_t n = _table.size();
+      if (n) {
+        for (size_t i = home(h, n);; i = (i + 1) & (n - 1)) {
+          const slot& s = _table[i];
+          if (s.tag == kEmpty) {
+            break;
+          }
+          if (s.tag == t && _entries[s.entry].key == key) {
+            return s.entry;
+          }
+        }
+      }
+
+      // the slots of the old table before _migrated were moved, but are still
+      // probed through
+      n = _old.size();
+      if (n) {
+        for (size_t i = home(h, n);; i = (i + 1) & (n - 1)) {
+          const slot& s = _old[i];
+          if (s.tag == kEmpty) {
+            break;
+          }
+          if (i >= _migrated && s.tag == t && _entries[s.entry].key == key) {
+            return s.entry;
+          }
+        }
+      }
+      return size_t(-1);
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    typename basic_hash_index<Key, Value, Ikey>::slot* basic_hash_index<Key, Value, Ikey>::locate(size_t e) {
+      uint64_t h = _entries[e].hash;
+      uint32_t t = tag(h);
+      size_t n = _table.size();
+      for (size_t i = home(h, n); _table[i].tag != kEmpty; i = (i + 1) & (n - 1)) {
+        if (_table[i].tag == t && _table[i].entry == e) {
+          return &_table[i];
+        }
+      }
+      n = _old.size();
+      for (size_t i = home(h, n);; i = (i + 1) & (n - 1)) {
+        if (i >= _migrated && _old[i].tag == t && _old[i].entry == e) {
+          return &_old[i];
+        }
+      }
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_hash_index<Key, Value, Ikey>::place(std::vector<slot>& table, uint64_t h, uint32_t e) {
+      size_t n = table.size();
+      size_t i = home(h, n);
+      while (table[i].tag != kEmpty) {
+        i = (i + 1) & (n - 1);
+      }
+      table[i].tag = tag(h);
+      table[i].entry = e;
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_hash_index<Key, Value, Ikey>::erase_slot(size_t s) {
+      // Without tombstones: a slot after the hole is moved into it unless
+      // its home lies cyclically in (hole, slot], then the search goes on
+      // from the slot it left.
+      size_t n = _table.size();
+      for (size_t i = s, j = s;;) {
+        _table[i].tag = kEmpty;
+        for (;;) {
+          j = (j + 1) & (n - 1);
+          if (_table[j].tag == kEmpty) {
+            --_size;
+            return;
+          }
+          size_t k = home(_entries[_table[j].entry].hash, n);
+          if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+            continue;
+          }
+          _table[i] = _table[j];
+          i = j;
+          break;
+        }
+      }
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_hash_index<Key, Value, Ikey>::erase_entry(size_t e) {
+      slot* s = locate(e);
+      if (s >= _table.data() && s < _table.data() + _table.size()) {
+        erase_slot(s - _table.data());
+      }
+      else {
+        // the probes of the old table go on through it
+        s->tag = kDeleted;
+      }
+
+      // the last entry takes the place of the erased one
+      size_t last = _entries.size() - 1;
+      if (e != last) {
+        locate(last)->entry = uint32_t(e);
+        _entries[e] = std::move(_entries[last]);
+      }
+      _entries.pop_back();
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_hash_index<Key, Value, Ikey>::grow() {
+      migrate(_old.size());
+      size_t n = _table.empty() ? 16 : _table.size() * 2;
+      _old.swap(_table);
+      _table.assign(n, slot { kEmpty, 0 });
+      _migrated = 0;
+      _size = 0;
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_hash_index<Key, Value, Ikey>::migrate(size_t n) {
+      if (_old.empty()) {
+        return;
+      }
+      // the old table, half full at most, is moved within an eighth of its
+      // size in modifications, so that the new one, twice as large, stays
+      // less than half full meanwhile
+      size_t last = std::min(_old.size(), _migrated + n);
+      for (; _migrated < last; ++_migrated) {
+        const slot& s = _old[_migrated];
+        if (s.tag != kEmpty && s.tag != kDeleted) {
+          place(_table, _entries[s.entry].hash, s.entry);
+          ++_size;
+        }
+      }
+      if (_migrated == _old.size()) {
+        std::vector<slot>().swap(_old);
+        _migrated = 0;
+      }
+    }
+
+  } // storage
+} // atlasdb
+
+#endif // BASIC_HASH_INDEX_TCC_
@@ -1,8 +1,571 @@
 #ifndef BASE_INDEX_IMPLE_H_
 #define BASE_INDEX_IMPLE_H_
 
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+
 namespace atlasdb {
   namespace storage {
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_index<Key, Value, Ikey>::defer(size_t threshold) {
+      if (threshold && covering()) {
+        throw storage_error(make_error_code(errc::invalid_argument), "covering indexes are not deferred");
+      }
+      _threshold = threshold;
+      if (_deltas.size() >= _threshold) {
+        flush();
+      }
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_index<Key, Value, Ikey>::flush() {
+      if (_deltas.empty()) {
+        return;
+      }
+      sort_deltas();
+
+      // The erases are made first, then the inserts as a sorted batch.
+      std::vector<index_node_type> inserts;
+      for (const delta& d : _deltas) {
+        ptrdiff_t n = change(d);
+        for (; n > 0; --n) {
+          inserts.push_back(d.node);
+        }
+        for (; n < 0; ++n) {
+          erase_entry(d.node.first, d.node.second);
+        }
+      }
+      _container.insert_sorted_batch(inserts.begin(), inserts.end());
+      _deltas.clear();
+      _sorted = 0;
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    boost::optional<typename basic_index<Key, Value, Ikey>::index_value_type>
+    basic_index<Key, Value, Ikey>::get(const index_key_type& key) const {
+      boost::optional<index_value_type> found;
+      for_each_key(key, [&found](const index_value_type& data) {
+        found = data;
+        return false;
+      });
+      return found;
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    size_t basic_index<Key, Value, Ikey>::count(const index_key_type& key) const {
+      auto range = _container.equal_range(key);
+      size_t n = std::distance(range.first, range.second);
+      if (!_deltas.empty()) {
+        sort_deltas();
+        for (auto d = lower_delta(key); d != _deltas.end() && !(key < d->node.first); ++d) {
+          n += change(*d);
+        }
+      }
+      return n;
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    template<class OutputIterator>
+    OutputIterator basic_index<Key, Value, Ikey>::keys(const index_key_type& key, OutputIterator out) const {
+      for_each_key(key, [&out](const index_value_type& data) {
+        *out++ = data;
+        return true;
+      });
+      return out;
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    template<class F>
+    void basic_index<Key, Value, Ikey>::for_each_key(const index_key_type& key, F f) const {
+      auto range = _container.equal_range(key);
+      if (_deltas.empty()) {
+        for (; range.first != range.second; ++range.first) {
+          if (!f(range.first->second)) {
+            return;
+          }
+        }
+        return;
+      }
+
+      // The overlay: the entries of the btree merged with the deltas, which
+      // take the place of the entries of their nodes.
+      sort_deltas();
+      auto d = lower_delta(key);
+      for (;;) {
+        if (d != _deltas.end() && !(key < d->node.first)
+            && (range.first == range.second || !(*range.first < d->node))) {
+          ptrdiff_t n = 0;
+          for (; range.first != range.second && !(d->node < *range.first); ++range.first) {
+            ++n;
+          }
+          for (n = std::max<ptrdiff_t>(n + d->count, d->floor); n > 0; --n) {
+            if (!f(d->node.second)) {
+              return;
+            }
+          }
+          ++d;
+        }
+        else if (range.first != range.second) {
+          if (!f(range.first->second)) {
+            return;
+          }
+          ++range.first;
+        }
+        else {
+          return;
+        }
+      }
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_index<Key, Value, Ikey>::insert(const index_key_type& key, const index_value_type& data) {
+      if (!_threshold) {
+        insert_entry(key, data);
+        return;
+      }
+      delta d = { index_node_type(key, data), 1, 0 };
+      _deltas.push_back(d);
+      if (_deltas.size() >= _threshold) {
+        flush();
+      }
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_index<Key, Value, Ikey>::update(const index_key_type& key, const index_key_type& new_key,
+        const index_value_type& data) {
+      del(key, data);
+      insert(new_key, data);
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_index<Key, Value, Ikey>::update(const index_key_type& key, const index_key_type& new_key,
+        const index_value_type& data, const Value& record) {
+      del(key, data);
+      insert(new_key, data, record);
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_index<Key, Value, Ikey>::refresh(const index_key_type& key, const index_value_type& data,
+        const Value& record) {
+      if (!covering()) {
+        return;
+      }
+      auto it = find_covered(key, data);
+      if (it != _covered.end()) {
+        project(record, it->second);
+      }
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_index<Key, Value, Ikey>::del(const index_key_type& key) {
+      settle();
+      auto range = _container.equal_range(key);
+      _container.erase(range.first, range.second);
+      if (covering()) {
+        auto covered = _covered.equal_range(key);
+        for (auto it = covered.first; it != covered.second; ++it) {
+          _free_slots.push_back(it->second);
+        }
+        _covered.erase(covered.first, covered.second);
+      }
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_index<Key, Value, Ikey>::del(const index_key_type& key, const index_value_type& data) {
+      if (covering()) {
+        auto it = find_covered(key, data);
+        if (it != _covered.end()) {
+          erase_covered(it);
+        }
+      }
+      if (!_threshold) {
+        erase_entry(key, data);
+        return;
+      }
+      delta d = { index_node_type(key, data), -1, 0 };
+      _deltas.push_back(d);
+      if (_deltas.size() >= _threshold) {
+        flush();
+      }
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_index<Key, Value, Ikey>::insert(const index_key_type& key, const index_value_type& data,
+        const Value& record) {
+      if (covering()) {
+        insert_covered(key, data, record);
+      }
+      insert(key, data);
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_index<Key, Value, Ikey>::insert_covered(const index_key_type& key, const index_value_type& data,
+        const Value& record) {
+      size_t slot;
+      if (!_free_slots.empty()) {
+        slot = _free_slots.back();
+        _free_slots.pop_back();
+      } else {
+        slot = _projections.size() / _width;
+        _projections.resize(_projections.size() + _width);
+      }
+      project(record, slot);
+      _covered.insert(std::make_pair(index_node_type(key, data), slot));
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_index<Key, Value, Ikey>::erase_covered(typename covered_container_type::iterator it) {
+      _free_slots.push_back(it->second);
+      _covered.erase(it);
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_index<Key, Value, Ikey>::cover(const std::vector<field_type>& fields) {
+      static_assert(std::is_trivially_copyable<Value>::value, "only the fields of plain records can be projected");
+      if (_threshold) {
+        throw storage_error(make_error_code(errc::invalid_argument), "deferred indexes are not covering");
+      }
+      for (const field_type& f : fields) {
+        if (f.offset < 0 || f.offset + f.size > sizeof(Value)) {
+          throw storage_error(make_error_code(errc::invalid_argument));
+        }
+      }
+      _fields = fields;
+      _width = 0;
+      for (const field_type& f : fields) {
+        _width += f.size;
+      }
+      _covered.clear();
+      _projections.clear();
+      _free_slots.clear();
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    bool basic_index<Key, Value, Ikey>::covers(const field_type& f) const {
+      // the bytes of f are covered if the projected fields overlapping it
+      // leave no gap, fields are few so they are not kept sorted
+      size_t from = f.offset;
+      size_t to = f.offset + f.size;
+      for (bool advanced = true; from < to && advanced;) {
+        advanced = false;
+        for (const field_type& p : _fields) {
+          if (size_t(p.offset) <= from && from < p.offset + p.size) {
+            from = p.offset + p.size;
+            advanced = true;
+          }
+        }
+      }
+      return !_fields.empty() && from >= to;
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    template<class F>
+    void basic_index<Key, Value, Ikey>::covered_range(const index_key_type& lower, const index_key_type& upper,
+        F f) const {
+      Value data = Value();
+      auto last = _covered.lower_bound(upper);
+      for (auto it = _covered.lower_bound(lower); it != last; ++it) {
+        const char* bytes = &_projections[it->second * _width];
+        for (const field_type& field : _fields) {
+          std::memcpy(reinterpret_cast<char*>(&data) + field.offset, bytes, field.size);
+          bytes += field.size;
+        }
+        if (!f(it->first.first, it->first.second, static_cast<const Value&>(data))) {
+          return;
+        }
+      }
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_index<Key, Value, Ikey>::project(const Value& record, size_t slot) {
+      char* bytes = &_projections[slot * _width];
+      for (const field_type& f : _fields) {
+        std::memcpy(bytes, reinterpret_cast<const char*>(&record) + f.offset, f.size);
+        bytes += f.size;
+      }
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    typename basic_index<Key, Value, Ikey>::covered_container_type::iterator
+    basic_index<Key, Value, Ikey>::find_covered(const index_key_type& key, const index_value_type& data) {
+      return _covered.find(index_node_type(key, data));
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_index<Key, Value, Ikey>::insert_entry(const index_key_type& key, const index_value_type& data) {
+      _container.insert(index_node_type(key, data));
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_index<Key, Value, Ikey>::erase_entry(const index_key_type& key, const index_value_type& data) {
+      auto it = _container.find(index_node_type(key, data));
+      if (it != _container.end()) {
+        _container.erase(it);
+      }
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    typename basic_index<Key, Value, Ikey>::cursor
+    basic_index<Key, Value, Ikey>::lower_bound(const index_key_type& lower, bool open) const {
+      return make_cursor(lower, open, boost::none, false);
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    typename basic_index<Key, Value, Ikey>::cursor
+    basic_index<Key, Value, Ikey>::upper_bound(const index_key_type& upper, bool open) const {
+      return make_cursor(boost::none, false, upper, open);
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    typename basic_index<Key, Value, Ikey>::cursor
+    basic_index<Key, Value, Ikey>::range(const index_key_type& lower, bool open, const index_key_type& upper,
+        bool open2) const {
+      return make_cursor(lower, open, upper, open2);
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    typename basic_index<Key, Value, Ikey>::cursor basic_index<Key, Value, Ikey>::range() const {
+      return make_cursor(boost::none, false, boost::none, false);
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    typename basic_index<Key, Value, Ikey>::cursor
+    basic_index<Key, Value, Ikey>::make_cursor(const boost::optional<index_key_type>& lower, bool open,
+        const boost::optional<index_key_type>& upper, bool open2) const {
+      settle();
+      cursor c;
+      c._container = &_container;
+      c._lower = lower;
+      c._upper = upper;
+      c._lower_open = open;
+      c._upper_open = open2;
+      if (!upper) {
+        c._last = _container.end();
+      }
+      else {
+        c._last = open2 ? _container.lower_bound(*upper) : _container.upper_bound(*upper);
+      }
+      if (!lower) {
+        c._it = _container.begin();
+      }
+      else {
+        c._it = c.clamp(open ? _container.upper_bound(*lower) : _container.lower_bound(*lower));
+      }
+      return c;
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    template<class OutputIterator>
+    OutputIterator basic_index<Key, Value, Ikey>::intersect(std::vector<cursor>& cursors, OutputIterator out) {
+      for (const cursor& c : cursors) {
+        if (!c.ordered()) {
+          throw storage_error(make_error_code(errc::invalid_argument), "intersect cursors over a single index key");
+        }
+      }
+      for (const cursor& c : cursors) {
+        if (c.at_end()) {
+          return out;
+        }
+      }
+      if (cursors.empty()) {
+        return out;
+      }
+
+      // The cursors in the order of their keys, the one after the last being
+      // the first: the cursor at the least key skips to the greatest one,
+      // that of the cursor before it, until all of them are at the same key.
+      std::sort(cursors.begin(), cursors.end(), [](const cursor& x, const cursor& y) {
+        return x.key() < y.key();
+      });
+      size_t n = cursors.size();
+      const index_value_type* max = &cursors[n - 1].key();
+      for (size_t p = 0;; p = (p + 1) % n) {
+        cursor& c = cursors[p];
+        if (c.key() < *max) {
+          c.skip_to(*max);
+        }
+        else {
+          // the same record key may be indexed more than once
+          *out++ = c.key();
+          do {
+            c.next();
+          } while (!c.at_end() && !(*max < c.key()));
+        }
+        if (c.at_end()) {
+          return out;
+        }
+        max = &c.key();
+      }
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    template<class OutputIterator>
+    OutputIterator basic_index<Key, Value, Ikey>::unite(std::vector<cursor>& cursors, OutputIterator out) {
+      for (const cursor& c : cursors) {
+        if (!c.ordered()) {
+          throw storage_error(make_error_code(errc::invalid_argument), "unite cursors over a single index key");
+        }
+      }
+      // the cursors are few, the least key is searched for among all of them
+      for (;;) {
+        const index_value_type* min = nullptr;
+        for (const cursor& c : cursors) {
+          if (!c.at_end() && (!min || c.key() < *min)) {
+            min = &c.key();
+          }
+        }
+        if (!min) {
+          return out;
+        }
+        *out++ = *min;
+        for (cursor& c : cursors) {
+          while (!c.at_end() && !(*min < c.key())) {
+            c.next();
+          }
+        }
+      }
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    bool basic_index<Key, Value, Ikey>::cursor::ordered() const {
+      return _lower && _upper && !_lower_open && !_upper_open && !(*_lower < *_upper) && !(*_upper < *_lower);
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_index<Key, Value, Ikey>::cursor::seek(const index_key_type& key) {
+      if (_lower && (key < *_lower || (_lower_open && !(*_lower < key)))) {
+        _it = clamp(_lower_open ? _container->upper_bound(*_lower) : _container->lower_bound(*_lower));
+        return;
+      }
+      _it = clamp(_container->lower_bound(key));
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_index<Key, Value, Ikey>::cursor::skip_to(const index_value_type& key) {
+      if (at_end() || !(_it->second < key)) {
+        return;
+      }
+      _it = clamp(_container->lower_bound(index_node_type(_it->first, key)));
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    bool basic_index<Key, Value, Ikey>::cursor::beyond(const index_key_type& key) const {
+      return _upper && (_upper_open ? !(key < *_upper) : *_upper < key);
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    typename basic_index<Key, Value, Ikey>::container_type::const_iterator
+    basic_index<Key, Value, Ikey>::cursor::clamp(typename container_type::const_iterator it) const {
+      return it == _container->end() || beyond(it->first) ? _last : it;
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_index<Key, Value, Ikey>::sort_deltas() const {
+      if (_sorted == _deltas.size()) {
+        return;
+      }
+      // stable, so that the deltas of a node stay in the order they were made
+      std::stable_sort(_deltas.begin() + _sorted, _deltas.end());
+      std::inplace_merge(_deltas.begin(), _deltas.begin() + _sorted, _deltas.end());
+
+      // max(max(n + a, b) + c, d) is max(n + a + c, max(b + c, d)), and
+      // max(n, 0) is n: such deltas are dropped
+      auto out = _deltas.begin();
+      for (auto it = _deltas.begin(); it != _deltas.end();) {
+        delta d = *it;
+        for (++it; it != _deltas.end() && !(d < *it); ++it) {
+          d.count += it->count;
+          d.floor = std::max(d.floor + it->count, it->floor);
+        }
+        if (d.count != 0 || d.floor != 0) {
+          *out++ = d;
+        }
+      }
+      _deltas.erase(out, _deltas.end());
+      _sorted = _deltas.size();
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    ptrdiff_t basic_index<Key, Value, Ikey>::change(const delta& d) const {
+      if (d.count >= 0 && d.floor == 0) {
+        return d.count;
+      }
+      ptrdiff_t n = _container.count(d.node);
+      return std::max<ptrdiff_t>(n + d.count, d.floor) - n;
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    typename std::vector<typename basic_index<Key, Value, Ikey>::delta>::const_iterator
+    basic_index<Key, Value, Ikey>::lower_delta(const index_key_type& key) const {
+      return std::lower_bound(_deltas.cbegin(), _deltas.cend(), key, [](const delta& d, const index_key_type& k) {
+        return d.node.first < k;
+      });
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    bool basic_index<Key, Value, Ikey>::empty() const {
+      settle();
+      return _container.empty();
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    typename basic_index<Key, Value, Ikey>::iterator basic_index<Key, Value, Ikey>::find(const index_key_type& key) {
+      settle();
+      return _container.find(key);
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    typename basic_index<Key, Value, Ikey>::const_iterator
+    basic_index<Key, Value, Ikey>::find(const index_key_type& key) const {
+      settle();
+      return _container.find(key);
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    typename basic_index<Key, Value, Ikey>::iterator basic_index<Key, Value, Ikey>::begin() {
+      settle();
+      return _container.begin();
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    typename basic_index<Key, Value, Ikey>::const_iterator basic_index<Key, Value, Ikey>::begin() const {
+      settle();
+      return _container.begin();
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    typename basic_index<Key, Value, Ikey>::iterator basic_index<Key, Value, Ikey>::end() {
+      return _container.end();
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    typename basic_index<Key, Value, Ikey>::const_iterator basic_index<Key, Value, Ikey>::end() const {
+      return _container.end();
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    typename basic_index<Key, Value, Ikey>::reverse_iterator basic_index<Key, Value, Ikey>::rbegin() {
+      settle();
+      return _container.rbegin();
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    typename basic_index<Key, Value, Ikey>::const_reverse_iterator basic_index<Key, Value, Ikey>::rbegin() const {
+      settle();
+      return _container.rbegin();
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    typename basic_index<Key, Value, Ikey>::reverse_iterator basic_index<Key, Value, Ikey>::rend() {
+      return _container.rend();
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    typename basic_index<Key, Value, Ikey>::const_reverse_iterator basic_index<Key, Value, Ikey>::rend() const {
+      return _container.rend();
+    }
 //
 //    template<class Provider>
 //    typename basic_index<Provider>::identifier basic_index<Provider>::getindexid() {
@@ -5,11 +5,34 @@ namespace atlasdb {
   namespace storage {
 
     template<typename Key, typename Value, typename IKey>
-    void basic_indexer<Key, Value, IKey>::create(const std::string& name) {
+    void basic_indexer<Key, Value, IKey>::create(const std::string& name, index_kind kind) {
+      std::lock_guard<std::mutex> guard(catalog_lock());
+      catalog()[name] = kind;
+    }
+
+    template<typename Key, typename Value, typename IKey>
+    index_kind basic_indexer<Key, Value, IKey>::kind(const std::string& name) {
+      std::lock_guard<std::mutex> guard(catalog_lock());
+      auto it = catalog().find(name);
+      return it == catalog().end() ? index_kind::btree : it->second;
     }
 
     template<typename Key, typename Value, typename IKey>
     void basic_indexer<Key, Value, IKey>::drop(const std::string& name) {
+      std::lock_guard<std::mutex> guard(catalog_lock());
+      catalog().erase(name);
+    }
+
+    template<typename Key, typename Value, typename IKey>
+    std::map<std::string, index_kind>& basic_indexer<Key, Value, IKey>::catalog() {
+      static std::map<std::string, index_kind> kinds;
+      return kinds;
+    }
+
+    template<typename Key, typename Value, typename IKey>
+    std::mutex& basic_indexer<Key, Value, IKey>::catalog_lock() {
+      static std::mutex lock;
+      return lock;
     }
 
     template<typename Key, typename Value, typename IKey>
@@ -19,10 +42,26 @@ namespace atlasdb {
     }
 
     template<typename Key, typename Value, typename IKey>
-    typename basic_indexer<Key, Value, IKey>::index&
+    typename basic_indexer<Key, Value, IKey>::index::cursor
     basic_indexer<Key, Value, IKey>::
     open(const std::string& name, const index_key_type& lower, bool open, const index_key_type& upper, bool open2) {
-      return _indexes[name];
+      return opened(name).range(lower, open, upper, open2);
+    }
+
+    template<typename Key, typename Value, typename IKey>
+    typename basic_indexer<Key, Value, IKey>::index::cursor
+    basic_indexer<Key, Value, IKey>::open(const std::string& name, const index_key_type& lower, bool open) {
+      return opened(name).lower_bound(lower, open);
+    }
+
+    template<typename Key, typename Value, typename IKey>
+    const typename basic_indexer<Key, Value, IKey>::index&
+    basic_indexer<Key, Value, IKey>::opened(const std::string& name) const {
+      auto it = _indexes.find(name);
+      if (it == _indexes.end()) {
+        throw storage_error(make_error_code(errc::item_not_found), "no index " + name + " was opened");
+      }
+      return it->second;
     }
 
     template<typename Key, typename Value, typename IKey>
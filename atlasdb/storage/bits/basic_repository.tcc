@@ -2,6 +2,10 @@
 #define BASIC_REPOSITORY_TCC_
 
 #include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <system_error>
 
 namespace atlasdb {
   namespace storage {
@@ -35,6 +39,11 @@ namespace atlasdb {
 
     template<typename Key, typename Value, typename IKey>
     void basic_repository<Key, Value, IKey>::close() {
+      if (_checkpoint.valid()) {
+        _checkpoint.wait();
+        _checkpoint = std::future<void>();
+      }
+      _log.reset();
 //      Provider *p = base::get_provider();
 //      assert(p!=nullptr);
 //      p->close();
@@ -44,11 +53,12 @@ namespace atlasdb {
 
     template<typename Key, typename Value, typename IKey>
     bool basic_repository<Key, Value, IKey>::put(const key_type& key, const value_type& value) {
-      return false;
-//      Provider *p = base::get_provider();
-//      assert(p!=nullptr);
-//      if (p->put(key, value)) return true;
-//      throw storage_error(p->err_code());
+      if (_log) {
+        append_log(kLogPut, key, value);
+      }
+      _container[key] = value;
+      maybe_checkpoint();
+      return true;
     }
 
     template<typename Key, typename Value, typename IKey>
@@ -69,6 +79,13 @@ namespace atlasdb {
 //      throw storage_error(p->err_code());
     }
 
+    template<typename Key, typename Value, typename IKey>
+    boost::optional<typename basic_repository<Key, Value, IKey>::value_type>
+    basic_repository<Key, Value, IKey>::get(const key_type& key) const {
+      const_iterator it = lookup(key);
+      return it == end() ? boost::optional<value_type>() : boost::optional<value_type>(it->second);
+    }
+
     template<typename Key, typename Value, typename IKey>
     typename basic_repository<Key, Value, IKey>::value_type
     basic_repository<Key, Value, IKey>::get(const key_type& key, void* buffer, size_t size) const {
@@ -84,11 +101,30 @@ namespace atlasdb {
     template<typename Key, typename Value, typename IKey>
     void basic_repository<Key, Value, IKey>::update(const key_type& key, const value_type& value, ptrdiff_t offset,
         size_t size) {
-//      Provider *p = base::get_provider();
-//      assert(p!=nullptr);
-//      p->update(key, value, offset, size);
-//      std::error_code code = p->err_code();
-//      if (code != errc::success) throw code;
+      iterator it = _container.find(key);
+      if (it == end()) {
+        throw storage_error(make_error_code(errc::item_not_found));
+      }
+      // the bytes must be in both values, checked so that offset + size
+      // cannot overflow, a negative offset converts to more than any size
+      size_t value_size = log_codec<value_type>::size(value);
+      size_t old_size = log_codec<value_type>::size(it->second);
+      if (size > value_size || static_cast<size_t>(offset) > value_size - size || size > old_size
+          || static_cast<size_t>(offset) > old_size - size) {
+        throw storage_error(make_error_code(errc::invalid_argument));
+      }
+
+      const char* bytes = static_cast<const char*>(log_codec<value_type>::data(value)) + offset;
+      if (_log) {
+        uint64_t at = offset;
+        _log->append(kLogPatch, log_codec<key_type>::data(key), log_codec<key_type>::size(key),
+            { log_slice { &at, sizeof(at) }, log_slice { bytes, size } });
+      }
+      // the nodes on the path to the value may be shared with snapshots, or
+      // be those of an image
+      it = _container.unshare(it);
+      log_codec<value_type>::patch(it->second, offset, bytes, size);
+      maybe_checkpoint();
     }
 
     // delete the old one and insert a new one
@@ -101,17 +137,126 @@ namespace atlasdb {
      }*/
 
 
+    template<typename Key, typename Value, typename IKey>
+    void basic_repository<Key, Value, IKey>::recover(const string& path, const log_options& options) {
+      close();
+      _container.clear();
+      _image.reset();
+
+      checkpoint_reader<key_type, value_type> checkpoint(path + ".checkpoint");
+      _container.bulk_load(checkpoint.begin(), checkpoint.end());
+      _log_path = path;
+      uint64_t lsn = write_ahead_log::replay(path + ".log", checkpoint.lsn(), [this](const log_record& record) {
+        apply(record);
+      });
+
+      _log_options = options;
+      _checkpoint_lsn = checkpoint.lsn();
+      _log.reset(new write_ahead_log(path + ".log", lsn, options));
+    }
+
+    template<typename Key, typename Value, typename IKey>
+    void basic_repository<Key, Value, IKey>::checkpoint() {
+      if (!_log) {
+        return;
+      }
+      if (_checkpoint.valid()) {
+        _checkpoint.get();
+      }
+
+      // the snapshot holds the records logged up to the start of the new
+      // segment, which replaying the log will start from
+      snapshot_type snapshot = _container.snapshot();
+      uint64_t lsn = _log->rotate();
+      _checkpoint_lsn = lsn;
+      write_ahead_log* log = _log.get();
+      string path = _log_path + ".checkpoint";
+      _checkpoint = std::async(std::launch::async, [=]() {
+        write_checkpoint<key_type, value_type>(path, lsn, snapshot.begin(), snapshot.end());
+        log->truncate(lsn);
+      });
+    }
+
+    template<typename Key, typename Value, typename IKey>
+    void basic_repository<Key, Value, IKey>::apply(const log_record& record) {
+      if (record.type == kLogClear) {
+        _container.clear();
+        return;
+      }
+
+      key_type key = log_codec<key_type>::decode(record.key, record.key_size);
+      switch (record.type) {
+      case kLogPut:
+        _container[key] = log_codec<value_type>::decode(record.value, record.value_size);
+        break;
+      case kLogInsert:
+        _container.insert(node_type(key, log_codec<value_type>::decode(record.value, record.value_size)));
+        break;
+      case kLogDel:
+        _container.erase(key);
+        break;
+      case kLogEraseRange:
+        _container.erase_range(key, log_codec<key_type>::decode(record.value, record.value_size));
+        break;
+      case kLogPatch: {
+        iterator it = _container.find(key);
+        uint64_t offset;
+        if (it == end() || record.value_size < sizeof(offset)) {
+          throw storage_error(make_error_code(errc::run_recovery), _log_path + ".log: patch of a missing record");
+        }
+        std::memcpy(&offset, record.value, sizeof(offset));
+        size_t size = record.value_size - sizeof(offset);
+        size_t old_size = log_codec<value_type>::size(it->second);
+        if (size > old_size || offset > old_size - size) {
+          throw storage_error(make_error_code(errc::run_recovery), _log_path + ".log: patch out of the record");
+        }
+        it = _container.unshare(it);
+        log_codec<value_type>::patch(it->second, offset, record.value + sizeof(offset), size);
+        break;
+      }
+      default:
+        throw storage_error(make_error_code(errc::run_recovery), _log_path + ".log: unknown record");
+      }
+    }
+
+    template<typename Key, typename Value, typename IKey>
+    void basic_repository<Key, Value, IKey>::save_image(const string& path) const {
+      // a crash while writing leaves the previous image intact
+      string tmp = path + ".tmp";
+      _container.write_image(tmp);
+      if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+        throw std::system_error(errno, std::generic_category(), path);
+      }
+    }
+
+    template<typename Key, typename Value, typename IKey>
+    void basic_repository<Key, Value, IKey>::open_image(const string& path) {
+      std::shared_ptr<btree_image> image = std::make_shared<btree_image>(path);
+      _container.attach_image(*image);
+      _image = image;
+    }
+
     template<typename Key, typename Value, typename IKey>
     bool basic_repository<Key, Value, IKey>::exists(const key_type& key) const {
-      return false;
-//      Provider *p = base::get_provider();
-//      assert(p!=nullptr);
-//      if (p->exists(key)) {
-//        return true;
-//      }
-//      std::error_code code = p->err_code();
-//      if (code != errc::item_not_found) throw code;
-//      return false;
+      return lookup(key) != end();
+    }
+
+    template<typename Key, typename Value, typename IKey>
+    void basic_repository<Key, Value, IKey>::reclaimer::run() {
+      std::unique_lock<std::mutex> lock(_lock);
+      for (;;) {
+        _ready.wait(lock, [this]() { return _stop || !_garbage.empty(); });
+        if (_garbage.empty()) {
+          return;
+        }
+        garbage g = std::move(_garbage.front());
+        _garbage.pop_front();
+        // truncate() goes on meanwhile
+        lock.unlock();
+        g.container.reset();
+        g.image.reset();
+        lock.lock();
+      }
     }
 
   }
@@ -1,92 +1,372 @@
 #ifndef ATLAS_STORAGE_BASIC_STOREHOUSE_TCC_
 #define ATLAS_STORAGE_BASIC_STOREHOUSE_TCC_
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <queue>
+#include <thread>
 
 namespace atlasdb {
   namespace storage {
 
+    template<typename Key, typename Value, typename Ikey>
+    basic_storehouse<Key, Value, Ikey>::basic_storehouse(const string& name, const std::vector<string>& indexes) :
+        repository(name), indexer(name), _rows(std::make_shared<row_space>()) {
+      open(name, indexes);
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_storehouse<Key, Value, Ikey>::open(const string&, const std::vector<string>& indexes) {
+      for (const auto& index : indexes) {
+        switch (indexer::kind(index)) {
+        case index_kind::btree:
+          indexer::open(index);
+          break;
+        case index_kind::bitmap:
+          open_bitmap(index);
+          break;
+        case index_kind::hash:
+          indexer::open_hash(index);
+          break;
+        }
+      }
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    typename basic_storehouse<Key, Value, Ikey>::bitmap_index&
+    basic_storehouse<Key, Value, Ikey>::open_bitmap(const string& name) {
+      bool opened = indexer::find_bitmap(name) != nullptr;
+      bitmap_index& b = indexer::open_bitmap(name);
+      if (!opened) {
+        b.share_rows(_rows);
+      }
+      return b;
+    }
+
     template<typename Key, typename Value, typename Ikey>
     void basic_storehouse<Key, Value, Ikey>::close() {
       repository::close();
       indexer::close();
     }
 
+    template<typename Key, typename Value, typename Ikey>
+    void basic_storehouse<Key, Value, Ikey>::defer_indexes(size_t threshold) {
+      for (auto& index : static_cast<indexer&>(*this)) {
+        if (threshold && index.second.covering()) {
+          throw storage_error(make_error_code(errc::invalid_argument), index.first + ": covering indexes are not deferred");
+        }
+      }
+      for (auto& index : static_cast<indexer&>(*this)) {
+        index.second.defer(threshold);
+      }
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_storehouse<Key, Value, Ikey>::cover(const string& name,
+        const std::vector<typename index::field_type>& fields) {
+      index& i = indexer::at(name);
+      i.cover(fields);
+      for (const auto& entry : i) {
+        boost::optional<value_type> value = repository::get(entry.second);
+        if (value) {
+          i.insert_covered(entry.first, entry.second, *value);
+        }
+      }
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    class basic_storehouse<Key, Value, Ikey>::run_merger {
+    public:
+
+      typedef std::input_iterator_tag iterator_category;
+      typedef index_node_type value_type;
+      typedef ptrdiff_t difference_type;
+      typedef const index_node_type* pointer;
+      typedef const index_node_type& reference;
+
+      // the end of any merge
+      run_merger() : _runs(nullptr), _heads(compare(nullptr)) {}
+
+      explicit run_merger(const std::vector<std::vector<index_node_type>>& runs) :
+          _runs(&runs), _heads(compare(&runs)) {
+        for (size_t r = 0; r < runs.size(); ++r) {
+          if (!runs[r].empty()) {
+            _heads.push(std::make_pair(r, size_t(0)));
+          }
+        }
+      }
+
+      reference operator*() const { return at(_heads.top()); }
+
+      pointer operator->() const { return &at(_heads.top()); }
+
+      run_merger& operator++() {
+        head h = _heads.top();
+        _heads.pop();
+        if (++h.second < (*_runs)[h.first].size()) {
+          _heads.push(h);
+        }
+        return *this;
+      }
+
+      bool operator==(const run_merger& x) const { return size() == x.size(); }
+
+      bool operator!=(const run_merger& x) const { return size() != x.size(); }
+
+    private:
+
+      // the next entry of a run: the run and the position in it
+      typedef std::pair<size_t, size_t> head;
+
+      // orders the heads so that the least entry is on top
+      struct compare {
+        explicit compare(const std::vector<std::vector<index_node_type>>* runs) : runs(runs) {}
+
+        bool operator()(const head& x, const head& y) const {
+          return (*runs)[y.first][y.second] < (*runs)[x.first][x.second];
+        }
+
+        const std::vector<std::vector<index_node_type>>* runs;
+      };
+
+      const index_node_type& at(const head& h) const { return (*_runs)[h.first][h.second]; }
+
+      // the ends of merges are those having no heads left
+      size_t size() const { return _runs ? _heads.size() : 0; }
+
+    private:
+
+      const std::vector<std::vector<index_node_type>>* _runs;
+      std::priority_queue<head, std::vector<head>, compare> _heads;
+    };
+
+    template<typename Key, typename Value, typename Ikey>
+    template<class F>
+    void basic_storehouse<Key, Value, Ikey>::build(const string& name, F ikeys, size_t partitions) {
+      if (indexer::kind(name) != index_kind::btree || building(name)) {
+        throw storage_error(make_error_code(errc::invalid_argument), name + ": not a btree index or being built");
+      }
+      if (!partitions) {
+        partitions = std::max(1u, std::thread::hardware_concurrency());
+      }
+      indexer::open(name);
+      build_state& b = _builds[name];
+      b.built.reset(new index(name));
+      index* built = b.built.get();
+
+      // the changes of the index made after the snapshot go to the side log
+      typename repository::snapshot_type snapshot = repository::snapshot();
+      b.done = std::async(std::launch::async, [snapshot, ikeys, partitions, built]() {
+        std::vector<key_type> splits;
+        snapshot.split_keys(partitions, std::back_inserter(splits));
+
+        // partition p holds the records in [splits[p - 1], splits[p])
+        std::vector<std::future<std::vector<index_node_type>>> parts;
+        for (size_t p = 0; p <= splits.size(); ++p) {
+          parts.push_back(std::async(std::launch::async, [&snapshot, &ikeys, &splits, p]() {
+            std::vector<index_node_type> run;
+            auto it = p ? snapshot.lower_bound(splits[p - 1]) : snapshot.begin();
+            auto last = p < splits.size() ? snapshot.lower_bound(splits[p]) : snapshot.end();
+            for (; it != last; ++it) {
+              const key_type& key = it->first;
+              ikeys(key, it->second, [&run, &key](const index_key_type& ikey) {
+                run.push_back(index_node_type(ikey, key));
+              });
+            }
+            std::sort(run.begin(), run.end());
+            return run;
+          }));
+        }
+        std::vector<std::vector<index_node_type>> runs;
+        for (auto& part : parts) {
+          runs.push_back(part.get());
+        }
+        built->load(run_merger(runs), run_merger());
+      });
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_storehouse<Key, Value, Ikey>::finish_build(const string& name) {
+      auto it = _builds.find(name);
+      if (it == _builds.end()) {
+        return;
+      }
+      std::unique_ptr<index> built = std::move(it->second.built);
+      std::vector<side_change> side_log;
+      side_log.swap(it->second.side_log);
+      try {
+        it->second.done.get();
+      }
+      catch (...) {
+        _builds.erase(it);
+        throw;
+      }
+      _builds.erase(it);
+
+      index& i = indexer::at(name);
+      i.settle();
+      i._container.swap(built->_container);
+      for (const side_change& change : side_log) {
+        if (change.second > 0) {
+          i.insert(change.first.first, change.first.second);
+        }
+        else {
+          i.del(change.first.first, change.first.second);
+        }
+      }
+      if (i.covering()) {
+        // the projections were those of the entries swapped out
+        std::vector<typename index::field_type> fields = i._fields;
+        cover(name, fields);
+      }
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    void basic_storehouse<Key, Value, Ikey>::commit() {
+      for (auto it = _builds.begin(); it != _builds.end();) {
+        string name = (it++)->first;
+        if (_builds[name].done.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+          finish_build(name);
+        }
+      }
+      for (auto& index : static_cast<indexer&>(*this)) {
+        index.second.flush();
+      }
+      repository::commit();
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    std::vector<typename basic_storehouse<Key, Value, Ikey>::side_change>*
+    basic_storehouse<Key, Value, Ikey>::side_log(const string& name) {
+      auto it = _builds.find(name);
+      return it == _builds.end() ? nullptr : &it->second.side_log;
+    }
+
     template<typename Key, typename Value, typename Ikey>
     void basic_storehouse<Key, Value, Ikey>::put(const key_type& key, const value_type& value, const named_ikeyset& ikeys) {
-//      if (ikeys.size() != indexer::size()) {
-//        throw storage_error(err_code(errc::indexnum_not_match));
-//      }
-//      repository::put(key, data);
-//
-//      if (!ikeys.empty()) {
-//        index_value_type ikeys(key.address(), key.size());
-//        auto ikey = ikeys.begin();
-//        auto ikey_end = ikeys.end();
-//        auto index = indexer::begin();
-//        for (; ikey != ikey_end; ikey++, index++) {
-//          index->second.insert(*ikey, ikeys);
-//        }
-//      }
+      repository::put(key, value);
+      for (const auto& named : ikeys) {
+        if (bitmap_index* b = indexer::find_bitmap(named.first)) {
+          insert_keys(*b, key, named.second);
+          continue;
+        }
+        if (hash_index* h = indexer::find_hash(named.first)) {
+          insert_keys(*h, key, named.second);
+          continue;
+        }
+        if (std::vector<side_change>* log = side_log(named.first)) {
+          for (const auto& ikey : named.second) {
+            log->push_back(side_change(index_node_type(ikey, key), 1));
+          }
+          continue;
+        }
+        index& i = indexer::at(named.first);
+        for (const auto& ikey : named.second) {
+          i.insert(ikey, key, value);
+        }
+      }
     }
 
     template<typename Key, typename Value, typename Ikey>
     void basic_storehouse<Key, Value, Ikey>::put(const node_type& node, const named_ikeyset& ikeys) {
-//      if (ikeys.size() != indexer::size()) {
-//        throw storage_error(err_code(errc::indexnum_not_match));
-//      }
-//      repository::put(node);
-//
-//      if (!ikeys.empty()) {
-//        index_value_type ikeys(node.first.address(), node.first.size());
-//
-//        auto ikey = ikeys.begin();
-//        auto ikey_end = ikeys.end();
-//        auto index = indexer::begin();
-//        for (; ikey != ikey_end; ikey++, index++) {
-//          index->second.insert(*ikey, ikeys);
-//        }
-//      }
+      put(node.first, node.second, ikeys);
     }
 
     template<typename Key, typename Value, typename Ikey>
     void basic_storehouse<Key, Value, Ikey>::update(const key_type& key, const value_type& value, const named_ikeyset& ikeys) {
-//      repository::update(key, data);
-//
-//      index_value_type ikeys(key.address(), key.size());
-//      auto ikey = ikeys.begin();
-//      auto ikey_end = ikeys.end();
-//      for (; ikey != ikey_end; ikey++) {
-//        indexer::at(get < 0 > (*ikey)).update(get < 1 > (*ikey), get < 2 > (*ikey), ikeys);
-//      }
+      for (const auto& named : ikeys) {
+        if (named.second.size() % 2 != 0) {
+          throw storage_error(make_error_code(errc::invalid_argument), named.first + ": odd number of index keys");
+        }
+      }
+      repository::put(key, value);
+      for (const auto& named : ikeys) {
+        if (bitmap_index* b = indexer::find_bitmap(named.first)) {
+          update_keys(*b, key, named.second);
+          continue;
+        }
+        if (hash_index* h = indexer::find_hash(named.first)) {
+          update_keys(*h, key, named.second);
+          continue;
+        }
+        if (std::vector<side_change>* log = side_log(named.first)) {
+          for (size_t k = 0; k < named.second.size(); k += 2) {
+            if (named.second[k] < named.second[k + 1] || named.second[k + 1] < named.second[k]) {
+              log->push_back(side_change(index_node_type(named.second[k], key), -1));
+              log->push_back(side_change(index_node_type(named.second[k + 1], key), 1));
+            }
+          }
+          continue;
+        }
+        index& i = indexer::at(named.first);
+        for (size_t k = 0; k < named.second.size(); k += 2) {
+          const index_key_type& from = named.second[k];
+          const index_key_type& to = named.second[k + 1];
+          if (from < to || to < from) {
+            i.update(from, to, key, value);
+          }
+          else {
+            i.refresh(from, key, value);
+          }
+        }
+      }
     }
 
     template<typename Key, typename Value, typename Ikey>
     void basic_storehouse<Key, Value, Ikey>::update(const node_type& node, const named_ikeyset& ikeys) {
-//      repository::update(node.frist, node.second);
-//
-//      index_value_type ikeys(node.frist.address(), node.frist.size());
-//      auto ikey = ikeys.begin();
-//      auto ikey_end = ikeys.end();
-//
-//      for (; ikey != ikey_end; ikey++) {
-//        indexer::at(std::get < 0 > (*ikey)).update(std::get < 1 > (*ikey), std::get < 2 > (*ikey), ikeys);
-//      }
+      update(node.first, node.second, ikeys);
     }
 
     template<typename Key, typename Value, typename Ikey>
     void basic_storehouse<Key, Value, Ikey>::del(const key_type& key, const named_ikeyset& ikeys) {
-      // if (ikeys.size() != indexer::size()) throw storage_error(err_code(errc::indexnum_not_match));
-
-//      repository::del(key);
-//
-//      index_value_type ikeys(key.address(), key.size());
-//      auto ikey = ikeys.begin();
-//      auto ikey_end = ikeys.end();
-//      auto index = indexer::begin();
-//      for (; ikey != ikey_end; ikey++, index++) {
-//        index->second.del(*ikey, ikeys);
-//      }
+      repository::del(key);
+      for (const auto& named : ikeys) {
+        if (bitmap_index* b = indexer::find_bitmap(named.first)) {
+          del_keys(*b, key, named.second);
+          continue;
+        }
+        if (hash_index* h = indexer::find_hash(named.first)) {
+          del_keys(*h, key, named.second);
+          continue;
+        }
+        if (std::vector<side_change>* log = side_log(named.first)) {
+          for (const auto& ikey : named.second) {
+            log->push_back(side_change(index_node_type(ikey, key), -1));
+          }
+          continue;
+        }
+        index& i = indexer::at(named.first);
+        for (const auto& ikey : named.second) {
+          i.del(ikey, key);
+        }
+      }
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    template<class Index>
+    void basic_storehouse<Key, Value, Ikey>::insert_keys(Index& index, const key_type& key, const ikeyset& ikeys) {
+      for (const auto& ikey : ikeys) {
+        index.insert(ikey, key);
+      }
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    template<class Index>
+    void basic_storehouse<Key, Value, Ikey>::update_keys(Index& index, const key_type& key, const ikeyset& ikeys) {
+      for (size_t k = 0; k < ikeys.size(); k += 2) {
+        if (ikeys[k] < ikeys[k + 1] || ikeys[k + 1] < ikeys[k]) {
+          index.update(ikeys[k], ikeys[k + 1], key);
+        }
+      }
+    }
+
+    template<typename Key, typename Value, typename Ikey>
+    template<class Index>
+    void basic_storehouse<Key, Value, Ikey>::del_keys(Index& index, const key_type& key, const ikeyset& ikeys) {
+      for (const auto& ikey : ikeys) {
+        index.del(ikey, key);
+      }
     }
 
   } // storage
@@ -0,0 +1,201 @@
+#ifndef SHARDED_REPOSITORY_TCC_
+#define SHARDED_REPOSITORY_TCC_
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace atlasdb {
+  namespace storage {
+
+    template<typename Key, typename Value, typename IKey, size_t N>
+    bool sharded_repository<Key, Value, IKey, N>::open(const string& table) {
+      bool opened = true;
+      for (size_t i = 0; i < N; ++i) {
+        std::lock_guard<std::mutex> guard(_shards[i].lock);
+        opened = _shards[i].repository.open(table + "." + std::to_string(i)) && opened;
+      }
+      return opened;
+    }
+
+    template<typename Key, typename Value, typename IKey, size_t N>
+    void sharded_repository<Key, Value, IKey, N>::close() {
+      for (auto& s : _shards) {
+        std::lock_guard<std::mutex> guard(s.lock);
+        s.repository.close();
+      }
+    }
+
+    template<typename Key, typename Value, typename IKey, size_t N>
+    void sharded_repository<Key, Value, IKey, N>::recover(const string& path, const log_options& options) {
+      for (size_t i = 0; i < N; ++i) {
+        std::lock_guard<std::mutex> guard(_shards[i].lock);
+        _shards[i].repository.recover(path + "." + std::to_string(i), options);
+      }
+    }
+
+    template<typename Key, typename Value, typename IKey, size_t N>
+    void sharded_repository<Key, Value, IKey, N>::commit() {
+      for (auto& s : _shards) {
+        std::lock_guard<std::mutex> guard(s.lock);
+        s.repository.commit();
+      }
+    }
+
+    template<typename Key, typename Value, typename IKey, size_t N>
+    void sharded_repository<Key, Value, IKey, N>::checkpoint() {
+      for (auto& s : _shards) {
+        std::lock_guard<std::mutex> guard(s.lock);
+        s.repository.checkpoint();
+      }
+    }
+
+    template<typename Key, typename Value, typename IKey, size_t N>
+    template<class InputIterator>
+    void sharded_repository<Key, Value, IKey, N>::load(InputIterator first, InputIterator last, double fill) {
+      // the pairs of a shard stay sorted
+      std::vector<node_type> nodes[N];
+      for (; first != last; ++first) {
+        nodes[shard(first->first)].push_back(*first);
+      }
+      for (size_t i = 0; i < N; ++i) {
+        std::lock_guard<std::mutex> guard(_shards[i].lock);
+        _shards[i].repository.load(nodes[i].begin(), nodes[i].end(), fill);
+      }
+    }
+
+    template<typename Key, typename Value, typename IKey, size_t N>
+    template<class InputIterator>
+    size_t sharded_repository<Key, Value, IKey, N>::put_sorted(InputIterator first, InputIterator last) {
+      std::vector<node_type> nodes[N];
+      for (; first != last; ++first) {
+        nodes[shard(first->first)].push_back(*first);
+      }
+      size_t n = 0;
+      for (size_t i = 0; i < N; ++i) {
+        std::lock_guard<std::mutex> guard(_shards[i].lock);
+        n += _shards[i].repository.put_sorted(nodes[i].begin(), nodes[i].end());
+      }
+      return n;
+    }
+
+    template<typename Key, typename Value, typename IKey, size_t N>
+    template<class ForwardIterator, class OutputIterator>
+    OutputIterator sharded_repository<Key, Value, IKey, N>::get_many(ForwardIterator first, ForwardIterator last,
+        OutputIterator out) const {
+      // the keys of every shard, and where their data blocks go
+      std::vector<key_type> keys[N];
+      std::vector<size_t> positions[N];
+      size_t n = 0;
+      for (ForwardIterator it = first; it != last; ++it, ++n) {
+        size_t i = shard(*it);
+        keys[i].push_back(*it);
+        positions[i].push_back(n);
+      }
+
+      std::vector<boost::optional<value_type>> found(n);
+      std::vector<boost::optional<value_type>> values;
+      for (size_t i = 0; i < N; ++i) {
+        if (keys[i].empty()) {
+          continue;
+        }
+        values.clear();
+        {
+          std::lock_guard<std::mutex> guard(_shards[i].lock);
+          _shards[i].repository.get_many(keys[i].begin(), keys[i].end(), std::back_inserter(values));
+        }
+        for (size_t k = 0; k < values.size(); ++k) {
+          found[positions[i][k]] = std::move(values[k]);
+        }
+      }
+      return std::move(found.begin(), found.end(), out);
+    }
+
+    template<typename Key, typename Value, typename IKey, size_t N>
+    size_t sharded_repository<Key, Value, IKey, N>::erase_range(const key_type& lower, const key_type& upper) {
+      size_t n = 0;
+      for (auto& s : _shards) {
+        std::lock_guard<std::mutex> guard(s.lock);
+        n += s.repository.erase_range(lower, upper);
+      }
+      return n;
+    }
+
+    template<typename Key, typename Value, typename IKey, size_t N>
+    void sharded_repository<Key, Value, IKey, N>::truncate() {
+      for (auto& s : _shards) {
+        std::lock_guard<std::mutex> guard(s.lock);
+        s.repository.truncate();
+      }
+    }
+
+    template<typename Key, typename Value, typename IKey, size_t N>
+    void sharded_repository<Key, Value, IKey, N>::hash_index(size_t max_bytes) {
+      for (auto& s : _shards) {
+        std::lock_guard<std::mutex> guard(s.lock);
+        s.repository.hash_index(max_bytes / N);
+      }
+    }
+
+    template<typename Key, typename Value, typename IKey, size_t N>
+    size_t sharded_repository<Key, Value, IKey, N>::compact(double fill) {
+      size_t n = 0;
+      for (auto& s : _shards) {
+        std::lock_guard<std::mutex> guard(s.lock);
+        n += s.repository.compact(fill);
+      }
+      return n;
+    }
+
+    template<typename Key, typename Value, typename IKey, size_t N>
+    size_t sharded_repository<Key, Value, IKey, N>::count() const {
+      size_t n = 0;
+      for (const auto& s : _shards) {
+        std::lock_guard<std::mutex> guard(s.lock);
+        n += s.repository.count();
+      }
+      return n;
+    }
+
+    template<typename Key, typename Value, typename IKey, size_t N>
+    size_t sharded_repository<Key, Value, IKey, N>::count(const key_type& first, const key_type& last) const {
+      size_t n = 0;
+      for (const auto& s : _shards) {
+        std::lock_guard<std::mutex> guard(s.lock);
+        n += s.repository.count(first, last);
+      }
+      return n;
+    }
+
+    template<typename Key, typename Value, typename IKey, size_t N>
+    size_t sharded_repository<Key, Value, IKey, N>::rank(const key_type& key) const {
+      // the records before key in all of the shards
+      size_t n = 0;
+      for (const auto& s : _shards) {
+        std::lock_guard<std::mutex> guard(s.lock);
+        n += s.repository.rank(key);
+      }
+      return n;
+    }
+
+    template<typename Key, typename Value, typename IKey, size_t N>
+    template<class Position>
+    typename sharded_repository<Key, Value, IKey, N>::const_iterator
+    sharded_repository<Key, Value, IKey, N>::merged(Position position) const {
+      std::shared_ptr<typename const_iterator::merge> m = std::make_shared<typename const_iterator::merge>();
+      for (size_t i = 0; i < N; ++i) {
+        {
+          // taking a snapshot only marks the nodes of the btree as shared
+          std::lock_guard<std::mutex> guard(_shards[i].lock);
+          m->snapshots[i] = const_cast<repository_type&>(_shards[i].repository).snapshot();
+        }
+        m->positions[i] = position(m->snapshots[i]);
+        m->push(i);
+      }
+      return const_iterator(m);
+    }
+
+  }
+}
+
+#endif // SHARDED_REPOSITORY_TCC_
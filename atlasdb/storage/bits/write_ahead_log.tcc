@@ -0,0 +1,122 @@
+#ifndef WRITE_AHEAD_LOG_TCC_
+#define WRITE_AHEAD_LOG_TCC_
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+
+namespace atlasdb {
+  namespace storage {
+
+    namespace checkpoint_format {
+
+      const char magic[8] = { 'A', 'T', 'L', 'A', 'S', 'C', 'K', 'P' };
+
+      // the magic, the lsn and the number of records
+      const size_t header_size = 24;
+
+      inline storage_error error(const string& path) {
+        return storage_error(make_error_code(errc::run_recovery), path + ": " + (errno ? std::strerror(errno) : "not a checkpoint"));
+      }
+
+    }
+
+    template<typename Key, typename Value, typename InputIterator>
+    void write_checkpoint(const string& path, uint64_t lsn, InputIterator first, InputIterator last) {
+      // a crash while writing leaves the previous checkpoint intact
+      string tmp = path + ".tmp";
+      std::FILE* f = std::fopen(tmp.c_str(), "wb");
+      if (!f) {
+        throw checkpoint_format::error(tmp);
+      }
+      std::unique_ptr<char[]> buffer(new char[1 << 20]);
+      std::setvbuf(f, buffer.get(), _IOFBF, 1 << 20);
+
+      uint64_t count = 0;
+      bool ok = std::fwrite(checkpoint_format::magic, 8, 1, f) == 1 && std::fwrite(&lsn, 8, 1, f) == 1
+          && std::fwrite(&count, 8, 1, f) == 1;
+      for (; ok && first != last; ++first) {
+        const Key& k = first->first;
+        const Value& v = first->second;
+        uint32_t sizes[2] = { uint32_t(log_codec<Key>::size(k)), uint32_t(log_codec<Value>::size(v)) };
+        ok = std::fwrite(sizes, sizeof(sizes), 1, f) == 1
+            && std::fwrite(log_codec<Key>::data(k), 1, sizes[0], f) == sizes[0]
+            && std::fwrite(log_codec<Value>::data(v), 1, sizes[1], f) == sizes[1];
+        ++count;
+      }
+
+      // the count last, a checkpoint cut short is not taken for a complete one
+      ok = ok && std::fseek(f, 16, SEEK_SET) == 0 && std::fwrite(&count, 8, 1, f) == 1 && std::fflush(f) == 0
+          && ::fsync(::fileno(f)) == 0;
+      int e = ok ? 0 : errno;
+      if (std::fclose(f) != 0 && ok) {
+        ok = false;
+        e = errno;
+      }
+      if (ok && std::rename(tmp.c_str(), path.c_str()) != 0) {
+        ok = false;
+        e = errno;
+      }
+      if (!ok) {
+        ::unlink(tmp.c_str());
+        errno = e;
+        throw checkpoint_format::error(tmp);
+      }
+
+      // the rename must be durable before the log segments the checkpoint
+      // covers are deleted
+      size_t slash = path.rfind('/');
+      int dir = ::open(slash == string::npos ? "." : path.substr(0, slash + 1).c_str(), O_RDONLY);
+      if (dir >= 0) {
+        ::fsync(dir);
+        ::close(dir);
+      }
+    }
+
+    template<typename Key, typename Value>
+    checkpoint_reader<Key, Value>::checkpoint_reader(const string& path) :
+        _path(path), _file(std::fopen(path.c_str(), "rb")), _lsn(0), _remaining(0) {
+      if (!_file) {
+        if (errno == ENOENT) {
+          return;
+        }
+        throw checkpoint_format::error(path);
+      }
+
+      char header[checkpoint_format::header_size];
+      errno = 0;
+      if (std::fread(header, sizeof(header), 1, _file) != 1
+          || std::memcmp(header, checkpoint_format::magic, sizeof(checkpoint_format::magic)) != 0) {
+        std::fclose(_file);
+        _file = nullptr;
+        throw checkpoint_format::error(path);
+      }
+      std::memcpy(&_lsn, header + 8, 8);
+      std::memcpy(&_remaining, header + 16, 8);
+    }
+
+    template<typename Key, typename Value>
+    bool checkpoint_reader<Key, Value>::next(record_type& record) {
+      if (_remaining == 0) {
+        return false;
+      }
+      uint32_t sizes[2];
+      errno = 0;
+      if (std::fread(sizes, sizeof(sizes), 1, _file) != 1) {
+        throw checkpoint_format::error(_path);
+      }
+      _bytes.resize(size_t(sizes[0]) + sizes[1]);
+      if (!_bytes.empty() && std::fread(_bytes.data(), _bytes.size(), 1, _file) != 1) {
+        throw checkpoint_format::error(_path);
+      }
+      record.first = log_codec<Key>::decode(_bytes.data(), sizes[0]);
+      record.second = log_codec<Value>::decode(_bytes.data() + sizes[0], sizes[1]);
+      --_remaining;
+      return true;
+    }
+
+  }
+}
+
+#endif // WRITE_AHEAD_LOG_TCC_
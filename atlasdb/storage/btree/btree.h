@@ -45,6 +45,9 @@
 #define ATLASDB_STORAGE_BTREE_BTREE_H_
 
 #include <cassert>
+#include <cstring>
+#include <atomic>
+#include <chrono>
 #include <string>
 #include <iterator>
 #include <algorithm>
@@ -53,6 +56,11 @@
 #include <type_traits>
 #include <ostream>
 #include <utility>
+#include <vector>
+
+#include <atlasdb/storage/btree/btree_abbrev.h>
+#include <atlasdb/storage/btree/btree_image.h>
+#include <atlasdb/storage/btree/btree_simd.h>
 
 namespace atlasdb {
   namespace storage {
@@ -70,6 +78,13 @@ namespace atlasdb {
     swap(a, b);
   }
 
+// Hints the processor to fetch the cache line holding p, to be read soon.
+  inline void btree_prefetch(const void *p) {
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(p, 0, 3);
+#endif
+  }
+
 // A template helper used to select A or B based on a condition.
   template<bool cond, typename A, typename B>
   struct if_ { typedef A type; };
@@ -166,6 +181,85 @@ namespace atlasdb {
     return key_comparer::bool_compare(comp, x, y);
   }
 
+// A helper class that indicates if the Compare parameter is transparent, i.e.
+// declares an is_transparent type as std::less<> does, so that it can compare
+// keys to values of other types. Lookups by such values then do not construct
+// a key.
+  template<typename Compare>
+  struct btree_is_transparent {
+    template<typename C> static small_ test(typename C::is_transparent*);
+    template<typename C> static big_ test(...);
+    enum { value = sizeof(test<Compare>(nullptr)) == sizeof(small_) };
+  };
+
+// The type T of the lookup routines taking a value of type K comparable to the
+// keys, which only exist if Compare is transparent.
+  template<typename Compare, typename K, typename T>
+  struct btree_if_transparent: public std::enable_if<btree_is_transparent<Compare>::value, T> {
+  };
+
+  inline bool btree_compare_result(bool less, std::false_type) { return less; }
+  inline bool btree_compare_result(int c, std::true_type) { return c < 0; }
+
+// A helper function to compare a key to a value of another type, or the other
+// way around, using the specified transparent compare functor.
+  template<typename Compare, typename X, typename Y>
+  static bool btree_compare_keys_as(const Compare &comp, const X &x, const Y &y) {
+    return btree_compare_result(comp(x, y), btree_is_key_compare_to<Compare>());
+  }
+
+// A transparent std::less<Key>, which also compares keys to values of other
+// types with operator<, e.g. string keys to a const char*. Nodes search their
+// keys with it as with std::less<Key>.
+  template<typename Key>
+  struct btree_transparent_less: public std::less<Key> {
+    typedef void is_transparent;
+
+    using std::less<Key>::operator();
+
+    template<typename X, typename Y>
+    bool operator()(const X &x, const Y &y) const { return x < y; }
+  };
+
+// Indicates whether keys of type Key are ordered by operator<, given the
+// key_compare type of the btree (see btree_common_params).
+  template<typename Compare, typename Key>
+  struct btree_is_less: public std::integral_constant<bool,
+      std::is_same<Compare, btree_key_compare_to_adapter<std::less<Key> > >::value
+      || std::is_same<Compare, btree_key_compare_to_adapter<btree_transparent_less<Key> > >::value> {
+  };
+
+// Lets btree::clear() free all of the nodes of a tree at once when the
+// allocator owns them exclusively (see btree_allocator.h), instead of
+// deallocating them one by one. Allocators are not releasable by default.
+  template<typename Alloc>
+  struct btree_allocator_release {
+    static bool releasable(const Alloc&) { return false; }
+    static void release(Alloc&) {}
+  };
+
+// Indicates whether the large nodes of a btree_map with keys of type Key keep a
+// copy of their keys in an array of their own (see btree_node::key_fields):
+// plain keys of 8 or 16 bytes. Define ATLASDB_BTREE_NO_SPLIT_KEYS to never do
+// so.
+  template<typename Key>
+  struct btree_split_key: public std::integral_constant<bool,
+#ifndef ATLASDB_BTREE_NO_SPLIT_KEYS
+      std::is_trivial<Key>::value && (sizeof(Key) == 8 || sizeof(Key) == 16)
+#else
+      false
+#endif
+      > {
+  };
+
+// Returns the number of values, at least n, of a node with split keys which
+// fit into size bytes: a cache line of node header followed by the cache lines
+// of the keys and then the values. n should be close to the result.
+  constexpr int btree_split_node_values(int size, int line, int key_size, int value_size, int n) {
+    return line + ((n + 1) * key_size + line - 1) / line * line + (n + 1) * value_size > size ? n
+        : btree_split_node_values(size, line, key_size, value_size, n + 1);
+  }
+
   template<typename Key, typename Compare, typename Alloc, int TargetNodeSize, int ValueSize>
   struct btree_common_params {
     // If Compare is derived from btree_key_compare_to_tag then use it as the
@@ -186,6 +280,15 @@ namespace atlasdb {
     enum {
       kTargetNodeSize = TargetNodeSize,
 
+      // Whether the nodes carry a version/lock word. Only concurrent_btree sets
+      // this (see concurrent_btree.h).
+      kConcurrent = false,
+
+      // Whether the internal nodes count the values in the subtree of each
+      // child, which gives the tree select() and rank() in O(log n). Set by
+      // btree_ranked_params.
+      kRanked = false,
+
       // Available space for values.  This is largest for leaf nodes,
       // which has overhead no fewer than two pointers.
       kNodeValueSpace = TargetNodeSize - 2 * sizeof(void*),
@@ -239,6 +342,14 @@ namespace atlasdb {
     static void swap(mutable_value_type *a, mutable_value_type *b) { btree_swap_helper<mutable_value_type>(*a, *b); }
   };
 
+// Wraps the parameters of a btree_map/btree_multimap to maintain subtree
+// counts in the internal nodes. Each insertion and erasure then updates one
+// count per level of the tree.
+  template<typename Params>
+  struct btree_ranked_params: public Params {
+    enum { kRanked = true };
+  };
+
 // An adapter class that converts a lower-bound compare into an upper-bound
 // compare.
   template<typename Key, typename Compare>
@@ -309,6 +420,31 @@ namespace atlasdb {
     }
   };
 
+// Dispatch helper class for using vectorized linear search. Only used for
+// plain std::less<> comparison of keys supported by btree_simd_search.
+  template<typename K, typename N, typename Compare>
+  struct btree_linear_search_simd {
+    static int lower_bound(const K &k, const N &n, Compare) {
+      return n.linear_search_simd(k, 0, n.count(), false);
+    }
+    static int upper_bound(const K &k, const N &n, Compare) {
+      return n.linear_search_simd(k, 0, n.count(), true);
+    }
+  };
+
+// Dispatch helper class for searching the abbreviated keys of a node. Only
+// used for plain std::less<> comparison of keys supported by
+// btree_abbrev_key.
+  template<typename K, typename N, typename Compare>
+  struct btree_abbrev_search {
+    static int lower_bound(const K &k, const N &n, Compare) {
+      return n.abbrev_search(k, false);
+    }
+    static int upper_bound(const K &k, const N &n, Compare) {
+      return n.abbrev_search(k, true);
+    }
+  };
+
 // A node in the btree holding. The same node type is used for both internal
 // and leaf nodes in the btree, though the nodes are allocated in such a way
 // that the children array is only valid in internal nodes.
@@ -333,6 +469,9 @@ namespace atlasdb {
     typedef btree_linear_search_compare_to<key_type, self_type, key_compare> linear_search_compare_to_type;
     typedef btree_binary_search_plain_compare<key_type, self_type, key_compare> binary_search_plain_compare_type;
     typedef btree_binary_search_compare_to<key_type, self_type, key_compare> binary_search_compare_to_type;
+    typedef btree_linear_search_simd<key_type, self_type, key_compare> linear_search_simd_type;
+    typedef btree_abbrev_search<key_type, self_type, key_compare> abbrev_search_type;
+    typedef btree_abbrev_key<key_type> abbrev_key;
     // If we have a valid key-compare-to type, use linear_search_compare_to,
     // otherwise use linear_search_plain_compare.
     typedef typename if_<Params::is_key_compare_to::value, linear_search_compare_to_type,
@@ -341,13 +480,75 @@ namespace atlasdb {
     // otherwise use binary_search_plain_compare.
     typedef typename if_<Params::is_key_compare_to::value, binary_search_compare_to_type,
         binary_search_plain_compare_type>::type binary_search_type;
+    // If the key is a 32 or 64 bit integral or floating point type ordered by
+    // std::less<>, use the vectorized linear search.
+    typedef typename if_<btree_simd_searchable<key_type>::value && btree_is_less<key_compare, key_type>::value,
+        linear_search_simd_type, linear_search_type>::type linear_search_or_simd_type;
     // If the key is an integral or floating point type, use linear search which
     // is faster than binary search for such types. Might be wise to also
     // configure linear search based on node-size.
     typedef typename if_<std::is_integral<key_type>::value || std::is_floating_point<key_type>::value,
-        linear_search_type, binary_search_type>::type search_type;
+        linear_search_or_simd_type, binary_search_type>::type search_or_binary_type;
+    // Nodes holding string keys ordered by std::less<> keep abbreviated keys,
+    // see btree_abbrev.h.
+    enum {
+      kAbbreviated = abbrev_key::value && btree_is_less<key_compare, key_type>::value,
+    };
+    typedef typename if_<kAbbreviated, abbrev_search_type, search_or_binary_type>::type search_type;
+    // The version/lock word of the nodes of a concurrent_btree: a writer sets
+    // bit 1 while it modifies the node and bumps the version when it is done,
+    // readers check the version did not change after reading the node. Empty
+    // for the nodes of a plain btree.
+    template<bool Concurrent, typename Dummy = void>
+    struct latch_fields {
+    };
+
+    template<typename Dummy>
+    struct latch_fields<true, Dummy> {
+      mutable std::atomic<uint64_t> version;
+    };
 
-    struct base_fields {
+    // The number of values in the subtree of each child of an internal node of
+    // a ranked btree. Empty for the nodes of other trees, where the accessors
+    // do nothing.
+    template<bool Ranked, int N, typename Dummy = void>
+    struct count_fields {
+      size_type get_child_count(int) const { return 0; }
+      void set_child_count(int, size_type) {}
+    };
+
+    template<int N, typename Dummy>
+    struct count_fields<true, N, Dummy> {
+      size_type get_child_count(int i) const { return counts[i]; }
+      void set_child_count(int i, size_type v) { counts[i] = v; }
+
+      size_type counts[N];
+    };
+
+    // The abbreviated keys of a node, see btree_abbrev.h. Empty for the nodes
+    // of other trees, where the accessors do nothing.
+    template<bool Abbreviated, int N, typename Dummy = void>
+    struct abbrev_fields {
+      size_t get_prefix() const { return 0; }
+      void set_prefix(size_t) {}
+      uint64_t get_abbrev(int) const { return 0; }
+      void set_abbrev(int, uint64_t) {}
+    };
+
+    template<int N, typename Dummy>
+    struct abbrev_fields<true, N, Dummy> {
+      size_t get_prefix() const { return prefix; }
+      void set_prefix(size_t v) { prefix = v; }
+      uint64_t get_abbrev(int i) const { return abbrevs[i]; }
+      void set_abbrev(int i, uint64_t v) { abbrevs[i] = v; }
+
+      // The length of a prefix shared by all of the keys in the node.
+      uint32_t prefix;
+      // The 8 bytes following the prefix of each key.
+      uint64_t abbrevs[N];
+    };
+
+    struct header_fields: public latch_fields<Params::kConcurrent> {
       typedef typename Params::node_count_type field_type;
 
       // A boolean indicating whether the node is a leaf or not.
@@ -358,8 +559,69 @@ namespace atlasdb {
       field_type max_count;
       // The count of the number of values in the node.
       field_type count;
-      // A pointer to the node's parent.
-      btree_node *parent;
+      // The number of references to the node: from its parent, or from the
+      // tree and its snapshots for the root. Nodes are only referenced more
+      // than once by trees which took snapshots.
+      std::atomic<uint32_t> refs;
+      // The link to the node's parent, see link().
+      intptr_t parent;
+    };
+
+    enum {
+      kCacheLineSize = 64,
+
+      // The number of values of a node with abbreviated keys, each of which
+      // takes an abbreviation on top of the value, so that such nodes hold
+      // fewer values than they would without.
+      kAbbrevTargetValues = (params_type::kTargetNodeSize - sizeof(header_fields) - sizeof(uint64_t))
+          / (params_type::kValueSize + sizeof(uint64_t)),
+      kAbbrevValues = kAbbrevTargetValues >= 3 ? kAbbrevTargetValues : 3,
+
+      // The number of values of a node with split keys, whose size is rounded
+      // up to whole cache lines.
+      kSplitNodeSize = (params_type::kTargetNodeSize + kCacheLineSize - 1) / kCacheLineSize * kCacheLineSize,
+      kSplitMinValues = (kSplitNodeSize - 2 * kCacheLineSize) / int(sizeof(key_type) + sizeof(mutable_value_type)),
+      kSplitValues = btree_split_node_values(kSplitNodeSize, kCacheLineSize, sizeof(key_type),
+          sizeof(mutable_value_type), kSplitMinValues >= 3 ? kSplitMinValues : 3),
+
+      // Large nodes of a btree_map with fixed width keys keep a copy of their
+      // keys, see key_fields. Copying the keys costs small nodes too many of
+      // their values for searches to pay off. The values of such nodes are
+      // plain bytes as well if the mapped type is trivial.
+      kSplitKeys = btree_split_key<key_type>::value && !std::is_same<key_type, mutable_value_type>::value
+          && !Params::kConcurrent && kSplitValues >= 32,
+      kTrivialValues = kSplitKeys && std::is_trivial<data_type>::value,
+    };
+
+    // The keys of the nodes of a btree_map with fixed width keys (see
+    // btree_split_key), copied into an array of their own ahead of the values.
+    // Searching such a node reads the cache lines holding its keys only, and
+    // the keys are shifted around as plain bytes. The header of the node takes
+    // the first cache line, the keys and the values each start on a cache
+    // line. Empty for the nodes of other trees, where the accessors do nothing.
+    template<bool Split, int N, typename Dummy = void>
+    struct key_fields {
+      void set_key(int, const key_type&) {}
+      void swap_key(int, key_fields&, int) {}
+      void move_keys(int, int, int) {}
+    };
+
+    template<int N, typename Dummy>
+    struct key_fields<true, N, Dummy> {
+      void set_key(int i, const key_type &k) { keys[i] = k; }
+      void swap_key(int i, key_fields &x, int j) { std::swap(keys[i], x.keys[j]); }
+      void move_keys(int to, int from, int n) { std::memmove(keys + to, keys + from, n * sizeof(key_type)); }
+
+      char header_line[kCacheLineSize
+          - (sizeof(header_fields) + alignof(key_type) - 1) / alignof(key_type) * alignof(key_type)];
+      union {
+        key_type keys[N];
+        char key_lines[(N * sizeof(key_type) + kCacheLineSize - 1) / kCacheLineSize * kCacheLineSize];
+      };
+    };
+
+    struct base_fields: public header_fields, public abbrev_fields<kAbbreviated, kAbbrevValues>,
+        public key_fields<kSplitKeys, kSplitValues> {
     };
 
     enum {
@@ -370,10 +632,16 @@ namespace atlasdb {
       // We need a minimum of 3 values per internal node in order to perform
       // splitting (1 value for the two nodes involved in the split and 1 value
       // propagated to the parent as the delimiter for the split).
-      kNodeValues = kNodeTargetValues >= 3 ? kNodeTargetValues : 3,
+      // Every branch is an int, enumerators of different enums would not mix.
+      kNodeValues = kAbbreviated ? static_cast<int>(kAbbrevValues)
+          : kSplitKeys ? static_cast<int>(kSplitValues)
+          : (kNodeTargetValues >= 3 ? static_cast<int>(kNodeTargetValues) : 3),
 
       kExactMatch = 1 << 30,
       kMatchMask = kExactMatch - 1,
+
+      // The number of leaves scan iterators prefetch ahead of the current one.
+      kPrefetchLeaves = 2,
     };
 
     struct leaf_fields: public base_fields {
@@ -382,69 +650,147 @@ namespace atlasdb {
       mutable_value_type values[kNodeValues];
     };
 
-    struct internal_fields: public leaf_fields {
-      // The array of child pointers. The keys in children_[i] are all less than
+    struct internal_fields: public leaf_fields, public count_fields<Params::kRanked, kNodeValues + 1> {
+      // The array of child links. The keys in children_[i] are all less than
       // key(i). The keys in children_[i + 1] are all greater than key(i). There
       // are always count + 1 children.
-      btree_node *children[kNodeValues + 1];
+      intptr_t children[kNodeValues + 1];
     };
 
     struct root_fields: public internal_fields {
-      btree_node *rightmost;
+      intptr_t rightmost;
       size_type size;
     };
 
   public:
     // Getter/setter for whether this is a leaf node or not. This value doesn't
     // change after the node is created.
-    bool leaf() const { return fields_.leaf; }
+    bool leaf() const { return base().leaf; }
 
     // Getter for the position of this node in its parent.
-    int position() const { return fields_.position; }
-    void set_position(int v) { fields_.position = v; }
+    int position() const { return base().position; }
+    void set_position(int v) { base().position = v; }
 
     // Getter/setter for the number of values stored in this node.
-    int count() const { return fields_.count; }
-    void set_count(int v) { fields_.count = v; }
-    int max_count() const { return fields_.max_count; }
+    int count() const { return base().count; }
+    void set_count(int v) { base().count = v; }
+    int max_count() const { return base().max_count; }
+
+    // Getter for the version/lock word. Only valid in a concurrent_btree.
+    std::atomic<uint64_t>* version() const { return &base().version; }
+
+    // Nodes link to each other by the distance from the node holding the link
+    // to the node linked to, rather than by address, so that the nodes of a
+    // btree image are valid wherever the image is mapped (see btree_image.h).
+    // A null link is the distance to address 0 and only valid in memory.
+    intptr_t link(const btree_node *n) const {
+      return static_cast<intptr_t>(reinterpret_cast<uintptr_t>(n) - reinterpret_cast<uintptr_t>(this));
+    }
+    btree_node* follow(intptr_t l) const {
+      return reinterpret_cast<btree_node*>(reinterpret_cast<uintptr_t>(this) + static_cast<uintptr_t>(l));
+    }
 
     // Getter for the parent of this node.
-    btree_node* parent() const { return fields_.parent; }
+    btree_node* parent() const { return follow(base().parent); }
+    void set_parent(btree_node *p) { base().parent = link(p); }
+
+    // Reference counting of the nodes shared with snapshots. unref() returns
+    // true if the last reference was dropped.
+    bool shared() const { return base().refs.load(std::memory_order_acquire) > 1; }
+    void ref() { base().refs.fetch_add(1, std::memory_order_relaxed); }
+    bool unref() { return base().refs.fetch_sub(1, std::memory_order_acq_rel) == 1; }
+    // Makes the node shared for good, as the nodes of a btree image which are
+    // never freed: the tree copies them before modifying them.
+    void pin() { base().refs.store(1u << 31, std::memory_order_relaxed); }
     // Getter for whether the node is the root of the tree. The parent of the
     // root of the tree is the leftmost node in the tree which is guaranteed to
     // be a leaf.
     bool is_root() const { return parent()->leaf(); }
     void make_root() {
       assert(parent()->is_root());
-      fields_.parent = fields_.parent->parent();
+      set_parent(parent()->parent());
     }
 
     // Getter for the rightmost root node field. Only valid on the root node.
-    btree_node* rightmost() const { return fields_.rightmost; }
-    btree_node** mutable_rightmost() { return &fields_.rightmost; }
+    btree_node* rightmost() const { return follow(fields_.rightmost); }
+    void set_rightmost(btree_node *n) { fields_.rightmost = link(n); }
 
     // Getter for the size root node field. Only valid on the root node.
     size_type size() const { return fields_.size; }
     size_type* mutable_size() { return &fields_.size; }
 
     // Getters for the key/value at position i in the node.
-    const key_type& key(int i) const { return params_type::key(fields_.values[i]); }
-    reference value(int i) { return reinterpret_cast<reference>(fields_.values[i]); }
-    const_reference value(int i) const { return reinterpret_cast<const_reference>(fields_.values[i]); }
-    mutable_value_type* mutable_value(int i) { return &fields_.values[i]; }
+    const key_type& key(int i) const { return key_at(i, std::integral_constant<bool, kSplitKeys>()); }
+    reference value(int i) { return reinterpret_cast<reference>(leaf_part().values[i]); }
+    const_reference value(int i) const { return reinterpret_cast<const_reference>(leaf_part().values[i]); }
+    mutable_value_type* mutable_value(int i) { return &leaf_part().values[i]; }
 
     // Swap value i in this node with value j in node x.
-    void value_swap(int i, btree_node *x, int j) { params_type::swap(mutable_value(i), x->mutable_value(j)); }
+    void value_swap(int i, btree_node *x, int j) {
+      params_type::swap(mutable_value(i), x->mutable_value(j));
+      base().swap_key(i, x->base(), j);
+    }
 
     // Getters/setter for the child at position i in the node.
-    btree_node* child(int i) const { return fields_.children[i]; }
-    btree_node** mutable_child(int i) { return &fields_.children[i]; }
+    btree_node* child(int i) const { return follow(internal_part().children[i]); }
+    // Sets the link to the child only, set_child() updates the child too.
+    void set_child_link(int i, btree_node *c) { internal_part().children[i] = link(c); }
     void set_child(int i, btree_node *c) {
-      *mutable_child(i) = c;
-      c->fields_.parent = this;
-      c->fields_.position = i;
+      set_child_link(i, c);
+      c->set_parent(this);
+      c->base().position = i;
+    }
+
+    // Getters/setter for the number of values in the subtree of the child at
+    // position i. Only maintained in the internal nodes of a ranked btree.
+    size_type child_count(int i) const { return internal_part().get_child_count(i); }
+    void set_child_count(int i, size_type v) { internal_part().set_child_count(i, v); }
+    void add_child_count(int i, size_type delta) { set_child_count(i, child_count(i) + delta); }
+
+    // Returns the number of values in the subtree rooted at this node, from
+    // the counts of its children.
+    size_type subtree_count() const {
+      size_type n = count();
+      if (!leaf()) {
+        for (int i = 0; i <= count(); ++i) {
+          n += child_count(i);
+        }
+      }
+      return n;
     }
 
+    // Getter/setter for the abbreviation of the key at position i. Only
+    // maintained in nodes with abbreviated keys (see btree_abbrev.h).
+    uint64_t abbrev(int i) const { return base().get_abbrev(i); }
+    void set_abbrev(int i, uint64_t v) { base().set_abbrev(i, v); }
+
+    // Returns the abbreviation of k following the prefix shared by the keys of
+    // this node. k must start with that prefix.
+    uint64_t abbreviate(const key_type &k) const {
+      size_t prefix = base().get_prefix();
+      size_t n = abbrev_key::size(k);
+      return n > prefix ? btree_abbreviate(abbrev_key::data(k) + prefix, n - prefix) : 0;
+    }
+
+    // Recomputes the shared prefix and the abbreviations of all of the keys.
+    void reset_abbrevs();
+
+    // Computes the abbreviation of the key which was just stored at position
+    // i. A new first or last key can shorten the shared prefix, in which case
+    // all of the abbreviations are recomputed.
+    void update_abbrev(int i);
+
+    // Returns whether the shared prefix and the abbreviations match the keys.
+    bool verify_abbrevs() const;
+
+    // Returns whether the copies of the keys of a node with split keys match
+    // the keys of the values.
+    bool verify_keys() const;
+
+    // Returns the position of the first value whose key is not less than k,
+    // or greater than k if upper is set, using the abbreviated keys.
+    int abbrev_search(const key_type &k, bool upper) const;
+
     // Returns the position of the first value whose key is not less than k.
     template<typename Compare>
     int lower_bound(const key_type &k, const Compare &comp) const { return search_type::lower_bound(k, *this, comp); }
@@ -452,6 +798,31 @@ namespace atlasdb {
     template<typename Compare>
     int upper_bound(const key_type &k, const Compare &comp) const { return search_type::upper_bound(k, *this, comp); }
 
+    // The same for a value k of another type compared to the keys by the
+    // transparent comp, which is done with a binary search: the specialized
+    // searches above only handle key_type.
+    template<typename K, typename Compare>
+    int lower_bound(const K &k, const Compare &comp) const { return transparent_search(k, false, comp); }
+    template<typename K, typename Compare>
+    int upper_bound(const K &k, const Compare &comp) const { return transparent_search(k, true, comp); }
+
+    // Returns the position of the first value whose key is not less than k, or
+    // greater than k if upper is set, for a value k of another type.
+    template<typename K, typename Compare>
+    int transparent_search(const K &k, bool upper, const Compare &comp) const {
+      int s = 0, e = count();
+      while (s != e) {
+        int mid = (s + e) / 2;
+        if (upper ? !btree_compare_keys_as(comp, k, key(mid)) : btree_compare_keys_as(comp, key(mid), k)) {
+          s = mid + 1;
+        }
+        else {
+          e = mid;
+        }
+      }
+      return s;
+    }
+
     // Returns the position of the first value whose key is not less than k using
     // linear search performed using plain compare.
     template<typename Compare>
@@ -482,6 +853,14 @@ namespace atlasdb {
       return s;
     }
 
+    // Returns the position of the first value whose key is not less than k (or
+    // greater than k if inclusive is set) using the vectorized search over the
+    // keys in [s, e).
+    int linear_search_simd(const key_type &k, int s, int e, bool inclusive) const {
+      return s + btree_simd_search<key_type>::search(reinterpret_cast<const char*>(&key(s)),
+          kSplitKeys ? sizeof(key_type) : sizeof(mutable_value_type), e - s, k, inclusive);
+    }
+
     // Returns the position of the first value whose key is not less than k using
     // binary search performed using plain compare.
     template<typename Compare>
@@ -531,6 +910,15 @@ namespace atlasdb {
     // at positions > i to the left by 1.
     void remove_value(int i);
 
+    // Merges the values of the sorted range [b, e) whose key is less than
+    // *upper, or all of them if upper is null, into this leaf at position i in
+    // one pass, until the leaf is full. If unique is set, values whose key is
+    // already in the leaf or repeats the previous one are skipped. Advances b
+    // past the values consumed and returns the number of values inserted.
+    template<typename InputIterator, typename Compare>
+    int merge_sorted(int i, InputIterator &b, InputIterator e, const key_type *upper, bool unique,
+        const Compare &comp);
+
     // Rebalances a node with its right sibling.
     void rebalance_right_to_left(btree_node *sibling, int to_move);
     void rebalance_left_to_right(btree_node *sibling, int to_move);
@@ -545,6 +933,10 @@ namespace atlasdb {
     // Swap the contents of "this" and "src".
     void swap(btree_node *src);
 
+    // Copies the values of src into this empty node, and makes it reference
+    // the children of src as well.
+    void clone(btree_node *src);
+
     // Node allocation/deletion routines.
     static btree_node* init_leaf(leaf_fields *f, btree_node *parent, int max_count) {
       btree_node *n = reinterpret_cast<btree_node*>(f);
@@ -552,7 +944,8 @@ namespace atlasdb {
       f->position = 0;
       f->max_count = max_count;
       f->count = 0;
-      f->parent = parent;
+      f->refs.store(1, std::memory_order_relaxed);
+      f->parent = n->link(parent);
       if (!NDEBUG) {
         memset(&f->values, 0, max_count * sizeof(value_type));
       }
@@ -572,12 +965,33 @@ namespace atlasdb {
 
     static btree_node* init_root(root_fields *f, btree_node *parent) {
       btree_node *n = init_internal(f, parent);
-      f->rightmost = parent;
+      n->set_rightmost(parent);
       f->size = parent->count();
 
       return n;
     }
 
+    // Prefetches the cache lines of a leaf which is not the root, and so has the
+    // size of leaf_fields, without touching the node itself.
+    void prefetch_leaf() const {
+      const char *p = reinterpret_cast<const char*>(this);
+      for (size_t offset = 0; offset < sizeof(leaf_fields); offset += kCacheLineSize) {
+        btree_prefetch(p + offset);
+      }
+    }
+
+    // Prefetches the leaves following this one, up to kPrefetchLeaves of them,
+    // as long as they share the parent of this leaf.
+    void prefetch_next_leaves() const {
+      if (is_root()) {
+        return;
+      }
+      int last = std::min<int>(parent()->count(), position() + kPrefetchLeaves);
+      for (int i = position() + 1; i <= last; ++i) {
+        parent()->child(i)->prefetch_leaf();
+      }
+    }
+
     void destroy() {
       for (int i = 0; i < count(); ++i) {
         value_destroy(i);
@@ -586,9 +1000,25 @@ namespace atlasdb {
 
   private:
 
-    void value_init(int i) { new (&fields_.values[i]) mutable_value_type; }
-    void value_init(int i, const value_type &x) { new (&fields_.values[i]) mutable_value_type(x); }
-    void value_destroy(int i) { fields_.values[i].~mutable_value_type(); }
+    void value_init(int i) { new (&leaf_part().values[i]) mutable_value_type; }
+    void value_init(int i, const value_type &x) {
+      new (&leaf_part().values[i]) mutable_value_type(x);
+      base().set_key(i, params_type::key(x));
+    }
+    void value_destroy(int i) { leaf_part().values[i].~mutable_value_type(); }
+
+    const key_type& key_at(int i, std::true_type) const { return base().keys[i]; }
+    const key_type& key_at(int i, std::false_type) const { return params_type::key(leaf_part().values[i]); }
+
+    // The fields of the node, reached through the smallest struct holding
+    // them: leaves and internal nodes are only allocated as large as their
+    // leaf_fields and internal_fields, never as large as fields_.
+    base_fields& base() { return *reinterpret_cast<base_fields*>(this); }
+    const base_fields& base() const { return *reinterpret_cast<const base_fields*>(this); }
+    leaf_fields& leaf_part() { return *reinterpret_cast<leaf_fields*>(this); }
+    const leaf_fields& leaf_part() const { return *reinterpret_cast<const leaf_fields*>(this); }
+    internal_fields& internal_part() { return *reinterpret_cast<internal_fields*>(this); }
+    const internal_fields& internal_part() const { return *reinterpret_cast<const internal_fields*>(this); }
 
   private:
 
@@ -687,6 +1117,45 @@ namespace atlasdb {
     int position;
   };
 
+// An iterator for sequential scans. When it enters a leaf it prefetches the
+// next leaves, so that they are in the cache by the time the scan reaches
+// them instead of costing a cache miss at every leaf boundary. The next leaves
+// are found through the parent of the current leaf, which the iterator has
+// just passed through.
+  template<typename Node, typename Reference, typename Pointer>
+  struct btree_scan_iterator: public btree_iterator<Node, Reference, Pointer> {
+    typedef btree_iterator<Node, Reference, Pointer> super_type;
+    typedef btree_scan_iterator<Node, Reference, Pointer> self_type;
+
+    btree_scan_iterator() {}
+    btree_scan_iterator(const super_type &x) : super_type(x) {
+      if (this->node && this->node->leaf() && this->position < this->node->count()) {
+        this->node->prefetch_next_leaves();
+      }
+    }
+
+    void increment() {
+      if (this->node->leaf() && ++this->position < this->node->count()) {
+        return;
+      }
+      this->increment_slow();
+      if (this->node->leaf() && this->position == 0) {
+        this->node->prefetch_next_leaves();
+      }
+    }
+
+    self_type& operator++() {
+      increment();
+      return *this;
+    }
+
+    self_type operator++(int) {
+      self_type tmp = *this;
+      ++*this;
+      return tmp;
+    }
+  };
+
 // Dispatch helper class for using btree::internal_locate with plain compare.
   struct btree_internal_locate_plain_compare {
     template<typename K, typename T, typename Iter>
@@ -703,6 +1172,318 @@ namespace atlasdb {
     }
   };
 
+  template<typename Params>
+  class btree;
+
+  template<typename Params>
+  class btree_verifier;
+
+// An immutable view of a btree as of the time btree::snapshot() was called.
+// Taking a snapshot is O(1), it only adds a reference to the root. The tree
+// copies shared nodes along with their ancestors before it modifies them
+// instead of modifying them in place, so the snapshot stays valid while the
+// tree changes. Nodes the tree no longer references are freed along with the
+// last snapshot referencing them.
+//
+// The parent pointers of shared nodes belong to the tree, so the iterators of
+// a snapshot keep the path from the root to the value they point at instead.
+// A snapshot can be read and released by a thread other than the one
+// modifying the tree.
+  template<typename Params>
+  class btree_snapshot {
+    typedef btree_snapshot<Params> self_type;
+    typedef btree<Params> tree_type;
+    typedef btree_node<Params> node_type;
+
+    enum {
+      kMatchMask = node_type::kMatchMask,
+      // Every internal node has at least two children, so a tree of this height
+      // would hold more values than size_type can count.
+      kMaxHeight = 8 * sizeof(typename Params::size_type),
+    };
+
+  public:
+
+    typedef typename Params::key_type key_type;
+    typedef typename Params::value_type value_type;
+    typedef typename Params::key_compare key_compare;
+    typedef typename Params::const_pointer const_pointer;
+    typedef typename Params::const_reference const_reference;
+    typedef typename Params::size_type size_type;
+    typedef typename Params::difference_type difference_type;
+    typedef typename Params::allocator_type::template rebind<char>::other internal_allocator_type;
+
+    class const_iterator {
+      friend class btree_snapshot;
+
+    public:
+
+      typedef typename Params::value_type value_type;
+      typedef typename Params::difference_type difference_type;
+      typedef typename Params::const_pointer pointer;
+      typedef typename Params::const_reference reference;
+      typedef std::bidirectional_iterator_tag iterator_category;
+
+      const_iterator() : depth_(0) {}
+
+      const_iterator(const const_iterator &x) : depth_(x.depth_) { std::copy(x.path_, x.path_ + depth_, path_); }
+
+      const_iterator& operator=(const const_iterator &x) {
+        depth_ = x.depth_;
+        std::copy(x.path_, x.path_ + depth_, path_);
+        return *this;
+      }
+
+      bool operator==(const const_iterator &x) const {
+        return depth_ == 0 ? x.depth_ == 0 : x.depth_ != 0 && top().node == x.top().node
+            && top().position == x.top().position;
+      }
+
+      bool operator!=(const const_iterator &x) const { return !(*this == x); }
+
+      const key_type& key() const { return top().node->key(top().position); }
+
+      reference operator*() const { return top().node->value(top().position); }
+
+      pointer operator->() const { return &top().node->value(top().position); }
+
+      const_iterator& operator++() {
+        increment();
+        return *this;
+      }
+
+      const_iterator& operator--() {
+        decrement();
+        return *this;
+      }
+
+      const_iterator operator++(int) {
+        const_iterator tmp = *this;
+        ++*this;
+        return tmp;
+      }
+
+      const_iterator operator--(int) {
+        const_iterator tmp = *this;
+        --*this;
+        return tmp;
+      }
+
+    private:
+
+      // A node on the path and the position of the value or child followed in it.
+      struct frame {
+        const node_type *node;
+        int position;
+      };
+
+      const frame& top() const { return path_[depth_ - 1]; }
+      frame& top() { return path_[depth_ - 1]; }
+
+      void push(const node_type *node, int position) {
+        assert(depth_ < kMaxHeight);
+        path_[depth_].node = node;
+        path_[depth_].position = position;
+        ++depth_;
+      }
+
+      void increment();
+      void decrement();
+
+      // Pops the nodes whose position is past their last value, leaving the
+      // root at the end position if there are none left.
+      void skip_end();
+
+      int depth_;
+      frame path_[kMaxHeight];
+    };
+
+    typedef const_iterator iterator;
+
+  public:
+
+    // An empty snapshot.
+    btree_snapshot() : comp_(), alloc_(), root_(nullptr), size_(0) {}
+
+    btree_snapshot(node_type *root, size_type size, const key_compare &comp, const internal_allocator_type &alloc);
+
+    btree_snapshot(const self_type &x);
+
+    self_type& operator=(self_type x) {
+      swap(x);
+      return *this;
+    }
+
+    ~btree_snapshot();
+
+    void swap(self_type &x);
+
+    const_iterator begin() const;
+
+    const_iterator end() const;
+
+    // Finds the first element whose key is not less than key.
+    const_iterator lower_bound(const key_type &key) const;
+
+    // Finds the first element whose key is greater than key.
+    const_iterator upper_bound(const key_type &key) const;
+
+    // Finds an element with the given key, or returns end().
+    const_iterator find(const key_type &key) const;
+
+    size_type size() const { return size_; }
+
+    bool empty() const { return size_ == 0; }
+
+    // Copies to out, in order, keys splitting the snapshot into at most n
+    // parts of about the same size, for scans of the parts in parallel. They
+    // are taken from the highest level of the tree holding enough keys, whose
+    // subtrees have about the same size.
+    template<typename OutputIterator>
+    OutputIterator split_keys(size_type n, OutputIterator out) const;
+
+  private:
+
+    key_compare comp_;
+    internal_allocator_type alloc_;
+    node_type *root_;
+    size_type size_;
+
+    friend class btree_verifier<Params>;
+  };
+
+// How full the nodes on one level of a btree are.
+  struct btree_level_fill {
+    enum { kBuckets = 10 };
+
+    // The number of nodes on the level, the number of values they hold and the
+    // number of bytes they take.
+    size_t nodes;
+    size_t values;
+    size_t bytes;
+    // The number of nodes by fill, in tenths of their capacity: histogram[i]
+    // counts the nodes holding at least i and less than i + 1 tenths of the
+    // values they can hold, histogram[kBuckets - 1] the fullest ones.
+    size_t histogram[kBuckets];
+  };
+
+// How full the nodes of a btree are, see btree_verifier.
+  struct btree_fragmentation {
+    // The levels from the root down to the leaves.
+    std::vector<btree_level_fill> levels;
+    // An estimate of the bytes btree::compact() frees: those of the nodes
+    // each level has on top of the full nodes its values would fit into.
+    size_t reclaimable_bytes;
+
+    btree_fragmentation() : reclaimable_bytes(0) {}
+  };
+
+// Checks the structure of a snapshot of a btree incrementally, a bounded
+// number of nodes per call to step(), so that a production tree can be
+// checked in the background without stopping its writers. The nodes are
+// visited depth first, and checked for the order and bounds of their keys,
+// their counts and, in a ranked btree, the counts of their subtrees. The
+// parent pointers of shared nodes belong to the tree (see btree_snapshot), so
+// they are not checked. On the way the verifier gathers how full the nodes of
+// each level are.
+//
+// Usage:
+//
+//   btree_map<int64_t, vertex>::verifier_type verifier(vertices.snapshot());
+//   while (!verifier.step(1000)) {
+//     ... serve requests ...
+//   }
+//   if (!verifier.ok()) { ... verifier.error() ... }
+  template<typename Params>
+  class btree_verifier {
+    typedef btree_node<Params> node_type;
+    typedef btree_snapshot<Params> snapshot_type;
+    typedef typename node_type::base_fields base_fields;
+    typedef typename node_type::internal_fields internal_fields;
+    typedef typename node_type::root_fields root_fields;
+
+    enum {
+      kMaxHeight = 8 * sizeof(typename Params::size_type),
+      // The number of nodes checked between two looks at the clock.
+      kClockInterval = 16,
+    };
+
+  public:
+
+    typedef typename Params::key_type key_type;
+    typedef typename Params::value_type value_type;
+    typedef typename Params::size_type size_type;
+    typedef std::chrono::steady_clock clock_type;
+
+    // Keeps a reference to the snapshot until the verifier is destroyed.
+    explicit btree_verifier(const snapshot_type &snapshot) : snapshot_(snapshot), depth_(0), started_(false),
+        nodes_(0), leaf_level_(-1) {}
+
+    // Checks up to max_nodes more nodes, or as many as it can until deadline.
+    // Returns done().
+    bool step(size_type max_nodes, clock_type::time_point deadline = clock_type::time_point::max());
+
+    // Whether the whole snapshot was checked or a problem was found.
+    bool done() const { return !error_.empty() || (started_ && depth_ == 0); }
+
+    // Whether no problem was found so far.
+    bool ok() const { return error_.empty(); }
+
+    // The first problem found, empty if there is none.
+    const std::string& error() const { return error_; }
+
+    // The number of nodes checked so far.
+    size_type nodes() const { return nodes_; }
+
+    // How full the nodes checked so far are.
+    const btree_fragmentation& fragmentation() const { return fragmentation_; }
+
+  private:
+
+    // A node being checked, the next child to check and the bounds of its
+    // keys, along with the number of values in its subtree checked so far.
+    struct frame {
+      const node_type *node;
+      int next;
+      const key_type *lo;
+      const key_type *hi;
+      size_type values;
+    };
+
+    // Checks node, on level "level" and with keys in [lo, hi], and adds it to
+    // the fragmentation report. Returns false if it is broken.
+    bool check(const node_type *node, int level, const key_type *lo, const key_type *hi);
+
+    bool fail(const std::string &what) {
+      error_ = what;
+      return false;
+    }
+
+    bool compare_keys(const key_type &x, const key_type &y) const {
+      return btree_compare_keys(snapshot_.comp_, x, y);
+    }
+
+    void push(const node_type *node, const key_type *lo, const key_type *hi) {
+      frame &f = path_[depth_++];
+      f.node = node;
+      f.next = 0;
+      f.lo = lo;
+      f.hi = hi;
+      f.values = node->count();
+    }
+
+  private:
+
+    snapshot_type snapshot_;
+    frame path_[kMaxHeight];
+    int depth_;
+    bool started_;
+    size_type nodes_;
+    int leaf_level_;
+    std::string error_;
+    btree_fragmentation fragmentation_;
+  };
+
   template<typename Params>
   class btree : public Params::key_compare {
     typedef btree<Params> self_type;
@@ -715,6 +1496,7 @@ namespace atlasdb {
 
     friend class btree_internal_locate_plain_compare;
     friend class btree_internal_locate_compare_to;
+    friend class btree_snapshot<Params>;
     typedef typename if_<is_key_compare_to::value, btree_internal_locate_compare_to, btree_internal_locate_plain_compare>::type internal_locate_type;
 
     enum {
@@ -723,6 +1505,21 @@ namespace atlasdb {
       kValueSize = node_type::kValueSize,
       kExactMatch = node_type::kExactMatch,
       kMatchMask = node_type::kMatchMask,
+      kMaxHeight = 8 * sizeof(typename Params::size_type),
+
+      // The number of probes of find_batch() descending the tree side by side.
+      kFindBatchGroup = 16,
+
+      // The number of bytes taken by the nodes of a btree image, see
+      // write_image().
+      kImageLeafSize = (sizeof(leaf_fields) + node_type::kCacheLineSize - 1) / node_type::kCacheLineSize
+          * node_type::kCacheLineSize,
+      kImageInternalSize = (sizeof(internal_fields) + node_type::kCacheLineSize - 1) / node_type::kCacheLineSize
+          * node_type::kCacheLineSize,
+      kImageRootSize = (sizeof(root_fields) + node_type::kCacheLineSize - 1) / node_type::kCacheLineSize
+          * node_type::kCacheLineSize,
+      // The number of nodes buffered per level while writing an image.
+      kImageBufferNodes = 256,
     };
 
     // A helper class to get the empty base class optimization for 0-size
@@ -768,6 +1565,9 @@ namespace atlasdb {
     typedef typename iterator::const_iterator const_iterator;
     typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
     typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef btree_scan_iterator<const node_type, const_reference, const_pointer> scan_iterator;
+    typedef btree_snapshot<Params> snapshot_type;
+    typedef btree_verifier<Params> verifier_type;
 
     typedef typename Params::allocator_type allocator_type;
     typedef typename allocator_type::template rebind<char>::other internal_allocator_type;
@@ -792,6 +1592,11 @@ namespace atlasdb {
     reverse_iterator rend() { return reverse_iterator(begin()); }
     const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
 
+    // Scan iterator routines, see btree_scan_iterator.
+    scan_iterator scan_begin() const { return scan_iterator(begin()); }
+    scan_iterator scan_end() const { return scan_iterator(end()); }
+    scan_iterator scan_lower_bound(const key_type &key) const { return scan_iterator(lower_bound(key)); }
+
     // Finds the first element whose key is not less than key.
     iterator lower_bound(const key_type &key) { return internal_end(internal_lower_bound(key, iterator(root(), 0))); }
     const_iterator lower_bound(const key_type &key) const {
@@ -815,6 +1620,40 @@ namespace atlasdb {
       return std::make_pair(lower_bound(key), upper_bound(key));
     }
 
+    // The lookup routines above for a value of any type K comparable to the
+    // keys, which take part in overload resolution only if key_compare is
+    // transparent (see btree_is_transparent). No key is constructed from key.
+    template<typename K>
+    typename btree_if_transparent<key_compare, K, iterator>::type lower_bound(const K &key) {
+      return internal_end(internal_lower_bound(key, iterator(root(), 0)));
+    }
+
+    template<typename K>
+    typename btree_if_transparent<key_compare, K, const_iterator>::type lower_bound(const K &key) const {
+      return internal_end(internal_lower_bound(key, const_iterator(root(), 0)));
+    }
+
+    template<typename K>
+    typename btree_if_transparent<key_compare, K, iterator>::type upper_bound(const K &key) {
+      return internal_end(internal_upper_bound(key, iterator(root(), 0)));
+    }
+
+    template<typename K>
+    typename btree_if_transparent<key_compare, K, const_iterator>::type upper_bound(const K &key) const {
+      return internal_end(internal_upper_bound(key, const_iterator(root(), 0)));
+    }
+
+    template<typename K>
+    typename btree_if_transparent<key_compare, K, std::pair<iterator, iterator> >::type equal_range(const K &key) {
+      return std::make_pair(lower_bound(key), upper_bound(key));
+    }
+
+    template<typename K>
+    typename btree_if_transparent<key_compare, K, std::pair<const_iterator, const_iterator> >::type equal_range(
+        const K &key) const {
+      return std::make_pair(lower_bound(key), upper_bound(key));
+    }
+
     // Inserts a value into the btree only if it does not already exist. The
     // boolean return value indicates whether insertion succeeded or failed. The
     // ValuePointer type is used to avoid instatiating the value unless the key
@@ -857,6 +1696,33 @@ namespace atlasdb {
     template<typename InputIterator>
     void insert_multi(InputIterator b, InputIterator e);
 
+    // Builds the btree bottom-up from the sorted range [b, e) in one linear
+    // pass: leaves are packed to fill * kNodeValues values and the internal
+    // levels are built as the leaves are filled, so no descent, shifting or
+    // splitting takes place. Duplicate keys are skipped by bulk_load_unique().
+    // If the btree is not empty, they are inserted as a sorted batch instead.
+    template<typename InputIterator>
+    void bulk_load_unique(InputIterator b, InputIterator e, double fill = 1.0) { internal_bulk_load(b, e, fill, true); }
+
+    template<typename InputIterator>
+    void bulk_load_multi(InputIterator b, InputIterator e, double fill = 1.0) { internal_bulk_load(b, e, fill, false); }
+
+    // Inserts the values of the sorted range [b, e) into the btree as
+    // insert_unique() or insert_multi() would, one after the other. Instead of
+    // descending from the root for every value, the tree is climbed from the
+    // leaf of the previous insertion only as far as the subtree holding the
+    // next key, and all of the values going to a leaf are merged into it at
+    // once, splitting it once when full. Returns the number of values inserted.
+    template<typename InputIterator>
+    size_type insert_sorted_batch_unique(InputIterator b, InputIterator e) {
+      return internal_insert_sorted_batch(b, e, true);
+    }
+
+    template<typename InputIterator>
+    size_type insert_sorted_batch_multi(InputIterator b, InputIterator e) {
+      return internal_insert_sorted_batch(b, e, false);
+    }
+
     void assign(const self_type &x);
 
     // Erase the specified iterator from the btree. The iterator must be valid
@@ -864,9 +1730,31 @@ namespace atlasdb {
     // the one that was erased (or end() if none exists).
     iterator erase(iterator iter);
 
-    // Erases range. Returns the number of keys erased.
+    // Erases range. Returns the number of keys erased. A range holding all of
+    // the values of the keys it spans is erased as by erase_range().
     int erase(iterator begin, iterator end);
 
+    // Erases all of the values whose key is in [lower, upper). Subtrees lying
+    // entirely within the range are released whole, so that only the nodes
+    // along the two boundaries of the range are rebalanced. Returns the number
+    // of values erased.
+    size_type erase_range(const key_type &lower, const key_type &upper) {
+      return compare_keys(lower, upper) ? internal_erase_range(lower, &upper) : 0;
+    }
+
+    // Fills sparse nodes up to fill of their capacity with the values of their
+    // right siblings, merging the siblings which fit into one node, and frees
+    // the nodes emptied on the way. Only the internal nodes and the leaves
+    // being modified are visited; nodes shared with snapshots are copied
+    // first. Returns the number of nodes freed.
+    size_type compact(double fill = 1.0) { return internal_compact_root(nullptr, nullptr, fill); }
+
+    // Compacts the nodes holding keys in [lower, upper) only, so that a large
+    // btree can be compacted a slice at a time.
+    size_type compact_range(const key_type &lower, const key_type &upper, double fill = 1.0) {
+      return compare_keys(lower, upper) ? internal_compact_root(&lower, &upper, fill) : 0;
+    }
+
     // Erases the specified key from the btree. Returns 1 if an element was
     // erased and 0 otherwise.
     int erase_unique(const key_type &key);
@@ -889,6 +1777,38 @@ namespace atlasdb {
       return internal_end(internal_find_multi(key, const_iterator(root(), 0)));
     }
 
+    // Finds the first value whose key compares equal to key, of any type K
+    // comparable to the keys if key_compare is transparent. Serves both
+    // find_unique() and find_multi().
+    template<typename K>
+    typename btree_if_transparent<key_compare, K, iterator>::type find_unique(const K &key) {
+      return internal_end(internal_find_multi(key, iterator(root(), 0)));
+    }
+
+    template<typename K>
+    typename btree_if_transparent<key_compare, K, const_iterator>::type find_unique(const K &key) const {
+      return internal_end(internal_find_multi(key, const_iterator(root(), 0)));
+    }
+
+    template<typename K>
+    typename btree_if_transparent<key_compare, K, iterator>::type find_multi(const K &key) {
+      return internal_end(internal_find_multi(key, iterator(root(), 0)));
+    }
+
+    template<typename K>
+    typename btree_if_transparent<key_compare, K, const_iterator>::type find_multi(const K &key) const {
+      return internal_end(internal_find_multi(key, const_iterator(root(), 0)));
+    }
+
+    // Finds the keys of [b, e), which must stay valid during the call, and
+    // writes an iterator to the first value with each key, or end(), to out in
+    // the order of the keys. The keys are looked up in sorted order, groups of
+    // them descending the tree level by level side by side with the next node
+    // of each prefetched, so that the cache misses of the group overlap. Keys
+    // falling into the leaf reached by the previous group skip the descent.
+    template<typename ForwardIterator, typename OutputIterator>
+    OutputIterator find_batch(ForwardIterator b, ForwardIterator e, OutputIterator out) const;
+
     // Returns a count of the number of times the key appears in the btree.
     size_type count_unique(const key_type &key) const {
       const_iterator begin = internal_find_unique(key, const_iterator(root(), 0));
@@ -903,12 +1823,61 @@ namespace atlasdb {
     // Returns a count of the number of times the key appears in the btree.
     size_type count_multi(const key_type &key) const { return distance(lower_bound(key), upper_bound(key)); }
 
+    // Order statistics, which require the subtree counts of a ranked btree
+    // (see btree_ranked_params). select() returns an iterator to the k-th value
+    // in key order, counting from 0, or end() if there is no such value.
+    // A negative k compares greater than size() once both are unsigned.
+    iterator select(size_type k) {
+      return static_cast<size_t>(k) < static_cast<size_t>(size()) ? internal_select(k, iterator(root(), 0)) : end();
+    }
+    const_iterator select(size_type k) const {
+      return static_cast<size_t>(k) < static_cast<size_t>(size()) ? internal_select(k, const_iterator(root(), 0)) :
+          end();
+    }
+
+    // Returns the number of values before iter.
+    size_type rank(const_iterator iter) const;
+
+    // Returns the number of values whose key is less than key.
+    size_type rank(const key_type &key) const { return rank(lower_bound(key)); }
+
+    // Returns the number of values whose key is in [lo, hi).
+    size_type count_range(const key_type &lo, const key_type &hi) const {
+      return compare_keys(lo, hi) ? rank(lower_bound(hi)) - rank(lower_bound(lo)) : 0;
+    }
+
     // Clear the btree, deleting all of the values it contains.
     void clear();
 
+    // Returns an immutable view of the current contents of the btree in O(1).
+    // From then on the btree copies the nodes shared with snapshots before
+    // modifying them.
+    snapshot_type snapshot();
+
+    // Returns an iterator to the same value as iter, through which the value
+    // can be modified without affecting any snapshot. Invalidates the other
+    // iterators if nodes have to be copied.
+    iterator unshare(iterator iter) {
+      iter.node = unshare_path(iter.node);
+      return iter;
+    }
+
     // Swap the contents of *this and x.
     void swap(self_type &x);
 
+    // Writes an image of the btree to the file at path (see btree_image.h).
+    // Requires trivially copyable values.
+    // Throws std::system_error if the file cannot be written.
+    void write_image(const std::string &path) const;
+
+    // Replaces the contents of the btree by those of a mapped btree image,
+    // which serves the reads in place from then on. The nodes of the image are
+    // copied before being modified. The image must stay mapped until the btree
+    // is cleared or destroyed, and can only be attached to one btree.
+    // Throws std::runtime_error if the image was written by a btree of
+    // another type.
+    void attach_image(btree_image &image);
+
     // Assign the contents of x to *this.
     self_type& operator=(const self_type &x) {
       if (std::addressof(x) != this) {
@@ -965,6 +1934,13 @@ namespace atlasdb {
       return h;
     }
 
+    // A counter bumped whenever a node leaves the tree: when it is deleted,
+    // dropped by clear(), erase_range() or swap(), or replaced by a copy
+    // because it is shared with a snapshot. As long as the counter does not
+    // change, pointers to the nodes of the tree stay valid, though the values
+    // of a node may move (see btree_hash_index).
+    uint64_t generation() const { return generation_; }
+
     // The number of internal, leaf and total nodes used by the btree.
     size_type leaf_nodes() const { return internal_stats(root()).leaf_nodes; }
     size_type internal_nodes() const { return internal_stats(root()).internal_nodes; }
@@ -1021,7 +1997,7 @@ namespace atlasdb {
 
     const node_type* rightmost() const { return (!root() || root()->leaf()) ? root() : root()->rightmost(); }
 
-    node_type** mutable_rightmost() { return root()->mutable_rightmost(); }
+    void set_rightmost(node_type *n) { root()->set_rightmost(n); }
 
     // The leftmost node is stored as the parent of the root node.
     node_type* leftmost() { return root() ? root()->parent() : nullptr; }
@@ -1061,17 +2037,20 @@ namespace atlasdb {
     }
 
     void delete_internal_node(node_type *node) {
+      ++generation_;
       node->destroy();
       assert(node != root());
       mutable_internal_allocator()->deallocate(reinterpret_cast<char*>(node), sizeof(internal_fields));
     }
 
     void delete_internal_root_node() {
+      ++generation_;
       root()->destroy();
       mutable_internal_allocator()->deallocate(reinterpret_cast<char*>(root()), sizeof(root_fields));
     }
 
     void delete_leaf_node(node_type *node) {
+      ++generation_;
       node->destroy();
       mutable_internal_allocator()->deallocate(reinterpret_cast<char*>(node),
           sizeof(base_fields) + node->max_count() * sizeof(value_type));
@@ -1125,25 +2104,145 @@ namespace atlasdb {
     template<typename IterType>
     std::pair<IterType, int> internal_locate_compare_to(const key_type& key, IterType iter) const;
 
-    // Internal routine which implements lower_bound().
+    // Internal routine which implements bulk_load_unique() and
+    // bulk_load_multi().
+    template<typename InputIterator>
+    void internal_bulk_load(InputIterator b, InputIterator e, double fill, bool unique);
+
+    // Internal routine which implements insert_sorted_batch_unique() and
+    // insert_sorted_batch_multi().
+    template<typename InputIterator>
+    size_type internal_insert_sorted_batch(InputIterator b, InputIterator e, bool unique);
+
+    // Appends the value v to the open node of level "level" during a bulk load,
+    // opening a new node on that level (and pushing v up) if the open node is
+    // full. Returns the node which receives the next node of level "level" - 1
+    // as its last child and stores the location of v into *last.
+    node_type* internal_bulk_append(std::vector<node_type*> &levels, int level, const value_type &v, int target,
+        const key_type **last);
+
+    // Adds delta to the subtree counts on the path from node to the root.
+    void internal_adjust_counts(node_type *node, size_type delta) {
+      if (params_type::kRanked) {
+        for (; !node->is_root(); node = node->parent()) {
+          node->parent()->add_child_count(node->position(), delta);
+        }
+      }
+    }
+
+    // Internal routine which implements erase_range(), erasing up to the end
+    // of the tree if upper is null.
+    size_type internal_erase_range(const key_type &lower, const key_type *upper);
+
+    // Merges or rebalances the nodes from iter.node up to the root after
+    // values were removed from iter.node at iter.position.
+    void internal_rebalance(iterator iter);
+
+    // Returns the number of values in the subtree rooted at node.
+    static size_type internal_subtree_size(const node_type *node);
+
+    // Internal routine which implements compact() and compact_range(),
+    // bounded by the keys lower and upper unless they are null.
+    size_type internal_compact_root(const key_type *lower, const key_type *upper, double fill);
+
+    // Compacts the children of node, which is not shared, and their subtrees
+    // and returns the number of nodes freed.
+    size_type internal_compact(node_type *node, const key_type *lower, const key_type *upper, int target);
+
+    // Returns true if the subtree of the child at position i of node may hold
+    // keys in [*lower, *upper).
+    bool internal_in_range(const node_type *node, int i, const key_type *lower, const key_type *upper) const {
+      return (!lower || i == node->count() || !compare_keys(node->key(i), *lower))
+          && (!upper || i == 0 || compare_keys(node->key(i - 1), *upper));
+    }
+
+    // Returns the last leaf of the subtree rooted at node.
+    static node_type* internal_last_leaf(node_type *node) {
+      while (!node->leaf()) {
+        node = node->child(node->count());
+      }
+      return node;
+    }
+
+    // Returns true if the values of the subtree rooted at node are all less
+    // than *upper, or if upper is null.
+    bool internal_below(node_type *node, const key_type *upper) const {
+      if (!upper) {
+        return true;
+      }
+      const node_type *leaf = internal_last_leaf(node);
+      return compare_keys(leaf->key(leaf->count() - 1), *upper);
+    }
+
+    // Recomputes the subtree counts of node and all of its descendants, and
+    // returns the number of values in the subtree.
+    size_type internal_count_subtrees(node_type *node);
+
+    // Internal routine which implements select(). Requires k < size().
     template<typename IterType>
-    IterType internal_lower_bound(const key_type& key, IterType iter) const;
+    IterType internal_select(size_type k, IterType iter) const;
+
+    // Internal routine which implements lower_bound(), for keys and for the
+    // values of other types transparent lookups take.
+    template<typename K, typename IterType>
+    IterType internal_lower_bound(const K& key, IterType iter) const;
 
     // Internal routine which implements upper_bound().
-    template<typename IterType>
-    IterType internal_upper_bound(const key_type& key, IterType iter) const;
+    template<typename K, typename IterType>
+    IterType internal_upper_bound(const K& key, IterType iter) const;
 
     // Internal routine which implements find_unique().
     template<typename IterType>
     IterType internal_find_unique(const key_type& key, IterType iter) const;
 
-    // Internal routine which implements find_multi().
-    template<typename IterType>
-    IterType internal_find_multi(const key_type& key, IterType iter) const;
+    // Internal routine which implements find_multi(), and find_unique() by a
+    // value of another type than key_type.
+    template<typename K, typename IterType>
+    IterType internal_find_multi(const K& key, IterType iter) const;
 
     // Deletes a node and all of its children.
     void internal_clear(node_type *node);
 
+    // Drops a reference to node, deleting it along with its children if it was
+    // the last one. The root of a tree or snapshot is allocated as root_fields.
+    static void release_node(internal_allocator_type *alloc, node_type *node, bool root);
+
+    // Copies the shared nodes on the path from the root to node, top down, and
+    // returns the copy of node. A node's copy shares its children, so every
+    // node below a copied one is shared as well.
+    node_type* unshare_path(node_type *node);
+
+    // Copies node if it is shared. The parent of node must not be shared.
+    node_type* unshare_node(node_type *node) {
+      return copy_on_write_ && node->shared() ? internal_unshare(node) : node;
+    }
+
+    // Replaces node by a copy in the tree and drops the tree's reference to it.
+    node_type* internal_unshare(node_type *node);
+
+    // The nodes of one level of a btree image being written, which are
+    // buffered and appended to the file in order.
+    struct image_level {
+      uint64_t offset;
+      size_t node_size;
+      size_type nodes;
+      size_type written;
+      std::vector<char> buffer;
+
+      uint64_t node_offset(size_type i) const { return offset + i * node_size; }
+    };
+
+    // Counts the nodes of each level below node, which is on level "level".
+    static void internal_count_image(const node_type *node, size_t level, std::vector<image_level> &levels);
+
+    // Writes node, which is on level "level", and its children to the image
+    // file fd, parent being the offset of its parent in the file.
+    void internal_write_image(int fd, const node_type *node, size_t level, uint64_t parent,
+        std::vector<image_level> &levels) const;
+
+    // Appends the buffered nodes of a level of an image to the file fd.
+    static void internal_flush_image(int fd, image_level &level);
+
     // Dumps a node and all of its children to the specified ostream.
     void internal_dump(std::ostream &os, const node_type *node, int level) const;
 
@@ -1166,6 +2265,12 @@ namespace atlasdb {
 
     empty_base_handle<internal_allocator_type, node_type*> root_;
 
+    // Set once a snapshot was taken, nodes may be shared with snapshots.
+    bool copy_on_write_;
+
+    // Bumped whenever a node leaves the tree, see generation().
+    uint64_t generation_;
+
   private:
 
     // A never instantiated helper function that returns big_ if we have a
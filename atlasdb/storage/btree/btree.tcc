@@ -47,6 +47,7 @@
 #include <cassert>
 #include <string>
 #include <functional>
+#include <memory>
 #include <type_traits>
 #include <ostream>
 
@@ -58,40 +59,114 @@ namespace atlasdb {
     template<typename P>
     inline void btree_node<P>::insert_value(int i, const value_type &x) {
       assert(i <= count());
-      value_init(count(), x);
-      for (int j = count(); j > i; --j) {
-        value_swap(j, this, j - 1);
+      if (kTrivialValues) {
+        std::memmove(static_cast<void*>(mutable_value(i + 1)), mutable_value(i),
+            (count() - i) * sizeof(mutable_value_type));
+        base().move_keys(i + 1, i, count() - i);
+        value_init(i, x);
+      }
+      else {
+        value_init(count(), x);
+        for (int j = count(); j > i; --j) {
+          value_swap(j, this, j - 1);
+        }
       }
       set_count(count() + 1);
+      if (kAbbreviated) {
+        for (int j = count() - 1; j > i; --j) {
+          set_abbrev(j, abbrev(j - 1));
+        }
+        update_abbrev(i);
+      }
 
       if (!leaf()) {
         ++i;
         for (int j = count(); j > i; --j) {
-          *mutable_child(j) = child(j - 1);
+          set_child_link(j, child(j - 1));
           child(j)->set_position(j);
+          set_child_count(j, child_count(j - 1));
         }
-        *mutable_child(i) = nullptr;
+        set_child_link(i, nullptr);
+        set_child_count(i, 0);
       }
     }
 
     template<typename P>
     inline void btree_node<P>::remove_value(int i) {
       if (!leaf()) {
-        assert(child(i + 1)->count() == 0);
+        // The child has been emptied by a merge, or released with its subtree.
+        assert(!child(i + 1) || child(i + 1)->count() == 0);
         for (int j = i + 1; j < count(); ++j) {
-          *mutable_child(j) = child(j + 1);
+          set_child_link(j, child(j + 1));
           child(j)->set_position(j);
+          set_child_count(j, child_count(j + 1));
         }
-        *mutable_child(count()) = nullptr;
+        set_child_link(count(), nullptr);
       }
 
       set_count(count() - 1);
+      if (kTrivialValues) {
+        value_destroy(i);
+        std::memmove(static_cast<void*>(mutable_value(i)), mutable_value(i + 1),
+            (count() - i) * sizeof(mutable_value_type));
+        base().move_keys(i, i + 1, count() - i);
+        return;
+      }
       for (; i < count(); ++i) {
         value_swap(i, this, i + 1);
+        set_abbrev(i, abbrev(i + 1));
       }
       value_destroy(i);
     }
 
+    template<typename P> template<typename InputIterator, typename Compare>
+    int btree_node<P>::merge_sorted(int i, InputIterator &b, InputIterator e, const key_type *upper, bool unique,
+        const Compare &comp) {
+      assert(leaf());
+      assert(i <= count());
+      // Move the values at positions >= i to the end of the node, the gap in
+      // front of them is filled with the merged values.
+      int n = count();
+      int room = max_count() - n;
+      for (int j = n; j < max_count(); ++j) {
+        value_init(j);
+      }
+      for (int j = n - 1; j >= i; --j) {
+        value_swap(j + room, this, j);
+      }
+
+      int w = i;
+      int r = i + room;
+      while (b != e && w < r) {
+        const key_type &k = params_type::key(*b);
+        if (upper && !btree_compare_keys(comp, k, *upper)) {
+          break;
+        }
+        if (r < max_count() && (unique ? btree_compare_keys(comp, key(r), k) : !btree_compare_keys(comp, k, key(r)))) {
+          value_swap(w++, this, r++);
+        }
+        else if (unique && ((r < max_count() && !btree_compare_keys(comp, k, key(r))) ||
+            (w > 0 && !btree_compare_keys(comp, key(w - 1), k)))) {
+          ++b;
+        }
+        else {
+          *mutable_value(w) = *b;
+          base().set_key(w++, k);
+          ++b;
+        }
+      }
+
+      while (r < max_count()) {
+        value_swap(w++, this, r++);
+      }
+      for (int j = w; j < max_count(); ++j) {
+        value_destroy(j);
+      }
+      set_count(w);
+      reset_abbrevs();
+      return w - n;
+    }
+
     template<typename P>
     void btree_node<P>::rebalance_right_to_left(btree_node *src, int to_move) {
       assert(parent() == src->parent());
@@ -100,6 +175,15 @@ namespace atlasdb {
       assert(to_move >= 1);
       assert(to_move <= src->count());
 
+      // The number of values moving from the subtree of src to the subtree of
+      // this node, for the counts in the parent.
+      size_type moved = to_move;
+      if (params_type::kRanked && !leaf()) {
+        for (int i = 0; i < to_move; ++i) {
+          moved += src->child_count(i);
+        }
+      }
+
       // Make room in the left node for the new values.
       for (int i = 0; i < to_move; ++i) {
         value_init(i + count());
@@ -128,17 +212,26 @@ namespace atlasdb {
         // Move the child pointers from the right to the left node.
         for (int i = 0; i < to_move; ++i) {
           set_child(1 + count() + i, src->child(i));
+          set_child_count(1 + count() + i, src->child_count(i));
         }
         for (int i = 0; i <= src->count() - to_move; ++i) {
           assert(i + to_move <= src->max_count());
           src->set_child(i, src->child(i + to_move));
-          *src->mutable_child(i + to_move) = nullptr;
+          src->set_child_count(i, src->child_count(i + to_move));
+          src->set_child_link(i + to_move, nullptr);
         }
       }
 
       // Fixup the counts on the src and dest nodes.
       set_count(count() + to_move);
       src->set_count(src->count() - to_move);
+      parent()->add_child_count(position(), moved);
+      parent()->add_child_count(src->position(), -moved);
+      if (kAbbreviated) {
+        reset_abbrevs();
+        src->reset_abbrevs();
+        parent()->update_abbrev(position());
+      }
     }
 
     template<typename P>
@@ -149,6 +242,15 @@ namespace atlasdb {
       assert(to_move >= 1);
       assert(to_move <= count());
 
+      // The number of values moving from the subtree of this node to the
+      // subtree of dest, for the counts in the parent.
+      size_type moved = to_move;
+      if (params_type::kRanked && !leaf()) {
+        for (int i = 1; i <= to_move; ++i) {
+          moved += child_count(count() - to_move + i);
+        }
+      }
+
       // Make room in the right node for the new values.
       for (int i = 0; i < to_move; ++i) {
         dest->value_init(i + dest->count());
@@ -173,17 +275,26 @@ namespace atlasdb {
         // Move the child pointers from the left to the right node.
         for (int i = dest->count(); i >= 0; --i) {
           dest->set_child(i + to_move, dest->child(i));
-          *dest->mutable_child(i) = nullptr;
+          dest->set_child_count(i + to_move, dest->child_count(i));
+          dest->set_child_link(i, nullptr);
         }
         for (int i = 1; i <= to_move; ++i) {
           dest->set_child(i - 1, child(count() - to_move + i));
-          *mutable_child(count() - to_move + i) = nullptr;
+          dest->set_child_count(i - 1, child_count(count() - to_move + i));
+          set_child_link(count() - to_move + i, nullptr);
         }
       }
 
       // Fixup the counts on the src and dest nodes.
       set_count(count() - to_move);
       dest->set_count(dest->count() + to_move);
+      parent()->add_child_count(position(), -moved);
+      parent()->add_child_count(dest->position(), moved);
+      if (kAbbreviated) {
+        reset_abbrevs();
+        dest->reset_abbrevs();
+        parent()->update_abbrev(position());
+      }
     }
 
     template<typename P>
@@ -224,9 +335,20 @@ namespace atlasdb {
         for (int i = 0; i <= dest->count(); ++i) {
           assert(child(count() + i + 1) != nullptr);
           dest->set_child(i, child(count() + i + 1));
-          *mutable_child(count() + i + 1) = nullptr;
+          dest->set_child_count(i, child_count(count() + i + 1));
+          set_child_link(count() + i + 1, nullptr);
         }
       }
+
+      if (params_type::kRanked) {
+        parent()->set_child_count(position(), subtree_count());
+        parent()->set_child_count(dest->position(), dest->subtree_count());
+      }
+      if (kAbbreviated) {
+        reset_abbrevs();
+        dest->reset_abbrevs();
+        parent()->update_abbrev(position());
+      }
     }
 
     template<typename P>
@@ -249,13 +371,18 @@ namespace atlasdb {
         // Move the child pointers from the right to the left node.
         for (int i = 0; i <= src->count(); ++i) {
           set_child(1 + count() + i, src->child(i));
-          *src->mutable_child(i) = nullptr;
+          set_child_count(1 + count() + i, src->child_count(i));
+          src->set_child_link(i, nullptr);
         }
       }
 
       // Fixup the counts on the src and dest nodes.
       set_count(1 + count() + src->count());
       src->set_count(0);
+      parent()->add_child_count(position(), 1 + parent()->child_count(src->position()));
+      if (kAbbreviated) {
+        reset_abbrevs();
+      }
 
       // Remove the value on the parent node.
       parent()->remove_value(position());
@@ -275,7 +402,13 @@ namespace atlasdb {
       int n = std::max(count(), x->count());
       for (int i = 0; i < n; ++i) {
         value_swap(i, x, i);
+        uint64_t a = abbrev(i);
+        set_abbrev(i, x->abbrev(i));
+        x->set_abbrev(i, a);
       }
+      size_t prefix = base().get_prefix();
+      base().set_prefix(x->base().get_prefix());
+      x->base().set_prefix(prefix);
       for (int i = count(); i < x->count(); ++i) {
         x->value_destroy(i);
       }
@@ -286,18 +419,146 @@ namespace atlasdb {
       if (!leaf()) {
         // Swap the child pointers.
         for (int i = 0; i <= n; ++i) {
-          btree_swap_helper(*mutable_child(i), *x->mutable_child(i));
+          btree_node *c = child(i);
+          set_child_link(i, x->child(i));
+          x->set_child_link(i, c);
+          size_type cc = child_count(i);
+          set_child_count(i, x->child_count(i));
+          x->set_child_count(i, cc);
         }
         for (int i = 0; i <= count(); ++i) {
-          x->child(i)->fields_.parent = x;
+          x->child(i)->set_parent(x);
         }
         for (int i = 0; i <= x->count(); ++i) {
-          child(i)->fields_.parent = this;
+          child(i)->set_parent(this);
         }
       }
 
       // Swap the counts.
-      btree_swap_helper(fields_.count, x->fields_.count);
+      btree_swap_helper(base().count, x->base().count);
+    }
+
+    template<typename P>
+    void btree_node<P>::clone(btree_node *src) {
+      assert(count() == 0);
+      assert(leaf() == src->leaf());
+      assert(max_count() >= src->count());
+
+      for (int i = 0; i < src->count(); ++i) {
+        value_init(i, src->value(i));
+        set_abbrev(i, src->abbrev(i));
+      }
+      set_count(src->count());
+      base().set_prefix(src->base().get_prefix());
+
+      if (!leaf()) {
+        for (int i = 0; i <= count(); ++i) {
+          src->child(i)->ref();
+          set_child(i, src->child(i));
+          set_child_count(i, src->child_count(i));
+        }
+      }
+    }
+
+    template<typename P>
+    void btree_node<P>::reset_abbrevs() {
+      if (!kAbbreviated) {
+        return;
+      }
+      base().set_prefix(count() == 0 ? 0 : btree_common_prefix(abbrev_key::data(key(0)), abbrev_key::size(key(0)),
+          abbrev_key::data(key(count() - 1)), abbrev_key::size(key(count() - 1))));
+      for (int i = 0; i < count(); ++i) {
+        set_abbrev(i, abbreviate(key(i)));
+      }
+    }
+
+    template<typename P>
+    void btree_node<P>::update_abbrev(int i) {
+      if (!kAbbreviated) {
+        return;
+      }
+      // The keys between the first and the last one share their prefix.
+      if (i == 0 || i == count() - 1) {
+        size_t prefix = btree_common_prefix(abbrev_key::data(key(0)), abbrev_key::size(key(0)),
+            abbrev_key::data(key(count() - 1)), abbrev_key::size(key(count() - 1)));
+        if (prefix != base().get_prefix()) {
+          reset_abbrevs();
+          return;
+        }
+      }
+      set_abbrev(i, abbreviate(key(i)));
+    }
+
+    template<typename P>
+    bool btree_node<P>::verify_abbrevs() const {
+      if (!kAbbreviated || count() == 0) {
+        return true;
+      }
+      size_t prefix = base().get_prefix();
+      for (int i = 0; i < count(); ++i) {
+        if (btree_common_prefix(abbrev_key::data(key(0)), abbrev_key::size(key(0)), abbrev_key::data(key(i)),
+            abbrev_key::size(key(i))) < prefix || abbrev(i) != abbreviate(key(i))) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    template<typename P>
+    bool btree_node<P>::verify_keys() const {
+      for (int i = 0; i < count(); ++i) {
+        if (std::memcmp(&key(i), &params_type::key(leaf_part().values[i]), sizeof(key_type)) != 0) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    template<typename P>
+    inline int btree_node<P>::abbrev_search(const key_type &k, bool upper) const {
+      const char *data = abbrev_key::data(k);
+      size_t size = abbrev_key::size(k);
+      size_t prefix = base().get_prefix();
+      if (count() == 0) {
+        return 0;
+      }
+
+      // Keys not starting with the shared prefix are less or greater than all
+      // of the keys of the node.
+      if (prefix > 0) {
+        int c = std::memcmp(data, abbrev_key::data(key(0)), std::min(size, prefix));
+        if (c < 0 || (c == 0 && size < prefix)) {
+          return 0;
+        }
+        if (c > 0) {
+          return count();
+        }
+      }
+
+      uint64_t a = size > prefix ? btree_abbreviate(data + prefix, size - prefix) : 0;
+      bool exact = false;
+      int s = 0, e = count();
+      while (s != e) {
+        int mid = (s + e) / 2;
+        int c;
+        if (abbrev(mid) != a) {
+          c = abbrev(mid) < a ? -1 : 1;
+        }
+        else {
+          const key_type &m = key(mid);
+          c = btree_bytes_compare(abbrev_key::data(m) + prefix, abbrev_key::size(m) - prefix, data + prefix,
+              size - prefix);
+        }
+        if (c < 0 || (c == 0 && upper)) {
+          s = mid + 1;
+        }
+        else {
+          exact = exact || c == 0;
+          e = mid;
+        }
+      }
+      // Like the other compare-to searches, flag an exact match.
+      return exact && params_type::is_key_compare_to::value ? s | kExactMatch : s;
     }
 
   ////
@@ -368,16 +629,320 @@ namespace atlasdb {
       }
     }
 
+  ////
+  // btree_snapshot methods
+    template<typename P>
+    void btree_snapshot<P>::const_iterator::increment() {
+      frame &f = top();
+      if (f.node->leaf()) {
+        ++f.position;
+        skip_end();
+        return;
+      }
+
+      // The next value is the first one in the subtree to the right.
+      const node_type *node = f.node->child(++f.position);
+      push(node, 0);
+      while (!node->leaf()) {
+        node = node->child(0);
+        push(node, 0);
+      }
+
+      // Prefetch the leaves following the one entered, snapshots are mostly
+      // used for full scans. Parent pointers of shared nodes can't be trusted,
+      // so use the parent on the path.
+      const frame &parent = path_[depth_ - 2];
+      int last = std::min<int>(parent.node->count(), parent.position + node_type::kPrefetchLeaves);
+      for (int i = parent.position + 1; i <= last; ++i) {
+        parent.node->child(i)->prefetch_leaf();
+      }
+    }
+
+    template<typename P>
+    void btree_snapshot<P>::const_iterator::decrement() {
+      frame &f = top();
+      if (f.node->leaf()) {
+        if (--f.position >= 0) {
+          return;
+        }
+        // Climb up to the first ancestor which has a value to the left of the
+        // subtree we came from.
+        while (depth_ > 1) {
+          --depth_;
+          if (top().position > 0) {
+            --top().position;
+            return;
+          }
+        }
+        return;
+      }
+
+      // The previous value is the last one in the subtree to the left.
+      const node_type *node = f.node->child(f.position);
+      push(node, node->count());
+      while (!node->leaf()) {
+        node = node->child(node->count());
+        push(node, node->count());
+      }
+      --top().position;
+    }
+
+    template<typename P>
+    void btree_snapshot<P>::const_iterator::skip_end() {
+      while (depth_ > 1 && top().position == top().node->count()) {
+        --depth_;
+      }
+    }
+
+    template<typename P>
+    btree_snapshot<P>::btree_snapshot(node_type *root, size_type size, const key_compare &comp,
+        const internal_allocator_type &alloc) :
+        comp_(comp), alloc_(alloc), root_(root), size_(size) {
+      if (root_) {
+        root_->ref();
+      }
+    }
+
+    template<typename P>
+    btree_snapshot<P>::btree_snapshot(const self_type &x) :
+        comp_(x.comp_), alloc_(x.alloc_), root_(x.root_), size_(x.size_) {
+      if (root_) {
+        root_->ref();
+      }
+    }
+
+    template<typename P>
+    btree_snapshot<P>::~btree_snapshot() {
+      if (root_) {
+        tree_type::release_node(&alloc_, root_, true);
+      }
+    }
+
+    template<typename P>
+    void btree_snapshot<P>::swap(self_type &x) {
+      std::swap(comp_, x.comp_);
+      std::swap(alloc_, x.alloc_);
+      std::swap(root_, x.root_);
+      std::swap(size_, x.size_);
+    }
+
+    template<typename P>
+    typename btree_snapshot<P>::const_iterator btree_snapshot<P>::begin() const {
+      const_iterator iter;
+      if (root_) {
+        const node_type *node = root_;
+        iter.push(node, 0);
+        while (!node->leaf()) {
+          node = node->child(0);
+          iter.push(node, 0);
+        }
+      }
+      return iter;
+    }
+
+    template<typename P>
+    typename btree_snapshot<P>::const_iterator btree_snapshot<P>::end() const {
+      const_iterator iter;
+      if (root_) {
+        iter.push(root_, root_->count());
+      }
+      return iter;
+    }
+
+    template<typename P>
+    typename btree_snapshot<P>::const_iterator btree_snapshot<P>::lower_bound(const key_type &key) const {
+      const_iterator iter;
+      for (const node_type *node = root_; node; node = node->leaf() ? nullptr : node->child(iter.top().position)) {
+        iter.push(node, node->lower_bound(key, comp_) & kMatchMask);
+      }
+      if (root_) {
+        iter.skip_end();
+      }
+      return iter;
+    }
+
+    template<typename P>
+    typename btree_snapshot<P>::const_iterator btree_snapshot<P>::upper_bound(const key_type &key) const {
+      const_iterator iter;
+      for (const node_type *node = root_; node; node = node->leaf() ? nullptr : node->child(iter.top().position)) {
+        iter.push(node, node->upper_bound(key, comp_));
+      }
+      if (root_) {
+        iter.skip_end();
+      }
+      return iter;
+    }
+
+    template<typename P> template<typename OutputIterator>
+    OutputIterator btree_snapshot<P>::split_keys(size_type n, OutputIterator out) const {
+      if (!root_ || n < 2) {
+        return out;
+      }
+      std::vector<const node_type*> level(1, root_);
+      size_type count = root_->count();
+      while (count + 1 < n && !level.front()->leaf()) {
+        std::vector<const node_type*> below;
+        count = 0;
+        for (const node_type *node : level) {
+          for (int i = 0; i <= node->count(); ++i) {
+            below.push_back(node->child(i));
+            count += below.back()->count();
+          }
+        }
+        level.swap(below);
+      }
+
+      std::vector<const key_type*> keys;
+      keys.reserve(count);
+      for (const node_type *node : level) {
+        for (int i = 0; i < node->count(); ++i) {
+          keys.push_back(&node->key(i));
+        }
+      }
+      size_type m = keys.size();
+      if (m < n) {
+        for (const key_type *key : keys) {
+          *out++ = *key;
+        }
+        return out;
+      }
+      for (size_type i = 1; i < n; ++i) {
+        *out++ = *keys[i * m / n];
+      }
+      return out;
+    }
+
+    template<typename P>
+    typename btree_snapshot<P>::const_iterator btree_snapshot<P>::find(const key_type &key) const {
+      const_iterator iter = lower_bound(key);
+      if (iter != end() && !btree_compare_keys(comp_, key, iter.key())) {
+        return iter;
+      }
+      return end();
+    }
+
+    ////
+    // btree_verifier methods
+
+    template<typename P>
+    bool btree_verifier<P>::step(size_type max_nodes, clock_type::time_point deadline) {
+      if (!started_) {
+        started_ = true;
+        const node_type *root = snapshot_.root_;
+        if (root) {
+          if (!check(root, 0, nullptr, nullptr)) {
+            return true;
+          }
+          push(root, nullptr, nullptr);
+        }
+      }
+
+      for (size_type n = 0; depth_ > 0 && error_.empty(); ) {
+        frame &f = path_[depth_ - 1];
+        if (f.node->leaf() || f.next > f.node->count()) {
+          // Done with the subtree of the node.
+          size_type values = f.values;
+          --depth_;
+          if (depth_ > 0) {
+            frame &parent = path_[depth_ - 1];
+            if (P::kRanked && parent.node->child_count(parent.next - 1) != values) {
+              fail("subtree count mismatch");
+            }
+            parent.values += values;
+          }
+          else if (values != snapshot_.size()) {
+            fail("size mismatch");
+          }
+          continue;
+        }
+
+        if (n == max_nodes || (n % kClockInterval == 0 && n > 0 && clock_type::now() >= deadline)) {
+          break;
+        }
+        int i = f.next++;
+        const key_type *lo = i == 0 ? f.lo : &f.node->key(i - 1);
+        const key_type *hi = i == f.node->count() ? f.hi : &f.node->key(i);
+        const node_type *child = f.node->child(i);
+        ++n;
+        if (depth_ == kMaxHeight || !check(child, depth_, lo, hi)) {
+          if (error_.empty()) {
+            fail("tree too high");
+          }
+          break;
+        }
+        push(child, lo, hi);
+      }
+
+      if (done()) {
+        size_t reclaimable = 0;
+        for (const auto &level : fragmentation_.levels) {
+          size_t needed = std::max<size_t>(1, (level.values + node_type::kNodeValues - 1) / node_type::kNodeValues);
+          if (level.nodes > needed) {
+            reclaimable += (level.nodes - needed) * (level.bytes / level.nodes);
+          }
+        }
+        fragmentation_.reclaimable_bytes = reclaimable;
+      }
+      return done();
+    }
+
+    template<typename P>
+    bool btree_verifier<P>::check(const node_type *node, int level, const key_type *lo, const key_type *hi) {
+      ++nodes_;
+      if (!node) {
+        return fail("null child");
+      }
+      if (node->count() <= 0 || node->count() > node->max_count()) {
+        return fail("bad node count");
+      }
+      if (lo && compare_keys(node->key(0), *lo)) {
+        return fail("key below the range of the node");
+      }
+      if (hi && compare_keys(*hi, node->key(node->count() - 1))) {
+        return fail("key above the range of the node");
+      }
+      for (int i = 1; i < node->count(); ++i) {
+        if (compare_keys(node->key(i), node->key(i - 1))) {
+          return fail("keys out of order");
+        }
+      }
+      if (!node->verify_abbrevs() || (node_type::kSplitKeys && !node->verify_keys())) {
+        return fail("stale key copies");
+      }
+      if (node->leaf()) {
+        if (leaf_level_ < 0) {
+          leaf_level_ = level;
+        }
+        else if (leaf_level_ != level) {
+          return fail("leaves on different levels");
+        }
+      }
+
+      if (fragmentation_.levels.size() <= size_t(level)) {
+        fragmentation_.levels.resize(level + 1, btree_level_fill());
+      }
+      btree_level_fill &fill = fragmentation_.levels[level];
+      ++fill.nodes;
+      fill.values += node->count();
+      fill.bytes += node->leaf() ? sizeof(base_fields) + node->max_count() * sizeof(value_type)
+          : level == 0 ? sizeof(root_fields) : sizeof(internal_fields);
+      ++fill.histogram[std::min<int>(btree_level_fill::kBuckets - 1,
+          node->count() * btree_level_fill::kBuckets / node->max_count())];
+      return true;
+    }
+
     ////
     // btree methods
       template<typename P>
       btree<P>::btree(const key_compare &comp, const allocator_type &alloc) :
-          key_compare(comp), root_(alloc, nullptr) {
+          key_compare(comp), root_(alloc, nullptr), copy_on_write_(false), generation_(0) {
       }
 
       template<typename P>
       btree<P>::btree(const self_type &x) :
-          key_compare(x.key_comp()), root_(x.internal_allocator(), nullptr) {
+          key_compare(x.key_comp()),
+          root_(std::allocator_traits<internal_allocator_type>::select_on_container_copy_construction(x.internal_allocator()), nullptr),
+          copy_on_write_(false), generation_(0) {
         assign(x);
       }
 
@@ -481,12 +1046,195 @@ namespace atlasdb {
         }
       }
 
+      template<typename P> template<typename InputIterator>
+      typename btree<P>::size_type btree<P>::internal_insert_sorted_batch(InputIterator b, InputIterator e, bool unique) {
+        size_type inserted = 0;
+        // The leaf of the previous insertion.
+        node_type *finger = nullptr;
+        while (b != e) {
+          if (empty()) {
+            if (unique) {
+              insert_unique(*b);
+            }
+            else {
+              insert_multi(*b);
+            }
+            ++b;
+            ++inserted;
+            continue;
+          }
+
+          // Climb from the finger as long as key is beyond the subtree of the
+          // node, keys only grow. upper bounds the keys of the subtree.
+          const key_type &key = params_type::key(*b);
+          node_type *node = finger ? finger : root();
+          const key_type *upper = nullptr;
+          while (node != root()) {
+            node_type *parent = node->parent();
+            int pos = node->position();
+            if (pos < parent->count() &&
+                (unique ? !compare_keys(parent->key(pos), key) : compare_keys(key, parent->key(pos)))) {
+              upper = &parent->key(pos);
+              break;
+            }
+            node = parent;
+          }
+
+          // Descend to the leaf of key. The nodes on the path to the finger are
+          // not shared with snapshots, the others are unshared on the way down.
+          node = unshare_node(node);
+          int pos;
+          for (;;) {
+            pos = unique ? node->lower_bound(key, key_comp()) & kMatchMask : node->upper_bound(key, key_comp());
+            if (node->leaf()) {
+              break;
+            }
+            if (pos < node->count()) {
+              upper = &node->key(pos);
+            }
+            node = unshare_node(node->child(pos));
+          }
+          finger = node;
+
+          if (unique && (pos < node->count() ? !compare_keys(key, node->key(pos)) : upper && !compare_keys(key, *upper))) {
+            // The key already exists in the tree, do nothing.
+            ++b;
+            continue;
+          }
+          if (node->count() == node->max_count()) {
+            // Make room in the leaf for the values to come.
+            finger = internal_insert(iterator(node, pos), *b).node;
+            ++b;
+            ++inserted;
+            continue;
+          }
+
+          int n = node->merge_sorted(pos, b, e, upper, unique, key_comp());
+          if (!root()->leaf()) {
+            *mutable_size() += n;
+          }
+          internal_adjust_counts(node, n);
+          inserted += n;
+        }
+        return inserted;
+      }
+
+      template<typename P> template<typename InputIterator>
+      void btree<P>::internal_bulk_load(InputIterator b, InputIterator e, double fill, bool unique) {
+        if (!empty()) {
+          internal_insert_sorted_batch(b, e, unique);
+          return;
+        }
+
+        // Nodes need at least two values so that the last node of each level can
+        // always be rebalanced with its left sibling.
+        const int target = std::max(2, std::min<int>(kNodeValues, static_cast<int>(fill * kNodeValues)));
+
+        // The open (rightmost) node of each level, leaves first.
+        std::vector<node_type*> levels;
+        node_type *leftmost = nullptr;
+        const key_type *last = nullptr;
+        size_type size = 0;
+        for (; b != e; ++b) {
+          const key_type &key = params_type::key(*b);
+          if (unique && last && !compare_keys(*last, key)) {
+            continue;
+          }
+          if (levels.empty()) {
+            // The leftmost leaf is allocated as a root leaf, which is what it
+            // stays if the whole input fits in it.
+            leftmost = new_leaf_root_node(kNodeValues);
+            levels.push_back(leftmost);
+          }
+
+          node_type *leaf = levels[0];
+          if (leaf->count() < target) {
+            leaf->insert_value(leaf->count(), *b);
+            last = &leaf->key(leaf->count() - 1);
+          }
+          else {
+            // The leaf is full, the value delimits it from the next leaf.
+            node_type *parent = internal_bulk_append(levels, 1, *b, target, &last);
+            levels[0] = new_leaf_node(parent);
+            parent->set_child(parent->count(), levels[0]);
+          }
+          ++size;
+        }
+
+        if (levels.empty()) {
+          return;
+        }
+
+        if (params_type::kRanked && levels.size() > 1) {
+          internal_count_subtrees(levels.back());
+        }
+
+        // Only the last node of each level can be underfull. Fill it up from its
+        // left sibling, top down so that every such node has a left sibling.
+        for (int level = static_cast<int>(levels.size()) - 2; level >= 0; --level) {
+          node_type *node = levels[level];
+          if (node->count() >= kMinNodeValues) {
+            continue;
+          }
+          assert(node->position() > 0);
+          node_type *left = node->parent()->child(node->position() - 1);
+          int to_move = (left->count() - node->count()) / 2;
+          if (to_move > 0) {
+            left->rebalance_left_to_right(node, to_move);
+          }
+        }
+
+        if (levels.size() == 1) {
+          *mutable_root() = levels[0];
+          return;
+        }
+
+        // The root node is special and holds the size of the tree and a pointer to
+        // the rightmost node, so move the values of the top node into a new root.
+        node_type *top = levels.back();
+        root_fields *p = reinterpret_cast<root_fields*>(mutable_internal_allocator()->allocate(sizeof(root_fields)));
+        node_type *root = node_type::init_root(p, leftmost);
+        root->set_child(0, top);
+        root->swap(top);
+        delete_internal_node(top);
+        *mutable_root() = root;
+        set_rightmost(levels[0]);
+        *mutable_size() = size;
+      }
+
+      template<typename P>
+      typename btree<P>::node_type* btree<P>::internal_bulk_append(std::vector<node_type*> &levels, int level,
+          const value_type &v, int target, const key_type **last) {
+        if (static_cast<int>(levels.size()) == level) {
+          // Grow the tree by one level above the full top node.
+          node_type *node = new_internal_node(nullptr);
+          node->set_child(0, levels[level - 1]);
+          levels.push_back(node);
+        }
+
+        node_type *node = levels[level];
+        if (node->count() < target) {
+          node->insert_value(node->count(), v);
+          *last = &node->key(node->count() - 1);
+          return node;
+        }
+
+        // The node is full, the value delimits it from the next node of this
+        // level, which starts out without values and with a single child.
+        node_type *parent = internal_bulk_append(levels, level + 1, v, target, last);
+        levels[level] = new_internal_node(parent);
+        parent->set_child(parent->count(), levels[level]);
+        return levels[level];
+      }
+
       template<typename P>
       void btree<P>::assign(const self_type &x) {
         clear();
 
         *mutable_key_comp() = x.key_comp();
-        *mutable_internal_allocator() = x.internal_allocator();
+        if (std::allocator_traits<internal_allocator_type>::propagate_on_container_copy_assignment::value) {
+          *mutable_internal_allocator() = x.internal_allocator();
+        }
 
         // Assignment can avoid key comparisons because we know the order of the
         // values is the same order we'll store them in.
@@ -504,14 +1252,18 @@ namespace atlasdb {
 
       template<typename P>
       typename btree<P>::iterator btree<P>::erase(iterator iter) {
+        iter.node = unshare_path(iter.node);
+
         bool internal_delete = false;
         if (!iter.node->leaf()) {
           // Deletion of a value on an internal node. Swap the key with the largest
           // value of our left child. This is easy, we just decrement iter.
           iterator tmp_iter(iter--);
+          iter.node = unshare_path(iter.node);
           assert(iter.node->leaf());
           assert(!compare_keys(tmp_iter.key(), iter.key()));
           iter.node->value_swap(iter.position, tmp_iter.node, tmp_iter.position);
+          tmp_iter.node->update_abbrev(tmp_iter.position);
           internal_delete = true;
           --*mutable_size();
         }
@@ -521,6 +1273,7 @@ namespace atlasdb {
 
         // Delete the key from the leaf.
         iter.node->remove_value(iter.position);
+        internal_adjust_counts(iter.node, -1);
 
         // We want to return the next value after the one we just erased. If we
         // erased from an internal node (internal_delete == true), then the next
@@ -567,6 +1320,22 @@ namespace atlasdb {
 
       template<typename P>
       int btree<P>::erase(iterator begin, iterator end) {
+        if (begin == end) {
+          return 0;
+        }
+        // The range covers whole keys unless it starts or ends among the values
+        // of a key, which only happens in a multi container.
+        if (internal_end(internal_lower_bound(begin.key(), iterator(root(), 0))) == begin &&
+            (end == this->end() || internal_end(internal_lower_bound(end.key(), iterator(root(), 0))) == end)) {
+          // Values move while the range is erased, copy the keys first.
+          key_type lower(begin.key());
+          if (end == this->end()) {
+            return internal_erase_range(lower, nullptr);
+          }
+          key_type upper(end.key());
+          return internal_erase_range(lower, &upper);
+        }
+
         int count = distance(begin, end);
         for (int i = 0; i < count; i++) {
           begin = erase(begin);
@@ -599,16 +1368,129 @@ namespace atlasdb {
 
       template<typename P>
       void btree<P>::clear() {
+        typedef btree_allocator_release<internal_allocator_type> allocator_release;
+        bool release = allocator_release::releasable(internal_allocator());
+
         if (root() != nullptr) {
-          internal_clear(root());
+          // If the allocator frees the nodes for us there is no need to walk the
+          // tree, unless the values have destructors to run.
+          if (!release || !std::is_trivially_destructible<typename node_type::mutable_value_type>::value) {
+            internal_clear(root());
+          }
         }
         *mutable_root() = nullptr;
+        copy_on_write_ = false;
+        ++generation_;
+
+        if (release) {
+          allocator_release::release(*mutable_internal_allocator());
+        }
       }
 
       template<typename P>
       void btree<P>::swap(self_type &x) {
         std::swap(static_cast<key_compare&>(*this), static_cast<key_compare&>(x));
         std::swap(root_, x.root_);
+        std::swap(copy_on_write_, x.copy_on_write_);
+        generation_ = x.generation_ = std::max(generation_, x.generation_) + 1;
+      }
+
+      template<typename P>
+      typename btree<P>::snapshot_type btree<P>::snapshot() {
+        copy_on_write_ = true;
+        return snapshot_type(root(), size(), key_comp(), internal_allocator());
+      }
+
+      template<typename P>
+      void btree<P>::write_image(const std::string &path) const {
+        static_assert(std::is_trivially_copyable<key_type>::value
+            && std::is_trivially_copyable<data_type>::value,
+            "btree images need trivially copyable values");
+
+        btree_image_header h;
+        std::memset(&h, 0, sizeof(h));
+        std::memcpy(h.magic, btree_image_header::magic_string(), sizeof(h.magic));
+        h.version = btree_image_header::kVersion;
+        h.node_values = kNodeValues;
+        h.value_size = sizeof(value_type);
+        h.leaf_size = sizeof(leaf_fields);
+        h.internal_size = sizeof(internal_fields);
+        h.root_size = sizeof(root_fields);
+        h.size = size();
+
+        // The nodes are laid out level by level, so the offset of every node
+        // follows from the number of nodes on each level, and the nodes of a
+        // level are written in the order of a depth first walk.
+        std::vector<image_level> levels(height());
+        uint64_t offset = btree_image_header::kSize;
+        if (root()) {
+          levels[0].nodes = 1;
+          internal_count_image(root(), 0, levels);
+          for (size_t i = 0; i < levels.size(); ++i) {
+            image_level &level = levels[i];
+            level.offset = offset;
+            level.node_size = i == 0 ? size_t(kImageRootSize)
+                : i + 1 == levels.size() ? size_t(kImageLeafSize) : size_t(kImageInternalSize);
+            level.written = 0;
+            level.buffer.reserve(kImageBufferNodes * level.node_size);
+            offset += level.nodes * level.node_size;
+          }
+          h.root = levels[0].offset;
+          h.leaves = levels.back().offset;
+        }
+        else {
+          h.leaves = offset;
+        }
+        h.bytes = offset;
+
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+          throw std::system_error(errno, std::generic_category(), path);
+        }
+        try {
+          std::vector<char> page(btree_image_header::kSize);
+          std::memcpy(&page[0], &h, sizeof(h));
+          if (::pwrite(fd, &page[0], page.size(), 0) != ssize_t(page.size())) {
+            throw std::system_error(errno, std::generic_category(), path);
+          }
+          if (root()) {
+            internal_write_image(fd, root(), 0, 0, levels);
+            for (auto &level : levels) {
+              internal_flush_image(fd, level);
+            }
+          }
+          if (::fsync(fd) != 0) {
+            throw std::system_error(errno, std::generic_category(), path);
+          }
+        }
+        catch (const std::system_error &e) {
+          ::close(fd);
+          throw std::system_error(e.code(), path);
+        }
+        ::close(fd);
+      }
+
+      template<typename P>
+      void btree<P>::attach_image(btree_image &image) {
+        static_assert(std::is_trivially_copyable<key_type>::value
+            && std::is_trivially_copyable<data_type>::value,
+            "btree images need trivially copyable values");
+
+        const btree_image_header &h = image.header();
+        if (h.node_values != kNodeValues || h.value_size != sizeof(value_type) || h.leaf_size != sizeof(leaf_fields)
+            || h.internal_size != sizeof(internal_fields) || h.root_size != sizeof(root_fields)) {
+          throw std::runtime_error("btree image of another btree type");
+        }
+
+        clear();
+        if (!h.root) {
+          return;
+        }
+        // The node links are relative, nothing is read before it is used.
+        *mutable_root() = reinterpret_cast<node_type*>(image.data() + h.root);
+        // The nodes of the image are pinned, so they are copied before being
+        // modified just like the nodes shared with a snapshot.
+        copy_on_write_ = true;
       }
 
       template<typename P>
@@ -647,6 +1529,7 @@ namespace atlasdb {
               to_move = std::max(1, to_move);
 
               if (((insert_position - to_move) >= 0) || ((left->count() + to_move) < left->max_count())) {
+                left = unshare_node(left);
                 left->rebalance_right_to_left(node, to_move);
 
                 assert(node->max_count() - node->count() == to_move);
@@ -673,6 +1556,7 @@ namespace atlasdb {
               to_move = std::max(1, to_move);
 
               if ((insert_position <= (node->count() - to_move)) || ((right->count() + to_move) < right->max_count())) {
+                right = unshare_node(right);
                 node->rebalance_left_to_right(right, to_move);
 
                 if (insert_position > node->count()) {
@@ -701,7 +1585,7 @@ namespace atlasdb {
             parent = new_internal_root_node();
             parent->set_child(0, root());
             *mutable_root() = parent;
-            assert(*mutable_rightmost() == parent->child(0));
+            assert(rightmost() == parent->child(0));
           }
           else {
             // The root node is an internal node. We do not want to create a new root
@@ -721,7 +1605,7 @@ namespace atlasdb {
           split_node = new_leaf_node(parent);
           node->split(split_node, insert_position);
           if (rightmost() == node) {
-            *mutable_rightmost() = split_node;
+            set_rightmost(split_node);
           }
         }
         else {
@@ -740,7 +1624,7 @@ namespace atlasdb {
         left->merge(right);
         if (right->leaf()) {
           if (rightmost() == right) {
-            *mutable_rightmost() = left;
+            set_rightmost(left);
           }
           delete_leaf_node(right);
         }
@@ -756,6 +1640,7 @@ namespace atlasdb {
           // Try merging with our left sibling.
           node_type *left = parent->child(iter->node->position() - 1);
           if ((1 + left->count() + iter->node->count()) <= left->max_count()) {
+            left = unshare_node(left);
             iter->position += 1 + left->count();
             merge_nodes(left, iter->node);
             iter->node = left;
@@ -766,6 +1651,7 @@ namespace atlasdb {
           // Try merging with our right sibling.
           node_type *right = parent->child(iter->node->position() + 1);
           if ((1 + iter->node->count() + right->count()) <= right->max_count()) {
+            right = unshare_node(right);
             merge_nodes(iter->node, right);
             return true;
           }
@@ -776,6 +1662,7 @@ namespace atlasdb {
           if ((right->count() > kMinNodeValues) && ((iter->node->count() == 0) || (iter->position > 0))) {
             int to_move = (right->count() - iter->node->count()) / 2;
             to_move = std::min(to_move, right->count() - 1);
+            right = unshare_node(right);
             iter->node->rebalance_right_to_left(right, to_move);
             return false;
           }
@@ -789,6 +1676,7 @@ namespace atlasdb {
           if ((left->count() > kMinNodeValues) && ((iter->node->count() == 0) || (iter->position < iter->node->count()))) {
             int to_move = (left->count() - iter->node->count()) / 2;
             to_move = std::min(to_move, left->count() - 1);
+            left = unshare_node(left);
             left->rebalance_left_to_right(iter->node, to_move);
             iter->position += to_move;
             return false;
@@ -820,6 +1708,7 @@ namespace atlasdb {
             // The child is an internal node. We want to keep the existing root node
             // so we move all of the values from the child node into the existing
             // (empty) root node.
+            child = unshare_node(child);
             child->swap(root());
             delete_internal_node(child);
           }
@@ -846,6 +1735,7 @@ namespace atlasdb {
           --iter;
           ++iter.position;
         }
+        iter.node = unshare_path(iter.node);
         if (iter.node->count() == iter.node->max_count()) {
           // Make room in the leaf for the new item.
           if (iter.node->max_count() < kNodeValues) {
@@ -866,6 +1756,7 @@ namespace atlasdb {
           ++*mutable_size();
         }
         iter.node->insert_value(iter.position, v);
+        internal_adjust_counts(iter.node, 1);
         return iter;
       }
 
@@ -902,8 +1793,239 @@ namespace atlasdb {
         return std::make_pair(iter, -kExactMatch);
       }
 
+      template<typename P> template<typename ForwardIterator, typename OutputIterator>
+      OutputIterator btree<P>::find_batch(ForwardIterator b, ForwardIterator e, OutputIterator out) const {
+        std::vector<const key_type*> keys;
+        for (; b != e; ++b) {
+          keys.push_back(&*b);
+        }
+        const int n = static_cast<int>(keys.size());
+        std::vector<const_iterator> found(n, end());
+        if (empty()) {
+          return std::copy(found.begin(), found.end(), out);
+        }
+
+        // Probes in key order walk the tree from left to right, so consecutive
+        // probes share most of their paths and often their leaf.
+        std::vector<int> order(n);
+        for (int i = 0; i < n; ++i) {
+          order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&](int x, int y) {
+          return compare_keys(*keys[x], *keys[y]);
+        });
+
+        const node_type *last_leaf = nullptr;
+        for (int g = 0; g < n; g += kFindBatchGroup) {
+          const node_type *nodes[kFindBatchGroup];
+          int probes[kFindBatchGroup];
+          int m = 0;
+          for (int i = g; i < std::min<int>(n, g + kFindBatchGroup); ++i) {
+            const key_type &key = *keys[order[i]];
+            // Inside the key range of the last leaf, the first value not less
+            // than key can only be in that leaf. Equal to its first key, there
+            // may be duplicates further left.
+            if (last_leaf && compare_keys(last_leaf->key(0), key)
+                && !compare_keys(last_leaf->key(last_leaf->count() - 1), key)) {
+              int position = last_leaf->lower_bound(key, key_comp()) & kMatchMask;
+              if (!compare_keys(key, last_leaf->key(position))) {
+                found[order[i]] = const_iterator(last_leaf, position);
+              }
+              continue;
+            }
+            nodes[m] = root();
+            probes[m++] = order[i];
+          }
+          if (m == 0) {
+            continue;
+          }
+
+          // All of the leaves are at the same depth.
+          while (!nodes[0]->leaf()) {
+            for (int j = 0; j < m; ++j) {
+              const node_type *node = nodes[j];
+              nodes[j] = node->child(node->lower_bound(*keys[probes[j]], key_comp()) & kMatchMask);
+              nodes[j]->prefetch_leaf();
+            }
+          }
+
+          for (int j = 0; j < m; ++j) {
+            const key_type &key = *keys[probes[j]];
+            const_iterator iter = internal_last(
+                const_iterator(nodes[j], nodes[j]->lower_bound(key, key_comp()) & kMatchMask));
+            if (iter.node && !compare_keys(key, iter.key())) {
+              found[probes[j]] = iter;
+            }
+          }
+          if (nodes[m - 1]->count() > 0) {
+            last_leaf = nodes[m - 1];
+          }
+        }
+        return std::copy(found.begin(), found.end(), out);
+      }
+
+      template<typename P>
+      typename btree<P>::size_type btree<P>::rank(const_iterator iter) const {
+        static_assert(params_type::kRanked, "rank_requires_btree_ranked_params");
+        if (!iter.node) {
+          return 0;
+        }
+
+        // Count the values and subtrees left of iter in its node, then the ones
+        // left of the node in each of its ancestors.
+        const node_type *node = iter.node;
+        size_type n = iter.position;
+        if (!node->leaf()) {
+          for (int i = 0; i <= iter.position; ++i) {
+            n += node->child_count(i);
+          }
+        }
+        for (; !node->is_root(); node = node->parent()) {
+          n += node->position();
+          for (int i = 0; i < node->position(); ++i) {
+            n += node->parent()->child_count(i);
+          }
+        }
+        return n;
+      }
+
+      template<typename P>
+      typename btree<P>::size_type btree<P>::internal_erase_range(const key_type &lower, const key_type *upper) {
+        if (root() == nullptr) {
+          return 0;
+        }
+        size_type erased = size();
+        if (!compare_keys(begin().key(), lower) && internal_below(root(), upper)) {
+          // The range covers the whole tree.
+          clear();
+          return erased;
+        }
+
+        while (root() != nullptr) {
+          // Look for the topmost node on the path to lower which holds values
+          // of the range with a whole subtree in between or after them. A
+          // single value of the range above that node is remembered, the
+          // values of the subtree to its left are then all out of the range.
+          node_type *node = root();
+          iterator single(nullptr, 0);
+          int i, j;
+          for (;;) {
+            i = node->lower_bound(lower, key_comp()) & kMatchMask;
+            j = upper ? node->lower_bound(*upper, key_comp()) & kMatchMask : node->count();
+            if (node->leaf() || j - i > 1 || (j - i == 1 && internal_below(node->child(j), upper))) {
+              break;
+            }
+            if (j - i == 1) {
+              single = iterator(node, i);
+            }
+            node = node->child(i);
+          }
+          if (i == j) {
+            if (!single.node) {
+              break;
+            }
+            // The predecessor of the value, which replaces it, is out of the range.
+            erase(single);
+            continue;
+          }
+
+          node = unshare_path(node);
+          size_type n = 0;
+          if (node->leaf()) {
+            n = j - i;
+            for (int k = i; k < j; ++k) {
+              node->remove_value(i);
+            }
+          }
+          else {
+            // Release the subtrees between the values of the range, keeping
+            // the last value of the range in front of a subtree only partly
+            // covered by the range.
+            int last = internal_below(node->child(j), upper) ? j : j - 1;
+            bool release_rightmost = last == node->count() && internal_last_leaf(node->child(last)) == rightmost();
+            for (int k = i; k < last; ++k) {
+              node_type *child = node->child(i + 1);
+              n += 1 + internal_subtree_size(child);
+              ++generation_;
+              release_node(mutable_internal_allocator(), child, false);
+              node->set_child_link(i + 1, nullptr);
+              node->remove_value(i);
+            }
+            if (release_rightmost) {
+              set_rightmost(internal_last_leaf(node->child(node->count())));
+            }
+          }
+
+          if (!root()->leaf()) {
+            *mutable_size() -= n;
+          }
+          internal_adjust_counts(node, -n);
+          internal_rebalance(iterator(node, i));
+        }
+        return erased - size();
+      }
+
+      template<typename P>
+      void btree<P>::internal_rebalance(iterator iter) {
+        for (;;) {
+          if (iter.node == root()) {
+            try_shrink();
+            break;
+          }
+          if (iter.node->count() >= kMinNodeValues) {
+            break;
+          }
+          if (!try_merge_or_rebalance(&iter)) {
+            break;
+          }
+          iter.node = iter.node->parent();
+        }
+      }
+
+      template<typename P>
+      typename btree<P>::size_type btree<P>::internal_subtree_size(const node_type *node) {
+        if (params_type::kRanked || node->leaf()) {
+          return node->subtree_count();
+        }
+        size_type n = node->count();
+        for (int i = 0; i <= node->count(); ++i) {
+          n += internal_subtree_size(node->child(i));
+        }
+        return n;
+      }
+
+      template<typename P>
+      typename btree<P>::size_type btree<P>::internal_count_subtrees(node_type *node) {
+        if (!node->leaf()) {
+          for (int i = 0; i <= node->count(); ++i) {
+            node->set_child_count(i, internal_count_subtrees(node->child(i)));
+          }
+        }
+        return node->subtree_count();
+      }
+
       template<typename P> template<typename IterType>
-      IterType btree<P>::internal_lower_bound(const key_type &key, IterType iter) const {
+      IterType btree<P>::internal_select(size_type k, IterType iter) const {
+        static_assert(params_type::kRanked, "select_requires_btree_ranked_params");
+        while (!iter.node->leaf()) {
+          // Skip the subtrees and values left of the k-th value.
+          int i = 0;
+          for (; k >= iter.node->child_count(i); ++i) {
+            k -= iter.node->child_count(i);
+            if (k == 0) {
+              iter.position = i;
+              return iter;
+            }
+            --k;
+          }
+          iter.node = iter.node->child(i);
+        }
+        iter.position = k;
+        return iter;
+      }
+
+      template<typename P> template<typename K, typename IterType>
+      IterType btree<P>::internal_lower_bound(const K &key, IterType iter) const {
         if (iter.node) {
           for (;;) {
             iter.position = iter.node->lower_bound(key, key_comp()) & kMatchMask;
@@ -917,8 +2039,8 @@ namespace atlasdb {
         return iter;
       }
 
-      template<typename P> template<typename IterType>
-      IterType btree<P>::internal_upper_bound(const key_type &key, IterType iter) const {
+      template<typename P> template<typename K, typename IterType>
+      IterType btree<P>::internal_upper_bound(const K &key, IterType iter) const {
         if (iter.node) {
           for (;;) {
             iter.position = iter.node->upper_bound(key, key_comp());
@@ -949,13 +2071,13 @@ namespace atlasdb {
         return IterType(nullptr, 0);
       }
 
-      template<typename P> template<typename IterType>
-      IterType btree<P>::internal_find_multi(const key_type &key, IterType iter) const {
+      template<typename P> template<typename K, typename IterType>
+      IterType btree<P>::internal_find_multi(const K &key, IterType iter) const {
         if (iter.node) {
           iter = internal_lower_bound(key, iter);
           if (iter.node) {
             iter = internal_last(iter);
-            if (iter.node && !compare_keys(key, iter.key())) {
+            if (iter.node && !btree_compare_keys_as(key_comp(), key, iter.key())) {
               return iter;
             }
           }
@@ -965,20 +2087,211 @@ namespace atlasdb {
 
       template<typename P>
       void btree<P>::internal_clear(node_type *node) {
+        release_node(mutable_internal_allocator(), node, node == root());
+      }
+
+      template<typename P>
+      void btree<P>::release_node(internal_allocator_type *alloc, node_type *node, bool root) {
+        if (!node->unref()) {
+          // Still referenced by a snapshot or by the tree.
+          return;
+        }
+
+        size_t size;
         if (!node->leaf()) {
           for (int i = 0; i <= node->count(); ++i) {
-            internal_clear(node->child(i));
+            release_node(alloc, node->child(i), false);
           }
+          size = root ? sizeof(root_fields) : sizeof(internal_fields);
+        }
+        else {
+          size = sizeof(base_fields) + node->max_count() * sizeof(value_type);
+        }
+        node->destroy();
+        alloc->deallocate(reinterpret_cast<char*>(node), size);
+      }
+
+      template<typename P>
+      typename btree<P>::node_type* btree<P>::unshare_path(node_type *node) {
+        if (!copy_on_write_) {
+          return node;
+        }
+
+        node_type *path[kMaxHeight];
+        int depth = 0;
+        for (;; node = node->parent()) {
+          assert(depth < kMaxHeight);
+          path[depth++] = node;
           if (node == root()) {
-            delete_internal_root_node();
+            break;
+          }
+        }
+        while (--depth > 0) {
+          unshare_node(path[depth]);
+        }
+        return unshare_node(path[0]);
+      }
+
+      template<typename P>
+      typename btree<P>::node_type* btree<P>::internal_unshare(node_type *node) {
+        bool is_root = node == root();
+        node_type *copy;
+        if (is_root) {
+          if (node->leaf()) {
+            copy = new_leaf_root_node(node->max_count());
           }
           else {
-            delete_internal_node(node);
+            copy = new_internal_root_node();
+            copy->set_rightmost(node->rightmost());
+            *copy->mutable_size() = node->size();
           }
+          copy->clone(node);
+          *mutable_root() = copy;
         }
         else {
-          delete_leaf_node(node);
+          node_type *parent = node->parent();
+          copy = node->leaf() ? new_leaf_node(parent) : new_internal_node(parent);
+          copy->clone(node);
+          parent->set_child(node->position(), copy);
+          if (leftmost() == node) {
+            root()->set_parent(copy);
+          }
+          if (rightmost() == node) {
+            set_rightmost(copy);
+          }
+        }
+
+        // Usually the snapshots keep the node alive, unless the last of them
+        // was released in the meantime.
+        ++generation_;
+        release_node(mutable_internal_allocator(), node, is_root);
+        return copy;
+      }
+
+      template<typename P>
+      typename btree<P>::size_type btree<P>::internal_compact_root(const key_type *lower, const key_type *upper,
+          double fill) {
+        if (!root() || root()->leaf()) {
+          return 0;
+        }
+        int target = std::max(1, std::min<int>(kNodeValues, fill * kNodeValues));
+        size_type freed = internal_compact(unshare_node(root()), lower, upper, target);
+        if (root()->count() == 0) {
+          try_shrink();
+          ++freed;
+        }
+        return freed;
+      }
+
+      template<typename P>
+      typename btree<P>::size_type btree<P>::internal_compact(node_type *node, const key_type *lower,
+          const key_type *upper, int target) {
+        size_type freed = 0;
+        if (!node->child(0)->leaf()) {
+          for (int i = 0; i <= node->count(); ++i) {
+            if (internal_in_range(node, i, lower, upper)) {
+              freed += internal_compact(unshare_node(node->child(i)), lower, upper, target);
+            }
+          }
+        }
+
+        for (int i = 0; i < node->count();) {
+          if (!internal_in_range(node, i, lower, upper) || !internal_in_range(node, i + 1, lower, upper)) {
+            ++i;
+            continue;
+          }
+          node_type *left = node->child(i);
+          node_type *right = node->child(i + 1);
+          // Merging the last two children of a node other than the root would
+          // leave it without values.
+          if (left->count() + right->count() + 1 <= target && (node->count() > 1 || node == root())) {
+            left = unshare_node(left);
+            merge_nodes(left, unshare_node(right));
+            ++freed;
+            continue;
+          }
+          if (left->count() < target && right->count() >= left->count() && right->count() > 1) {
+            left = unshare_node(left);
+            left->rebalance_right_to_left(unshare_node(right), std::min(target - left->count(), right->count() - 1));
+          }
+          ++i;
+        }
+        return freed;
+      }
+
+      template<typename P>
+      void btree<P>::internal_count_image(const node_type *node, size_t level, std::vector<image_level> &levels) {
+        if (node->leaf()) {
+          return;
+        }
+        levels[level + 1].nodes += node->count() + 1;
+        for (int i = 0; i <= node->count(); ++i) {
+          internal_count_image(node->child(i), level + 1, levels);
+        }
+      }
+
+      template<typename P>
+      void btree<P>::internal_write_image(int fd, const node_type *node, size_t level, uint64_t parent,
+          std::vector<image_level> &levels) const {
+        image_level &l = levels[level];
+        if (l.buffer.size() == kImageBufferNodes * l.node_size) {
+          internal_flush_image(fd, l);
+        }
+        size_t at = l.buffer.size();
+        l.buffer.resize(at + l.node_size);
+        char *p = &l.buffer[at];
+
+        size_t bytes = !node->leaf() ? (level == 0 ? sizeof(root_fields) : sizeof(internal_fields))
+            : sizeof(base_fields) + node->max_count() * sizeof(value_type);
+        std::memcpy(p, reinterpret_cast<const char*>(node), bytes);
+
+        // The copy is complete before the children are written, which may flush
+        // the buffers of the levels below only. Its links are the distances in
+        // the file to the nodes it links to: the address the node at offset
+        // would have if the file were mapped where the copy is.
+        const image_level &leaves = levels.back();
+        node_type *copy = reinterpret_cast<node_type*>(p);
+        uint64_t self = l.node_offset(l.written + at / l.node_size);
+        auto at_offset = [copy, self](uint64_t offset) {
+          return reinterpret_cast<node_type*>(reinterpret_cast<uintptr_t>(copy) + offset - self);
+        };
+        copy->pin();
+        copy->set_parent(at_offset(level == 0 ? leaves.node_offset(0) : parent));
+        if (!node->leaf()) {
+          const image_level &below = levels[level + 1];
+          for (int i = 0; i <= node->count(); ++i) {
+            copy->set_child_link(i, at_offset(below.node_offset(below.written + below.buffer.size() / below.node_size
+                + i)));
+          }
+          if (level == 0) {
+            copy->set_rightmost(at_offset(leaves.node_offset(leaves.nodes - 1)));
+          }
+
+          for (int i = 0; i <= node->count(); ++i) {
+            internal_write_image(fd, node->child(i), level + 1, self, levels);
+          }
+        }
+      }
+
+      template<typename P>
+      void btree<P>::internal_flush_image(int fd, image_level &level) {
+        const char *p = level.buffer.data();
+        size_t n = level.buffer.size();
+        uint64_t offset = level.node_offset(level.written);
+        while (n > 0) {
+          ssize_t r = ::pwrite(fd, p, n, offset);
+          if (r < 0) {
+            if (errno == EINTR) {
+              continue;
+            }
+            throw std::system_error(errno, std::generic_category());
+          }
+          p += r;
+          n -= r;
+          offset += r;
         }
+        level.written += level.buffer.size() / level.node_size;
+        level.buffer.clear();
       }
 
       template<typename P>
@@ -1010,14 +2323,18 @@ namespace atlasdb {
         for (int i = 1; i < node->count(); ++i) {
           assert(!compare_keys(node->key(i), node->key(i - 1)));
         }
+        assert(node->verify_abbrevs());
+        assert(!node_type::kSplitKeys || node->verify_keys());
         int count = node->count();
         if (!node->leaf()) {
           for (int i = 0; i <= node->count(); ++i) {
             assert(node->child(i) != nullptr);
             assert(node->child(i)->parent() == node);
             assert(node->child(i)->position() == i);
-            count += internal_verify(node->child(i), (i == 0) ? lo : &node->key(i - 1),
+            int child_count = internal_verify(node->child(i), (i == 0) ? lo : &node->key(i - 1),
                 (i == node->count()) ? hi : &node->key(i));
+            assert(!params_type::kRanked || node->child_count(i) == child_count);
+            count += child_count;
           }
         }
         return count;
@@ -0,0 +1,92 @@
+// Abbreviated keys for btree nodes holding byte string keys.
+//
+// Comparing two std::string keys means dereferencing both and comparing them
+// byte by byte. Keys of a table often share long prefixes (tenant and type
+// tags), so a search through a node repeats the comparison of the same
+// leading bytes over and over. A node holding such keys therefore also keeps
+// the length of a prefix shared by all of its keys and, for each key, the 8
+// bytes following that prefix packed into a big endian integer, zero padded.
+// Searching the node first compares the probe key with the shared prefix
+// once, then compares the abbreviation of the probe with those of the keys.
+// Two different abbreviations order their keys the same way, so the full keys
+// only have to be compared on ties.
+//
+// This trims the cost of lookups, not memory. The keys themselves are stored
+// as usual since iterators hand out references to them, and the shared prefix
+// is not cut from them. The abbreviations come on top: a node of the default
+// target size holds 5 std::string keys instead of 7.
+//
+// A key type takes part by specializing btree_abbrev_key, which requires that
+// its ordering is the lexicographic ordering of its bytes as unsigned chars
+// (memcmp() order, shorter keys first on ties), as for std::string.
+
+#ifndef ATLASDB_STORAGE_BTREE_BTREE_ABBREV_H_
+#define ATLASDB_STORAGE_BTREE_BTREE_ABBREV_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace atlasdb {
+  namespace storage {
+
+  // Gives access to the bytes of a key type whose order is the memcmp() order
+  // of its bytes. Not abbreviated by default.
+    template<typename Key>
+    struct btree_abbrev_key {
+      enum { value = false };
+      static const char* data(const Key&) { return nullptr; }
+      static size_t size(const Key&) { return 0; }
+    };
+
+    template<>
+    struct btree_abbrev_key<std::string> {
+      enum { value = true };
+      static const char* data(const std::string &k) { return k.data(); }
+      static size_t size(const std::string &k) { return k.size(); }
+    };
+
+  // Packs the first 8 of the n bytes at p into an integer which compares like
+  // the bytes do, padding with zeroes.
+    inline uint64_t btree_abbreviate(const char *p, size_t n) {
+      uint64_t a = 0;
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      if (n >= sizeof(a)) {
+        std::memcpy(&a, p, sizeof(a));
+        return __builtin_bswap64(a);
+      }
+#endif
+      for (size_t i = 0; i < sizeof(a); ++i) {
+        a = (a << 8) | (i < n ? static_cast<unsigned char>(p[i]) : 0);
+      }
+      return a;
+    }
+
+  // Returns the length of the longest common prefix of two byte strings.
+    inline size_t btree_common_prefix(const char *a, size_t an, const char *b, size_t bn) {
+      size_t n = std::min(an, bn);
+      size_t i = 0;
+      while (i + sizeof(uint64_t) <= n && std::memcmp(a + i, b + i, sizeof(uint64_t)) == 0) {
+        i += sizeof(uint64_t);
+      }
+      while (i < n && a[i] == b[i]) {
+        ++i;
+      }
+      return i;
+    }
+
+  // Compares two byte strings the way std::string::compare() does.
+    inline int btree_bytes_compare(const char *a, size_t an, const char *b, size_t bn) {
+      int c = std::memcmp(a, b, std::min(an, bn));
+      if (c != 0) {
+        return c;
+      }
+      return an < bn ? -1 : (an > bn ? 1 : 0);
+    }
+
+  } // storage
+} // atlasdb
+
+#endif // ATLASDB_STORAGE_BTREE_BTREE_ABBREV_H_
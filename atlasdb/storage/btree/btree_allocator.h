@@ -0,0 +1,265 @@
+// A node allocator for btree_map and btree_multimap.
+//
+// A btree allocates nodes of only a handful of sizes: leaf_fields,
+// internal_fields, root_fields and the small root leaves of a growing tree.
+// btree_node_arena carves them out of huge page sized chunks with a bump
+// pointer and recycles freed nodes through one free list per node size, so a
+// large table costs a few mmap() calls instead of millions of malloc() calls,
+// and sibling nodes allocated one after the other end up next to each other.
+//
+// Every tree gets its own arena: copying a btree (which asks the allocator for
+// select_on_container_copy_construction()) gives the copy a new arena, and
+// copy assignment does not propagate the allocator. This is what allows
+// btree::clear() to release all of the nodes of a tree at once by unmapping
+// the chunks of its arena. Snapshots of a tree (see btree_snapshot) share its
+// arena and may free nodes from another thread, so the free lists are guarded
+// by a spinlock, which is uncontended unless a snapshot is being released.
+//
+// Usage:
+//
+//   typedef btree_node_allocator<std::pair<const int64_t, vertex>> allocator;
+//   btree_map<int64_t, vertex, std::less<int64_t>, allocator> vertices;
+
+#ifndef ATLASDB_STORAGE_BTREE_BTREE_ALLOCATOR_H_
+#define ATLASDB_STORAGE_BTREE_BTREE_ALLOCATOR_H_
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <atlasdb/storage/btree/btree.h>
+
+namespace atlasdb {
+  namespace storage {
+
+    class btree_node_arena {
+    public:
+
+      enum {
+        // A chunk is aligned to and spans exactly one transparent huge page
+        // on x86-64, see map_chunk().
+        kChunkSize = 2 << 20,
+        // Node sizes are rounded up to a cache line, so that every node starts
+        // on one. Enough for any value type stored in a btree.
+        kAlignment = 64,
+      };
+
+    public:
+
+      btree_node_arena() : _top(nullptr), _end(nullptr), _bytes_mapped(0) {}
+
+      btree_node_arena(const btree_node_arena&) = delete;
+      btree_node_arena& operator=(const btree_node_arena&) = delete;
+
+      ~btree_node_arena() { release(); }
+
+    public:
+
+      void* allocate(size_t size) {
+        size = round_up(size);
+        spin_guard guard(_lock);
+        size_class &c = find_class(size);
+        if (c.free_list) {
+          free_node *n = c.free_list;
+          c.free_list = n->next;
+          return n;
+        }
+
+        if (size > static_cast<size_t>(_end - _top)) {
+          if (size > kChunkSize / 4) {
+            // Too large to share a chunk with other nodes; huge value types only.
+            return map(size);
+          }
+          _top = static_cast<char*>(map_chunk());
+          _end = _top + kChunkSize;
+        }
+
+        void *p = _top;
+        _top += size;
+        return p;
+      }
+
+      void deallocate(void *p, size_t size) {
+        size = round_up(size);
+        spin_guard guard(_lock);
+        size_class &c = find_class(size);
+        free_node *n = static_cast<free_node*>(p);
+        n->next = c.free_list;
+        c.free_list = n;
+      }
+
+      // Unmaps every chunk, freeing all of the nodes ever allocated from this
+      // arena at once. Nodes must not be accessed afterwards.
+      void release() {
+        for (auto &chunk : _chunks) {
+          ::munmap(chunk.first, chunk.second);
+        }
+        _chunks.clear();
+        _classes.clear();
+        _top = _end = nullptr;
+        _bytes_mapped = 0;
+      }
+
+      // The number of bytes obtained from the operating system.
+      size_t bytes_mapped() const { return _bytes_mapped; }
+
+    private:
+
+      struct free_node {
+        free_node *next;
+      };
+
+      struct spin_guard {
+        explicit spin_guard(std::atomic_flag &f) : flag(f) {
+          while (flag.test_and_set(std::memory_order_acquire)) {
+          }
+        }
+
+        ~spin_guard() { flag.clear(std::memory_order_release); }
+
+        std::atomic_flag &flag;
+      };
+
+      struct size_class {
+        size_t size;
+        free_node *free_list;
+      };
+
+      static size_t round_up(size_t size) {
+        size = std::max(size, sizeof(free_node));
+        return (size + kAlignment - 1) & ~static_cast<size_t>(kAlignment - 1);
+      }
+
+      // A tree uses few distinct node sizes, a linear search is fastest.
+      size_class& find_class(size_t size) {
+        for (auto &c : _classes) {
+          if (c.size == size) return c;
+        }
+        _classes.push_back(size_class { size, nullptr });
+        return _classes.back();
+      }
+
+      void* map(size_t size) {
+        void *p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+          throw std::bad_alloc();
+        }
+        _chunks.push_back(std::make_pair(p, size));
+        _bytes_mapped += size;
+        return p;
+      }
+
+      // mmap() aligns to a page only: a chunk is cut out of a mapping one
+      // chunk larger, at a chunk boundary, so that the kernel can back it with
+      // a single huge page, and the rest is unmapped.
+      void* map_chunk() {
+        char *p = static_cast<char*>(::mmap(nullptr, 2 * kChunkSize, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (p == MAP_FAILED) {
+          throw std::bad_alloc();
+        }
+        char *chunk = reinterpret_cast<char*>(
+            (reinterpret_cast<uintptr_t>(p) + kChunkSize - 1) & ~static_cast<uintptr_t>(kChunkSize - 1));
+        if (chunk != p) {
+          ::munmap(p, chunk - p);
+        }
+        ::munmap(chunk + kChunkSize, p + kChunkSize - chunk);
+#ifdef MADV_HUGEPAGE
+        ::madvise(chunk, kChunkSize, MADV_HUGEPAGE);
+#endif
+        _chunks.push_back(std::make_pair(static_cast<void*>(chunk), static_cast<size_t>(kChunkSize)));
+        _bytes_mapped += kChunkSize;
+        return chunk;
+      }
+
+    private:
+
+      std::atomic_flag _lock = ATOMIC_FLAG_INIT;
+      char *_top;
+      char *_end;
+      size_t _bytes_mapped;
+      std::vector<size_class> _classes;
+      std::vector<std::pair<void*, size_t>> _chunks;
+    };
+
+    template<typename T>
+    class btree_node_allocator {
+    public:
+
+      typedef T value_type;
+      typedef T* pointer;
+      typedef const T* const_pointer;
+      typedef T& reference;
+      typedef const T& const_reference;
+      typedef size_t size_type;
+      typedef ptrdiff_t difference_type;
+
+      typedef std::false_type propagate_on_container_copy_assignment;
+      typedef std::true_type propagate_on_container_move_assignment;
+      typedef std::true_type propagate_on_container_swap;
+
+      template<typename U>
+      struct rebind {
+        typedef btree_node_allocator<U> other;
+      };
+
+    public:
+
+      btree_node_allocator() : _arena(std::make_shared<btree_node_arena>()) {}
+
+      template<typename U>
+      btree_node_allocator(const btree_node_allocator<U>& other) : _arena(other.arena()) {}
+
+    public:
+
+      pointer allocate(size_type n) { return static_cast<pointer>(_arena->allocate(n * sizeof(T))); }
+
+      void deallocate(pointer p, size_type n) { _arena->deallocate(p, n * sizeof(T)); }
+
+      template<typename U, typename ... Args>
+      void construct(U *p, Args&&... args) { ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...); }
+
+      template<typename U>
+      void destroy(U *p) { p->~U(); }
+
+      size_type max_size() const { return btree_node_arena::kChunkSize / sizeof(T); }
+
+      // A copied container gets an arena of its own.
+      btree_node_allocator select_on_container_copy_construction() const { return btree_node_allocator(); }
+
+      // The whole arena can be released if no one else allocates from it.
+      bool releasable() const { return _arena.use_count() == 1; }
+
+      void release() { _arena->release(); }
+
+      const std::shared_ptr<btree_node_arena>& arena() const { return _arena; }
+
+      template<typename U>
+      bool operator==(const btree_node_allocator<U>& other) const { return _arena == other.arena(); }
+
+      template<typename U>
+      bool operator!=(const btree_node_allocator<U>& other) const { return _arena != other.arena(); }
+
+    private:
+
+      std::shared_ptr<btree_node_arena> _arena;
+    };
+
+    template<typename T>
+    struct btree_allocator_release<btree_node_allocator<T>> {
+      static bool releasable(const btree_node_allocator<T>& alloc) { return alloc.releasable(); }
+      static void release(btree_node_allocator<T>& alloc) { alloc.release(); }
+    };
+
+  } // storage
+} // atlasdb
+
+#endif // ATLASDB_STORAGE_BTREE_BTREE_ALLOCATOR_H_
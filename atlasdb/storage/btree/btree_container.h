@@ -18,6 +18,8 @@
 #include <iosfwd>
 #include <utility>
 
+#include <atlasdb/storage/btree/btree.h>
+
 namespace atlasdb {
   namespace storage {
 
@@ -46,6 +48,9 @@ namespace atlasdb {
       typedef typename Tree::const_iterator const_iterator;
       typedef typename Tree::reverse_iterator reverse_iterator;
       typedef typename Tree::const_reverse_iterator const_reverse_iterator;
+      typedef typename Tree::scan_iterator scan_iterator;
+      typedef typename Tree::snapshot_type snapshot_type;
+      typedef typename Tree::verifier_type verifier_type;
 
     public:
 
@@ -72,6 +77,13 @@ namespace atlasdb {
 
       const_reverse_iterator rend() const { return tree_.rend(); }
 
+      // Iterators for sequential scans, which prefetch the leaves ahead.
+      scan_iterator scan_begin() const { return tree_.scan_begin(); }
+
+      scan_iterator scan_end() const { return tree_.scan_end(); }
+
+      scan_iterator scan_lower_bound(const key_type &key) const { return tree_.scan_lower_bound(key); }
+
       // Lookup routines.
       iterator lower_bound(const key_type &key) { return tree_.lower_bound(key); }
 
@@ -85,11 +97,86 @@ namespace atlasdb {
 
       std::pair<const_iterator, const_iterator> equal_range(const key_type &key) const { return tree_.equal_range(key); }
 
+      // Lookups by a value of any type comparable to the keys, if key_compare
+      // is transparent (see btree_is_transparent).
+      template<typename K>
+      typename btree_if_transparent<key_compare, K, iterator>::type lower_bound(const K &key) {
+        return tree_.lower_bound(key);
+      }
+
+      template<typename K>
+      typename btree_if_transparent<key_compare, K, const_iterator>::type lower_bound(const K &key) const {
+        return tree_.lower_bound(key);
+      }
+
+      template<typename K>
+      typename btree_if_transparent<key_compare, K, iterator>::type upper_bound(const K &key) {
+        return tree_.upper_bound(key);
+      }
+
+      template<typename K>
+      typename btree_if_transparent<key_compare, K, const_iterator>::type upper_bound(const K &key) const {
+        return tree_.upper_bound(key);
+      }
+
+      template<typename K>
+      typename btree_if_transparent<key_compare, K, std::pair<iterator, iterator> >::type equal_range(const K &key) {
+        return tree_.equal_range(key);
+      }
+
+      template<typename K>
+      typename btree_if_transparent<key_compare, K, std::pair<const_iterator, const_iterator> >::type equal_range(
+          const K &key) const {
+        return tree_.equal_range(key);
+      }
+
+      // Looks up many keys at once, see btree::find_batch().
+      template<typename ForwardIterator, typename OutputIterator>
+      OutputIterator find_batch(ForwardIterator b, ForwardIterator e, OutputIterator out) const {
+        return tree_.find_batch(b, e, out);
+      }
+
+      // Order statistics routines, only available on ranked containers (see
+      // btree_ranked_params).
+      iterator select(size_type k) { return tree_.select(k); }
+
+      const_iterator select(size_type k) const { return tree_.select(k); }
+
+      size_type rank(const_iterator iter) const { return tree_.rank(iter); }
+
+      size_type rank(const key_type &key) const { return tree_.rank(key); }
+
+      size_type count_range(const key_type &lo, const key_type &hi) const { return tree_.count_range(lo, hi); }
+
+      // Erases the values whose key is in [lower, upper), see btree::erase_range().
+      size_type erase_range(const key_type &lower, const key_type &upper) { return tree_.erase_range(lower, upper); }
+
       // Utility routines.
+      key_compare key_comp() const { return tree_.key_comp(); }
+
+      // Bumped whenever a node leaves the tree, see btree::generation().
+      uint64_t generation() const { return tree_.generation(); }
+
       void clear() { tree_.clear(); }
 
       void swap(self_type &x) { tree_.swap(x.tree_); }
 
+      // Returns an immutable view of the current contents in O(1), which stays
+      // valid while the container is modified. Values modified in place through
+      // iterators rather than with insert(), erase() or operator[] must be
+      // unshared first (see btree::unshare()).
+      snapshot_type snapshot() { return tree_.snapshot(); }
+
+      iterator unshare(iterator iter) { return tree_.unshare(iter); }
+
+      // Writes an image of the container to the file at path, see
+      // btree::write_image().
+      void write_image(const std::string &path) const { tree_.write_image(path); }
+
+      // Serves the container from a mapped btree image, see
+      // btree::attach_image().
+      void attach_image(btree_image &image) { tree_.attach_image(image); }
+
       void dump(std::ostream &os) const { tree_.dump(os); }
 
       void verify() const { tree_.verify(); }
@@ -117,6 +204,13 @@ namespace atlasdb {
 
       double overhead() const { return tree_.overhead(); }
 
+      // Fills up sparse nodes and frees the emptied ones, see btree::compact().
+      size_type compact(double fill = 1.0) { return tree_.compact(fill); }
+
+      size_type compact_range(const key_type &lower, const key_type &upper, double fill = 1.0) {
+        return tree_.compact_range(lower, upper, fill);
+      }
+
       bool operator==(const self_type& x) const {
         if (size() != x.size()) {
           return false;
@@ -181,6 +275,16 @@ namespace atlasdb {
 
       const_iterator find(const key_type &key) const { return this->tree_.find_unique(key); }
 
+      template<typename K>
+      typename btree_if_transparent<key_compare, K, iterator>::type find(const K &key) {
+        return this->tree_.find_unique(key);
+      }
+
+      template<typename K>
+      typename btree_if_transparent<key_compare, K, const_iterator>::type find(const K &key) const {
+        return this->tree_.find_unique(key);
+      }
+
       size_type count(const key_type &key) const { return this->tree_.count_unique(key); }
 
       // Insertion routines.
@@ -191,6 +295,15 @@ namespace atlasdb {
       template<typename InputIterator>
       void insert(InputIterator b, InputIterator e) { this->tree_.insert_unique(b, e); }
 
+      // Bulk loads the sorted range [b, e) into an empty container, packing the
+      // nodes to the given fill factor. See btree::bulk_load_unique().
+      template<typename InputIterator>
+      void bulk_load(InputIterator b, InputIterator e, double fill = 1.0) { this->tree_.bulk_load_unique(b, e, fill); }
+
+      // Inserts the sorted range [b, e), see btree::insert_sorted_batch_unique().
+      template<typename InputIterator>
+      size_type insert_sorted_batch(InputIterator b, InputIterator e) { return this->tree_.insert_sorted_batch_unique(b, e); }
+
       // Deletion routines.
       int erase(const key_type &key) { return this->tree_.erase_unique(key); }
 
@@ -247,7 +360,7 @@ namespace atlasdb {
 
       // Insertion routines.
       data_type& operator[](const key_type &key) {
-        return this->tree_.insert_unique(key, generate_value(key)).first->second;
+        return this->tree_.unshare(this->tree_.insert_unique(key, generate_value(key)).first)->second;
       }
     };
 
@@ -292,6 +405,16 @@ namespace atlasdb {
 
       const_iterator find(const key_type &key) const { return this->tree_.find_multi(key); }
 
+      template<typename K>
+      typename btree_if_transparent<key_compare, K, iterator>::type find(const K &key) {
+        return this->tree_.find_multi(key);
+      }
+
+      template<typename K>
+      typename btree_if_transparent<key_compare, K, const_iterator>::type find(const K &key) const {
+        return this->tree_.find_multi(key);
+      }
+
       size_type count(const key_type &key) const { return this->tree_.count_multi(key); }
 
       // Insertion routines.
@@ -302,6 +425,15 @@ namespace atlasdb {
       template<typename InputIterator>
       void insert(InputIterator b, InputIterator e) { this->tree_.insert_multi(b, e); }
 
+      // Bulk loads the sorted range [b, e) into an empty container, packing the
+      // nodes to the given fill factor. See btree::bulk_load_multi().
+      template<typename InputIterator>
+      void bulk_load(InputIterator b, InputIterator e, double fill = 1.0) { this->tree_.bulk_load_multi(b, e, fill); }
+
+      // Inserts the sorted range [b, e), see btree::insert_sorted_batch_multi().
+      template<typename InputIterator>
+      size_type insert_sorted_batch(InputIterator b, InputIterator e) { return this->tree_.insert_sorted_batch_multi(b, e); }
+
       // Deletion routines.
       int erase(const key_type &key) { return this->tree_.erase_multi(key); }
 
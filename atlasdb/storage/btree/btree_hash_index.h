@@ -0,0 +1,197 @@
+// A hash index over the keys of a btree container, for exact match lookups.
+//
+// Finding a key in a large btree takes a cache miss or more per level of the
+// tree. The hash index maps the fingerprint of a key to the node and the slot
+// within the node which held the key when it was last looked up, in a table
+// of 64 byte buckets of 4 entries each. Looking a key up probes one bucket and
+// checks the key in the node it points to, so a hit costs about one cache miss
+// on top of reading the value; range scans keep using the btree.
+//
+// The entries are not maintained by the btree. A node keeps its address while
+// values are inserted into or erased from it, and while it is split, so an
+// entry whose key moved elsewhere is detected by comparing the key found at
+// its slot, and refreshed by descending the btree. Nodes leaving the tree, as
+// when they are merged, bump its generation (see btree::generation()), which
+// invalidates all of the entries at once; the index then fills up again as
+// keys are looked up. Keys which are not in the container always descend the
+// btree.
+//
+// The table has a fixed size, chosen when the index is created, so that the
+// memory it takes is bounded; a full bucket evicts one of its entries.
+//
+// Like the btree, the index must not be used by several threads at once, not
+// even for lookups, which fill the index.
+//
+// Usage:
+//
+//   btree_map<int64_t, vertex> vertices;
+//   btree_hash_index<btree_map<int64_t, vertex>> index(1 << 20);
+//   auto it = index.find(vertices, 42);
+
+#ifndef ATLASDB_STORAGE_BTREE_BTREE_HASH_INDEX_H_
+#define ATLASDB_STORAGE_BTREE_BTREE_HASH_INDEX_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+
+#include <atlasdb/storage/btree/btree.h>
+
+namespace atlasdb {
+  namespace storage {
+
+    // The counters of a btree_hash_index.
+    struct btree_hash_index_stats {
+      // The number of bytes taken by the table.
+      size_t bytes;
+      // The number of entries of the table and the number of them in use.
+      size_t capacity;
+      size_t entries;
+      // The number of lookups answered by the table, and of those which
+      // descended the btree.
+      uint64_t hits;
+      uint64_t misses;
+      // The number of times all of the entries were invalidated.
+      uint64_t invalidations;
+    };
+
+    template<typename Container, typename Hash = std::hash<typename Container::key_type> >
+    class btree_hash_index {
+    public:
+
+      typedef Container container_type;
+      typedef typename Container::key_type key_type;
+      typedef typename Container::key_compare key_compare;
+      typedef typename Container::const_iterator const_iterator;
+      typedef typename const_iterator::node_type node_type;
+      typedef Hash hasher;
+
+      enum {
+        kBucketEntries = 4,
+        kCacheLineSize = 64,
+      };
+
+    public:
+
+      // Creates an index taking at most max_bytes, and at least one bucket.
+      explicit btree_hash_index(size_t max_bytes, const hasher &hash = hasher()) :
+          _hash(hash), _buckets(nullptr), _mask(0), _shift(63), _epoch(1), _generation(0), _stats() {
+        size_t n = 1;
+        while ((n * 2) * sizeof(bucket) <= max_bytes) {
+          n *= 2;
+          _shift = 64 - __builtin_ctzll(n);
+        }
+        void *p = nullptr;
+        if (::posix_memalign(&p, kCacheLineSize, n * sizeof(bucket)) != 0) {
+          throw std::bad_alloc();
+        }
+        std::memset(p, 0, n * sizeof(bucket));
+        _buckets = static_cast<bucket*>(p);
+        _mask = n - 1;
+        _stats.bytes = n * sizeof(bucket);
+        _stats.capacity = n * kBucketEntries;
+      }
+
+      btree_hash_index(const btree_hash_index&) = delete;
+      btree_hash_index& operator=(const btree_hash_index&) = delete;
+
+      ~btree_hash_index() { std::free(_buckets); }
+
+    public:
+
+      // Finds key in c, the container the index is used with, as c.find(key)
+      // does.
+      const_iterator find(const container_type &c, const key_type &key) {
+        if (c.generation() != _generation) {
+          invalidate();
+          _generation = c.generation();
+        }
+
+        // The high bits of the product pick the bucket, the low ones, which are
+        // distinct for keys hashing to values distinct in their low bits, make
+        // the fingerprint. Only the topmost bits spread runs of keys over all
+        // of the buckets.
+        uint64_t h = static_cast<uint64_t>(_hash(key)) * 0x9e3779b97f4a7c15ULL;
+        uint32_t fingerprint = static_cast<uint32_t>(h);
+        bucket &b = _buckets[(h >> _shift) & _mask];
+        entry *victim = &b.entries[(fingerprint >> 30) % kBucketEntries];
+        for (int i = 0; i < kBucketEntries; ++i) {
+          entry &e = b.entries[i];
+          if (e.epoch != _epoch) {
+            victim = &e;
+            continue;
+          }
+          if (e.fingerprint == fingerprint) {
+            if (e.position < e.node->count() && equal(c, e.node->key(e.position), key)) {
+              ++_stats.hits;
+              return const_iterator(e.node, e.position);
+            }
+            // The key moved, or another key has the same fingerprint.
+            victim = &e;
+            break;
+          }
+        }
+
+        ++_stats.misses;
+        const_iterator it = c.find(key);
+        if (it != c.end()) {
+          if (victim->epoch != _epoch) {
+            ++_stats.entries;
+          }
+          victim->node = it.node;
+          victim->fingerprint = fingerprint;
+          victim->position = static_cast<uint16_t>(it.position);
+          victim->epoch = _epoch;
+        }
+        return it;
+      }
+
+      // Drops all of the entries in O(1).
+      void invalidate() {
+        if (++_epoch == 0) {
+          std::memset(_buckets, 0, _stats.bytes);
+          _epoch = 1;
+        }
+        _stats.entries = 0;
+        ++_stats.invalidations;
+      }
+
+      const btree_hash_index_stats& stats() const { return _stats; }
+
+    private:
+
+      struct entry {
+        const node_type *node;
+        uint32_t fingerprint;
+        uint16_t position;
+        // The entry is valid if it matches the epoch of the index.
+        uint16_t epoch;
+      };
+
+      struct bucket {
+        entry entries[kBucketEntries];
+      };
+
+      static bool equal(const container_type &c, const key_type &a, const key_type &b) {
+        return !btree_compare_keys(c.key_comp(), a, b) && !btree_compare_keys(c.key_comp(), b, a);
+      }
+
+    private:
+
+      hasher _hash;
+      bucket *_buckets;
+      size_t _mask;
+      // Shifts the bucket number down from the top of the hash.
+      int _shift;
+      uint16_t _epoch;
+      uint64_t _generation;
+      btree_hash_index_stats _stats;
+    };
+
+  } // storage
+} // atlasdb
+
+#endif // ATLASDB_STORAGE_BTREE_BTREE_HASH_INDEX_H_
@@ -0,0 +1,139 @@
+// The file format of btree images, and the mappings of btree image files.
+//
+// A btree image is a copy of the nodes of a btree of trivially copyable values
+// which a process maps and reads right away instead of inserting the values
+// again, see btree::write_image() and btree::attach_image(). The file starts
+// with a page holding the btree_image_header, followed by the nodes level by
+// level, from the root down to the leaves and from left to right within a
+// level. All of the nodes of a level take the same number of bytes, the size of
+// the nodes rounded up to whole cache lines, so the upper levels of the tree
+// are packed at the front of the file and the leaves follow each other in key
+// order.
+//
+// The nodes link to each other by the distance between them in the file, as
+// btree nodes always do in memory (see btree_node::link()), so the image is
+// used as is wherever it is mapped, and pages are only read as lookups and
+// scans fault them in.
+//
+// The mapping is private, so the file is never modified. A btree serving reads
+// from an image treats its nodes as shared with a snapshot which is never
+// released: modifying the btree copies the nodes on the path to the
+// modification into memory first. The image must stay mapped as long as the
+// btree references its nodes.
+//
+// Usage:
+//
+//   vertices.write_image("vertices.img");
+//   ...
+//   auto image = std::make_shared<btree_image>("vertices.img");
+//   vertices.attach_image(*image);
+
+#ifndef ATLASDB_STORAGE_BTREE_BTREE_IMAGE_H_
+#define ATLASDB_STORAGE_BTREE_BTREE_IMAGE_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+namespace atlasdb {
+  namespace storage {
+
+    // The first page of a btree image file.
+    struct btree_image_header {
+      enum {
+        kVersion = 2,
+        kSize = 4096,
+      };
+
+      static const char* magic_string() { return "ATLASBTI"; }
+
+      char magic[8];
+      uint32_t version;
+      // The layout of the nodes, which the btree attaching the image must share.
+      uint32_t node_values;
+      uint32_t value_size;
+      uint32_t leaf_size;
+      uint32_t internal_size;
+      uint32_t root_size;
+      // The size of the file.
+      uint64_t bytes;
+      // The offsets of the root node, 0 if the btree was empty, and of the first
+      // leaf which follows all of the internal nodes.
+      uint64_t root;
+      uint64_t leaves;
+      // The number of values.
+      uint64_t size;
+    };
+
+    // A private read/write mapping of a btree image file, unmapped on
+    // destruction.
+    class btree_image {
+    public:
+
+      // Maps the image file at path.
+      // @throw std::system_error if the file cannot be read or mapped, and
+      //    std::runtime_error if it is not a btree image.
+      explicit btree_image(const std::string &path) : _data(nullptr), _size(0) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+          throw std::system_error(errno, std::generic_category(), path);
+        }
+
+        btree_image_header h;
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || ::pread(fd, &h, sizeof(h), 0) != ssize_t(sizeof(h))) {
+          int e = errno;
+          ::close(fd);
+          throw std::system_error(e ? e : EIO, std::generic_category(), path);
+        }
+        if (std::memcmp(h.magic, btree_image_header::magic_string(), sizeof(h.magic)) != 0
+            || h.version != btree_image_header::kVersion || h.bytes != uint64_t(st.st_size)) {
+          ::close(fd);
+          throw std::runtime_error(path + ": not a btree image");
+        }
+
+        void *p = ::mmap(nullptr, h.bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        int e = errno;
+        ::close(fd);
+        if (p == MAP_FAILED) {
+          throw std::system_error(e, std::generic_category(), path);
+        }
+        _data = static_cast<char*>(p);
+        _size = h.bytes;
+
+        // The internal nodes are read by every lookup, have them read ahead.
+        ::madvise(_data, header().leaves, MADV_WILLNEED);
+      }
+
+      btree_image(const btree_image&) = delete;
+      btree_image& operator=(const btree_image&) = delete;
+
+      ~btree_image() { ::munmap(_data, _size); }
+
+    public:
+
+      const btree_image_header& header() const { return *reinterpret_cast<const btree_image_header*>(_data); }
+
+      char* data() const { return _data; }
+
+      size_t size() const { return _size; }
+
+    private:
+
+      char *_data;
+      size_t _size;
+    };
+
+  } // storage
+} // atlasdb
+
+#endif // ATLASDB_STORAGE_BTREE_BTREE_IMAGE_H_
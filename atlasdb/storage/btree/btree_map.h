@@ -111,6 +111,87 @@ namespace atlasdb {
     template<typename K, typename V, typename C, typename A, int N>
     inline void swap(btree_multimap<K, V, C, A, N> &x, btree_multimap<K, V, C, A, N> &y) { x.swap(y); }
 
+  // A btree_map whose internal nodes maintain subtree counts, adding select(),
+  // rank() and count_range() in O(log n) at the price of larger internal
+  // nodes and a count update per level on every insertion and erasure.
+    template
+    <
+        typename Key,
+        typename Value,
+        typename Compare = std::less<Key>,
+        typename Alloc = std::allocator<std::pair<const Key, Value>>,
+        int TargetNodeSize = 256
+    >
+    class btree_ranked_map : public btree_map_container<
+        btree<btree_ranked_params<btree_map_params<Key, Value, Compare, Alloc, TargetNodeSize>>>>
+    {
+    private:
+
+      typedef btree_ranked_map<Key, Value, Compare, Alloc, TargetNodeSize> self_type;
+      typedef btree_ranked_params<btree_map_params<Key, Value, Compare, Alloc, TargetNodeSize>> params_type;
+      typedef btree<params_type> btree_type;
+      typedef btree_map_container<btree_type> super_type;
+
+    public:
+
+      typedef typename btree_type::key_compare key_compare;
+      typedef typename btree_type::allocator_type allocator_type;
+
+    public:
+
+      // Default constructor.
+      btree_ranked_map(const key_compare &comp = key_compare(), const allocator_type &alloc = allocator_type()) :
+          super_type(comp, alloc) { }
+
+      // Copy constructor.
+      btree_ranked_map(const self_type &x) : super_type(x) { }
+
+      // Range constructor.
+      template<class InputIterator>
+      btree_ranked_map(InputIterator b, InputIterator e, const key_compare &comp = key_compare(),
+          const allocator_type &alloc = allocator_type()) : super_type(b, e, comp, alloc) { }
+    };
+
+    template<typename K, typename V, typename C, typename A, int N>
+    inline void swap(btree_ranked_map<K, V, C, A, N> &x, btree_ranked_map<K, V, C, A, N> &y) { x.swap(y); }
+
+  // The btree_multimap counterpart of btree_ranked_map.
+    template<typename Key, typename Value, typename Compare = std::less<Key>,
+        typename Alloc = std::allocator<std::pair<const Key, Value> >, int TargetNodeSize = 256>
+    class btree_ranked_multimap : public btree_multi_container<
+        btree<btree_ranked_params<btree_map_params<Key, Value, Compare, Alloc, TargetNodeSize>>>>
+    {
+    private:
+
+      typedef btree_ranked_multimap<Key, Value, Compare, Alloc, TargetNodeSize> self_type;
+      typedef btree_ranked_params<btree_map_params<Key, Value, Compare, Alloc, TargetNodeSize>> params_type;
+      typedef btree<params_type> btree_type;
+      typedef btree_multi_container<btree_type> super_type;
+
+    public:
+
+      typedef typename btree_type::key_compare key_compare;
+      typedef typename btree_type::allocator_type allocator_type;
+      typedef typename btree_type::data_type data_type;
+      typedef typename btree_type::mapped_type mapped_type;
+
+    public:
+      // Default constructor.
+      btree_ranked_multimap(const key_compare &comp = key_compare(), const allocator_type &alloc = allocator_type()) :
+          super_type(comp, alloc) { }
+
+      // Copy constructor.
+      btree_ranked_multimap(const self_type &x) : super_type(x) { }
+
+      // Range constructor.
+      template<class InputIterator>
+      btree_ranked_multimap(InputIterator b, InputIterator e, const key_compare &comp = key_compare(),
+          const allocator_type &alloc = allocator_type()) : super_type(b, e, comp, alloc) { }
+    };
+
+    template<typename K, typename V, typename C, typename A, int N>
+    inline void swap(btree_ranked_multimap<K, V, C, A, N> &x, btree_ranked_multimap<K, V, C, A, N> &y) { x.swap(y); }
+
   } // storage
 } // atlasdb
 
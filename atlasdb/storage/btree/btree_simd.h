@@ -0,0 +1,339 @@
+// Vectorized in-node key search for btree nodes holding integral or floating
+// point keys.
+//
+// A node stores its keys in values[], so the keys form a strided array whose
+// stride is the size of the node's mutable_value_type (the key itself for a
+// btree_set, a std::pair<Key, Data> for a btree_map). Since the keys of a node
+// are sorted, lower_bound(k) is the number of keys less than k and
+// upper_bound(k) is the number of keys not greater than k. Both are computed
+// here by comparing a whole vector of keys against k at once and turning the
+// comparison result into a bit mask, stopping at the first vector which holds
+// a key not satisfying the predicate.
+//
+// The AVX2 and SSE4.2 kernels are compiled with per-function target attributes
+// so no special compiler flags are needed; the kernel is chosen once at runtime
+// from the capabilities of the CPU, falling back to a scalar loop. Define
+// ATLASDB_BTREE_NO_SIMD to always use the scalar loop.
+
+#ifndef ATLASDB_STORAGE_BTREE_BTREE_SIMD_H_
+#define ATLASDB_STORAGE_BTREE_BTREE_SIMD_H_
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#if !defined(ATLASDB_BTREE_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) \
+  && (defined(__clang__) || (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#define ATLASDB_BTREE_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+namespace atlasdb {
+  namespace storage {
+
+  // Indicates whether keys of type Key can be searched with the vectorized
+  // kernels: 32 or 64 bit integers, floats and doubles.
+    template<typename Key>
+    struct btree_simd_searchable: public std::integral_constant<bool,
+        (std::is_integral<Key>::value && !std::is_same<Key, bool>::value && (sizeof(Key) == 4 || sizeof(Key) == 8))
+            || std::is_same<Key, float>::value || std::is_same<Key, double>::value> {
+    };
+
+  // Loads the i-th key of a strided key array.
+    template<typename Key>
+    inline Key btree_simd_load(const char *base, int stride, int i) {
+      Key k;
+      std::memcpy(&k, base + i * stride, sizeof(Key));
+      return k;
+    }
+
+  // The scalar fallback, also used for the tail which doesn't fill a vector.
+    template<typename Key>
+    inline int btree_scalar_search(const char *base, int stride, int s, int n, Key k, bool inclusive) {
+      if (inclusive) {
+        while (s < n && !(k < btree_simd_load<Key>(base, stride, s))) {
+          ++s;
+        }
+      }
+      else {
+        while (s < n && btree_simd_load<Key>(base, stride, s) < k) {
+          ++s;
+        }
+      }
+      return s;
+    }
+
+#ifdef ATLASDB_BTREE_SIMD_X86
+
+  // Integer comparisons in SSE/AVX are signed only. Unsigned keys are mapped
+  // onto signed ones by flipping the sign bit of both sides of the comparison,
+  // which preserves the ordering.
+    template<typename Key>
+    struct btree_simd_bias {
+      static const uint64_t value = std::is_signed<Key>::value ? 0 : (uint64_t(1) << (8 * sizeof(Key) - 1));
+    };
+
+    __attribute__((target("sse4.2")))
+    inline int btree_sse42_search_i32(const char *base, int stride, int n, int32_t k, bool inclusive, int32_t bias) {
+      const __m128i b = _mm_set1_epi32(bias);
+      const __m128i kv = _mm_xor_si128(_mm_set1_epi32(k), b);
+      int i = 0;
+      for (; i + 4 <= n; i += 4) {
+        __m128i v;
+        if (stride == 4) {
+          v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(base + i * 4));
+        }
+        else {
+          v = _mm_set_epi32(btree_simd_load<int32_t>(base, stride, i + 3), btree_simd_load<int32_t>(base, stride, i + 2),
+              btree_simd_load<int32_t>(base, stride, i + 1), btree_simd_load<int32_t>(base, stride, i));
+        }
+        v = _mm_xor_si128(v, b);
+        // Bits are set for the keys which satisfy the predicate.
+        int mask = inclusive ? ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(v, kv))) & 0xf
+            : _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(kv, v)));
+        if (mask != 0xf) {
+          return i + __builtin_ctz(~mask);
+        }
+      }
+      return i;
+    }
+
+    __attribute__((target("sse4.2")))
+    inline int btree_sse42_search_i64(const char *base, int stride, int n, int64_t k, bool inclusive, int64_t bias) {
+      const __m128i b = _mm_set1_epi64x(bias);
+      const __m128i kv = _mm_xor_si128(_mm_set1_epi64x(k), b);
+      int i = 0;
+      for (; i + 2 <= n; i += 2) {
+        __m128i v;
+        if (stride == 8) {
+          v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(base + i * 8));
+        }
+        else {
+          v = _mm_set_epi64x(btree_simd_load<int64_t>(base, stride, i + 1), btree_simd_load<int64_t>(base, stride, i));
+        }
+        v = _mm_xor_si128(v, b);
+        int mask = inclusive ? ~_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(v, kv))) & 0x3
+            : _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(kv, v)));
+        if (mask != 0x3) {
+          return i + __builtin_ctz(~mask);
+        }
+      }
+      return i;
+    }
+
+    __attribute__((target("sse4.2")))
+    inline int btree_sse42_search_f32(const char *base, int stride, int n, float k, bool inclusive) {
+      const __m128 kv = _mm_set1_ps(k);
+      int i = 0;
+      for (; i + 4 <= n; i += 4) {
+        __m128 v;
+        if (stride == 4) {
+          v = _mm_loadu_ps(reinterpret_cast<const float*>(base + i * 4));
+        }
+        else {
+          v = _mm_set_ps(btree_simd_load<float>(base, stride, i + 3), btree_simd_load<float>(base, stride, i + 2),
+              btree_simd_load<float>(base, stride, i + 1), btree_simd_load<float>(base, stride, i));
+        }
+        int mask = _mm_movemask_ps(inclusive ? _mm_cmple_ps(v, kv) : _mm_cmplt_ps(v, kv));
+        if (mask != 0xf) {
+          return i + __builtin_ctz(~mask);
+        }
+      }
+      return i;
+    }
+
+    __attribute__((target("sse4.2")))
+    inline int btree_sse42_search_f64(const char *base, int stride, int n, double k, bool inclusive) {
+      const __m128d kv = _mm_set1_pd(k);
+      int i = 0;
+      for (; i + 2 <= n; i += 2) {
+        __m128d v;
+        if (stride == 8) {
+          v = _mm_loadu_pd(reinterpret_cast<const double*>(base + i * 8));
+        }
+        else {
+          v = _mm_set_pd(btree_simd_load<double>(base, stride, i + 1), btree_simd_load<double>(base, stride, i));
+        }
+        int mask = _mm_movemask_pd(inclusive ? _mm_cmple_pd(v, kv) : _mm_cmplt_pd(v, kv));
+        if (mask != 0x3) {
+          return i + __builtin_ctz(~mask);
+        }
+      }
+      return i;
+    }
+
+  // The AVX2 kernels gather the strided keys of a btree_map node with a single
+  // instruction; the keys of a btree_set node are loaded directly.
+    __attribute__((target("avx2")))
+    inline int btree_avx2_search_i32(const char *base, int stride, int n, int32_t k, bool inclusive, int32_t bias) {
+      const __m256i b = _mm256_set1_epi32(bias);
+      const __m256i kv = _mm256_xor_si256(_mm256_set1_epi32(k), b);
+      const __m256i index = _mm256_mullo_epi32(_mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0), _mm256_set1_epi32(stride));
+      int i = 0;
+      for (; i + 8 <= n; i += 8) {
+        __m256i v;
+        if (stride == 4) {
+          v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(base + i * 4));
+        }
+        else {
+          v = _mm256_i32gather_epi32(reinterpret_cast<const int*>(base + i * stride), index, 1);
+        }
+        v = _mm256_xor_si256(v, b);
+        int mask = inclusive ? ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v, kv))) & 0xff
+            : _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(kv, v)));
+        if (mask != 0xff) {
+          return i + __builtin_ctz(~mask);
+        }
+      }
+      return i;
+    }
+
+    __attribute__((target("avx2")))
+    inline int btree_avx2_search_i64(const char *base, int stride, int n, int64_t k, bool inclusive, int64_t bias) {
+      const __m256i b = _mm256_set1_epi64x(bias);
+      const __m256i kv = _mm256_xor_si256(_mm256_set1_epi64x(k), b);
+      const __m128i index = _mm_mullo_epi32(_mm_set_epi32(3, 2, 1, 0), _mm_set1_epi32(stride));
+      int i = 0;
+      for (; i + 4 <= n; i += 4) {
+        __m256i v;
+        if (stride == 8) {
+          v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(base + i * 8));
+        }
+        else {
+          v = _mm256_i32gather_epi64(reinterpret_cast<const long long*>(base + i * stride), index, 1);
+        }
+        v = _mm256_xor_si256(v, b);
+        int mask = inclusive ? ~_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(v, kv))) & 0xf
+            : _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(kv, v)));
+        if (mask != 0xf) {
+          return i + __builtin_ctz(~mask);
+        }
+      }
+      return i;
+    }
+
+    __attribute__((target("avx2")))
+    inline int btree_avx2_search_f32(const char *base, int stride, int n, float k, bool inclusive) {
+      const __m256 kv = _mm256_set1_ps(k);
+      const __m256i index = _mm256_mullo_epi32(_mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0), _mm256_set1_epi32(stride));
+      int i = 0;
+      for (; i + 8 <= n; i += 8) {
+        __m256 v;
+        if (stride == 4) {
+          v = _mm256_loadu_ps(reinterpret_cast<const float*>(base + i * 4));
+        }
+        else {
+          v = _mm256_i32gather_ps(reinterpret_cast<const float*>(base + i * stride), index, 1);
+        }
+        int mask = _mm256_movemask_ps(inclusive ? _mm256_cmp_ps(v, kv, _CMP_LE_OQ) : _mm256_cmp_ps(v, kv, _CMP_LT_OQ));
+        if (mask != 0xff) {
+          return i + __builtin_ctz(~mask);
+        }
+      }
+      return i;
+    }
+
+    __attribute__((target("avx2")))
+    inline int btree_avx2_search_f64(const char *base, int stride, int n, double k, bool inclusive) {
+      const __m256d kv = _mm256_set1_pd(k);
+      const __m128i index = _mm_mullo_epi32(_mm_set_epi32(3, 2, 1, 0), _mm_set1_epi32(stride));
+      int i = 0;
+      for (; i + 4 <= n; i += 4) {
+        __m256d v;
+        if (stride == 8) {
+          v = _mm256_loadu_pd(reinterpret_cast<const double*>(base + i * 8));
+        }
+        else {
+          // from a zeroed source under an all-ones mask: the plain gather
+          // starts from an undefined vector, which the compiler takes for a
+          // use of an uninitialized value
+          v = _mm256_mask_i32gather_pd(_mm256_setzero_pd(), reinterpret_cast<const double*>(base + i * stride), index,
+              _mm256_castsi256_pd(_mm256_set1_epi64x(-1)), 1);
+        }
+        int mask = _mm256_movemask_pd(inclusive ? _mm256_cmp_pd(v, kv, _CMP_LE_OQ) : _mm256_cmp_pd(v, kv, _CMP_LT_OQ));
+        if (mask != 0xf) {
+          return i + __builtin_ctz(~mask);
+        }
+      }
+      return i;
+    }
+
+  // Routes a key type onto the kernels for its lane type. The kernels search
+  // whole vectors only and leave the tail to btree_scalar_search.
+    template<typename Key, bool Integral = std::is_integral<Key>::value, int Size = sizeof(Key)>
+    struct btree_simd_kernels;
+
+    template<typename Key>
+    struct btree_simd_kernels<Key, true, 4> {
+      static int sse42(const char *base, int stride, int n, Key k, bool inclusive) {
+        return btree_sse42_search_i32(base, stride, n, k, inclusive, btree_simd_bias<Key>::value);
+      }
+      static int avx2(const char *base, int stride, int n, Key k, bool inclusive) {
+        return btree_avx2_search_i32(base, stride, n, k, inclusive, btree_simd_bias<Key>::value);
+      }
+    };
+
+    template<typename Key>
+    struct btree_simd_kernels<Key, true, 8> {
+      static int sse42(const char *base, int stride, int n, Key k, bool inclusive) {
+        return btree_sse42_search_i64(base, stride, n, k, inclusive, btree_simd_bias<Key>::value);
+      }
+      static int avx2(const char *base, int stride, int n, Key k, bool inclusive) {
+        return btree_avx2_search_i64(base, stride, n, k, inclusive, btree_simd_bias<Key>::value);
+      }
+    };
+
+    template<>
+    struct btree_simd_kernels<float, false, 4> {
+      static int sse42(const char *base, int stride, int n, float k, bool inclusive) {
+        return btree_sse42_search_f32(base, stride, n, k, inclusive);
+      }
+      static int avx2(const char *base, int stride, int n, float k, bool inclusive) {
+        return btree_avx2_search_f32(base, stride, n, k, inclusive);
+      }
+    };
+
+    template<>
+    struct btree_simd_kernels<double, false, 8> {
+      static int sse42(const char *base, int stride, int n, double k, bool inclusive) {
+        return btree_sse42_search_f64(base, stride, n, k, inclusive);
+      }
+      static int avx2(const char *base, int stride, int n, double k, bool inclusive) {
+        return btree_avx2_search_f64(base, stride, n, k, inclusive);
+      }
+    };
+
+#endif // ATLASDB_BTREE_SIMD_X86
+
+  // Searches a strided array of n sorted keys starting at base. Returns the
+  // number of keys less than k, or not greater than k if inclusive is set.
+    template<typename Key>
+    struct btree_simd_search {
+      typedef int (*kernel_type)(const char *base, int stride, int n, Key k, bool inclusive);
+
+      static int search(const char *base, int stride, int n, Key k, bool inclusive) {
+        static const kernel_type kernel = select_kernel();
+        int i = kernel ? kernel(base, stride, n, k, inclusive) : 0;
+        return btree_scalar_search<Key>(base, stride, i, n, k, inclusive);
+      }
+
+    private:
+
+      static kernel_type select_kernel() {
+#ifdef ATLASDB_BTREE_SIMD_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+          return &btree_simd_kernels<Key>::avx2;
+        }
+        if (__builtin_cpu_supports("sse4.2")) {
+          return &btree_simd_kernels<Key>::sse42;
+        }
+#endif
+        return nullptr;
+      }
+    };
+
+  } // storage
+} // atlasdb
+
+#endif // ATLASDB_STORAGE_BTREE_BTREE_SIMD_H_
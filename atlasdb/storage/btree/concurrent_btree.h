@@ -0,0 +1,275 @@
+// A btree which can be shared by many reader and writer threads without
+// external synchronisation.
+//
+// concurrent_btree uses optimistic lock coupling: every node carries a
+// version/lock word (see btree_node::latch_fields). Readers never write to
+// shared memory; they note the version of a node before reading it and check
+// it afterwards, starting over from the root if a writer modified the node in
+// the meantime. Writers descend the same way and lock only the leaf they
+// modify, or a node and its parent when the node is full and has to be split.
+// Full nodes are split on the way down, so the parent of a node being split
+// always has room for the new separator.
+//
+// The tree reuses the btree_node layout, but unlike btree it keeps values in
+// the leaves only; the values of an internal node are copies of the largest
+// key in the subtree to their left. Nodes are never merged or freed while the
+// tree is in use, which is what makes it safe for a reader to follow a child
+// pointer it read from a node which was modified concurrently. Erasing values
+// can leave leaves underfull or empty; they are reused by later insertions.
+//
+// Readers copy keys and values out of nodes which may be modified at the same
+// time, so both must be trivially copyable. Nodes are allocated by several
+// writers at once, so the allocator must be thread safe, as std::allocator and
+// btree_node_allocator, whose arena is guarded by a spinlock, are. See
+// concurrent_repository for a storage built on this tree.
+//
+// clear(), verify() and the destructor require that no other thread uses the
+// tree.
+
+#ifndef ATLASDB_STORAGE_BTREE_CONCURRENT_BTREE_H_
+#define ATLASDB_STORAGE_BTREE_CONCURRENT_BTREE_H_
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include <atlasdb/storage/btree/btree.h>
+
+namespace atlasdb {
+  namespace storage {
+
+  // A parameters structure for holding the type parameters for a
+  // concurrent_btree_map.
+    template<typename Key, typename Data, typename Compare, typename Alloc, int TargetNodeSize>
+    struct concurrent_btree_map_params: public btree_map_params<Key, Data, Compare, Alloc, TargetNodeSize> {
+      enum { kConcurrent = true };
+    };
+
+    template<typename Params>
+    class concurrent_btree {
+      typedef concurrent_btree<Params> self_type;
+      typedef btree_node<Params> node_type;
+      typedef typename node_type::base_fields base_fields;
+      typedef typename node_type::leaf_fields leaf_fields;
+      typedef typename node_type::internal_fields internal_fields;
+
+      enum {
+        kNodeValues = node_type::kNodeValues,
+        kMatchMask = node_type::kMatchMask,
+
+        // Set in the version word while a writer modifies the node.
+        kLocked = 2,
+
+        // After this many restarts a thread yields before trying again.
+        kSpinRestarts = 8,
+      };
+
+      // The outcome of a single optimistic attempt of an operation.
+      enum attempt_result {
+        kRestart, kNotFound, kFound, kInserted, kAssigned,
+      };
+
+    public:
+
+      typedef Params params_type;
+      typedef typename Params::key_type key_type;
+      typedef typename Params::data_type data_type;
+      typedef typename Params::mapped_type mapped_type;
+      typedef typename Params::value_type value_type;
+      typedef typename Params::mutable_value_type mutable_value_type;
+      typedef typename Params::key_compare key_compare;
+      typedef typename Params::size_type size_type;
+      typedef typename Params::allocator_type allocator_type;
+      typedef typename allocator_type::template rebind<char>::other internal_allocator_type;
+
+    public:
+
+      concurrent_btree(const key_compare &comp, const allocator_type &alloc);
+
+      concurrent_btree(const self_type&) = delete;
+      self_type& operator=(const self_type&) = delete;
+
+      ~concurrent_btree();
+
+    public:
+
+      // Copies the value with the given key into *value, which may be null.
+      // Returns false if there is no such value.
+      bool find(const key_type &key, mutable_value_type *value) const;
+
+      // Inserts a value unless one with the same key exists. Returns true if
+      // the value was inserted.
+      bool insert_unique(const value_type &v);
+
+      // Inserts a value or overwrites the one with the same key. Returns true if
+      // the value was inserted, false if it was overwritten.
+      bool insert_or_assign(const value_type &v);
+
+      // Erases the value with the given key. Returns true if there was one.
+      bool erase_unique(const key_type &key);
+
+      // Erases all of the values, not thread safe.
+      void clear();
+
+      // Verifies the structure of the tree, not thread safe. Returns the first
+      // problem found, empty if there is none.
+      std::string verify() const;
+
+      size_type size() const { return size_.load(std::memory_order_relaxed); }
+
+      bool empty() const { return size() == 0; }
+
+      const key_compare& key_comp() const { return comp_; }
+
+    private:
+
+      attempt_result try_find(const key_type &key, mutable_value_type *value) const;
+      attempt_result try_insert(const value_type &v, bool assign);
+      attempt_result try_erase(const key_type &key);
+
+      // Descends from the root to the leaf which may hold key. Stores the leaf,
+      // its parent and their versions. Returns false if the descent must be
+      // restarted.
+      bool descend(const key_type &key, node_type **leaf, uint64_t *version, node_type **parent,
+          uint64_t *parent_version) const;
+
+      // Splits the locked, full node, moving half of its values to a new right
+      // sibling, and adds the sibling to the locked parent, or to a new root if
+      // node is the root.
+      void split(node_type *parent, node_type *node);
+
+      // Returns the position of the child of the internal node which may hold
+      // key, or the position of the first value in the leaf not less than key.
+      int position(const node_type *node, const key_type &key) const {
+        return node->lower_bound(key, comp_) & kMatchMask;
+      }
+
+      bool compare_keys(const key_type &x, const key_type &y) const { return btree_compare_keys(comp_, x, y); }
+
+      // Version/lock word routines. read_lock() returns false if the node is
+      // being modified, validate() returns false if the node was modified since
+      // read_lock() returned version, upgrade_lock() locks the node for writing
+      // unless it was modified since.
+      static bool read_lock(const node_type *node, uint64_t *version) {
+        *version = node->version()->load(std::memory_order_acquire);
+        return (*version & kLocked) == 0;
+      }
+
+      static bool validate(const node_type *node, uint64_t version) {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return node->version()->load(std::memory_order_relaxed) == version;
+      }
+
+      static bool upgrade_lock(node_type *node, uint64_t version) {
+        return node->version()->compare_exchange_strong(version, version + kLocked, std::memory_order_acquire);
+      }
+
+      static void unlock(node_type *node) { node->version()->fetch_add(kLocked, std::memory_order_release); }
+
+      static void backoff(int restarts);
+
+      // Node allocation/deletion routines.
+      node_type* new_leaf_node();
+      node_type* new_internal_node();
+      void delete_node(node_type *node);
+      void internal_clear(node_type *node);
+
+      // Verifies the subtree rooted at node, whose keys must be greater than
+      // *lo and not greater than *hi, and adds the number of values in it to
+      // *count. Returns the first problem found, empty if there is none.
+      std::string internal_verify(const node_type *node, const key_type *lo, const key_type *hi,
+          size_type *count) const;
+
+    private:
+
+      key_compare comp_;
+      internal_allocator_type alloc_;
+      std::atomic<node_type*> root_;
+      std::atomic<size_type> size_;
+
+      static_assert(std::is_trivially_copyable<key_type>::value, "concurrent_btree_key_must_be_trivially_copyable");
+      static_assert(std::is_same<data_type, std::false_type>::value || std::is_trivially_copyable<data_type>::value,
+          "concurrent_btree_data_must_be_trivially_copyable");
+    };
+
+  // A map of trivially copyable keys and values which can be shared by many
+  // reader and writer threads. Values are returned by copy since there are no
+  // iterators, a value may be erased or overwritten at any time.
+    template
+    <
+        typename Key,
+        typename Value,
+        typename Compare = std::less<Key>,
+        typename Alloc = std::allocator<std::pair<const Key, Value>>,
+        int TargetNodeSize = 256
+    >
+    class concurrent_btree_map {
+    private:
+
+      typedef concurrent_btree_map<Key, Value, Compare, Alloc, TargetNodeSize> self_type;
+      typedef concurrent_btree_map_params<Key, Value, Compare, Alloc, TargetNodeSize> params_type;
+      typedef concurrent_btree<params_type> btree_type;
+
+    public:
+
+      typedef typename btree_type::key_type key_type;
+      typedef typename btree_type::data_type data_type;
+      typedef typename btree_type::mapped_type mapped_type;
+      typedef typename btree_type::value_type value_type;
+      typedef typename btree_type::key_compare key_compare;
+      typedef typename btree_type::allocator_type allocator_type;
+      typedef typename btree_type::size_type size_type;
+
+    public:
+
+      // Default constructor.
+      concurrent_btree_map(const key_compare &comp = key_compare(), const allocator_type &alloc = allocator_type()) :
+          tree_(comp, alloc) { }
+
+    public:
+
+      // Copies the value mapped to key into *value, which may be null. Returns
+      // false if key is not in the map.
+      bool find(const key_type &key, mapped_type *value) const {
+        typename btree_type::mutable_value_type v;
+        if (!tree_.find(key, &v)) {
+          return false;
+        }
+        if (value) {
+          *value = v.second;
+        }
+        return true;
+      }
+
+      size_type count(const key_type &key) const { return tree_.find(key, nullptr); }
+
+      bool insert(const value_type &x) { return tree_.insert_unique(x); }
+
+      bool insert_or_assign(const key_type &key, const mapped_type &value) {
+        return tree_.insert_or_assign(value_type(key, value));
+      }
+
+      size_type erase(const key_type &key) { return tree_.erase_unique(key); }
+
+      void clear() { tree_.clear(); }
+
+      std::string verify() const { return tree_.verify(); }
+
+      size_type size() const { return tree_.size(); }
+
+      bool empty() const { return tree_.empty(); }
+
+      key_compare key_comp() const { return tree_.key_comp(); }
+
+    private:
+
+      btree_type tree_;
+    };
+
+  } // storage
+} // atlasdb
+
+#endif // ATLASDB_STORAGE_BTREE_CONCURRENT_BTREE_H_
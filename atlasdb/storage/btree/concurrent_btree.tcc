@@ -0,0 +1,380 @@
+// The implementation of concurrent_btree, see concurrent_btree.h.
+
+#ifndef ATLASDB_STORAGE_BTREE_CONCURRENT_BTREE_TCC_
+#define ATLASDB_STORAGE_BTREE_CONCURRENT_BTREE_TCC_
+
+#include <cassert>
+#include <algorithm>
+#include <thread>
+
+#include <atlasdb/storage/btree/concurrent_btree.h>
+
+namespace atlasdb {
+  namespace storage {
+
+    template<typename P>
+    concurrent_btree<P>::concurrent_btree(const key_compare &comp, const allocator_type &alloc) :
+        comp_(comp), alloc_(alloc), root_(nullptr), size_(0) {
+      root_.store(new_leaf_node(), std::memory_order_release);
+    }
+
+    template<typename P>
+    concurrent_btree<P>::~concurrent_btree() {
+      internal_clear(root_.load(std::memory_order_relaxed));
+    }
+
+    template<typename P>
+    bool concurrent_btree<P>::find(const key_type &key, mutable_value_type *value) const {
+      for (int restarts = 0;; ++restarts) {
+        attempt_result res = try_find(key, value);
+        if (res != kRestart) {
+          return res == kFound;
+        }
+        backoff(restarts);
+      }
+    }
+
+    template<typename P>
+    bool concurrent_btree<P>::insert_unique(const value_type &v) {
+      for (int restarts = 0;; ++restarts) {
+        attempt_result res = try_insert(v, false);
+        if (res != kRestart) {
+          return res == kInserted;
+        }
+        backoff(restarts);
+      }
+    }
+
+    template<typename P>
+    bool concurrent_btree<P>::insert_or_assign(const value_type &v) {
+      for (int restarts = 0;; ++restarts) {
+        attempt_result res = try_insert(v, true);
+        if (res != kRestart) {
+          return res == kInserted;
+        }
+        backoff(restarts);
+      }
+    }
+
+    template<typename P>
+    bool concurrent_btree<P>::erase_unique(const key_type &key) {
+      for (int restarts = 0;; ++restarts) {
+        attempt_result res = try_erase(key);
+        if (res != kRestart) {
+          return res == kFound;
+        }
+        backoff(restarts);
+      }
+    }
+
+    template<typename P>
+    void concurrent_btree<P>::clear() {
+      internal_clear(root_.load(std::memory_order_relaxed));
+      root_.store(new_leaf_node(), std::memory_order_release);
+      size_.store(0, std::memory_order_relaxed);
+    }
+
+    template<typename P>
+    std::string concurrent_btree<P>::verify() const {
+      size_type count = 0;
+      std::string error = internal_verify(root_.load(std::memory_order_acquire), nullptr, nullptr, &count);
+      if (error.empty() && count != size()) {
+        error = "the size does not match the number of values";
+      }
+      return error;
+    }
+
+    template<typename P>
+    bool concurrent_btree<P>::descend(const key_type &key, node_type **leaf, uint64_t *version, node_type **parent,
+        uint64_t *parent_version) const {
+      node_type *node = root_.load(std::memory_order_acquire);
+      uint64_t v;
+      if (!read_lock(node, &v) || node != root_.load(std::memory_order_acquire)) {
+        return false;
+      }
+
+      node_type *p = nullptr;
+      uint64_t pv = 0;
+      while (!node->leaf()) {
+        node_type *child = node->child(position(node, key));
+        // The child pointer is only meaningful if node did not change while it
+        // was read. Validating node again after the version of the child was
+        // read makes sure the child was not split in between, which could have
+        // moved key to its new sibling.
+        uint64_t cv;
+        if (!validate(node, v) || !read_lock(child, &cv) || !validate(node, v)) {
+          return false;
+        }
+        p = node;
+        pv = v;
+        node = child;
+        v = cv;
+      }
+
+      *leaf = node;
+      *version = v;
+      if (parent) {
+        *parent = p;
+        *parent_version = pv;
+      }
+      return true;
+    }
+
+    template<typename P>
+    typename concurrent_btree<P>::attempt_result concurrent_btree<P>::try_find(const key_type &key,
+        mutable_value_type *value) const {
+      node_type *leaf;
+      uint64_t v;
+      if (!descend(key, &leaf, &v, nullptr, nullptr)) {
+        return kRestart;
+      }
+
+      int pos = position(leaf, key);
+      bool found = pos < leaf->count() && !compare_keys(key, leaf->key(pos));
+      if (found && value) {
+        *value = *leaf->mutable_value(pos);
+      }
+      if (!validate(leaf, v)) {
+        return kRestart;
+      }
+      return found ? kFound : kNotFound;
+    }
+
+    template<typename P>
+    typename concurrent_btree<P>::attempt_result concurrent_btree<P>::try_insert(const value_type &x, bool assign) {
+      const key_type &key = params_type::key(x);
+
+      node_type *node = root_.load(std::memory_order_acquire);
+      uint64_t v;
+      if (!read_lock(node, &v) || node != root_.load(std::memory_order_acquire)) {
+        return kRestart;
+      }
+
+      node_type *p = nullptr;
+      uint64_t pv = 0;
+      for (;;) {
+        if (node->count() == kNodeValues) {
+          // Split full nodes on the way down so the parent of any node being
+          // split has room for one more child.
+          if (p && !upgrade_lock(p, pv)) {
+            return kRestart;
+          }
+          if (!upgrade_lock(node, v)) {
+            if (p) unlock(p);
+            return kRestart;
+          }
+          if (!p && node != root_.load(std::memory_order_relaxed)) {
+            // The root was split since we read it, node has a parent now.
+            unlock(node);
+            return kRestart;
+          }
+          split(p, node);
+          unlock(node);
+          if (p) unlock(p);
+          return kRestart;
+        }
+
+        if (node->leaf()) {
+          break;
+        }
+
+        node_type *child = node->child(position(node, key));
+        uint64_t cv;
+        if (!validate(node, v) || !read_lock(child, &cv) || !validate(node, v)) {
+          return kRestart;
+        }
+        p = node;
+        pv = v;
+        node = child;
+        v = cv;
+      }
+
+      int pos = position(node, key);
+      bool found = pos < node->count() && !compare_keys(key, node->key(pos));
+      if (found && !assign) {
+        return validate(node, v) ? kFound : kRestart;
+      }
+
+      if (!upgrade_lock(node, v)) {
+        return kRestart;
+      }
+      if (found) {
+        *node->mutable_value(pos) = x;
+        unlock(node);
+        return kAssigned;
+      }
+
+      int count = node->count();
+      std::copy_backward(node->mutable_value(pos), node->mutable_value(count), node->mutable_value(count + 1));
+      *node->mutable_value(pos) = x;
+      node->set_count(count + 1);
+      unlock(node);
+
+      size_.fetch_add(1, std::memory_order_relaxed);
+      return kInserted;
+    }
+
+    template<typename P>
+    typename concurrent_btree<P>::attempt_result concurrent_btree<P>::try_erase(const key_type &key) {
+      node_type *leaf;
+      uint64_t v;
+      if (!descend(key, &leaf, &v, nullptr, nullptr)) {
+        return kRestart;
+      }
+
+      int pos = position(leaf, key);
+      bool found = pos < leaf->count() && !compare_keys(key, leaf->key(pos));
+      if (!found) {
+        return validate(leaf, v) ? kNotFound : kRestart;
+      }
+
+      if (!upgrade_lock(leaf, v)) {
+        return kRestart;
+      }
+      int count = leaf->count();
+      std::copy(leaf->mutable_value(pos + 1), leaf->mutable_value(count), leaf->mutable_value(pos));
+      leaf->set_count(count - 1);
+      unlock(leaf);
+
+      size_.fetch_sub(1, std::memory_order_relaxed);
+      return kFound;
+    }
+
+    template<typename P>
+    void concurrent_btree<P>::split(node_type *parent, node_type *node) {
+      int count = node->count();
+      int half = count / 2;
+      node_type *sibling;
+      mutable_value_type separator;
+
+      if (node->leaf()) {
+        // The separator is a copy of the largest key staying in node.
+        sibling = new_leaf_node();
+        std::copy(node->mutable_value(half), node->mutable_value(count), sibling->mutable_value(0));
+        sibling->set_count(count - half);
+        separator = *node->mutable_value(half - 1);
+      }
+      else {
+        // The middle separator moves up to the parent.
+        sibling = new_internal_node();
+        std::copy(node->mutable_value(half + 1), node->mutable_value(count), sibling->mutable_value(0));
+        for (int i = half + 1; i <= count; ++i) {
+          sibling->set_child_link(i - half - 1, node->child(i));
+        }
+        sibling->set_count(count - half - 1);
+        separator = *node->mutable_value(half);
+      }
+      node->set_count(half);
+
+      if (parent == nullptr) {
+        node_type *root = new_internal_node();
+        *root->mutable_value(0) = separator;
+        root->set_child_link(0, node);
+        root->set_child_link(1, sibling);
+        root->set_count(1);
+        root_.store(root, std::memory_order_release);
+        return;
+      }
+
+      int pos = 0;
+      while (parent->child(pos) != node) {
+        ++pos;
+      }
+      int pcount = parent->count();
+      assert(pcount < kNodeValues);
+      std::copy_backward(parent->mutable_value(pos), parent->mutable_value(pcount), parent->mutable_value(pcount + 1));
+      for (int i = pcount; i > pos; --i) {
+        parent->set_child_link(i + 1, parent->child(i));
+      }
+      *parent->mutable_value(pos) = separator;
+      parent->set_child_link(pos + 1, sibling);
+      parent->set_count(pcount + 1);
+    }
+
+    template<typename P>
+    void concurrent_btree<P>::backoff(int restarts) {
+      if (restarts >= kSpinRestarts) {
+        std::this_thread::yield();
+      }
+    }
+
+    template<typename P>
+    typename concurrent_btree<P>::node_type* concurrent_btree<P>::new_leaf_node() {
+      leaf_fields *p = reinterpret_cast<leaf_fields*>(alloc_.allocate(sizeof(leaf_fields)));
+      node_type *n = node_type::init_leaf(p, nullptr, kNodeValues);
+      n->version()->store(0, std::memory_order_relaxed);
+      return n;
+    }
+
+    template<typename P>
+    typename concurrent_btree<P>::node_type* concurrent_btree<P>::new_internal_node() {
+      internal_fields *p = reinterpret_cast<internal_fields*>(alloc_.allocate(sizeof(internal_fields)));
+      node_type *n = node_type::init_internal(p, nullptr);
+      n->version()->store(0, std::memory_order_relaxed);
+      return n;
+    }
+
+    template<typename P>
+    void concurrent_btree<P>::delete_node(node_type *node) {
+      if (node->leaf()) {
+        alloc_.deallocate(reinterpret_cast<char*>(node), sizeof(leaf_fields));
+      }
+      else {
+        alloc_.deallocate(reinterpret_cast<char*>(node), sizeof(internal_fields));
+      }
+    }
+
+    template<typename P>
+    void concurrent_btree<P>::internal_clear(node_type *node) {
+      if (!node->leaf()) {
+        for (int i = 0; i <= node->count(); ++i) {
+          internal_clear(node->child(i));
+        }
+      }
+      delete_node(node);
+    }
+
+    template<typename P>
+    std::string concurrent_btree<P>::internal_verify(const node_type *node, const key_type *lo,
+        const key_type *hi, size_type *count) const {
+      if (node->version()->load(std::memory_order_relaxed) & kLocked) {
+        return "a node is still locked";
+      }
+      if (node->count() > kNodeValues) {
+        return "a node holds more values than it can";
+      }
+      for (int i = 1; i < node->count(); ++i) {
+        if (!compare_keys(node->key(i - 1), node->key(i))) {
+          return "the keys of a node are out of order";
+        }
+      }
+      if (node->count() > 0 && ((lo && !compare_keys(*lo, node->key(0)))
+          || (hi && compare_keys(*hi, node->key(node->count() - 1))))) {
+        return "the keys of a node are out of the bounds of its parent";
+      }
+
+      if (node->leaf()) {
+        *count += node->count();
+        return std::string();
+      }
+
+      if (node->count() == 0) {
+        return "an internal node is empty";
+      }
+      for (int i = 0; i <= node->count(); ++i) {
+        if (node->child(i) == nullptr) {
+          return "a child of an internal node is missing";
+        }
+        std::string error = internal_verify(node->child(i), (i == 0) ? lo : &node->key(i - 1),
+            (i == node->count()) ? hi : &node->key(i), count);
+        if (!error.empty()) {
+          return error;
+        }
+      }
+      return std::string();
+    }
+
+  } // storage
+} // atlasdb
+
+#endif // ATLASDB_STORAGE_BTREE_CONCURRENT_BTREE_TCC_
@@ -0,0 +1,153 @@
+#ifndef ATLASDB_STORAGE_CONCURRENT_REPOSITORY_H_
+#define ATLASDB_STORAGE_CONCURRENT_REPOSITORY_H_
+
+#include <functional>
+#include <string>
+#include <utility>
+
+#include <boost/optional.hpp>
+
+#include <atlasdb/storage/btree/btree_allocator.h>
+#include <atlasdb/storage/btree/concurrent_btree.h>
+
+#include <atlasdb/storage/storage_base.h>
+#include <atlasdb/storage/storage_error.h>
+
+namespace atlasdb {
+  namespace storage {
+
+    using std::string;
+
+    /**
+     * A repository of trivially copyable keys and values held by a single
+     * concurrent_btree_map, which any number of threads read and write at once
+     * without a lock: readers never block and writers lock only the btree
+     * leaves they modify. Where sharded_repository takes a lock per shard and
+     * keeps records in key order, this one scales with the readers of hot
+     * keys, but has no iterators and no range operations.
+     *
+     * put(), insert(), get(), exists() and del() may be called from several
+     * threads at once; truncate() and verify() need the storage to themselves.
+     * The storage is in memory only, it has no log.
+     * */
+    template<typename Key, typename Value, typename Ikey>
+    class concurrent_repository : virtual public storage_base {
+    public:
+
+      typedef Key key_type;
+      typedef Value value_type;
+      typedef std::pair<key_type, value_type> node_type;
+      typedef std::less<key_type> key_compare;
+
+      // nodes are carved out of an arena whose allocations are spinlocked, and
+      // are not freed before the storage is truncated
+      typedef btree_node_allocator<std::pair<const key_type, value_type>> allocator_type;
+      typedef concurrent_btree_map<key_type, value_type, key_compare, allocator_type> container_type;
+
+      typedef storage_base base_type;
+      typedef concurrent_repository<Key, Value, Ikey> self_type;
+
+    public:
+
+      concurrent_repository() = default;
+
+      concurrent_repository(const string& table) : storage_base(table) {
+        open(table);
+      }
+
+      virtual ~concurrent_repository() {
+        close();
+      }
+
+    public:
+
+      /**
+       * open a primary storage for reading and writing
+       * @return true if success
+       */
+      bool open(const string&) {
+        return false;
+      }
+
+      /**
+       * close this storage
+       */
+      virtual void close() {
+      }
+
+    public:
+
+      /**
+       * put data nodes to the storage, overwriting the data of key if any
+       * @return true if success
+       */
+      bool put(const key_type& key, const value_type& value) {
+        _container.insert_or_assign(key, value);
+        return true;
+      }
+
+      /**
+       * put a data node unless key is in the storage already
+       * @return true if it was put
+       */
+      bool insert(const key_type& key, const value_type& value) {
+        return _container.insert(std::make_pair(key, value));
+      }
+
+      /**
+       * Simple fetch a data block with a given key, a copy of it since another
+       * thread may overwrite or delete it at any time
+       */
+      boost::optional<value_type> get(const key_type& key) const {
+        value_type value;
+        return _container.find(key, &value) ? boost::optional<value_type>(value) : boost::optional<value_type>();
+      }
+
+      bool exists(const key_type& key) const {
+        return _container.count(key) != 0;
+      }
+
+      /**
+       * delete an existing data node in the storage
+       */
+      void del(const key_type& key) {
+        _container.erase(key);
+      }
+
+      /**
+       * delete all of the records
+       * @notice not thread safe
+       */
+      void truncate() {
+        _container.clear();
+      }
+
+      /**
+       * check the structure of the btree
+       * @throw storage_error(verify_bad) if it is broken
+       * @notice not thread safe
+       */
+      void verify() const {
+        std::string error = _container.verify();
+        if (!error.empty()) {
+          throw storage_error(make_error_code(errc::verify_bad), error);
+        }
+      }
+
+    public:
+
+      size_t count() const {
+        return _container.size();
+      }
+
+      bool empty() const { return _container.empty(); }
+
+    private:
+
+      container_type _container;
+    };
+
+  } // storage
+} // atlasdb
+
+#endif // ATLASDB_STORAGE_CONCURRENT_REPOSITORY_H_
@@ -0,0 +1,591 @@
+/*
+ * roaring_bitmap.ipp
+ *
+ *  Created on: Oct 18, 2026
+ */
+
+#include <algorithm>
+#include <iterator>
+
+#include <atlasdb/storage/roaring_bitmap.h>
+
+#if !defined(ATLASDB_BITMAP_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) \
+  && (defined(__clang__) || (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#define ATLASDB_BITMAP_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+namespace atlasdb {
+  namespace storage {
+
+    namespace {
+
+      // the bitset kernels leave the result in a and return its cardinality
+      typedef uint32_t (*bitset_kernel)(uint64_t* a, const uint64_t* b);
+
+      // the array kernel writes the integers of both sorted arrays to out
+      // and returns their number
+      typedef size_t (*array_kernel)(const uint16_t* a, size_t na, const uint16_t* b, size_t nb, uint16_t* out);
+
+      uint32_t bitset_and(uint64_t* a, const uint64_t* b) {
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < roaring_bitmap::kBitsetWords; ++i) {
+          a[i] &= b[i];
+          n += __builtin_popcountll(a[i]);
+        }
+        return n;
+      }
+
+      uint32_t bitset_or(uint64_t* a, const uint64_t* b) {
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < roaring_bitmap::kBitsetWords; ++i) {
+          a[i] |= b[i];
+          n += __builtin_popcountll(a[i]);
+        }
+        return n;
+      }
+
+      uint32_t bitset_andnot(uint64_t* a, const uint64_t* b) {
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < roaring_bitmap::kBitsetWords; ++i) {
+          a[i] &= ~b[i];
+          n += __builtin_popcountll(a[i]);
+        }
+        return n;
+      }
+
+      // the tail of the arrays, or all of them, merged one integer at a time
+      size_t array_intersect(const uint16_t* a, size_t na, const uint16_t* b, size_t nb, uint16_t* out) {
+        size_t i = 0, j = 0, n = 0;
+        while (i < na && j < nb) {
+          if (a[i] < b[j]) {
+            ++i;
+          }
+          else if (b[j] < a[i]) {
+            ++j;
+          }
+          else {
+            out[n++] = a[i];
+            ++i;
+            ++j;
+          }
+        }
+        return n;
+      }
+
+#ifdef ATLASDB_BITMAP_SIMD_X86
+
+      // The compiler turns the popcounts into popcnt instructions, which all
+      // of the CPUs with AVX2 have.
+      __attribute__((target("avx2,popcnt")))
+      uint32_t bitset_and_avx2(uint64_t* a, const uint64_t* b) {
+        for (uint32_t i = 0; i < roaring_bitmap::kBitsetWords; i += 4) {
+          __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+          __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+          _mm256_storeu_si256(reinterpret_cast<__m256i*>(a + i), _mm256_and_si256(va, vb));
+        }
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < roaring_bitmap::kBitsetWords; ++i) {
+          n += __builtin_popcountll(a[i]);
+        }
+        return n;
+      }
+
+      __attribute__((target("avx2,popcnt")))
+      uint32_t bitset_or_avx2(uint64_t* a, const uint64_t* b) {
+        for (uint32_t i = 0; i < roaring_bitmap::kBitsetWords; i += 4) {
+          __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+          __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+          _mm256_storeu_si256(reinterpret_cast<__m256i*>(a + i), _mm256_or_si256(va, vb));
+        }
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < roaring_bitmap::kBitsetWords; ++i) {
+          n += __builtin_popcountll(a[i]);
+        }
+        return n;
+      }
+
+      __attribute__((target("avx2,popcnt")))
+      uint32_t bitset_andnot_avx2(uint64_t* a, const uint64_t* b) {
+        for (uint32_t i = 0; i < roaring_bitmap::kBitsetWords; i += 4) {
+          __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+          __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+          // andnot(x, y) is ~x & y
+          _mm256_storeu_si256(reinterpret_cast<__m256i*>(a + i), _mm256_andnot_si256(vb, va));
+        }
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < roaring_bitmap::kBitsetWords; ++i) {
+          n += __builtin_popcountll(a[i]);
+        }
+        return n;
+      }
+
+      // Compares every 8 integers of a against 8 of b at once: the string
+      // instruction sets a bit for every integer of a equal to any of b. The
+      // block whose last integer is the smaller one is done with, both if the
+      // last integers are equal. The lengths are explicit since 0 is an
+      // integer like any other.
+      __attribute__((target("sse4.2,popcnt")))
+      size_t array_intersect_sse42(const uint16_t* a, size_t na, const uint16_t* b, size_t nb, uint16_t* out) {
+        const int mode = _SIDD_UWORD_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_BIT_MASK;
+        size_t ea = na / 8 * 8, eb = nb / 8 * 8;
+        size_t i = 0, j = 0, n = 0;
+        if (ea && eb) {
+          __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a));
+          __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b));
+          for (;;) {
+            __m128i r = _mm_cmpestrm(vb, 8, va, 8, mode);
+            for (uint32_t mask = _mm_extract_epi32(r, 0); mask; mask &= mask - 1) {
+              out[n++] = a[i + __builtin_ctz(mask)];
+            }
+            uint16_t la = a[i + 7], lb = b[j + 7];
+            if (la <= lb) {
+              i += 8;
+              if (i == ea) {
+                break;
+              }
+              va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+            }
+            if (lb <= la) {
+              j += 8;
+              if (j == eb) {
+                break;
+              }
+              vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + j));
+            }
+          }
+        }
+        // the integers of a already written are less than those left in b,
+        // and the other way round
+        return n + array_intersect(a + i, na - i, b + j, nb - j, out + n);
+      }
+
+#endif // ATLASDB_BITMAP_SIMD_X86
+
+      struct bitmap_kernels {
+        bitset_kernel bitset_and;
+        bitset_kernel bitset_or;
+        bitset_kernel bitset_andnot;
+        array_kernel array_intersect;
+
+        static const bitmap_kernels& get() {
+          static const bitmap_kernels kernels = select();
+          return kernels;
+        }
+
+      private:
+
+        static bitmap_kernels select() {
+          bitmap_kernels k = { &storage::bitset_and, &storage::bitset_or, &storage::bitset_andnot,
+              &storage::array_intersect };
+#ifdef ATLASDB_BITMAP_SIMD_X86
+          __builtin_cpu_init();
+          if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+            k.bitset_and = &bitset_and_avx2;
+            k.bitset_or = &bitset_or_avx2;
+            k.bitset_andnot = &bitset_andnot_avx2;
+          }
+          if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt")) {
+            k.array_intersect = &array_intersect_sse42;
+          }
+#endif
+          return k;
+        }
+      };
+
+      inline bool test_bit(const std::vector<uint64_t>& bits, uint16_t x) {
+        return bits[x >> 6] >> (x & 63) & 1;
+      }
+
+    }
+
+    bool roaring_bitmap::container::contains(uint16_t x) const {
+      switch (kind) {
+      case kArray:
+        return std::binary_search(values.begin(), values.end(), x);
+      case kBitset:
+        return test_bit(bits, x);
+      case kRun: {
+        // the last run starting at x or before
+        size_t lo = 0, hi = values.size() / 2;
+        while (lo < hi) {
+          size_t mid = (lo + hi) / 2;
+          if (values[mid * 2] <= x) {
+            lo = mid + 1;
+          }
+          else {
+            hi = mid;
+          }
+        }
+        return lo > 0 && x - values[lo * 2 - 2] <= values[lo * 2 - 1];
+      }
+      }
+      return false;
+    }
+
+    void roaring_bitmap::container::expand() {
+      if (kind != kRun) {
+        return;
+      }
+      if (cardinality > kArrayMax) {
+        to_bitset();
+      }
+      else {
+        to_array();
+      }
+    }
+
+    void roaring_bitmap::container::normalize() {
+      if (kind == kBitset && cardinality <= kArrayMax) {
+        to_array();
+      }
+      else if (kind == kArray && cardinality > kArrayMax) {
+        to_bitset();
+      }
+    }
+
+    void roaring_bitmap::container::to_bitset() {
+      std::vector<uint64_t> b(kBitsetWords);
+      for_each(0, [&b](uint32_t x) {
+        b[x >> 6] |= uint64_t(1) << (x & 63);
+        return true;
+      });
+      bits.swap(b);
+      std::vector<uint16_t>().swap(values);
+      kind = kBitset;
+    }
+
+    void roaring_bitmap::container::to_array() {
+      std::vector<uint16_t> v;
+      v.reserve(cardinality);
+      for_each(0, [&v](uint32_t x) {
+        v.push_back(uint16_t(x));
+        return true;
+      });
+      values.swap(v);
+      std::vector<uint64_t>().swap(bits);
+      kind = kArray;
+    }
+
+    roaring_bitmap::container_iterator roaring_bitmap::find(uint16_t key) {
+      return std::lower_bound(_containers.begin(), _containers.end(), key, [](const container& c, uint16_t k) {
+        return c.key < k;
+      });
+    }
+
+    roaring_bitmap::const_container_iterator roaring_bitmap::find(uint16_t key) const {
+      return std::lower_bound(_containers.begin(), _containers.end(), key, [](const container& c, uint16_t k) {
+        return c.key < k;
+      });
+    }
+
+    bool roaring_bitmap::add(value_type x) {
+      uint16_t key = x >> 16, low = uint16_t(x);
+      container_iterator c = find(key);
+      if (c == _containers.end() || c->key != key) {
+        c = _containers.insert(c, container(key));
+      }
+      c->expand();
+      if (c->kind == kBitset) {
+        uint64_t& w = c->bits[low >> 6];
+        uint64_t bit = uint64_t(1) << (low & 63);
+        if (w & bit) {
+          return false;
+        }
+        w |= bit;
+        ++c->cardinality;
+        return true;
+      }
+
+      auto it = std::lower_bound(c->values.begin(), c->values.end(), low);
+      if (it != c->values.end() && *it == low) {
+        return false;
+      }
+      c->values.insert(it, low);
+      ++c->cardinality;
+      c->normalize();
+      return true;
+    }
+
+    bool roaring_bitmap::remove(value_type x) {
+      uint16_t key = x >> 16, low = uint16_t(x);
+      container_iterator c = find(key);
+      if (c == _containers.end() || c->key != key || !c->contains(low)) {
+        return false;
+      }
+      c->expand();
+      if (c->kind == kBitset) {
+        c->bits[low >> 6] &= ~(uint64_t(1) << (low & 63));
+      }
+      else {
+        c->values.erase(std::lower_bound(c->values.begin(), c->values.end(), low));
+      }
+      if (--c->cardinality == 0) {
+        _containers.erase(c);
+      }
+      else {
+        c->normalize();
+      }
+      return true;
+    }
+
+    bool roaring_bitmap::contains(value_type x) const {
+      const_container_iterator c = find(x >> 16);
+      return c != _containers.end() && c->key == x >> 16 && c->contains(uint16_t(x));
+    }
+
+    uint64_t roaring_bitmap::cardinality() const {
+      uint64_t n = 0;
+      for (const container& c : _containers) {
+        n += c.cardinality;
+      }
+      return n;
+    }
+
+    size_t roaring_bitmap::optimize() {
+      size_t n = 0;
+      std::vector<uint16_t> runs;
+      for (container& c : _containers) {
+        if (c.kind == kRun) {
+          ++n;
+          continue;
+        }
+        runs.clear();
+        c.for_each(0, [&runs](uint32_t x) {
+          if (!runs.empty() && uint32_t(runs[runs.size() - 2]) + runs.back() + 1 == x) {
+            ++runs.back();
+          }
+          else {
+            runs.push_back(uint16_t(x));
+            runs.push_back(0);
+          }
+          return true;
+        });
+        size_t size = c.kind == kArray ? c.values.size() * 2 : kBitsetWords * 8;
+        if (runs.size() * 2 < size) {
+          c.values.assign(runs.begin(), runs.end());
+          std::vector<uint64_t>().swap(c.bits);
+          c.kind = kRun;
+          ++n;
+        }
+      }
+      return n;
+    }
+
+    size_t roaring_bitmap::bytes() const {
+      size_t n = _containers.capacity() * sizeof(container);
+      for (const container& c : _containers) {
+        n += c.values.capacity() * sizeof(uint16_t) + c.bits.capacity() * sizeof(uint64_t);
+      }
+      return n;
+    }
+
+    void roaring_bitmap::intersect(container& a, const container& b) {
+      if (b.kind == kRun) {
+        container c = b;
+        c.expand();
+        intersect(a, c);
+        return;
+      }
+      a.expand();
+      const bitmap_kernels& k = bitmap_kernels::get();
+      if (a.kind == kArray && b.kind == kArray) {
+        std::vector<uint16_t> v(std::min(a.values.size(), b.values.size()));
+        v.resize(k.array_intersect(a.values.data(), a.values.size(), b.values.data(), b.values.size(), v.data()));
+        a.values.swap(v);
+        a.cardinality = a.values.size();
+      }
+      else if (a.kind == kArray) {
+        a.values.erase(std::remove_if(a.values.begin(), a.values.end(), [&b](uint16_t x) {
+          return !test_bit(b.bits, x);
+        }), a.values.end());
+        a.cardinality = a.values.size();
+      }
+      else if (b.kind == kArray) {
+        std::vector<uint16_t> v;
+        v.reserve(b.values.size());
+        for (uint16_t x : b.values) {
+          if (test_bit(a.bits, x)) {
+            v.push_back(x);
+          }
+        }
+        a.values.swap(v);
+        std::vector<uint64_t>().swap(a.bits);
+        a.kind = kArray;
+        a.cardinality = a.values.size();
+      }
+      else {
+        a.cardinality = k.bitset_and(a.bits.data(), b.bits.data());
+      }
+      a.normalize();
+    }
+
+    void roaring_bitmap::unite(container& a, const container& b) {
+      if (b.kind == kRun) {
+        container c = b;
+        c.expand();
+        unite(a, c);
+        return;
+      }
+      a.expand();
+      if (a.kind == kArray && b.kind == kArray && a.cardinality + b.cardinality <= kArrayMax) {
+        std::vector<uint16_t> v;
+        v.reserve(a.values.size() + b.values.size());
+        std::set_union(a.values.begin(), a.values.end(), b.values.begin(), b.values.end(), std::back_inserter(v));
+        a.values.swap(v);
+        a.cardinality = a.values.size();
+        return;
+      }
+      if (a.kind == kArray) {
+        a.to_bitset();
+      }
+      if (b.kind == kArray) {
+        for (uint16_t x : b.values) {
+          uint64_t& w = a.bits[x >> 6];
+          uint64_t bit = uint64_t(1) << (x & 63);
+          a.cardinality += !(w & bit);
+          w |= bit;
+        }
+      }
+      else {
+        a.cardinality = bitmap_kernels::get().bitset_or(a.bits.data(), b.bits.data());
+      }
+      a.normalize();
+    }
+
+    void roaring_bitmap::subtract(container& a, const container& b) {
+      if (b.kind == kRun) {
+        container c = b;
+        c.expand();
+        subtract(a, c);
+        return;
+      }
+      a.expand();
+      if (a.kind == kArray && b.kind == kArray) {
+        std::vector<uint16_t> v;
+        v.reserve(a.values.size());
+        std::set_difference(a.values.begin(), a.values.end(), b.values.begin(), b.values.end(), std::back_inserter(v));
+        a.values.swap(v);
+        a.cardinality = a.values.size();
+      }
+      else if (a.kind == kArray) {
+        a.values.erase(std::remove_if(a.values.begin(), a.values.end(), [&b](uint16_t x) {
+          return test_bit(b.bits, x);
+        }), a.values.end());
+        a.cardinality = a.values.size();
+      }
+      else if (b.kind == kArray) {
+        for (uint16_t x : b.values) {
+          uint64_t& w = a.bits[x >> 6];
+          uint64_t bit = uint64_t(1) << (x & 63);
+          a.cardinality -= !!(w & bit);
+          w &= ~bit;
+        }
+      }
+      else {
+        a.cardinality = bitmap_kernels::get().bitset_andnot(a.bits.data(), b.bits.data());
+      }
+      a.normalize();
+    }
+
+    roaring_bitmap& roaring_bitmap::operator&=(const roaring_bitmap& x) {
+      auto out = _containers.begin();
+      auto it = x._containers.begin();
+      for (container& c : _containers) {
+        while (it != x._containers.end() && it->key < c.key) {
+          ++it;
+        }
+        if (it == x._containers.end()) {
+          break;
+        }
+        if (it->key == c.key) {
+          intersect(c, *it);
+          if (c.cardinality) {
+            if (&*out != &c) {
+              *out = std::move(c);
+            }
+            ++out;
+          }
+        }
+      }
+      _containers.erase(out, _containers.end());
+      return *this;
+    }
+
+    roaring_bitmap& roaring_bitmap::operator|=(const roaring_bitmap& x) {
+      std::vector<container> result;
+      result.reserve(_containers.size() + x._containers.size());
+      auto a = _containers.begin();
+      auto b = x._containers.begin();
+      while (a != _containers.end() || b != x._containers.end()) {
+        if (b == x._containers.end() || (a != _containers.end() && a->key < b->key)) {
+          result.push_back(std::move(*a++));
+        }
+        else if (a == _containers.end() || b->key < a->key) {
+          result.push_back(*b++);
+        }
+        else {
+          unite(*a, *b++);
+          result.push_back(std::move(*a++));
+        }
+      }
+      _containers.swap(result);
+      return *this;
+    }
+
+    roaring_bitmap& roaring_bitmap::operator-=(const roaring_bitmap& x) {
+      auto out = _containers.begin();
+      auto it = x._containers.begin();
+      for (container& c : _containers) {
+        while (it != x._containers.end() && it->key < c.key) {
+          ++it;
+        }
+        if (it != x._containers.end() && it->key == c.key) {
+          subtract(c, *it);
+        }
+        if (c.cardinality) {
+          if (&*out != &c) {
+            *out = std::move(c);
+          }
+          ++out;
+        }
+      }
+      _containers.erase(out, _containers.end());
+      return *this;
+    }
+
+    roaring_bitmap operator&(const roaring_bitmap& a, const roaring_bitmap& b) {
+      // the result is no larger than the smaller set
+      roaring_bitmap r = a.cardinality() <= b.cardinality() ? a : b;
+      r &= a.cardinality() <= b.cardinality() ? b : a;
+      return r;
+    }
+
+    bool roaring_bitmap::operator==(const roaring_bitmap& x) const {
+      if (_containers.size() != x._containers.size()) {
+        return false;
+      }
+      for (size_t i = 0; i < _containers.size(); ++i) {
+        const container& a = _containers[i];
+        const container& b = x._containers[i];
+        if (a.key != b.key || a.cardinality != b.cardinality) {
+          return false;
+        }
+        if (a.kind == kRun || b.kind == kRun) {
+          // arrays and bitsets are the same for the same cardinality
+          container ca = a, cb = b;
+          ca.expand();
+          cb.expand();
+          if (ca.values != cb.values || ca.bits != cb.bits) {
+            return false;
+          }
+        }
+        else if (a.values != b.values || a.bits != b.bits) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+  } // storage
+} // atlasdb
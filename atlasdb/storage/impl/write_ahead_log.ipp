@@ -0,0 +1,460 @@
+/*
+ * write_ahead_log.ipp
+ *
+ *  Created on: Oct 18, 2026
+ */
+
+#include <dirent.h>
+
+#include <algorithm>
+#include <cinttypes>
+
+#include <atlasdb/storage/write_ahead_log.h>
+
+namespace atlasdb {
+  namespace storage {
+
+    namespace {
+
+      const char log_magic[8] = { 'A', 'T', 'L', 'A', 'S', 'L', 'O', 'G' };
+
+      // records larger than that are taken for garbage left by a crash
+      const uint32_t max_record_size = uint32_t(1) << 31;
+
+      storage_error recovery_error(const string& what) {
+        return storage_error(make_error_code(errc::run_recovery), what);
+      }
+
+      bool write_all(int fd, const char* p, size_t n) {
+        while (n > 0) {
+          ssize_t r = ::write(fd, p, n);
+          if (r < 0) {
+            if (errno == EINTR) {
+              continue;
+            }
+            return false;
+          }
+          p += r;
+          n -= r;
+        }
+        return true;
+      }
+
+    }
+
+    uint32_t log_crc32(uint32_t crc, const void* p, size_t n) {
+      // slicing by 8: a table per byte of a 64 bit word, so that a word is
+      // folded in per 8 lookups with no dependency between them
+      static const struct tables {
+        uint32_t entries[8][256];
+        tables() {
+          for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+              c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            }
+            entries[0][i] = c;
+          }
+          for (uint32_t i = 0; i < 256; ++i) {
+            for (int t = 1; t < 8; ++t) {
+              entries[t][i] = entries[0][entries[t - 1][i] & 0xff] ^ (entries[t - 1][i] >> 8);
+            }
+          }
+        }
+      } t;
+
+      const unsigned char* b = static_cast<const unsigned char*>(p);
+      crc = ~crc;
+      for (; n >= 8; n -= 8, b += 8) {
+        uint32_t lo, hi;
+        std::memcpy(&lo, b, 4);
+        std::memcpy(&hi, b + 4, 4);
+        lo ^= crc;
+        crc = t.entries[7][lo & 0xff] ^ t.entries[6][(lo >> 8) & 0xff] ^ t.entries[5][(lo >> 16) & 0xff]
+            ^ t.entries[4][lo >> 24] ^ t.entries[3][hi & 0xff] ^ t.entries[2][(hi >> 8) & 0xff]
+            ^ t.entries[1][(hi >> 16) & 0xff] ^ t.entries[0][hi >> 24];
+      }
+      if (n >= 4) {
+        uint32_t w;
+        std::memcpy(&w, b, 4);
+        w ^= crc;
+        crc = t.entries[3][w & 0xff] ^ t.entries[2][(w >> 8) & 0xff] ^ t.entries[1][(w >> 16) & 0xff]
+            ^ t.entries[0][w >> 24];
+        n -= 4;
+        b += 4;
+      }
+      for (; n > 0; --n, ++b) {
+        crc = t.entries[0][(crc ^ *b) & 0xff] ^ (crc >> 8);
+      }
+      return ~crc;
+    }
+
+    write_ahead_log::write_ahead_log(const string& path, lsn_type start, const log_options& options) :
+        _path(path), _options(options), _buffer(options.buffer_size), _reserved(start), _completed(start),
+        _written(start), _synced(start), _failed(false), _sync_waiters(0), _space_waiters(0), _stop(false), _fd(-1) {
+      if (_buffer.size() < kRecordHeader || (_buffer.size() & (_buffer.size() - 1)) != 0) {
+        throw storage_error(make_error_code(errc::invalid_argument), "log buffer size not a power of 2");
+      }
+      _segments = segments(path);
+      open_segment(start);
+      check();
+      _thread = std::thread(&write_ahead_log::run, this);
+    }
+
+    write_ahead_log::~write_ahead_log() {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+      }
+      _wake.notify_one();
+      _thread.join();
+      if (_fd >= 0) {
+        ::close(_fd);
+      }
+    }
+
+    write_ahead_log::lsn_type write_ahead_log::append(uint8_t type, const void* key, size_t key_size,
+        std::initializer_list<log_slice> value) {
+      size_t value_size = 0;
+      for (const log_slice& slice : value) {
+        value_size += slice.size;
+      }
+      size_t n = kRecordHeader + key_size + value_size;
+      if (n > _buffer.size() || n > max_record_size) {
+        throw storage_error(make_error_code(errc::log_buffer_full), _path + ": record larger than the log buffer");
+      }
+      check();
+
+      // Reserve the bytes of the record, leaving the bytes not written out yet
+      // alone.
+      lsn_type lsn = _reserved.load(std::memory_order_relaxed);
+      for (;;) {
+        if (lsn + n - _written.load(std::memory_order_acquire) > _buffer.size()) {
+          wait_for_space(lsn + n);
+          lsn = _reserved.load(std::memory_order_relaxed);
+        }
+        else if (_reserved.compare_exchange_weak(lsn, lsn + n, std::memory_order_acq_rel)) {
+          break;
+        }
+      }
+
+      // Build the record in place and checksum it from the type on in one
+      // pass, or in a staging buffer when it wraps around the ring buffer.
+      size_t at = lsn & (_buffer.size() - 1);
+      std::vector<char> wrapped;
+      char* p = &_buffer[at];
+      if (at + n > _buffer.size()) {
+        wrapped.resize(n);
+        p = wrapped.data();
+      }
+      uint32_t size = n;
+      uint32_t key_size32 = key_size;
+      std::memcpy(p, &size, 4);
+      p[8] = type;
+      std::memcpy(p + 9, &key_size32, 4);
+      char* q = p + kRecordHeader;
+      if (key_size > 0) {
+        std::memcpy(q, key, key_size);
+        q += key_size;
+      }
+      for (const log_slice& slice : value) {
+        if (slice.size > 0) {
+          std::memcpy(q, slice.data, slice.size);
+          q += slice.size;
+        }
+      }
+      uint32_t crc = log_crc32(0, p + 8, n - 8);
+      std::memcpy(p + 4, &crc, 4);
+      if (!wrapped.empty()) {
+        copy_in(lsn, p, n);
+      }
+
+      // Publish the record once the records before it are, so that the log
+      // thread writes out complete records only.
+      while (_completed.load(std::memory_order_acquire) != lsn) {
+        std::this_thread::yield();
+      }
+      _completed.store(lsn + n, std::memory_order_release);
+
+      // wake the log thread once, as the record fills half of the buffer
+      lsn_type written = _written.load(std::memory_order_relaxed);
+      if (lsn + n - written >= _buffer.size() / 2 && lsn - written < _buffer.size() / 2) {
+        _wake.notify_one();
+      }
+      return lsn + n;
+    }
+
+    void write_ahead_log::commit(lsn_type lsn) {
+      check();
+      switch (_options.sync) {
+      case log_sync::commit: {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_synced.load(std::memory_order_acquire) < lsn) {
+          write_out(true);
+        }
+        break;
+      }
+      case log_sync::group: {
+        std::unique_lock<std::mutex> lock(_mutex);
+        ++_sync_waiters;
+        _wake.notify_one();
+        _done.wait(lock, [&] { return _synced.load(std::memory_order_acquire) >= lsn || _failed.load(); });
+        --_sync_waiters;
+        break;
+      }
+      case log_sync::interval:
+        break;
+      }
+      check();
+    }
+
+    void write_ahead_log::sync() {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        write_out(true);
+      }
+      check();
+    }
+
+    write_ahead_log::lsn_type write_ahead_log::rotate() {
+      std::lock_guard<std::mutex> lock(_mutex);
+      lsn_type lsn = _reserved.load(std::memory_order_acquire);
+      if (_rotations.empty() ? _segments.back().first < lsn : _rotations.back() < lsn) {
+        _rotations.push_back(lsn);
+      }
+      _wake.notify_one();
+      return lsn;
+    }
+
+    void write_ahead_log::truncate(lsn_type lsn) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      while (_segments.size() > 1 && _segments[1].first <= lsn) {
+        ::unlink(_segments.front().second.c_str());
+        _segments.erase(_segments.begin());
+      }
+    }
+
+    write_ahead_log::lsn_type write_ahead_log::replay(const string& path, lsn_type from,
+        const std::function<void(const log_record&)>& apply) {
+      lsn_type lsn = from;
+      std::vector<char> bytes;
+      for (const auto& segment : segments(path)) {
+        std::FILE* f = std::fopen(segment.second.c_str(), "rb");
+        if (!f) {
+          throw recovery_error(segment.second + ": " + std::strerror(errno));
+        }
+        char header[kSegmentHeader];
+        lsn_type start;
+        if (std::fread(header, 1, kSegmentHeader, f) != kSegmentHeader
+            || std::memcmp(header, log_magic, sizeof(log_magic)) != 0) {
+          // Created right before a crash.
+          std::fclose(f);
+          continue;
+        }
+        std::memcpy(&start, header + 8, 8);
+        if (start > lsn) {
+          std::fclose(f);
+          throw recovery_error(segment.second + ": records missing before the segment");
+        }
+
+        // Read up to the first incomplete record.
+        lsn_type end = start;
+        for (;;) {
+          char h[kRecordHeader];
+          if (std::fread(h, 1, kRecordHeader, f) != kRecordHeader) {
+            break;
+          }
+          uint32_t size, crc, key_size;
+          std::memcpy(&size, h, 4);
+          std::memcpy(&crc, h + 4, 4);
+          std::memcpy(&key_size, h + 9, 4);
+          if (size < kRecordHeader || size > max_record_size || key_size > size - kRecordHeader) {
+            break;
+          }
+          bytes.resize(size - kRecordHeader);
+          if (std::fread(bytes.data(), 1, bytes.size(), f) != bytes.size()) {
+            break;
+          }
+          uint32_t c = log_crc32(0, h + 8, 5);
+          if (log_crc32(c, bytes.data(), bytes.size()) != crc) {
+            break;
+          }
+
+          end += size;
+          if (end > lsn) {
+            log_record r;
+            r.lsn = end;
+            r.type = static_cast<uint8_t>(h[8]);
+            r.key = bytes.data();
+            r.key_size = key_size;
+            r.value = bytes.data() + key_size;
+            r.value_size = bytes.size() - key_size;
+            apply(r);
+            lsn = end;
+          }
+        }
+        std::fclose(f);
+      }
+      return lsn;
+    }
+
+    void write_ahead_log::remove(const string& path) {
+      for (const auto& segment : segments(path)) {
+        ::unlink(segment.second.c_str());
+      }
+    }
+
+    std::vector<std::pair<write_ahead_log::lsn_type, string>> write_ahead_log::segments(const string& path) {
+      size_t slash = path.rfind('/');
+      string dir = slash == string::npos ? "." : path.substr(0, slash + 1);
+      string prefix = (slash == string::npos ? path : path.substr(slash + 1)) + ".";
+
+      std::vector<std::pair<lsn_type, string>> result;
+      if (DIR* d = ::opendir(dir.c_str())) {
+        while (struct dirent* e = ::readdir(d)) {
+          string name = e->d_name;
+          if (name.size() != prefix.size() + 16 || name.compare(0, prefix.size(), prefix) != 0
+              || name.find_first_not_of("0123456789abcdef", prefix.size()) != string::npos) {
+            continue;
+          }
+          lsn_type start = std::strtoull(name.c_str() + prefix.size(), nullptr, 16);
+          result.push_back(std::make_pair(start, segment_name(path, start)));
+        }
+        ::closedir(d);
+      }
+      std::sort(result.begin(), result.end());
+      return result;
+    }
+
+    string write_ahead_log::segment_name(const string& path, lsn_type start) {
+      char suffix[18];
+      std::snprintf(suffix, sizeof(suffix), ".%016" PRIx64, start);
+      return path + suffix;
+    }
+
+    void write_ahead_log::copy_in(lsn_type lsn, const void* p, size_t n) {
+      if (n == 0) {
+        return;
+      }
+      size_t at = lsn & (_buffer.size() - 1);
+      size_t first = std::min(n, _buffer.size() - at);
+      std::memcpy(&_buffer[at], p, first);
+      std::memcpy(&_buffer[0], static_cast<const char*>(p) + first, n - first);
+    }
+
+    void write_ahead_log::wait_for_space(lsn_type end) {
+      std::unique_lock<std::mutex> lock(_mutex);
+      ++_space_waiters;
+      _wake.notify_one();
+      _done.wait(lock, [&] { return end - _written.load(std::memory_order_acquire) <= _buffer.size() || _failed.load(); });
+      --_space_waiters;
+      lock.unlock();
+      check();
+    }
+
+    void write_ahead_log::run() {
+      std::unique_lock<std::mutex> lock(_mutex);
+      std::chrono::steady_clock::time_point synced = std::chrono::steady_clock::now();
+      for (;;) {
+        // Only wakes up for work to do, the waiters satisfied already have to
+        // take the lock to leave.
+        _wake.wait_for(lock, _options.interval, [&] {
+          lsn_type completed = _completed.load(std::memory_order_acquire);
+          lsn_type written = _written.load(std::memory_order_relaxed);
+          return _stop || (_sync_waiters > 0 && _synced.load(std::memory_order_relaxed) < completed)
+              || (_space_waiters > 0 && written < completed) || (!_rotations.empty() && _rotations.front() <= completed)
+              || completed - written >= _buffer.size() / 2;
+        });
+
+        // Group commits and interval syncs.
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        bool sync = _stop || _sync_waiters > 0 || now - synced >= _options.interval;
+        if (sync) {
+          synced = now;
+        }
+        write_out(sync);
+        _done.notify_all();
+        if (_stop || _failed.load()) {
+          return;
+        }
+      }
+    }
+
+    void write_ahead_log::write_out(bool sync) {
+      if (_failed.load()) {
+        return;
+      }
+      lsn_type end = _completed.load(std::memory_order_acquire);
+      lsn_type written = _written.load(std::memory_order_relaxed);
+      for (;;) {
+        if (!_rotations.empty() && _rotations.front() == written) {
+          // The records of the older segments must be durable before those of
+          // the new one.
+          if (::fdatasync(_fd) != 0) {
+            return fail(_segments.back().second + ": " + std::strerror(errno));
+          }
+          _synced.store(written, std::memory_order_release);
+          ::close(_fd);
+          _fd = -1;
+          open_segment(written);
+          _rotations.erase(_rotations.begin());
+          if (_failed.load()) {
+            return;
+          }
+          continue;
+        }
+        if (written == end) {
+          break;
+        }
+
+        lsn_type stop = _rotations.empty() ? end : std::min(end, _rotations.front());
+        size_t at = written & (_buffer.size() - 1);
+        size_t first = std::min<size_t>(stop - written, _buffer.size() - at);
+        if (!write_all(_fd, &_buffer[at], first) || !write_all(_fd, &_buffer[0], stop - written - first)) {
+          return fail(_segments.back().second + ": " + std::strerror(errno));
+        }
+        written = stop;
+        _written.store(written, std::memory_order_release);
+      }
+
+      if (sync && _synced.load(std::memory_order_relaxed) < written) {
+        if (::fdatasync(_fd) != 0) {
+          return fail(_segments.back().second + ": " + std::strerror(errno));
+        }
+        _synced.store(written, std::memory_order_release);
+      }
+    }
+
+    void write_ahead_log::open_segment(lsn_type start) {
+      string name = segment_name(_path, start);
+      _fd = ::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      char header[kSegmentHeader];
+      std::memcpy(header, log_magic, sizeof(log_magic));
+      std::memcpy(header + 8, &start, 8);
+      if (_fd < 0 || !write_all(_fd, header, kSegmentHeader)) {
+        return fail(name + ": " + std::strerror(errno));
+      }
+      if (!_segments.empty() && _segments.back().first == start) {
+        _segments.back().second = name;
+      }
+      else {
+        _segments.push_back(std::make_pair(start, name));
+      }
+    }
+
+    void write_ahead_log::fail(const string& what) {
+      if (!_failed.load()) {
+        _error = what;
+        _failed.store(true, std::memory_order_release);
+      }
+      _done.notify_all();
+    }
+
+    void write_ahead_log::check() const {
+      if (_failed.load(std::memory_order_acquire)) {
+        throw recovery_error(_error);
+      }
+    }
+
+  } // storage
+} // atlasdb
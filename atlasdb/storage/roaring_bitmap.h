@@ -0,0 +1,213 @@
+/*
+ * roaring_bitmap.h
+ *
+ * A compressed set of 32 bit integers, for the row ids of bitmap indexes.
+ *
+ * The integers are split by their high 16 bits into chunks of 65536, and
+ * every chunk that is not empty is held by a container of the one of three
+ * kinds that suits its density: a sorted array of the low 16 bits for up to
+ * 4096 integers, a bitset of 65536 bits (8KB) for more, or a sorted array of
+ * runs of consecutive integers, which optimize() picks where it is the
+ * smallest. Set operations work container by container, those on two bitsets
+ * and on two arrays with vectorized kernels.
+ *
+ * The AVX2 and SSE4.2 kernels are compiled with per-function target
+ * attributes and chosen once at runtime from the capabilities of the CPU, as
+ * the btree search kernels are, see btree_simd.h. Define
+ * ATLASDB_BITMAP_NO_SIMD to always use the scalar loops.
+ */
+
+#ifndef ATLASDB_STORAGE_ROARING_BITMAP_H_
+#define ATLASDB_STORAGE_ROARING_BITMAP_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <vector>
+
+namespace atlasdb {
+  namespace storage {
+
+    class roaring_bitmap {
+    public:
+
+      typedef uint32_t value_type;
+
+      // the most integers an array container holds
+      static const uint32_t kArrayMax = 4096;
+
+      // the number of 64 bit words of a bitset container
+      static const uint32_t kBitsetWords = 1024;
+
+    public:
+
+      roaring_bitmap() {}
+
+      roaring_bitmap(std::initializer_list<value_type> values) {
+        for (value_type x : values) {
+          add(x);
+        }
+      }
+
+    public:
+
+      /**
+       * add x to the set
+       * @return true if it was not in the set
+       */
+      bool add(value_type x);
+
+      /**
+       * remove x from the set
+       * @return true if it was in the set
+       */
+      bool remove(value_type x);
+
+      bool contains(value_type x) const;
+
+      /**
+       * the number of integers in the set
+       */
+      uint64_t cardinality() const;
+
+      bool empty() const { return _containers.empty(); }
+
+      void clear() { _containers.clear(); }
+
+      /**
+       * turn the containers holding runs of consecutive integers into run
+       * containers where it makes them smaller, e.g. once a bitmap was built
+       * @return the number of run containers
+       */
+      size_t optimize();
+
+      /**
+       * the number of bytes held by the containers
+       */
+      size_t bytes() const;
+
+      /**
+       * call f with the integers of the set in increasing order, while it
+       * returns true
+       */
+      template<class F>
+      void for_each(F f) const;
+
+    public:
+
+      roaring_bitmap& operator&=(const roaring_bitmap& x);
+
+      roaring_bitmap& operator|=(const roaring_bitmap& x);
+
+      /**
+       * remove the integers of x, the and-not of the sets
+       */
+      roaring_bitmap& operator-=(const roaring_bitmap& x);
+
+      friend roaring_bitmap operator&(const roaring_bitmap& a, const roaring_bitmap& b);
+
+      friend roaring_bitmap operator|(roaring_bitmap a, const roaring_bitmap& b) { return a |= b; }
+
+      friend roaring_bitmap operator-(roaring_bitmap a, const roaring_bitmap& b) { return a -= b; }
+
+      bool operator==(const roaring_bitmap& x) const;
+
+      bool operator!=(const roaring_bitmap& x) const { return !(*this == x); }
+
+    private:
+
+      enum kind_type : uint8_t { kArray, kBitset, kRun };
+
+      // the integers of a chunk: for an array their low 16 bits in values,
+      // for runs the pairs <start, length - 1> in values, for a bitset 1024
+      // words in bits
+      struct container {
+        uint16_t key;
+        kind_type kind;
+        uint32_t cardinality;
+        std::vector<uint16_t> values;
+        std::vector<uint64_t> bits;
+
+        container(uint16_t key = 0) : key(key), kind(kArray), cardinality(0) {}
+
+        bool contains(uint16_t x) const;
+
+        // turns a run container into an array or a bitset
+        void expand();
+
+        // turns an array into a bitset or a bitset into an array as their
+        // cardinality asks for
+        void normalize();
+
+        void to_bitset();
+
+        void to_array();
+
+        template<class F>
+        bool for_each(uint32_t high, F f) const;
+      };
+
+      typedef std::vector<container>::iterator container_iterator;
+      typedef std::vector<container>::const_iterator const_container_iterator;
+
+      container_iterator find(uint16_t key);
+
+      const_container_iterator find(uint16_t key) const;
+
+      static void intersect(container& a, const container& b);
+
+      static void unite(container& a, const container& b);
+
+      static void subtract(container& a, const container& b);
+
+    private:
+
+      // the containers that are not empty, by key
+      std::vector<container> _containers;
+    };
+
+    template<class F>
+    void roaring_bitmap::for_each(F f) const {
+      for (const container& c : _containers) {
+        if (!c.for_each(uint32_t(c.key) << 16, f)) {
+          return;
+        }
+      }
+    }
+
+    template<class F>
+    bool roaring_bitmap::container::for_each(uint32_t high, F f) const {
+      switch (kind) {
+      case kArray:
+        for (uint16_t x : values) {
+          if (!f(high | x)) {
+            return false;
+          }
+        }
+        break;
+      case kBitset:
+        for (uint32_t i = 0; i < kBitsetWords; ++i) {
+          for (uint64_t w = bits[i]; w; w &= w - 1) {
+            if (!f(high | (i * 64 + __builtin_ctzll(w)))) {
+              return false;
+            }
+          }
+        }
+        break;
+      case kRun:
+        for (size_t i = 0; i < values.size(); i += 2) {
+          for (uint32_t x = values[i], last = x + values[i + 1]; x <= last; ++x) {
+            if (!f(high | x)) {
+              return false;
+            }
+          }
+        }
+        break;
+      }
+      return true;
+    }
+
+  } // storage
+} // atlasdb
+
+#endif // ATLASDB_STORAGE_ROARING_BITMAP_H_
@@ -0,0 +1,332 @@
+#ifndef ATLASDB_STORAGE_SHARDED_REPOSITORY_H_
+#define ATLASDB_STORAGE_SHARDED_REPOSITORY_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <atlasdb/storage/basic_repository.h>
+
+namespace atlasdb {
+  namespace storage {
+
+    using std::string;
+
+    /**
+     * A repository whose records are spread over N basic_repository shards by
+     * the hash of their key, each shard with its own btree and its own lock,
+     * so that threads working on different keys rarely wait for each other
+     * and every btree is N times smaller.
+     *
+     * Point operations lock the one shard of their key. Operations over key
+     * ranges visit all of the shards, and ordered iteration merges the records
+     * of the shards back into key order.
+     *
+     * All of the operations may be called from several threads at once.
+     * */
+    template<typename Key, typename Value, typename Ikey, size_t N>
+    class sharded_repository : virtual public storage_base {
+    public:
+
+      static_assert(N > 0, "a sharded repository needs shards");
+
+      typedef basic_repository<Key, Value, Ikey> repository_type;
+
+      typedef Key key_type;
+      typedef Value value_type;
+      typedef std::pair<key_type, value_type> node_type;
+      typedef typename repository_type::key_compare key_compare;
+      typedef typename repository_type::snapshot_type snapshot_type;
+      typedef std::hash<key_type> hasher;
+
+      typedef storage_base base_type;
+      typedef sharded_repository<Key, Value, Ikey, N> self_type;
+
+      class const_iterator;
+      typedef const_iterator iterator;
+
+    public:
+
+      sharded_repository() = default;
+
+      sharded_repository(const string& table) : storage_base(table) {
+        open(table);
+      }
+
+      virtual ~sharded_repository() {
+        close();
+      }
+
+    public:
+
+      /**
+       * open the shards of a storage, <table>.<shard>, for reading and writing
+       * @return true if all of them were opened
+       */
+      bool open(const string& table);
+
+      /**
+       * close the shards
+       */
+      virtual void close();
+
+      /**
+       * make the shards durable, each with its own log and checkpoints at
+       * <path>.<shard>, see basic_repository::recover()
+       */
+      void recover(const string& path, const log_options& options = log_options());
+
+      /**
+       * make the modifications logged so far in all of the shards durable
+       */
+      void commit();
+
+      /**
+       * take a checkpoint of every shard
+       */
+      void checkpoint();
+
+    public:
+
+      /**
+       * the shard holding the records of key
+       */
+      static size_t shard(const key_type& key) {
+        // the high bits of the product depend on all of the bits of the hash,
+        // which may be the key itself for integers
+        uint64_t h = static_cast<uint64_t>(hasher()(key)) * 0x9e3779b97f4a7c15ULL;
+        return static_cast<size_t>((h >> 32) * N >> 32);
+      }
+
+      /**
+       * put data nodes to the storage
+       * @return true if success
+       */
+      bool put(const key_type& key, const value_type& value) {
+        shard_type& s = _shards[shard(key)];
+        std::lock_guard<std::mutex> guard(s.lock);
+        return s.repository.put(key, value);
+      }
+
+      /**
+       * bulk load key/value pairs sorted by key into an empty storage, see
+       * basic_repository::load()
+       */
+      template<class InputIterator>
+      void load(InputIterator first, InputIterator last, double fill = 1.0);
+
+      /**
+       * put key/value pairs sorted by key into the storage, see
+       * basic_repository::put_sorted()
+       * @return the number of pairs put
+       */
+      template<class InputIterator>
+      size_t put_sorted(InputIterator first, InputIterator last);
+
+      /**
+       * Simple fetch a data block with a given key
+       */
+      boost::optional<value_type> get(const key_type& key) const {
+        const shard_type& s = _shards[shard(key)];
+        std::lock_guard<std::mutex> guard(s.lock);
+        return s.repository.get(key);
+      }
+
+      /**
+       * fetch the data blocks of many keys at once, the keys are grouped by
+       * shard so that every shard is locked once, see
+       * basic_repository::get_many()
+       */
+      template<class ForwardIterator, class OutputIterator>
+      OutputIterator get_many(ForwardIterator first, ForwardIterator last, OutputIterator out) const;
+
+      bool exists(const key_type& key) const {
+        const shard_type& s = _shards[shard(key)];
+        std::lock_guard<std::mutex> guard(s.lock);
+        return s.repository.exists(key);
+      }
+
+      /**
+       * overwrite bytes of the data block of key in place, see
+       * basic_repository::update()
+       */
+      void update(const key_type& key, const value_type& new_value, ptrdiff_t offset, size_t size) {
+        shard_type& s = _shards[shard(key)];
+        std::lock_guard<std::mutex> guard(s.lock);
+        s.repository.update(key, new_value, offset, size);
+      }
+
+      template<class P>
+      void update(const key_type& key, const value_type& data, P p) {
+        shard_type& s = _shards[shard(key)];
+        std::lock_guard<std::mutex> guard(s.lock);
+        s.repository.update(key, data, p);
+      }
+
+      /**
+       * delete an existing data node in the storage
+       */
+      void del(const key_type& key) {
+        shard_type& s = _shards[shard(key)];
+        std::lock_guard<std::mutex> guard(s.lock);
+        s.repository.del(key);
+      }
+
+      /**
+       * delete the records whose key is in [lower, upper) from every shard
+       * @return the number of deleted records
+       */
+      size_t erase_range(const key_type& lower, const key_type& upper);
+
+      /**
+       * delete all of the records, see basic_repository::truncate()
+       */
+      void truncate();
+
+      /**
+       * keep a hash index of at most max_bytes in all, spread evenly over the
+       * shards, see basic_repository::hash_index()
+       */
+      void hash_index(size_t max_bytes);
+
+      /**
+       * fill up sparse btree nodes in every shard, see
+       * basic_repository::compact()
+       * @return the number of btree nodes freed
+       */
+      size_t compact(double fill = 1.0);
+
+    public:
+
+      size_t count() const;
+
+      /**
+       * count the records whose key is in [first, last)
+       */
+      size_t count(const key_type& first, const key_type& last) const;
+
+      /**
+       * the position of the first record whose key is not less than key, in
+       * key order over all of the shards
+       */
+      size_t rank(const key_type& key) const;
+
+      bool empty() const { return count() == 0; }
+
+    public:
+
+      /**
+       * iterate over the records in key order, merging the records of the
+       * shards; the iterator reads a snapshot of every shard taken by begin()
+       * or lower_bound(), so writers go on meanwhile and are not seen
+       * @notice the snapshots of the shards are taken one after the other,
+       *    each shard is consistent but they are not taken at the same instant
+       */
+      const_iterator begin() const {
+        return merged([](const snapshot_type& s) { return s.begin(); });
+      }
+
+      const_iterator end() const { return const_iterator(); }
+
+      /**
+       * iterate from the first record whose key is not less than key, see
+       * begin()
+       */
+      const_iterator lower_bound(const key_type& key) const {
+        return merged([&key](const snapshot_type& s) { return s.lower_bound(key); });
+      }
+
+    public:
+
+      /**
+       * an input iterator over the records of all of the shards in key order,
+       * a k-way merge of the iterators of the snapshots of the shards
+       */
+      class const_iterator : public std::iterator<std::input_iterator_tag,
+          typename snapshot_type::const_iterator::value_type> {
+        friend class sharded_repository;
+
+      public:
+
+        typedef typename snapshot_type::const_iterator::reference reference;
+        typedef typename snapshot_type::const_iterator::pointer pointer;
+
+        const_iterator() {}
+
+        reference operator*() const { return *_merge->positions[_merge->heap[0]]; }
+        pointer operator->() const { return &**this; }
+
+        const_iterator& operator++() {
+          _merge->next();
+          if (_merge->size == 0) {
+            _merge.reset();
+          }
+          return *this;
+        }
+
+        // two iterators are equal if both are at the end, or are the same
+        bool operator==(const const_iterator& x) const { return _merge == x._merge; }
+        bool operator!=(const const_iterator& x) const { return _merge != x._merge; }
+
+      private:
+
+        // the snapshots of the shards, the positions in each of them and a
+        // min heap of the shards not at their end by the key at their position
+        struct merge {
+          snapshot_type snapshots[N];
+          typename snapshot_type::const_iterator positions[N];
+          size_t heap[N];
+          size_t size;
+
+          merge() : size(0) {}
+
+          bool greater(size_t a, size_t b) const {
+            return key_compare()(positions[b]->first, positions[a]->first);
+          }
+
+          void push(size_t i) {
+            if (positions[i] != snapshots[i].end()) {
+              heap[size++] = i;
+              std::push_heap(heap, heap + size, [this](size_t a, size_t b) { return greater(a, b); });
+            }
+          }
+
+          void next() {
+            std::pop_heap(heap, heap + size, [this](size_t a, size_t b) { return greater(a, b); });
+            size_t i = heap[--size];
+            ++positions[i];
+            push(i);
+          }
+        };
+
+        explicit const_iterator(std::shared_ptr<merge> m) : _merge(m->size ? m : nullptr) {}
+
+        std::shared_ptr<merge> _merge;
+      };
+
+    private:
+
+      // merges the shards from the position in the snapshot of each
+      template<class Position>
+      const_iterator merged(Position position) const;
+
+    private:
+
+      struct shard_type {
+        mutable std::mutex lock;
+        repository_type repository;
+        // keeps the lock of the next shard off the cache lines of this one
+        char padding[64];
+      };
+
+      shard_type _shards[N];
+    };
+
+  } // storage
+} // atlasdb
+
+#endif // ATLASDB_STORAGE_SHARDED_REPOSITORY_H_
@@ -8,14 +8,24 @@
 #ifndef ATLASDB_STORAGE_STORAGE_H_
 #define ATLASDB_STORAGE_STORAGE_H_
 
+#include <atlasdb/storage/basic_bitmap_index.h>
+#include <atlasdb/storage/basic_hash_index.h>
 #include <atlasdb/storage/basic_index.h>
 #include <atlasdb/storage/basic_indexer.h>
 #include <atlasdb/storage/basic_repository.h>
 #include <atlasdb/storage/basic_storehouse.h>
+#include <atlasdb/storage/concurrent_repository.h>
+#include <atlasdb/storage/sharded_repository.h>
+#include <atlasdb/storage/roaring_bitmap.h>
+#include <atlasdb/storage/write_ahead_log.h>
 
+#include <atlasdb/storage/bits/basic_bitmap_index.tcc>
+#include <atlasdb/storage/bits/basic_hash_index.tcc>
 #include <atlasdb/storage/bits/basic_index.tcc>
 #include <atlasdb/storage/bits/basic_indexer.tcc>
 #include <atlasdb/storage/bits/basic_repository.tcc>
 #include <atlasdb/storage/bits/basic_storehouse.tcc>
+#include <atlasdb/storage/bits/sharded_repository.tcc>
+#include <atlasdb/storage/bits/write_ahead_log.tcc>
 
 #endif /* ATLASDB_STORAGE_STORAGE_H_ */
@@ -60,7 +60,7 @@ namespace atlasdb {
 
     static const std::error_category& storage_category = get_storage_category();
 
-    std::error_code make_error_code(errc e) {
+    inline std::error_code make_error_code(errc e) {
       return std::error_code(static_cast<int>(e), get_storage_category());
     }
 
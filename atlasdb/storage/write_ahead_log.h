@@ -0,0 +1,384 @@
+/*
+ * write_ahead_log.h
+ *
+ * The write ahead log and the checkpoints of durable repositories.
+ *
+ * A log is a sequence of records, each identified by its lsn: the offset in
+ * the log right after the record. Appending a record reserves its bytes in an
+ * in-memory ring buffer with an atomic add and copies the record in, so
+ * threads append without taking a lock; a background thread writes the
+ * buffer out to the current segment file of the log. When the records become
+ * durable depends on the sync policy, see log_sync.
+ *
+ * The log is cut into segment files, <path>.<start lsn in hex>, so that the
+ * segments holding only records older than the last checkpoint are deleted
+ * as whole files. A checkpoint is a file of the records of a snapshot in key
+ * order, together with the lsn of the log when the snapshot was taken.
+ * Recovery loads the checkpoint and replays the records logged after it.
+ */
+
+#ifndef ATLASDB_STORAGE_WRITE_AHEAD_LOG_H_
+#define ATLASDB_STORAGE_WRITE_AHEAD_LOG_H_
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <atlasdb/storage/storage_error.h>
+
+namespace atlasdb {
+  namespace storage {
+
+    using std::string;
+
+    /**
+     * when committed records become durable
+     */
+    enum class log_sync {
+      // commit() writes the log out and syncs it before returning
+      commit,
+      // commit() waits for the log thread, which syncs once for all of the
+      // commits waiting at that time
+      group,
+      // commit() returns at once, the log thread syncs every interval, so a
+      // crash loses at most the last interval of commits
+      interval
+    };
+
+    struct log_options {
+      log_sync sync;
+      // the size of the ring buffer records are appended to, a power of 2
+      size_t buffer_size;
+      // the period of the log thread, see log_sync::interval
+      std::chrono::milliseconds interval;
+      // a checkpoint is taken once the log grew by that many bytes since the
+      // previous one, 0 for checkpoints on demand only
+      uint64_t checkpoint_bytes;
+
+      log_options() :
+          sync(log_sync::group), buffer_size(size_t(1) << 24), interval(10), checkpoint_bytes(uint64_t(1) << 30) {
+      }
+    };
+
+    /**
+     * a record read back from the log
+     */
+    struct log_record {
+      uint64_t lsn;
+      uint8_t type;
+      const char* key;
+      size_t key_size;
+      const char* value;
+      size_t value_size;
+    };
+
+    /**
+     * a part of the value of a log record
+     */
+    struct log_slice {
+      const void* data;
+      size_t size;
+    };
+
+    /**
+     * how keys and values are written to the log and to checkpoints: as
+     * their bytes for trivially copyable types, strings and the types holding
+     * a <buffer, size> pair like query::key, other types need a
+     * specialization; patch() overwrites n bytes of a value in place, see
+     * basic_repository::update()
+     */
+    template<typename T, typename Enable = void>
+    struct log_codec;
+
+    template<typename T>
+    struct log_codec<T, typename std::enable_if<std::is_trivially_copyable<T>::value>::type> {
+      static const void* data(const T& x) { return &x; }
+      static size_t size(const T&) { return sizeof(T); }
+      static T decode(const char* p, size_t) {
+        T x;
+        std::memcpy(&x, p, sizeof(T));
+        return x;
+      }
+      static void patch(T& x, size_t offset, const char* p, size_t n) {
+        std::memcpy(reinterpret_cast<char*>(&x) + offset, p, n);
+      }
+    };
+
+    template<typename T>
+    struct log_codec<T, typename std::enable_if<
+        std::is_same<decltype(std::declval<const T&>().data()), std::pair<const char*, size_t>>::value>::type> {
+      static const void* data(const T& x) { return x.data().first; }
+      static size_t size(const T& x) { return x.data().second; }
+      static T decode(const char* p, size_t n) { return T(p, n); }
+    };
+
+    template<>
+    struct log_codec<std::string> {
+      static const void* data(const std::string& x) { return x.data(); }
+      static size_t size(const std::string& x) { return x.size(); }
+      static std::string decode(const char* p, size_t n) { return std::string(p, n); }
+      static void patch(std::string& x, size_t offset, const char* p, size_t n) { x.replace(offset, n, p, n); }
+    };
+
+    class write_ahead_log {
+    public:
+
+      typedef uint64_t lsn_type;
+
+      enum {
+        // the bytes of a record before the key: its size, checksum, type and
+        // the size of the key
+        kRecordHeader = 13,
+        // the bytes of a segment file before the first record
+        kSegmentHeader = 16,
+      };
+
+    public:
+
+      /**
+       * start appending to a new segment of the log at path, whose first
+       * record follows lsn start, usually the lsn returned by replay()
+       * @throw storage_error(errc::run_recovery) if the segment cannot be
+       *    created
+       */
+      write_ahead_log(const string& path, lsn_type start, const log_options& options = log_options());
+
+      write_ahead_log(const write_ahead_log&) = delete;
+      write_ahead_log& operator=(const write_ahead_log&) = delete;
+
+      /**
+       * write out and sync the records appended so far
+       */
+      ~write_ahead_log();
+
+    public:
+
+      /**
+       * append a record, a key and a value of the given sizes
+       * @return the lsn of the record
+       * @throw storage_error(errc::log_buffer_full) if the record is larger
+       *    than the buffer, and storage_error(errc::run_recovery) if the log
+       *    could not be written
+       * @notice waits for the log thread only if the buffer is full
+       */
+      lsn_type append(uint8_t type, const void* key, size_t key_size, const void* value, size_t value_size) {
+        return append(type, key, key_size, { log_slice { value, value_size } });
+      }
+
+      /**
+       * append a record whose value is gathered from several slices, which
+       * are copied to the buffer directly
+       */
+      lsn_type append(uint8_t type, const void* key, size_t key_size, std::initializer_list<log_slice> value);
+
+      /**
+       * make the records up to lsn durable, as the sync policy says
+       */
+      void commit(lsn_type lsn);
+
+      /**
+       * make all of the records appended so far durable, whatever the policy
+       */
+      void sync();
+
+      /**
+       * start a new segment after the records appended so far
+       * @return the lsn the new segment starts at
+       */
+      lsn_type rotate();
+
+      /**
+       * delete the segments holding only records up to lsn, once they are
+       * covered by a checkpoint
+       */
+      void truncate(lsn_type lsn);
+
+      /**
+       * the lsn of the last record appended
+       */
+      lsn_type lsn() const { return _reserved.load(std::memory_order_acquire); }
+
+    public:
+
+      /**
+       * read the records following lsn from in the log at path, up to the
+       * first incomplete record, which a crash may have left at the end of a
+       * segment
+       * @return the lsn of the last record read, or from
+       * @throw storage_error(errc::run_recovery) if records are missing
+       *    between the segments
+       */
+      static lsn_type replay(const string& path, lsn_type from, const std::function<void(const log_record&)>& apply);
+
+      /**
+       * remove all of the segments of the log at path
+       */
+      static void remove(const string& path);
+
+    private:
+
+      // the segment files of the log at path, by start lsn
+      static std::vector<std::pair<lsn_type, string>> segments(const string& path);
+
+      static string segment_name(const string& path, lsn_type start);
+
+      // copies n bytes to the ring buffer at log offset lsn
+      void copy_in(lsn_type lsn, const void* p, size_t n);
+
+      // waits until the records up to end fit into the buffer
+      void wait_for_space(lsn_type end);
+
+      // the log thread
+      void run();
+
+      // writes the records completed so far out to the segments, and syncs
+      // them if sync is set, with _mutex held
+      void write_out(bool sync);
+
+      void open_segment(lsn_type start);
+
+      // marks the log as failed, so that appends and commits throw
+      void fail(const string& what);
+
+      void check() const;
+
+    private:
+
+      string _path;
+      log_options _options;
+
+      // the ring buffer, and the log offsets up to which its bytes were
+      // reserved by appends, copied in by them, written out and synced
+      std::vector<char> _buffer;
+      std::atomic<lsn_type> _reserved;
+      std::atomic<lsn_type> _completed;
+      std::atomic<lsn_type> _written;
+      std::atomic<lsn_type> _synced;
+      std::atomic<bool> _failed;
+      string _error;
+
+      std::mutex _mutex;
+      // wakes up the log thread, and the threads waiting for it
+      std::condition_variable _wake;
+      std::condition_variable _done;
+      int _sync_waiters;
+      int _space_waiters;
+      bool _stop;
+
+      int _fd;
+      // the segments by start lsn, the current one last, and the lsns to
+      // start new segments at
+      std::vector<std::pair<lsn_type, string>> _segments;
+      std::vector<lsn_type> _rotations;
+
+      std::thread _thread;
+    };
+
+    /**
+     * write a checkpoint of the records [first, last), in key order, taken
+     * at lsn, to path
+     * @throw storage_error(errc::run_recovery) if it cannot be written
+     * @notice the file is replaced once the checkpoint is complete
+     */
+    template<typename Key, typename Value, typename InputIterator>
+    void write_checkpoint(const string& path, uint64_t lsn, InputIterator first, InputIterator last);
+
+    /**
+     * the records of a checkpoint file, read sequentially
+     */
+    template<typename Key, typename Value>
+    class checkpoint_reader {
+    public:
+
+      typedef std::pair<Key, Value> record_type;
+
+      class iterator : public std::iterator<std::input_iterator_tag, record_type> {
+      public:
+
+        iterator() : _reader(nullptr) {}
+        explicit iterator(checkpoint_reader* reader) : _reader(reader) { ++*this; }
+
+        const record_type& operator*() const { return _record; }
+        const record_type* operator->() const { return &_record; }
+
+        iterator& operator++() {
+          if (!_reader->next(_record)) {
+            _reader = nullptr;
+          }
+          return *this;
+        }
+
+        bool operator==(const iterator& x) const { return _reader == x._reader; }
+        bool operator!=(const iterator& x) const { return _reader != x._reader; }
+
+      private:
+
+        checkpoint_reader* _reader;
+        record_type _record;
+      };
+
+    public:
+
+      /**
+       * open the checkpoint at path, if there is one
+       * @throw storage_error(errc::run_recovery) if it is not a checkpoint
+       */
+      explicit checkpoint_reader(const string& path);
+
+      ~checkpoint_reader() {
+        if (_file) {
+          std::fclose(_file);
+        }
+      }
+
+      checkpoint_reader(const checkpoint_reader&) = delete;
+      checkpoint_reader& operator=(const checkpoint_reader&) = delete;
+
+      bool exists() const { return _file != nullptr; }
+
+      /**
+       * the lsn the checkpoint was taken at, 0 without checkpoint
+       */
+      uint64_t lsn() const { return _lsn; }
+
+      iterator begin() { return _file ? iterator(this) : iterator(); }
+      iterator end() { return iterator(); }
+
+    private:
+
+      bool next(record_type& record);
+
+    private:
+
+      string _path;
+      std::FILE* _file;
+      uint64_t _lsn;
+      uint64_t _remaining;
+      std::vector<char> _bytes;
+    };
+
+    /**
+     * the crc32 (IEEE) of n bytes at p, continuing from crc
+     */
+    uint32_t log_crc32(uint32_t crc, const void* p, size_t n);
+
+  } // storage
+} // atlasdb
+
+#endif // ATLASDB_STORAGE_WRITE_AHEAD_LOG_H_
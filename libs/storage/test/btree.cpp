@@ -5,11 +5,176 @@
  *      Author: vincent
  */
 
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <atlasdb/query/kv.h>
 #include <atlasdb/storage/btree/btree.h>
+#include <atlasdb/storage/btree/btree.tcc>
+#include <atlasdb/storage/btree/btree_allocator.h>
+#include <atlasdb/storage/btree/btree_hash_index.h>
 #include <atlasdb/storage/btree/btree_map.h>
+#include <atlasdb/storage/btree/concurrent_btree.tcc>
+
+#include "check.h"
 
 using namespace atlasdb::storage;
 
+// Checks that a btree container holds the values of a std::map or a
+// std::multimap, in the same order.
+template<class Tree, class Reference>
+static void check_same(const Tree& tree, const Reference& reference) {
+  CHECK(static_cast<size_t>(tree.size()) == reference.size());
+  CHECK(std::equal(reference.begin(), reference.end(), tree.begin()));
+}
+
+// Orders strings and raw <pointer, size> byte ranges alike, the way query::key
+// compares to query::key_bytes.
+struct bytes_less {
+  typedef void is_transparent;
+
+  static atlasdb::query::key_bytes bytes(const std::string& s) { return atlasdb::query::key_bytes(s.data(), s.size()); }
+  static atlasdb::query::key_bytes bytes(const atlasdb::query::key_bytes& b) { return b; }
+
+  template<class A, class B>
+  bool operator()(const A& a, const B& b) const { return atlasdb::query::compare_bytes(bytes(a), bytes(b)) < 0; }
+};
+
+// Compares the vectorized in-node search of keys of type Key to the scalar
+// loop, on duplicate keys and on the least and greatest keys of the type, for
+// every length of the array so that the tails are covered, with the stride of
+// a btree_set node and with that of a btree_map node.
+template<typename Key>
+static void check_simd_search() {
+  const Key lo = std::numeric_limits<Key>::lowest();
+  const Key hi = std::numeric_limits<Key>::max();
+  std::vector<Key> keys = { lo, lo, hi, hi, hi, Key(0), Key(0), Key(0), Key(1), Key(5), Key(5) };
+  for (int i = 0; i < 40; ++i) {
+    keys.push_back(Key(i * 3));
+  }
+  std::sort(keys.begin(), keys.end());
+  std::vector<Key> probes = keys;
+  probes.push_back(Key(2));
+  probes.push_back(Key(100));
+
+  for (int stride : { int(sizeof(Key)), int(sizeof(std::pair<Key, int64_t>)) }) {
+    std::vector<char> base(keys.size() * stride);
+    for (size_t i = 0; i < keys.size(); ++i) {
+      std::memcpy(&base[i * stride], &keys[i], sizeof(Key));
+    }
+    for (int n = 0; n <= int(keys.size()); ++n) {
+      for (Key k : probes) {
+        for (bool inclusive : { false, true }) {
+          int expected = btree_scalar_search<Key>(base.data(), stride, 0, n, k, inclusive);
+          CHECK(btree_simd_search<Key>::search(base.data(), stride, n, k, inclusive) == expected);
+#ifdef ATLASDB_BTREE_SIMD_X86
+          // the kernels stop at a whole vector, the scalar loop goes on
+          if (__builtin_cpu_supports("sse4.2")) {
+            int i = btree_simd_kernels<Key>::sse42(base.data(), stride, n, k, inclusive);
+            CHECK(i <= expected && btree_scalar_search<Key>(base.data(), stride, i, n, k, inclusive) == expected);
+          }
+          if (__builtin_cpu_supports("avx2")) {
+            int i = btree_simd_kernels<Key>::avx2(base.data(), stride, n, k, inclusive);
+            CHECK(i <= expected && btree_scalar_search<Key>(base.data(), stride, i, n, k, inclusive) == expected);
+          }
+#endif
+        }
+      }
+    }
+  }
+
+  // through the nodes of a btree holding many duplicates
+  btree_multimap<Key, int> tree;
+  std::multimap<Key, int> reference;
+  for (int i = 0; i < 5000; ++i) {
+    Key k = i % 7 == 0 ? lo : i % 11 == 0 ? hi : Key(i % 300);
+    tree.insert(std::make_pair(k, i));
+    reference.insert(std::make_pair(k, i));
+  }
+  for (Key k : probes) {
+    CHECK(std::distance(tree.begin(), tree.lower_bound(k))
+        == std::distance(reference.begin(), reference.lower_bound(k)));
+    CHECK(std::distance(tree.begin(), tree.upper_bound(k))
+        == std::distance(reference.begin(), reference.upper_bound(k)));
+  }
+}
+
+// Runs writers, each inserting, overwriting and erasing keys of its own, and
+// readers looking up the keys of all of the writers at once on a
+// concurrent_btree_map. A value holds its key in its high bits, so that a read
+// torn by a concurrent write shows. The map must end up holding what the
+// writers left, in a well formed tree.
+static void check_concurrent_btree() {
+  enum { kWriters = 4, kReaders = 4, kKeys = 20000, kRounds = 4 };
+  concurrent_btree_map<int64_t, int64_t> map;
+  std::map<int64_t, int64_t> written[kWriters];
+  std::atomic<int> writing(kWriters);
+  std::atomic<bool> torn(false);
+
+  std::vector<std::thread> threads;
+  for (int w = 0; w < kWriters; ++w) {
+    threads.emplace_back([&map, &written, &writing, w]() {
+      uint64_t seed = w + 1;
+      for (int64_t round = 1; round <= kRounds; ++round) {
+        for (int i = 0; i < kKeys; ++i) {
+          seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+          int64_t key = static_cast<int64_t>(seed >> 33) % kKeys * kWriters + w;
+          if ((seed >> 20) % 4 == 0) {
+            map.erase(key);
+            written[w].erase(key);
+          } else {
+            map.insert_or_assign(key, key << 20 | round);
+            written[w][key] = key << 20 | round;
+          }
+        }
+      }
+      --writing;
+    });
+  }
+  for (int r = 0; r < kReaders; ++r) {
+    threads.emplace_back([&map, &writing, &torn, r]() {
+      int64_t key = r;
+      while (writing > 0) {
+        int64_t value;
+        if (map.find(key, &value) && value >> 20 != key) {
+          torn = true;
+        }
+        key = (key + 7919) % (kKeys * kWriters);
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  CHECK(!torn);
+  CHECK(map.verify().empty());
+  size_t size = 0;
+  for (const auto& w : written) {
+    size += w.size();
+    for (const auto& v : w) {
+      int64_t value;
+      CHECK(map.find(v.first, &value) && value == v.second);
+    }
+  }
+  CHECK(static_cast<size_t>(map.size()) == size);
+  for (int64_t key = 0; key < kKeys * kWriters; ++key) {
+    CHECK(static_cast<size_t>(map.count(key)) == written[key % kWriters].count(key));
+  }
+}
+
 int main() {
   std::less<int> compare;
   std::allocator<int> alloc;
@@ -18,6 +183,661 @@ int main() {
 
   btree_map<int, int> m;
   btree_multimap<int, int> m2;
+  concurrent_btree_map<int, int> m3;
+  btree_ranked_map<int, int> m4;
+
+  check_simd_search<int32_t>();
+  check_simd_search<uint32_t>();
+  check_simd_search<int64_t>();
+  check_simd_search<uint64_t>();
+  check_simd_search<float>();
+  check_simd_search<double>();
+  check_concurrent_btree();
+
+  btree_map<int, int>::snapshot_type s = m.snapshot();
+  CHECK(m4.select(m4.rank(0)) == m4.end());
+
+  std::vector<int> keys;
+  std::vector<btree_map<int, int>::const_iterator> found;
+  m.find_batch(keys.begin(), keys.end(), std::back_inserter(found));
+
+  // string keys sharing long prefixes, some of them prefixes of others or
+  // differing only in trailing zero bytes, which the abbreviations of nodes do
+  // not tell apart, are found as std::map finds them
+  {
+    btree_map<std::string, int> strings;
+    std::map<std::string, int> reference;
+    const char *prefixes[] = { "tenant/", "tenant/ab/", "tenant/ab/type/", "tenant/ab/type/key/" };
+    auto key = [&prefixes](int i) {
+      std::string k = prefixes[i % 4] + std::to_string(i * 7919 % 40009);
+      return i % 5 == 0 ? k + std::string(i % 13, '\0') : k;
+    };
+    for (int i = 0; i < 40000; ++i) {
+      strings[key(i)] = i;
+      reference[key(i)] = i;
+    }
+    // erasing changes the first and last keys of nodes, and so the prefixes
+    // their keys share
+    for (int i = 0; i < 40000; i += 3) {
+      CHECK(static_cast<size_t>(strings.erase(key(i))) == reference.erase(key(i)));
+    }
+    check_same(strings, reference);
+
+    auto same = [&strings, &reference](btree_map<std::string, int>::const_iterator it,
+        std::map<std::string, int>::const_iterator expected) {
+      return it == strings.end() ? expected == reference.end() : expected != reference.end() && *it == *expected;
+    };
+    std::vector<std::string> probes = { "", "t", "tenant", "tenant/ab/type/key/99999", "u" };
+    for (const auto& v : reference) {
+      probes.push_back(v.first);
+      probes.push_back(v.first + '0');
+      probes.push_back(v.first.substr(0, v.first.size() - 1));
+    }
+    for (const auto& probe : probes) {
+      CHECK(same(strings.find(probe), reference.find(probe)));
+      CHECK(same(strings.lower_bound(probe), reference.lower_bound(probe)));
+      CHECK(same(strings.upper_bound(probe), reference.upper_bound(probe)));
+    }
+
+    // the verifier checks the prefixes and abbreviations of every node
+    btree_map<std::string, int>::verifier_type verifier(strings.snapshot());
+    while (!verifier.step(1000)) {
+    }
+    CHECK(verifier.ok());
+  }
+
+  // transparent lookups of trees of many nodes find what lookups by key do
+  {
+    btree_map<std::string, int, btree_transparent_less<std::string>> m6;
+    btree_map<std::string, int, bytes_less> by_bytes;
+    for (int i = 0; i < 20000; ++i) {
+      std::string k = "tenant/" + std::to_string(i % 7) + "/key/" + std::to_string(i * 2);
+      m6[k] = i;
+      by_bytes[k] = i;
+    }
+    for (int i = -1; i < 41000; i += 13) {
+      std::string k = "tenant/" + std::to_string(i % 7) + "/key/" + std::to_string(i);
+      CHECK(m6.find(k.c_str()) == m6.find(k));
+      CHECK(m6.lower_bound(k.c_str()) == m6.lower_bound(k));
+      CHECK(m6.upper_bound(k.c_str()) == m6.upper_bound(k));
+      atlasdb::query::key_bytes b(k.data(), k.size());
+      CHECK(by_bytes.find(b) == by_bytes.find(k));
+      CHECK(by_bytes.lower_bound(b) == by_bytes.lower_bound(k));
+      CHECK(by_bytes.equal_range(b) == by_bytes.equal_range(k));
+    }
+    CHECK(m6.find("tenant/0/key/0")->second == 0 && m6.find("tenant/0/key/1") == m6.end());
+    CHECK(m6.lower_bound("") == m6.begin() && m6.lower_bound("u") == m6.end());
+    // a prefix of a key sorts before it
+    atlasdb::query::key_bytes prefix("tenant/3/key/1", 13);
+    CHECK(by_bytes.lower_bound(prefix) == by_bytes.lower_bound(std::string("tenant/3/key/")));
+  }
+
+  // a hash index finds what the btree finds, from its entries once they are
+  // filled, and drops them when nodes leave the tree
+  {
+    btree_map<int, int> probed;
+    for (int i = 0; i < 50000; ++i) {
+      probed[i * 3] = i;
+    }
+    btree_hash_index<btree_map<int, int>> hash_index(1 << 20);
+    for (int i = 0; i < 50000; ++i) {
+      CHECK(hash_index.find(probed, i * 3) == probed.find(i * 3));
+    }
+    const btree_hash_index_stats& stats = hash_index.stats();
+    CHECK(stats.hits == 0 && stats.misses == 50000 && stats.entries > 40000 && stats.entries <= stats.capacity);
+    for (int i = 0; i < 50000; ++i) {
+      CHECK(hash_index.find(probed, i * 3)->second == i);
+    }
+    CHECK(stats.hits > 40000 && stats.hits + stats.misses == 100000);
+
+    // keys not in the tree are missed and take no entry
+    size_t entries = stats.entries;
+    for (int i = 0; i < 1000; ++i) {
+      CHECK(hash_index.find(probed, i * 3 + 1) == probed.end());
+    }
+    CHECK(stats.entries == entries && stats.hits + stats.misses == 101000);
+
+    // inserts shift keys within their nodes and split them, erases of single
+    // values merge nodes, which invalidates the entries
+    for (int i = 0; i < 50000; i += 2) {
+      probed[i * 3 + 1] = -i;
+    }
+    for (int i = 0; i < 50000; ++i) {
+      CHECK(hash_index.find(probed, i * 3) == probed.find(i * 3));
+      CHECK(hash_index.find(probed, i * 3 + 1) == probed.find(i * 3 + 1));
+    }
+    uint64_t invalidations = stats.invalidations;
+    for (int i = 0; i < 50000; i += 3) {
+      probed.erase(i * 3);
+    }
+    CHECK(probed.generation() > 0);
+    for (int i = 0; i < 50000; ++i) {
+      auto it = hash_index.find(probed, i * 3);
+      CHECK(it == probed.find(i * 3) && (i % 3 == 0) == (it == probed.end()));
+    }
+    CHECK(stats.invalidations > invalidations);
+
+    // the entries of a tree swapped with another do not point into it
+    btree_map<int, int> other;
+    for (int i = 0; i < 1000; ++i) {
+      other[i * 3] = i + 1000000;
+    }
+    invalidations = stats.invalidations;
+    probed.swap(other);
+    for (int i = 0; i < 2000; ++i) {
+      CHECK(hash_index.find(probed, i * 3) == probed.find(i * 3));
+    }
+    CHECK(stats.invalidations == invalidations + 1 && hash_index.find(probed, 3)->second == 1000001);
+  }
+
+  // range erases of trees of many nodes, empty, within a leaf, across whole
+  // subtrees and up to either end, erase what std::map erases
+  {
+    CHECK(m4.erase_range(0, 100) == 0 && m4.empty());
+    btree_ranked_map<int, int> ranked;
+    btree_multimap<int, int> multi;
+    std::map<int, int> reference;
+    std::multimap<int, int> multi_reference;
+    for (int i = 0; i < 100000; ++i) {
+      ranked[i * 2] = i;
+      reference[i * 2] = i;
+      multi.insert(std::make_pair(i / 3, i));
+      multi_reference.insert(std::make_pair(i / 3, i));
+    }
+    const std::pair<int, int> ranges[] = { { 5, 5 }, { 7, 3 }, { 1001, 1011 }, { 3000, 90000 }, { -10, 400 },
+        { 150000, 250000 }, { 100, 200 }, { 2000, 1000000 }, { -1, 1000000 } };
+    for (const auto& r : ranges) {
+      size_t expected = r.first < r.second
+          ? std::distance(reference.lower_bound(r.first), reference.lower_bound(r.second)) : 0;
+      CHECK(static_cast<size_t>(ranked.erase_range(r.first, r.second)) == expected);
+      if (r.first < r.second) {
+        reference.erase(reference.lower_bound(r.first), reference.lower_bound(r.second));
+      }
+      check_same(ranked, reference);
+      CHECK(ranked.rank(r.second) == static_cast<ssize_t>(std::distance(reference.begin(),
+          reference.lower_bound(r.second))));
+      btree_ranked_map<int, int>::verifier_type verifier(ranked.snapshot());
+      while (!verifier.step(1000)) {
+      }
+      CHECK(verifier.ok());
+
+      expected = r.first < r.second
+          ? std::distance(multi_reference.lower_bound(r.first), multi_reference.lower_bound(r.second)) : 0;
+      CHECK(static_cast<size_t>(multi.erase_range(r.first, r.second)) == expected);
+      if (r.first < r.second) {
+        multi_reference.erase(multi_reference.lower_bound(r.first), multi_reference.lower_bound(r.second));
+      }
+      check_same(multi, multi_reference);
+    }
+    CHECK(ranked.empty() && multi.empty());
+  }
+
+  std::vector<std::pair<int, int>> batch;
+  m.insert_sorted_batch(batch.begin(), batch.end());
+
+  // an empty tree verifies in one step and has nothing to compact
+  btree_map<int, int>::verifier_type verifier(m.snapshot());
+  CHECK(verifier.step(100) && verifier.ok() && verifier.nodes() == m.nodes());
+  CHECK(m.compact() == 0 && m.empty() && m.nodes() == 0);
+
+  // snapshots keep the values they were taken with while the tree takes
+  // inserts, erases, operator[] and range erases
+  {
+    btree_map<int, int> tree;
+    std::map<int, int> reference;
+    for (int i = 0; i < 30000; ++i) {
+      tree[i * 2] = i;
+      reference[i * 2] = i;
+    }
+    btree_map<int, int>::snapshot_type first = tree.snapshot();
+    std::map<int, int> first_reference = reference;
+
+    for (int i = 0; i < 60000; i += 3) {
+      tree.insert(std::make_pair(i + 1, -i));
+      reference.insert(std::make_pair(i + 1, -i));
+      tree[i] = i;
+      reference[i] = i;
+      tree.erase(i + 2);
+      reference.erase(i + 2);
+    }
+    btree_map<int, int>::snapshot_type second = tree.snapshot();
+    std::map<int, int> second_reference = reference;
+
+    size_t erased = std::distance(reference.lower_bound(10000), reference.lower_bound(40000));
+    CHECK(static_cast<size_t>(tree.erase_range(10000, 40000)) == erased);
+    reference.erase(reference.lower_bound(10000), reference.lower_bound(40000));
+    for (int i = 0; i < 70000; i += 5) {
+      tree[i] += 1;
+      reference[i] += 1;
+    }
+    check_same(tree, reference);
+    check_same(first, first_reference);
+    check_same(second, second_reference);
+    CHECK(first.find(4)->second == 2 && first.find(1) == first.end());
+    for (int key : { -1, 0, 1, 9999, 10000, 25001, 39999, 40000, 59999, 70000 }) {
+      CHECK(std::distance(first.lower_bound(key), first.end())
+          == std::distance(first_reference.lower_bound(key), first_reference.end()));
+      CHECK(std::equal(second_reference.upper_bound(key), second_reference.end(), second.upper_bound(key)));
+    }
+
+    // nor does clearing the tree free the nodes of the snapshots
+    tree.clear();
+    CHECK(tree.empty());
+    check_same(first, first_reference);
+    check_same(second, second_reference);
+  }
+
+  // images, mapped twice so that at least one mapping is at another address
+  // than the other, serve the values of the btree they were written from
+  {
+    btree_ranked_map<int, int> written;
+    std::map<int, int> reference;
+    for (int i = 0; i < 50000; ++i) {
+      written[i * 3] = i;
+      reference[i * 3] = i;
+    }
+    written.erase_range(3000, 6000);
+    reference.erase(reference.lower_bound(3000), reference.lower_bound(6000));
+
+    char path[] = "/tmp/atlasdb_btree_image_XXXXXX";
+    int fd = ::mkstemp(path);
+    CHECK(fd >= 0);
+    ::close(fd);
+    written.write_image(path);
+    btree_image image(path);
+    btree_image other_image(path);
+    ::unlink(path);
+    CHECK(image.data() != other_image.data());
+
+    btree_ranked_map<int, int> attached;
+    btree_ranked_map<int, int> other_attached;
+    attached.attach_image(image);
+    other_attached.attach_image(other_image);
+    check_same(attached, reference);
+    check_same(other_attached, reference);
+    CHECK(std::equal(reference.rbegin(), reference.rend(), attached.rbegin()));
+    CHECK(attached.find(2997)->second == 999 && attached.find(3000) == attached.end());
+    CHECK(other_attached.select(other_attached.rank(6000))->second == 2000);
+
+    // modifications copy the nodes out of the image, leaving it as it was
+    std::map<int, int> modified = reference;
+    for (int i = 0; i < 150000; i += 11) {
+      attached[i] = -i;
+      modified[i] = -i;
+      attached.erase(i + 3);
+      modified.erase(i + 3);
+    }
+    check_same(attached, modified);
+    check_same(other_attached, reference);
+
+    btree_ranked_map<int, int> empty;
+    char empty_path[] = "/tmp/atlasdb_btree_image_XXXXXX";
+    fd = ::mkstemp(empty_path);
+    CHECK(fd >= 0);
+    ::close(fd);
+    empty.write_image(empty_path);
+    btree_image empty_image(empty_path);
+    ::unlink(empty_path);
+    attached.attach_image(empty_image);
+    CHECK(attached.empty() && attached.begin() == attached.end());
+  }
+
+  // bulk loads of trees of many nodes, packed or not
+  {
+    std::vector<std::pair<int, int>> sorted;
+    std::map<int, int> reference;
+    for (int i = 0; i < 10000; ++i) {
+      sorted.push_back(std::make_pair(i * 2, i));
+      reference[i * 2] = i;
+    }
+    for (double fill : { 1.0, 0.7, 0.01 }) {
+      btree_map<int, int> loaded;
+      loaded.bulk_load(sorted.begin(), sorted.end(), fill);
+      check_same(loaded, reference);
+      CHECK(loaded.find(4000)->second == 2000 && loaded.find(4001) == loaded.end());
+      std::map<int, int> changed = reference;
+      for (int i = 1; i < 20000; i += 7) {
+        loaded[i] = -i;
+        changed[i] = -i;
+        loaded.erase(i + 1);
+        changed.erase(i + 1);
+      }
+      check_same(loaded, changed);
+    }
+
+    // duplicates are kept by a multimap, in order, and skipped by a map
+    std::vector<std::pair<int, int>> duplicates;
+    std::multimap<int, int> multi_reference;
+    std::map<int, int> unique_reference;
+    for (int i = 0; i < 5000; ++i) {
+      duplicates.push_back(std::make_pair(i / 3, i));
+      multi_reference.insert(std::make_pair(i / 3, i));
+      unique_reference.insert(std::make_pair(i / 3, i));
+    }
+    btree_multimap<int, int> multi_loaded;
+    multi_loaded.bulk_load(duplicates.begin(), duplicates.end());
+    check_same(multi_loaded, multi_reference);
+    btree_map<int, int> unique_loaded;
+    unique_loaded.bulk_load(duplicates.begin(), duplicates.end());
+    check_same(unique_loaded, unique_reference);
+
+    // a tree that is not empty takes the values as a sorted batch
+    btree_map<int, int> nonempty;
+    nonempty[1] = 1;
+    nonempty[30001] = 2;
+    std::map<int, int> nonempty_reference = reference;
+    nonempty_reference[1] = 1;
+    nonempty_reference[30001] = 2;
+    nonempty.bulk_load(sorted.begin(), sorted.end());
+    check_same(nonempty, nonempty_reference);
+  }
+
+  // node arenas recycle freed nodes, and clear() releases them at once
+  {
+    typedef btree_node_allocator<std::pair<const int, int>> allocator;
+    std::weak_ptr<btree_node_arena> arena;
+    auto make_allocator = [&arena]() {
+      allocator alloc;
+      arena = alloc.arena();
+      return alloc;
+    };
+    btree_map<int, int, std::less<int>, allocator> recycled(std::less<int>(), make_allocator());
+    std::map<int, int> reference;
+    for (int i = 0; i < 100000; ++i) {
+      recycled[i * 3 % 100003] = i;
+      reference[i * 3 % 100003] = i;
+    }
+    check_same(recycled, reference);
+    size_t mapped = arena.lock()->bytes_mapped();
+    CHECK(mapped > 0 && mapped % btree_node_arena::kChunkSize == 0);
+
+    // chunks start at a huge page boundary, the first node of one at its start
+    {
+      btree_node_arena fresh;
+      const size_t quarter = btree_node_arena::kChunkSize / 4;
+      for (int i = 0; i < 3; ++i) {
+        char *node = static_cast<char*>(fresh.allocate(quarter));
+        CHECK(reinterpret_cast<uintptr_t>(node) % btree_node_arena::kChunkSize == 0);
+        for (int j = 1; j < 4; ++j) {
+          CHECK(fresh.allocate(quarter) == node + j * quarter);
+        }
+      }
+      CHECK(fresh.bytes_mapped() == 3 * btree_node_arena::kChunkSize);
+    }
+
+    for (int i = 0; i < 100000; i += 2) {
+      recycled.erase(i);
+      reference.erase(i);
+    }
+    for (int i = 0; i < 100000; i += 2) {
+      recycled[i] = -i;
+      reference[i] = -i;
+    }
+    check_same(recycled, reference);
+    CHECK(arena.lock()->bytes_mapped() == mapped);
+
+    recycled.clear();
+    CHECK(recycled.empty() && arena.lock()->bytes_mapped() == 0);
+    reference.clear();
+    for (int i = 0; i < 5000; ++i) {
+      recycled[i] = i;
+      reference[i] = i;
+    }
+    check_same(recycled, reference);
+  }
+
+  // scans visit the values begin() to end() does, from any key
+  {
+    btree_map<int, int> scanned;
+    std::map<int, int> reference;
+    CHECK(scanned.scan_begin() == scanned.scan_end());
+    CHECK(scanned.scan_lower_bound(0) == scanned.scan_end());
+    for (int i = 0; i < 50000; ++i) {
+      scanned[i * 7 % 50021] = i;
+      reference[i * 7 % 50021] = i;
+    }
+    // leave some leaves sparse and some empty
+    for (int i = 10000; i < 30000; ++i) {
+      if (i % 97 != 0) {
+        scanned.erase(i);
+        reference.erase(i);
+      }
+    }
+    CHECK(std::equal(reference.begin(), reference.end(), scanned.scan_begin()));
+    CHECK(std::distance(scanned.scan_begin(), scanned.scan_end()) == static_cast<ptrdiff_t>(reference.size()));
+    for (int key : { -1, 0, 9999, 10001, 12513, 29999, 30000, 50020, 50021 }) {
+      auto it = scanned.scan_lower_bound(key);
+      auto expected = reference.lower_bound(key);
+      CHECK(std::distance(it, scanned.scan_end()) == std::distance(expected, reference.end()));
+      CHECK(std::equal(expected, reference.end(), it));
+    }
+
+    btree_multimap<int, int> multi_scanned;
+    std::multimap<int, int> multi_reference;
+    for (int i = 0; i < 20000; ++i) {
+      multi_scanned.insert(std::make_pair(i % 1000, i));
+      multi_reference.insert(std::make_pair(i % 1000, i));
+    }
+    CHECK(std::distance(multi_scanned.scan_begin(), multi_scanned.scan_end()) == 20000);
+    CHECK(std::equal(multi_reference.begin(), multi_reference.end(), multi_scanned.scan_begin()));
+    CHECK(std::equal(multi_reference.lower_bound(500), multi_reference.end(), multi_scanned.scan_lower_bound(500)));
+  }
+
+  // order statistics of a ranked tree of many nodes, as it changes
+  {
+    btree_ranked_map<int, int> ranked;
+    std::map<int, int> reference;
+    for (int i = 0; i < 30000; ++i) {
+      ranked[i * 2] = i;
+      reference[i * 2] = i;
+    }
+    for (int i = 0; i < 60000; i += 3 * 2) {
+      ranked.erase(i);
+      reference.erase(i);
+    }
+    ranked.erase_range(20000, 24000);
+    reference.erase(reference.lower_bound(20000), reference.lower_bound(24000));
+    check_same(ranked, reference);
+
+    size_t n = 0;
+    for (const auto& v : reference) {
+      CHECK(static_cast<size_t>(ranked.rank(v.first)) == n);
+      CHECK(ranked.select(ranked.rank(v.first))->first == v.first);
+      CHECK(ranked.select(n)->second == v.second);
+      CHECK(static_cast<size_t>(ranked.rank(v.first + 1)) == n + 1);
+      ++n;
+    }
+    CHECK(ranked.select(ranked.size()) == ranked.end() && ranked.select(-1) == ranked.end());
+    CHECK(ranked.rank(-1) == 0 && ranked.rank(60000) == ranked.size());
+    for (int lo = -1; lo < 60000; lo += 997) {
+      int hi = lo + 5000;
+      CHECK(ranked.count_range(lo, hi) == std::distance(reference.lower_bound(lo), reference.lower_bound(hi)));
+    }
+  }
+
+  // large nodes keeping their keys in an array of their own (kSplitKeys) take
+  // random inserts, overwrites, erases and range erases as std::map does
+  {
+    typedef std::allocator<std::pair<const int64_t, int64_t>> allocator;
+    typedef btree_map<int64_t, int64_t, std::less<int64_t>, allocator, 1024> split_map;
+    typedef btree_multimap<int64_t, int64_t, std::less<int64_t>, allocator, 1024> split_multimap;
+#ifndef ATLASDB_BTREE_NO_SPLIT_KEYS
+    static_assert(btree_node<btree_map_params<int64_t, int64_t, std::less<int64_t>, allocator, 1024>>::kSplitKeys,
+        "1024 byte nodes of int64_t keys split their keys");
+#endif
+    split_map split;
+    split_multimap multi_split;
+    std::map<int64_t, int64_t> reference;
+    std::multimap<int64_t, int64_t> multi_reference;
+    uint64_t seed = 1;
+    auto next = [&seed]() {
+      seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+      return static_cast<int64_t>(seed >> 33) % 100000 - 50000;
+    };
+    for (int round = 0; round < 4; ++round) {
+      for (int i = 0; i < 60000; ++i) {
+        int64_t k = next() * 1000003;
+        if (i % 3 == 0) {
+          CHECK(static_cast<size_t>(split.erase(k)) == reference.erase(k));
+          auto it = multi_split.lower_bound(k / 7);
+          auto expected = multi_reference.lower_bound(k / 7);
+          CHECK(it == multi_split.end() ? expected == multi_reference.end() : *it == *expected);
+          if (it != multi_split.end() && it->first == k / 7) {
+            multi_split.erase(it);
+            multi_reference.erase(expected);
+          }
+        } else {
+          split[k] = i;
+          reference[k] = i;
+          multi_split.insert(std::make_pair(k / 7, i));
+          multi_reference.insert(std::make_pair(k / 7, i));
+        }
+      }
+      check_same(split, reference);
+      check_same(multi_split, multi_reference);
+      for (int i = 0; i < 2000; ++i) {
+        int64_t k = next() * 1000003 + i % 3 - 1;
+        auto it = split.lower_bound(k);
+        auto expected = reference.lower_bound(k);
+        CHECK(it == split.end() ? expected == reference.end() : expected != reference.end() && *it == *expected);
+        CHECK((split.find(k) == split.end()) == (reference.find(k) == reference.end()));
+        CHECK(static_cast<size_t>(multi_split.count(k / 7)) == multi_reference.count(k / 7));
+      }
+      int64_t lower = next() * 1000003;
+      int64_t upper = lower + 5000 * 1000003LL;
+      size_t expected = std::distance(reference.lower_bound(lower), reference.lower_bound(upper));
+      CHECK(static_cast<size_t>(split.erase_range(lower, upper)) == expected);
+      reference.erase(reference.lower_bound(lower), reference.lower_bound(upper));
+      check_same(split, reference);
+    }
+    CHECK(std::equal(reference.rbegin(), reference.rend(), split.rbegin()));
+
+    split_map copy(split);
+    split.clear();
+    check_same(copy, reference);
+    CHECK(split.empty() && split.begin() == split.end());
+  }
+
+  // batched lookups of unsorted, repeated and missing keys find what find()
+  // does, in the order of the keys
+  {
+    btree_map<int, int> probed;
+    btree_multimap<int, int> multi_probed;
+    for (int i = 0; i < 40000; ++i) {
+      probed[i * 3] = i;
+      multi_probed.insert(std::make_pair(i / 4 * 3, i));
+    }
+    std::vector<int> probes;
+    for (int i = 0; i < 20000; ++i) {
+      probes.push_back(static_cast<int>(i * 2654435761u % 130000) - 5000);
+    }
+    probes.push_back(probes.front());
+    probes.push_back(119997);
+    probes.push_back(-1);
+
+    std::vector<btree_map<int, int>::const_iterator> found;
+    probed.find_batch(probes.begin(), probes.end(), std::back_inserter(found));
+    CHECK(found.size() == probes.size());
+    for (size_t i = 0; i < probes.size(); ++i) {
+      CHECK(found[i] == probed.find(probes[i]));
+    }
+    std::vector<btree_multimap<int, int>::const_iterator> multi_found;
+    multi_probed.find_batch(probes.begin(), probes.end(), std::back_inserter(multi_found));
+    CHECK(multi_found.size() == probes.size());
+    for (size_t i = 0; i < probes.size(); ++i) {
+      CHECK(multi_found[i] == multi_probed.find(probes[i]));
+      CHECK(multi_found[i] == multi_probed.end() || multi_found[i] == multi_probed.lower_bound(probes[i]));
+    }
+  }
+
+  // sorted batches merged into trees of many nodes, as inserts one by one
+  {
+    btree_map<int, int> merged;
+    btree_multimap<int, int> multi_merged;
+    std::map<int, int> reference;
+    std::multimap<int, int> multi_reference;
+    for (int i = 0; i < 30000; ++i) {
+      merged[i * 5] = i;
+      reference[i * 5] = i;
+      multi_merged.insert(std::make_pair(i * 5, i));
+      multi_reference.insert(std::make_pair(i * 5, i));
+    }
+    // runs of new keys between existing ones, keys already present, runs of
+    // duplicates, and keys below and above all of the others
+    std::vector<std::pair<int, int>> sorted;
+    for (int i = -100; i < 160000; i += (i / 1000 % 3 == 0) ? 1 : 7) {
+      sorted.push_back(std::make_pair(i, -i));
+      if (i % 11 == 0) {
+        sorted.push_back(std::make_pair(i, -i - 1));
+      }
+    }
+    size_t inserted = 0;
+    for (const auto& v : sorted) {
+      inserted += reference.insert(v).second;
+      multi_reference.insert(v);
+    }
+    CHECK(static_cast<size_t>(merged.insert_sorted_batch(sorted.begin(), sorted.end())) == inserted);
+    check_same(merged, reference);
+    CHECK(static_cast<size_t>(multi_merged.insert_sorted_batch(sorted.begin(), sorted.end())) == sorted.size());
+    check_same(multi_merged, multi_reference);
+    CHECK(merged.insert_sorted_batch(sorted.begin(), sorted.end()) == 0);
+    check_same(merged, reference);
+  }
+
+  // verification to completion, and compaction of sparse trees
+  {
+    btree_ranked_map<int, int> sparse;
+    std::map<int, int> reference;
+    for (int i = 0; i < 100000; ++i) {
+      sparse[i] = i;
+      reference[i] = i;
+    }
+    for (int i = 0; i < 100000; ++i) {
+      if (i % 10 != 0) {
+        sparse.erase(i);
+        reference.erase(i);
+      }
+    }
+    check_same(sparse, reference);
+
+    btree_ranked_map<int, int>::verifier_type before(sparse.snapshot());
+    int steps = 0;
+    while (!before.step(100)) {
+      ++steps;
+    }
+    CHECK(before.ok() && before.error().empty() && steps > 0);
+    CHECK(before.nodes() == sparse.nodes());
+    CHECK(before.fragmentation().reclaimable_bytes > 0);
+
+    // the snapshot keeps the nodes as they were while compact() copies them
+    btree_ranked_map<int, int>::snapshot_type snapshot = sparse.snapshot();
+    typedef btree_ranked_map<int, int>::size_type size_type;
+    size_type nodes = sparse.nodes();
+    size_type freed = sparse.compact_range(0, 50000);
+    CHECK(freed > 0 && sparse.nodes() == nodes - freed);
+    freed += sparse.compact();
+    CHECK(sparse.nodes() == nodes - freed && sparse.nodes() * 4 < nodes * 3);
+    check_same(sparse, reference);
+    CHECK(sparse.select(5000)->first == 50000 && sparse.rank(50000) == 5000);
+    CHECK(std::equal(reference.begin(), reference.end(), snapshot.begin()));
+
+    btree_ranked_map<int, int>::verifier_type after(sparse.snapshot());
+    while (!after.step(100)) {
+    }
+    CHECK(after.ok() && after.nodes() == sparse.nodes());
+    CHECK(after.fragmentation().reclaimable_bytes < before.fragmentation().reclaimable_bytes);
+
+    // the compacted tree takes inserts and erases as any other
+    for (int i = 1; i < 100000; i += 10) {
+      sparse[i] = -i;
+      reference[i] = -i;
+    }
+    check_same(sparse, reference);
+    btree_ranked_map<int, int>::verifier_type grown(sparse.snapshot());
+    while (!grown.step(1000)) {
+    }
+    CHECK(grown.ok());
+  }
 
   return 0;
 }
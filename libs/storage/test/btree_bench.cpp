@@ -0,0 +1,82 @@
+/*
+ * btree_bench.cpp
+ *
+ * Times random inserts, random lookups and a full scan of btree_maps with
+ * int64_t keys for a few node sizes. Built twice, as btree_bench with the keys
+ * of large nodes copied into an array of their own and as
+ * btree_bench_interleaved with ATLASDB_BTREE_NO_SPLIT_KEYS.
+ */
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <random>
+#include <vector>
+
+#include <atlasdb/storage/btree/btree_allocator.h>
+#include <atlasdb/storage/btree/btree_map.h>
+#include <atlasdb/storage/btree/btree.tcc>
+
+using namespace atlasdb::storage;
+
+namespace {
+
+  typedef std::chrono::steady_clock clock_type;
+
+  double seconds_since(clock_type::time_point start) {
+    return std::chrono::duration<double>(clock_type::now() - start).count();
+  }
+
+  template<int TargetNodeSize>
+  void bench(const std::vector<int64_t> &keys, const std::vector<int64_t> &probes) {
+    typedef btree_node_allocator<std::pair<const int64_t, int64_t>> allocator;
+    typedef btree_map<int64_t, int64_t, std::less<int64_t>, allocator, TargetNodeSize> map_type;
+
+    map_type m;
+    clock_type::time_point start = clock_type::now();
+    for (int64_t k : keys) {
+      m[k] = k;
+    }
+    double insert = seconds_since(start);
+
+    int64_t sum = 0;
+    start = clock_type::now();
+    for (int64_t k : probes) {
+      sum += m.find(k)->second;
+    }
+    double find = seconds_since(start);
+
+    start = clock_type::now();
+    for (const auto &v : m) {
+      sum += v.second;
+    }
+    double scan = seconds_since(start);
+
+    std::printf("node %5d bytes: insert %.3fs find %.3fs scan %.3fs (%lld)\n", TargetNodeSize, insert, find, scan,
+        static_cast<long long>(sum & 1));
+  }
+
+}
+
+int main(int argc, char *argv[]) {
+  size_t n = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 4000000;
+
+  std::mt19937_64 gen(1);
+  std::vector<int64_t> keys(n);
+  for (int64_t &k : keys) {
+    k = static_cast<int64_t>(gen());
+  }
+  std::vector<int64_t> probes(n);
+  for (int64_t &k : probes) {
+    k = keys[gen() % n];
+  }
+
+  bench<256>(keys, probes);
+  bench<512>(keys, probes);
+  bench<1024>(keys, probes);
+  bench<2048>(keys, probes);
+  bench<4096>(keys, probes);
+  return 0;
+}
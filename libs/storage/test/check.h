@@ -0,0 +1,22 @@
+/*
+ * check.h
+ *
+ * The checks of the tests, made whether NDEBUG is defined or not, unlike
+ * assert(): a failed check reports its condition and fails the test.
+ */
+
+#ifndef ATLASDB_LIBS_STORAGE_TEST_CHECK_H_
+#define ATLASDB_LIBS_STORAGE_TEST_CHECK_H_
+
+#include <cstdio>
+#include <cstdlib>
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+      std::exit(EXIT_FAILURE); \
+    } \
+  } while (0)
+
+#endif // ATLASDB_LIBS_STORAGE_TEST_CHECK_H_
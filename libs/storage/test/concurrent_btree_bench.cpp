@@ -0,0 +1,123 @@
+/*
+ * concurrent_btree_bench.cpp
+ *
+ * Times a mix of 90% lookups and 10% writes of random int64_t keys run by 1, 2,
+ * 4, ... threads on a concurrent_btree_map and on a btree_map behind a mutex,
+ * to show how the throughput of each scales with the number of threads.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <atlasdb/storage/btree/btree_allocator.h>
+#include <atlasdb/storage/btree/btree_map.h>
+#include <atlasdb/storage/btree/btree.tcc>
+#include <atlasdb/storage/btree/concurrent_btree.tcc>
+
+using namespace atlasdb::storage;
+
+namespace {
+
+  typedef std::chrono::steady_clock clock_type;
+  typedef btree_node_allocator<std::pair<const int64_t, int64_t>> allocator;
+
+  double seconds_since(clock_type::time_point start) {
+    return std::chrono::duration<double>(clock_type::now() - start).count();
+  }
+
+  // A btree_map which every thread locks for each operation.
+  class locked_map {
+  public:
+
+    bool find(int64_t key, int64_t *value) const {
+      std::lock_guard<std::mutex> guard(_lock);
+      auto it = _map.find(key);
+      if (it == _map.end()) {
+        return false;
+      }
+      *value = it->second;
+      return true;
+    }
+
+    void insert_or_assign(int64_t key, int64_t value) {
+      std::lock_guard<std::mutex> guard(_lock);
+      _map[key] = value;
+    }
+
+  private:
+
+    mutable std::mutex _lock;
+    btree_map<int64_t, int64_t, std::less<int64_t>, allocator> _map;
+  };
+
+  // Runs ops operations on map from each of threads threads, and returns the
+  // number of operations per second. The values found are added to sum.
+  template<class Map>
+  double run(Map &map, const std::vector<int64_t> &keys, size_t ops, int threads, std::atomic<int64_t> &sum) {
+    std::vector<std::thread> workers;
+    clock_type::time_point start = clock_type::now();
+    for (int t = 0; t < threads; ++t) {
+      workers.emplace_back([&map, &keys, ops, t, &sum]() {
+        std::mt19937_64 gen(t + 1);
+        int64_t found = 0;
+        for (size_t i = 0; i < ops; ++i) {
+          uint64_t r = gen();
+          int64_t key = keys[r % keys.size()];
+          if ((r >> 56) % 10 == 0) {
+            map.insert_or_assign(key, key);
+          } else {
+            int64_t value;
+            found += map.find(key, &value) ? value : 0;
+          }
+        }
+        sum += found;
+      });
+    }
+    for (auto &w : workers) {
+      w.join();
+    }
+    return ops * threads / seconds_since(start);
+  }
+
+  template<class Map>
+  void fill(Map &map, const std::vector<int64_t> &keys) {
+    for (size_t i = 0; i < keys.size(); i += 2) {
+      map.insert_or_assign(keys[i], keys[i]);
+    }
+  }
+
+}
+
+int main(int argc, char *argv[]) {
+  size_t n = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+  int max_threads = std::max(8u, std::thread::hardware_concurrency());
+
+  std::mt19937_64 gen(1);
+  std::vector<int64_t> keys(n);
+  for (int64_t &k : keys) {
+    k = static_cast<int64_t>(gen());
+  }
+
+  concurrent_btree_map<int64_t, int64_t, std::less<int64_t>, allocator> concurrent;
+  locked_map locked;
+  fill(concurrent, keys);
+  fill(locked, keys);
+
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    std::atomic<int64_t> sum(0);
+    double c = run(concurrent, keys, n, threads, sum);
+    double l = run(locked, keys, n, threads, sum);
+    std::printf("%3d threads: concurrent %.2f Mops/s locked %.2f Mops/s (%lld)\n", threads, c / 1e6, l / 1e6,
+        static_cast<long long>(sum & 1));
+  }
+  return 0;
+}
@@ -5,24 +5,743 @@
  *      Author: vincent
  */
 
+#include <atlasdb/storage/basic_bitmap_index.h>
+#include <atlasdb/storage/basic_hash_index.h>
 #include <atlasdb/storage/basic_index.h>
 #include <atlasdb/storage/basic_indexer.h>
 #include <atlasdb/storage/basic_repository.h>
 #include <atlasdb/storage/basic_storehouse.h>
+#include <atlasdb/storage/concurrent_repository.h>
+#include <atlasdb/storage/sharded_repository.h>
 
+#include <atlasdb/storage/bits/basic_bitmap_index.tcc>
+#include <atlasdb/storage/bits/basic_hash_index.tcc>
+#include <atlasdb/storage/bits/basic_index.tcc>
 #include <atlasdb/storage/bits/basic_indexer.tcc>
 #include <atlasdb/storage/bits/basic_repository.tcc>
 #include <atlasdb/storage/bits/basic_storehouse.tcc>
+#include <atlasdb/storage/bits/sharded_repository.tcc>
+#include <atlasdb/storage/bits/write_ahead_log.tcc>
+#include <atlasdb/storage/btree/btree.tcc>
+#include <atlasdb/storage/btree/concurrent_btree.tcc>
+
+#include <atlasdb/storage/impl/roaring_bitmap.ipp>
+#include <atlasdb/storage/impl/storage_error.ipp>
+#include <atlasdb/storage/impl/write_ahead_log.ipp>
+
+#include <atomic>
+#include <map>
+#include <random>
+#include <set>
+#include <thread>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "check.h"
 
 using namespace atlasdb::storage;
 
+// Checks the set operations of roaring bitmaps against std::set, on chunks
+// held by arrays, by bitsets and by runs, and on chunks of different kinds
+// in the two operands. Built with ATLASDB_BITMAP_NO_SIMD, the same checks go
+// through the scalar loops; otherwise the vectorized kernels the CPU has are
+// also compared to the scalar loops directly.
+static void check_roaring() {
+  std::mt19937 gen(2);
+  std::set<uint32_t> a, b;
+  for (uint32_t chunk = 0; chunk < 6; ++chunk) {
+    uint32_t high = chunk << 16;
+    // arrays and bitsets in chunks 0 and 1, and either way round in chunk 4
+    for (int i = 0; i < 1000; ++i) {
+      a.insert(high | gen() % (chunk == 4 ? 65536 : 4000));
+      b.insert(high | gen() % 4000);
+    }
+    if (chunk == 1 || chunk == 4) {
+      for (int i = 0; i < 30000; ++i) {
+        (chunk == 1 ? b : a).insert(high | gen() % 65536);
+        a.insert(high | gen() % 65536);
+      }
+    }
+    // runs in chunks 2 and 3, against runs, arrays and bitsets in chunk 5
+    if (chunk == 2 || chunk == 3 || chunk == 5) {
+      for (uint32_t x = 0; x < 65536; x += 1000) {
+        for (uint32_t y = x; y < x + 300 + chunk * 100; ++y) {
+          (chunk == 3 ? b : a).insert(high | y);
+        }
+      }
+    }
+  }
+
+  roaring_bitmap ra, rb;
+  for (uint32_t x : a) {
+    ra.add(x);
+  }
+  for (uint32_t x : b) {
+    rb.add(x);
+  }
+  CHECK(ra.optimize() > 0);
+  rb.optimize();
+
+  auto same = [](const roaring_bitmap& r, const std::set<uint32_t>& expected) {
+    std::vector<uint32_t> found;
+    r.for_each([&found](uint32_t x) {
+      found.push_back(x);
+      return true;
+    });
+    return r.cardinality() == expected.size() && std::equal(found.begin(), found.end(), expected.begin())
+        && found.size() == expected.size();
+  };
+  CHECK(same(ra, a) && same(rb, b));
+
+  std::set<uint32_t> both, either, only;
+  std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::inserter(both, both.end()));
+  std::set_union(a.begin(), a.end(), b.begin(), b.end(), std::inserter(either, either.end()));
+  std::set_difference(a.begin(), a.end(), b.begin(), b.end(), std::inserter(only, only.end()));
+  CHECK(same(ra & rb, both) && same(rb & ra, both));
+  CHECK(same(ra | rb, either) && same(rb | ra, either));
+  CHECK(same(ra - rb, only));
+
+#ifdef ATLASDB_BITMAP_SIMD_X86
+  std::vector<uint64_t> x(roaring_bitmap::kBitsetWords), y(roaring_bitmap::kBitsetWords);
+  for (size_t i = 0; i < x.size(); ++i) {
+    x[i] = uint64_t(gen()) << 32 | gen();
+    y[i] = i % 7 ? uint64_t(gen()) << 32 | gen() : 0;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+    typedef uint32_t (*kernel)(uint64_t*, const uint64_t*);
+    std::pair<kernel, kernel> kernels[] = { { &bitset_and, &bitset_and_avx2 }, { &bitset_or, &bitset_or_avx2 },
+        { &bitset_andnot, &bitset_andnot_avx2 } };
+    for (const auto& k : kernels) {
+      std::vector<uint64_t> scalar = x, vector = x;
+      CHECK(k.first(scalar.data(), y.data()) == k.second(vector.data(), y.data()) && scalar == vector);
+    }
+  }
+  if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt")) {
+    // every length up to a few vectors, so that the tails are covered, and
+    // arrays holding 0 and 65535
+    for (size_t na = 0; na < 40; ++na) {
+      for (size_t nb = 0; nb < 40; nb += 3) {
+        std::set<uint16_t> sa = { 0 }, sb = { 0, 65535 };
+        while (sa.size() < na) {
+          sa.insert(gen() % 64);
+        }
+        while (sb.size() < nb) {
+          sb.insert(gen() % 64);
+        }
+        std::vector<uint16_t> va(sa.begin(), sa.end()), vb(sb.begin(), sb.end());
+        va.resize(na);
+        vb.resize(nb);
+        std::vector<uint16_t> scalar(40), vector(40);
+        size_t n = array_intersect(va.data(), na, vb.data(), nb, scalar.data());
+        CHECK(array_intersect_sse42(va.data(), na, vb.data(), nb, vector.data()) == n && scalar == vector);
+      }
+    }
+  }
+#endif
+}
+
+// A plain record, some of whose fields are projected into a covering index.
+struct player {
+  int64_t id;
+  double score;
+  char name[24];
+  int32_t level;
+};
+
+// Checks the projections handed out by a covering index of player records
+// against the records, through puts, updates moving records to other index
+// keys or refreshing their projections, and deletes. The index is covered once
+// it holds entries, whose projections are then taken from the repository, and
+// rebuilt while the records keep changing.
+static void check_covering() {
+  typedef basic_storehouse<int, player, int> storehouse_type;
+  typedef storehouse_type::index index_type;
+  storehouse_type players("players", { "level" });
+  std::map<int, player> records;
+  auto make = [](int key, int round, int moves) {
+    player p = player();
+    p.id = key;
+    p.score = key * 0.5 + round;
+    std::string name = "player-" + std::to_string(key) + "-round-" + std::to_string(round);
+    name.copy(p.name, sizeof(p.name) - 1);
+    p.level = (key * 7 + moves) % 37;
+    return p;
+  };
+
+  for (int key = 0; key < 3000; ++key) {
+    if (key == 1000) {
+      players.cover("level", { index_type::field([](const player& p) -> const double& { return p.score; }),
+          index_type::field([](const player& p) -> const char (&)[24] { return p.name; }),
+          index_type::field([](const player& p) -> const int32_t& { return p.level; }) });
+    }
+    records[key] = make(key, 0, 0);
+    players.put(key, records[key], { { "level", { records[key].level } } });
+  }
+  auto change = [&](int round) {
+    for (int key = round; key < 3000; key += 3) {
+      auto it = records.find(key);
+      if (it != records.end()) {
+        // half of the records keep their index key
+        player p = make(key, round, key % 2 ? round : 0);
+        players.update(key, p, { { "level", { it->second.level, p.level } } });
+        it->second = p;
+      }
+    }
+    for (int key = round * 2; key < 3000; key += 11) {
+      auto it = records.find(key);
+      if (it != records.end()) {
+        players.del(key, { { "level", { it->second.level } } });
+        records.erase(it);
+      }
+    }
+  };
+  auto same = [&]() {
+    // the entries by index key, then by record key
+    std::vector<std::pair<std::pair<int, int>, player>> expected;
+    for (const auto& r : records) {
+      expected.push_back(std::make_pair(std::make_pair(r.second.level, r.first), r.second));
+    }
+    std::sort(expected.begin(), expected.end(), [](const std::pair<std::pair<int, int>, player>& a,
+        const std::pair<std::pair<int, int>, player>& b) { return a.first < b.first; });
+    size_t n = 0;
+    players.at("level").covered_range(0, 37, [&expected, &n](int level, int key, const player& data) {
+      CHECK(n < expected.size() && level == expected[n].first.first && key == expected[n].first.second);
+      const player& p = expected[n].second;
+      CHECK(data.id == 0 && data.score == p.score && std::strcmp(data.name, p.name) == 0 && data.level == p.level);
+      ++n;
+      return true;
+    });
+    CHECK(n == expected.size());
+  };
+  change(1);
+  change(2);
+  same();
+
+  // the changes made while the index is built reach it through the side log,
+  // their projections through the repository
+  players.build("level", [](int, const player& p, const std::function<void(const int&)>& emit) {
+    emit(p.level);
+  }, 2);
+  change(3);
+  for (int key = 3000; key < 3100; ++key) {
+    records[key] = make(key, 3, 0);
+    players.put(key, records[key], { { "level", { records[key].level } } });
+  }
+  players.finish_build("level");
+  CHECK(players.at("level").covering());
+  same();
+
+  size_t n = 0;
+  players.at("level").covered_range(10, 12, [&n](int level, int, const player& data) {
+    CHECK(level >= 10 && level < 12 && data.level == level);
+    return ++n < 5;
+  });
+  CHECK(n == 5);
+}
+
+// Checks that the bitmaps of two bitmap indexes of a storehouse combine: their
+// rows name the same records, so that the keys of the & and | of their rows
+// are the records matching both conditions or either. Some records are in one
+// index only, and updates and deletes give rows back to be reused.
+static void check_bitmap_rows() {
+  basic_indexer<int, int, int>::create("status", index_kind::bitmap);
+  basic_indexer<int, int, int>::create("region", index_kind::bitmap);
+  basic_storehouse<int, int, int> accounts("accounts", { "status", "region" });
+  std::map<int, int> statuses;
+  std::map<int, int> regions;
+  auto put = [&](int key) {
+    basic_storehouse<int, int, int>::named_ikeyset ikeys;
+    if (key % 7 != 0) {
+      statuses[key] = key % 4;
+      ikeys["status"] = { key % 4 };
+    }
+    if (key % 5 != 0) {
+      regions[key] = key * 3 % 10;
+      ikeys["region"] = { key * 3 % 10 };
+    }
+    accounts.put(key, key, ikeys);
+  };
+  for (int key = 0; key < 20000; ++key) {
+    put(key);
+  }
+  for (int key = 0; key < 20000; key += 3) {
+    auto s = statuses.find(key);
+    auto r = regions.find(key);
+    if (key % 2 == 0 && s != statuses.end()) {
+      accounts.update(key, key, { { "status", { s->second, (s->second + 1) % 4 } } });
+      s->second = (s->second + 1) % 4;
+    } else {
+      basic_storehouse<int, int, int>::named_ikeyset ikeys;
+      if (s != statuses.end()) {
+        ikeys["status"] = { s->second };
+        statuses.erase(s);
+      }
+      if (r != regions.end()) {
+        ikeys["region"] = { r->second };
+        regions.erase(r);
+      }
+      accounts.del(key, ikeys);
+    }
+  }
+  for (int key = 20000; key < 22000; ++key) {
+    put(key);
+  }
+
+  std::set<int> indexed;
+  for (const auto& v : statuses) {
+    indexed.insert(v.first);
+  }
+  for (const auto& v : regions) {
+    indexed.insert(v.first);
+  }
+  CHECK(accounts.bitmap("status").row_space().size() == indexed.size());
+  CHECK(&accounts.bitmap("status").row_space() == &accounts.bitmap("region").row_space());
+
+  auto keys = [&accounts](const roaring_bitmap& rows) {
+    std::vector<int> found;
+    accounts.bitmap("status").keys(rows, std::back_inserter(found));
+    std::sort(found.begin(), found.end());
+    return found;
+  };
+  for (int status = 0; status < 4; ++status) {
+    for (int region = 0; region < 10; ++region) {
+      std::vector<int> both, either, only;
+      for (int key : indexed) {
+        auto s = statuses.find(key);
+        auto r = regions.find(key);
+        bool in_status = s != statuses.end() && s->second == status;
+        bool in_region = r != regions.end() && r->second == region;
+        if (in_status && in_region) {
+          both.push_back(key);
+        }
+        if (in_status || in_region) {
+          either.push_back(key);
+        }
+        if (in_status && !in_region) {
+          only.push_back(key);
+        }
+      }
+      roaring_bitmap s = accounts.bitmap("status").rows(status);
+      roaring_bitmap r = accounts.bitmap("region").rows(region);
+      CHECK(keys(s & r) == both);
+      CHECK(keys(s | r) == either);
+      CHECK(keys(s - r) == only);
+    }
+  }
+  {
+    // rows already handed out cannot move to another row space
+    bool thrown = false;
+    try {
+      accounts.bitmap("status").share_rows(
+          std::make_shared<basic_storehouse<int, int, int>::row_space>());
+    } catch (const storage_error&) {
+      thrown = true;
+    }
+    CHECK(thrown);
+  }
+}
+
+// Checks a hash index against a std::multimap after every put, update and
+// delete, while it grows and shrinks back: the probes go through tables being
+// moved, slots moved back over deleted ones and entries renumbered when the
+// last one fills the place of a deleted one. With few records the table stays
+// small and its runs of slots wrap around its end.
+static void check_hash_index(int records_count, int distinct_phones, int steps) {
+  typedef basic_storehouse<int, int, int> contacts_type;
+  contacts_type::indexer::create("phone", index_kind::hash);
+  contacts_type contacts("contacts", { "phone" });
+  const auto& phones = contacts.hash("phone");
+  std::multimap<int, int> reference;
+  std::map<int, std::vector<int>> records;
+  std::mt19937 rng(23);
+  // consecutive index keys would land in consecutive slots, without runs
+  std::vector<int> pool;
+  for (int i = 0; i < distinct_phones; ++i) {
+    pool.push_back(static_cast<int>(rng() & 0x7fffffff));
+  }
+
+  auto same = [&]() {
+    size_t distinct = 0;
+    for (auto it = reference.begin(); it != reference.end(); it = reference.upper_bound(it->first)) {
+      std::vector<int> expected, found;
+      for (auto r = reference.equal_range(it->first); r.first != r.second; ++r.first) {
+        expected.push_back(r.first->second);
+      }
+      phones.keys(it->first, std::back_inserter(found));
+      std::sort(expected.begin(), expected.end());
+      std::sort(found.begin(), found.end());
+      CHECK(found == expected);
+      CHECK(phones.count(it->first) == expected.size());
+      ++distinct;
+    }
+    CHECK(phones.size() == distinct);
+    CHECK(phones.count(-1) == 0 && !phones.get(-1));
+  };
+  auto forget = [&reference](int phone, int key) {
+    auto r = reference.equal_range(phone);
+    reference.erase(std::find(r.first, r.second, std::multimap<int, int>::value_type(phone, key)));
+  };
+
+  for (int step = 0; step < steps; ++step) {
+    // puts prevail for 2000 steps, deletes for the next 1000, and so on
+    bool growing = step % 3000 < 2000;
+    int key = static_cast<int>(rng() % records_count);
+    auto record = records.find(key);
+    if (record == records.end()) {
+      if (!growing && rng() % 4 != 0) {
+        continue;
+      }
+      std::vector<int> keys = { pool[rng() % pool.size()] };
+      if (rng() % 3 == 0) {
+        keys.push_back(pool[rng() % pool.size()]);
+      }
+      contacts.put(key, key, { { "phone", contacts_type::ikeyset(keys.begin(), keys.end()) } });
+      for (int phone : keys) {
+        reference.emplace(phone, key);
+      }
+      records[key] = keys;
+    } else if (!growing || rng() % 4 == 0) {
+      contacts.del(key, { { "phone", contacts_type::ikeyset(record->second.begin(), record->second.end()) } });
+      for (int phone : record->second) {
+        forget(phone, key);
+      }
+      records.erase(record);
+    } else {
+      int from = record->second.front();
+      int to = pool[rng() % pool.size()];
+      contacts.update(key, key, { { "phone", { from, to } } });
+      forget(from, key);
+      reference.emplace(to, key);
+      record->second.front() = to;
+    }
+    same();
+    if (step == 1999) {
+      CHECK(phones.size() > static_cast<size_t>(std::min(records_count, distinct_phones) / 3));
+    }
+  }
+}
+
 int main() {
   basic_index<int, int, int> index;
+  {
+    // the same puts, updates and deletes, repeated and of missing entries,
+    // must leave the same entries whether the index changes are made at once
+    // or buffered
+    basic_storehouse<int, int, int> immediate("immediate", { "rank" }), deferred("deferred", { "rank" });
+    deferred.defer_indexes(64);
+    std::mt19937 gen(1);
+    for (int i = 0; i < 20000; ++i) {
+      int key = gen() % 16, rank = gen() % 8, op = gen() % 3;
+      for (basic_storehouse<int, int, int>* s : { &immediate, &deferred }) {
+        switch (op) {
+        case 0:
+          s->put(key, i, { { "rank", { rank } } });
+          break;
+        case 1:
+          s->del(key, { { "rank", { rank } } });
+          break;
+        case 2:
+          s->update(key, i, { { "rank", { rank, (rank + 1) % 8 } } });
+          break;
+        }
+      }
+      const basic_index<int, int, int>& expected = immediate.at("rank");
+      const basic_index<int, int, int>& found = deferred.at("rank");
+      if (i % 97 == 0) {
+        for (int r = 0; r < 8; ++r) {
+          std::vector<int> expected_keys, found_keys;
+          expected.keys(r, std::back_inserter(expected_keys));
+          found.keys(r, std::back_inserter(found_keys));
+          CHECK(expected.count(r) == found.count(r) && expected_keys == found_keys && expected.get(r) == found.get(r));
+        }
+      }
+      if (i % 1009 == 0) {
+        auto first = found.begin();
+        CHECK(found.pending() == 0);
+        CHECK(std::distance(first, found.end()) == std::distance(expected.begin(), expected.end())
+            && std::equal(expected.begin(), expected.end(), first));
+      }
+    }
+  }
 
   basic_indexer<int, int, int> indexer;
 
-  basic_repository<int, int, int> repository;
+  char dir[] = "/tmp/atlasdb_storage_test.XXXXXX";
+  CHECK(::mkdtemp(dir) != nullptr);
+  std::string path = std::string(dir) + "/repository";
+  {
+    basic_repository<int, int, int> repository;
+    repository.recover(path);
+    repository.put(1, 2);
+    repository.update(1, 3, 0, sizeof(int));
+    for (std::pair<ptrdiff_t, size_t> bad : { std::make_pair(ptrdiff_t(1), sizeof(int)),
+        std::make_pair(ptrdiff_t(-1), size_t(1)), std::make_pair(ptrdiff_t(1), size_t(-1)) }) {
+      bool thrown = false;
+      try {
+        repository.update(1, 4, bad.first, bad.second);
+      } catch (const storage_error&) {
+        thrown = true;
+      }
+      CHECK(thrown && *repository.get(1) == 3);
+    }
+    repository.commit();
+  }
+  {
+    basic_repository<int, int, int> recovered;
+    recovered.recover(path);
+    CHECK(recovered.count() == 1 && *recovered.get(1) == 3);
+  }
+  write_ahead_log::remove(path + ".log");
+  ::unlink((path + ".checkpoint").c_str());
+  CHECK(::rmdir(dir) == 0);
+  {
+    basic_repository<int, int, int> truncated;
+    for (int round = 0; round < 3; ++round) {
+      for (int i = 0; i < 10000; ++i) {
+        truncated.put(i, round);
+      }
+      truncated.truncate();
+      CHECK(truncated.empty());
+    }
+    truncated.put(1, 2);
+    CHECK(truncated.count() == 1 && *truncated.get(1) == 2);
+  }
+
+  basic_storehouse<int, int, int> storehouse("universe", { "age" });
+  storehouse.defer_indexes(1024);
+  storehouse.put(1, 2, { { "age", { 30 } } });
+  CHECK(*storehouse.at("age").get(30) == 1);
+  storehouse.defer_indexes(0);
+  storehouse.cover("age", { basic_index<int, int, int>::field([](const int& v) -> const int& { return v; }) });
+  storehouse.at("age").covered_range(30, 31, [](int, int key, int data) {
+    CHECK(key == 1 && data == 2);
+    return true;
+  });
+  {
+    // the projections of a covering index are not buffered with its entries
+    bool thrown = false;
+    try {
+      storehouse.defer_indexes(1024);
+    } catch (const storage_error&) {
+      thrown = true;
+    }
+    CHECK(thrown);
+  }
+  storehouse.commit();
+  check_covering();
+
+  storehouse.put(5, 6, { { "age", { 31, 40 } } });
+  storehouse.put(6, 7, { { "age", { 40 } } });
+  auto adults = storehouse.open("age", 30, true, 40, false);
+  CHECK(!adults.at_end() && adults.ikey() == 31 && adults.key() == 5);
+  adults.skip_to(6);
+  CHECK(!adults.at_end() && adults.ikey() == 40 && adults.key() == 5);
+  std::vector<basic_index<int, int, int>::cursor> ages = { storehouse.at("age").range(31),
+      storehouse.at("age").range(40) };
+  std::vector<int> both;
+  basic_index<int, int, int>::intersect(ages, std::back_inserter(both));
+  CHECK(both.size() == 1 && both[0] == 5);
+  {
+    // a record key indexed twice under an index key is found once
+    storehouse.put(8, 9, { { "age", { 31, 31, 40, 40 } } });
+    std::vector<basic_index<int, int, int>::cursor> twice = { storehouse.at("age").range(31),
+        storehouse.at("age").range(40) };
+    std::vector<int> found;
+    basic_index<int, int, int>::intersect(twice, std::back_inserter(found));
+    CHECK(found == std::vector<int>({ 5, 8 }));
+    twice = { storehouse.at("age").range(31), storehouse.at("age").range(40) };
+    found.clear();
+    basic_index<int, int, int>::unite(twice, std::back_inserter(found));
+    CHECK(found == std::vector<int>({ 5, 6, 8 }));
+    storehouse.del(8, { { "age", { 31, 31, 40, 40 } } });
+    CHECK(storehouse.at("age").count(31) == 1);
+
+    // the record keys of a range over several index keys are not in order
+    std::vector<basic_index<int, int, int>::cursor> unordered = { storehouse.at("age").range(31),
+        storehouse.open("age", 30, true, 40, false) };
+    for (int unite = 0; unite < 2; ++unite) {
+      bool thrown = false;
+      try {
+        if (unite) {
+          basic_index<int, int, int>::unite(unordered, std::back_inserter(found));
+        } else {
+          basic_index<int, int, int>::intersect(unordered, std::back_inserter(found));
+        }
+      } catch (const storage_error& e) {
+        thrown = e.code() == make_error_code(errc::invalid_argument);
+      }
+      CHECK(thrown);
+    }
+
+    // a range is not opened over an index that was not
+    basic_indexer<int, int, int>& indexes = storehouse;
+    size_t opened = indexes.size();
+    for (int bounded = 0; bounded < 2; ++bounded) {
+      bool thrown = false;
+      try {
+        if (bounded) {
+          storehouse.open("height", 150, false, 200, false);
+        } else {
+          storehouse.open("height", 150);
+        }
+      } catch (const storage_error& e) {
+        thrown = e.code() == make_error_code(errc::item_not_found);
+      }
+      CHECK(thrown && indexes.size() == opened);
+    }
+  }
+
+  storehouse.open("parity");
+  storehouse.build("parity", [](int, int value, const std::function<void(const int&)>& emit) {
+    emit(value % 2);
+  });
+  // a put, an update to another index key, one keeping it and a delete
+  storehouse.put(7, 9, { { "parity", { 1 } } });
+  storehouse.update(5, 7, { { "parity", { 0, 1 } } });
+  storehouse.update(1, 4, { { "parity", { 0, 0 } } });
+  storehouse.del(6, { { "age", { 40 } }, { "parity", { 1 } } });
+  storehouse.finish_build("parity");
+  {
+    std::vector<int> even, odd;
+    storehouse.at("parity").keys(0, std::back_inserter(even));
+    storehouse.at("parity").keys(1, std::back_inserter(odd));
+    CHECK(even == std::vector<int>({ 1 }) && odd == std::vector<int>({ 5, 7 }));
+  }
+
+  check_roaring();
+
+  storehouse.open_bitmap("region");
+  storehouse.put(2, 3, { { "region", { 7 } } });
+  storehouse.put(3, 4, { { "region", { 7 } } });
+  storehouse.put(4, 5, { { "region", { 8 } } });
+  CHECK((storehouse.bitmap("region").rows(7) | storehouse.bitmap("region").rows(8)).cardinality() == 3);
+  CHECK((storehouse.bitmap("region").rows(7, 9) - storehouse.bitmap("region").rows(8)).cardinality() == 2);
+  check_bitmap_rows();
+
+  basic_indexer<int, int, int>::create("email", index_kind::hash);
+  basic_storehouse<int, int, int> users("users", { "email" });
+  users.put(1, 2, { { "email", { 42 } } });
+  users.put(2, 3, { { "email", { 42 } } });
+  CHECK(users.hash("email").count(42) == 2);
+  check_hash_index(6000, 5000, 12000);
+  check_hash_index(12, 400, 300000);
+
+  // a sharded repository holds what a std::map holds, its records spread over
+  // all of the shards and merged back into key order
+  {
+    typedef sharded_repository<int, int, int, 4> sharded_type;
+    sharded_type sharded;
+    std::map<int, int> reference;
+    CHECK(sharded.begin() == sharded.end() && sharded.empty());
+    for (int i = 0; i < 20000; ++i) {
+      sharded.put(i * 7 % 20011, i);
+      reference[i * 7 % 20011] = i;
+    }
+    for (int i = 0; i < 20011; i += 5) {
+      sharded.put(i, -i);
+      reference[i] = -i;
+      sharded.del(i + 1);
+      reference.erase(i + 1);
+    }
+    size_t per_shard[4] = {};
+    for (const auto& v : reference) {
+      ++per_shard[sharded_type::shard(v.first)];
+    }
+    for (size_t n : per_shard) {
+      CHECK(n > reference.size() / 8);
+    }
+
+    CHECK(sharded.count() == reference.size());
+    CHECK(std::equal(reference.begin(), reference.end(), sharded.begin()));
+    CHECK(static_cast<size_t>(std::distance(sharded.begin(), sharded.end())) == reference.size());
+    for (int key : { -1, 0, 1, 2, 999, 10000, 10001, 20009, 20010, 20011 }) {
+      CHECK(std::equal(reference.lower_bound(key), reference.end(), sharded.lower_bound(key)));
+      CHECK(static_cast<size_t>(std::distance(sharded.lower_bound(key), sharded.end()))
+          == static_cast<size_t>(std::distance(reference.lower_bound(key), reference.end())));
+      CHECK(sharded.rank(key) == static_cast<size_t>(std::distance(reference.begin(), reference.lower_bound(key))));
+      for (int last : { key, key + 1, key + 777, 30000 }) {
+        size_t expected = key < last
+            ? std::distance(reference.lower_bound(key), reference.lower_bound(last)) : 0;
+        CHECK(sharded.count(key, last) == expected);
+      }
+    }
+
+    // the values of the keys land at the positions of the keys, with keys
+    // repeated, missing and from every shard
+    std::vector<int> keys;
+    for (int i = 0; i < 3000; ++i) {
+      keys.push_back(static_cast<int>(i * 2654435761u % 22000) - 1000);
+    }
+    keys.push_back(keys.front());
+    std::vector<boost::optional<int>> values;
+    sharded.get_many(keys.begin(), keys.end(), std::back_inserter(values));
+    CHECK(values.size() == keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+      auto it = reference.find(keys[i]);
+      CHECK(it == reference.end() ? !values[i] : values[i] && *values[i] == it->second);
+    }
+
+    // an iterator reads the records as of begin()
+    sharded_type::const_iterator before = sharded.begin();
+    std::map<int, int> old_reference = reference;
+    size_t erased = std::distance(reference.lower_bound(5000), reference.lower_bound(15000));
+    CHECK(sharded.erase_range(5000, 15000) == erased);
+    reference.erase(reference.lower_bound(5000), reference.lower_bound(15000));
+    CHECK(sharded.count() == reference.size() && sharded.count(5000, 15000) == 0);
+    CHECK(std::equal(reference.begin(), reference.end(), sharded.begin()));
+    CHECK(std::equal(old_reference.begin(), old_reference.end(), before));
+    CHECK(sharded.erase_range(15000, 5000) == 0 && sharded.count() == reference.size());
+
+    // threads writing keys of their own and reading those of the others end
+    // up with what each of them left
+    enum { kThreads = 4, kKeys = 4000 };
+    std::map<int, int> written[kThreads];
+    std::atomic<bool> torn(false);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; ++t) {
+      threads.emplace_back([&sharded, &written, &torn, t]() {
+        for (int round = 1; round <= 3; ++round) {
+          for (int i = 0; i < kKeys; ++i) {
+            int key = 100000 + i * kThreads + t;
+            if ((i + round) % 5 == 0) {
+              sharded.del(key);
+              written[t].erase(key);
+            } else {
+              sharded.put(key, key * 4 + round);
+              written[t][key] = key * 4 + round;
+            }
+            auto mine = sharded.get(key);
+            auto other = sharded.get(100000 + i * kThreads + (t + 1) % kThreads);
+            if ((mine ? *mine : -1) != (written[t].count(key) ? written[t][key] : -1)
+                || (other && *other / 4 != 100000 + i * kThreads + (t + 1) % kThreads)) {
+              torn = true;
+            }
+          }
+        }
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    CHECK(!torn);
+    for (const auto& w : written) {
+      reference.insert(w.begin(), w.end());
+    }
+    CHECK(sharded.count() == reference.size());
+    CHECK(std::equal(reference.begin(), reference.end(), sharded.begin()));
+    CHECK(sharded.rank(100000) == sharded.count() - sharded.count(100000, 200000));
+  }
 
-  basic_storehouse<int, int, int> storehouse("universe");
+  concurrent_repository<int, int, int> concurrent;
+  std::thread writer([&concurrent]() {
+    concurrent.put(1, 2);
+    concurrent.put(2, 3);
+  });
+  writer.join();
+  CHECK(concurrent.get(1) == 2 && !concurrent.insert(2, 4) && *concurrent.get(2) == 3 && !concurrent.get(3));
+  concurrent.del(1);
+  CHECK(concurrent.count() == 1 && !concurrent.exists(1));
+  concurrent.verify();
 
 }